@@ -22,6 +22,12 @@ namespace std {
 #  include <cstdint>
 #endif
 
+#if defined(_POSIX)
+#  include <time.h>
+#  include <cstring>
+#  include <cstdio>
+#endif
+
 #include <string>
 #include <ErrBase.h>
 
@@ -131,6 +137,33 @@ namespace ArsLexis
     typedef long tick_t;
     
     typedef int status_t;
+
+#  if defined(_POSIX)
+
+    typedef std::basic_string<char>   NarrowString;
+
+#  define tstrcpy  strcpy
+#  define tstrncmp strncmp
+#  define memzero(data,size)  memset((data), 0, (size))
+#  define StrPrintF sprintf
+
+#  define ErrTry try
+#  define ErrCatch(theErr) catch (long theErr) 
+#  define ErrEndCatch 
+#  define ErrThrow(err) throw(long(err))
+#  define ErrReturn(val) return (val)
+
+    // Milliseconds of monotonic clock, same unit as on Win32.
+    static inline tick_t ticks()
+    {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return tick_t(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+    }
+
+    static inline tick_t ticksPerSecond() {return 1000;}
+
+#  endif
         
 # endif
     
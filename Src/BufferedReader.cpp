@@ -140,6 +140,32 @@ status_t BufferedReader::readMarked(void* buffer, ulong_t& length)
     return errNone;
 }
 
+status_t BufferedReader::readToEnd()
+{
+    assert(isMarked_);
+    if (!isMarked_)
+        return sysErrParamErr;
+
+    Buffer_t::size_type size = buffer_.size();
+    while (true)
+    {
+        // Growing by the size already read keeps number of reallocations logarithmic.
+        ulong_t length = std::max<ulong_t>(chunkSize_, size);
+        buffer_.resize(size + length);
+        status_t error = reader_.readRaw(&buffer_[size], length);
+        if (errNone != error)
+        {
+            buffer_.resize(size);
+            return error;
+        }
+        size += length;
+        if (0 == length)
+            break;
+    }
+    buffer_.resize(size);
+    return errNone;
+}
+
 status_t BufferedReader::readLine(bool& eof, NarrowString& out, char_t delimiter)
 {
     NarrowString line;
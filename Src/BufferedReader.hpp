@@ -43,6 +43,9 @@ public:
     
     ulong_t position() const {return position_;}
 
+    //! Reads rest of the stream into buffer, so that it can be reached with seek() (also from its end). Reader must be marked.
+    status_t readToEnd();
+
     //! Provides accelerated readLine thanks to the use of buffering.        
     virtual status_t readLine(bool& eof, NarrowString& out, char_t delimiter = '\n');
     
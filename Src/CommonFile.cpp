@@ -3,7 +3,11 @@
 
 
 File::File():
-    handle_(reinterpret_cast<FileHandle_t>(invalidFileHandle))
+    handle_(FileHandle_t(invalidFileHandle))
+#ifdef FILE_HAS_MAPPING
+    , map_(NULL),
+    mapSize_(0)
+#endif
 {}
 
 File::~File()
@@ -1,14 +1,22 @@
-#include <bitset>
 #include <DataStore.hpp>
 #include <File.hpp>
 #include <Text.hpp>
+#include <Logging.hpp>
+#include <LZ77.hpp>
 
 #ifdef _PALM_OS
 #include <Application.hpp>
 #endif
 
 struct StreamIndexEntry {
-    bool used;
+    
+    // Flags take place of former bool used, so entries written before remain valid.
+    enum {
+        flagUsed = 1,
+        flagCompressed = 2
+    };
+    
+    unsigned char flags;
     char name[DataStore::maxStreamNameLength];
     File::Position firstFragment;
     
@@ -19,13 +27,77 @@ struct StreamIndexEntry {
 static const File::Position invalidFragmentStart=0;
 
 StreamIndexEntry::StreamIndexEntry():
-    used(false),
+    flags(0),
     firstFragment(invalidFragmentStart)
 {
     using namespace std;
     memset(name, 0, sizeof(name));
 }
 
+//! Index entry of v1 format, which kept legacyStreamsCount of them at the start of file.
+struct LegacyStreamIndexEntry {
+
+    enum {
+        maxNameLength = 32,
+        streamsCount = 32
+    };
+
+    bool used;
+    char name[maxNameLength];
+    File::Position firstFragment;
+    
+};
+
+//! Starts v2 store file, directory blocks are chained through nextFragment of their fragment headers.
+struct StoreHeaderEntry {
+    char signature[4];
+    uint_t version;
+    File::Position firstDirectoryBlock;
+};
+
+static const char storeSignature[4] = {'A', 'D', 'S', '2'};
+
+/**
+ * Follows StoreHeaderEntry and points to the journal of transaction being committed, length 0 meaning there's none.
+ * Writing it is the commit point: journal it doesn't point to is never replayed. Length goes first, so that torn write
+ * which clears it can't leave the rest pointing anywhere.
+ */
+struct PendingJournalEntry {
+    ulong_t length;
+    ulong_t checksum;
+    File::Position start;
+};
+
+enum {storeVersion = 2};
+
+//! Header write recorded in the journal, followed by length bytes to be written at position.
+struct JournalRecordEntry {
+    File::Position position;
+    ulong_t length;
+};
+
+//! Ends the journal, which is appended after the last fragment while transaction is committed, so that it's found without its pointer too.
+struct JournalTrailerEntry {
+    ulong_t length;
+    ulong_t checksum;
+    char signature[4];
+};
+
+static const char journalSignature[4] = {'J', 'R', 'N', 'L'};
+
+// FNV-1a, used both for hashing stream names and as journal checksum.
+static ulong_t hashBytes(const void* data, ulong_t length)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    ulong_t hash = 2166136261UL;
+    for (ulong_t i = 0; i < length; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
 
 struct FragmentHeaderEntry {
     uint_t ownerIndex;
@@ -41,28 +113,47 @@ FragmentHeaderEntry::FragmentHeaderEntry():
     nextFragment(invalidFragmentStart)
 {}
     
-DataStore::StreamHeader::StreamHeader(const char* n, ulong_t nlen, uint_t i, File::Position f):
-    name(n, nlen),
-    index(i),
-    firstFragment(f)
-{}  
 
 DataStore::FragmentHeader::FragmentHeader(File::Position s, uint_t o, uint_t l, File::Position n):
     start(s),
     ownerIndex(o),
     length(l),
-    nextFragment(n)
+    nextFragment(n),
+    hasFreeExtent(false),
+    committed(true)
 {}    
+
+DataStore::StreamHeader::StreamHeader(const char* n, ulong_t nlen, uint_t i, File::Position f):
+    name(n, nlen),
+    index(i),
+    firstFragment(f),
+    nextInBucket(NULL),
+    compressed(false)
+{}  
   
 DataStore::DataStore(): 
-    fileName_(NULL)
+    fileName_(NULL),
+    legacyFormat_(false),
+    openStreamsCount_(0),
+#ifdef FILE_HAS_MAPPING
+    openReadersCount_(0),
+#endif
+    streamsCount_(0),
+    compactStream_(0),
+    compactFragment_(invalidFragmentStart),
+    compactCursor_(0)
+#ifndef NDEBUG
+    , crashAfterWrites_(noCrash),
+    crashed_(false)
+#endif
 {
 }
 
 DataStore::~DataStore()
 {
-    std::for_each(streamHeaders_.begin(), streamHeaders_.end(), ObjectDeleter<StreamHeader>());
-    std::for_each(fragmentHeaders_.begin(), fragmentHeaders_.end(), ObjectDeleter<FragmentHeader>());
+    if (file_.isOpen())
+        flushHeaders();
+    clearHeaders();
     
 #ifdef _PALM_OS
     if (file_.isOpen()) 
@@ -101,54 +192,501 @@ Finish:
     free(fileName_);
 }
 
-status_t DataStore::createIndex()
+void DataStore::clearHeaders()
 {
     std::for_each(streamHeaders_.begin(), streamHeaders_.end(), ObjectDeleter<StreamHeader>());
     streamHeaders_.clear();
+    streamBuckets_.clear();
+    streamsCount_ = 0;
+    freeSlots_.clear();
+    directoryBlocks_.clear();
     std::for_each(fragmentHeaders_.begin(), fragmentHeaders_.end(), ObjectDeleter<FragmentHeader>());
     fragmentHeaders_.clear();
-    status_t error = file_.seek(0, File::seekFromBeginning);
+    freeExtents_.clear();
+    dirtyStreamHeaders_.clear();
+    dirtyFragmentHeaders_.clear();
+    releasedFragments_.clear();
+    journal_.clear();
+    compactStream_ = 0;
+    compactFragment_ = invalidFragmentStart;
+    compactCursor_ = 0;
+}
+
+status_t DataStore::createIndex()
+{
+    clearHeaders();
+    legacyFormat_ = false;
+    status_t error = writeStoreHeader(invalidFragmentStart);
+    if (errNone != error)
+        return error;
+    if (errNone != (error = commit()))
+        return error;
+    error = findEof();
+    return error;
+}
+
+status_t DataStore::writeStoreHeader(File::Position firstDirectoryBlock)
+{
+    StoreHeaderEntry entry;
+    memmove(entry.signature, storeSignature, sizeof(storeSignature));
+    entry.version = storeVersion;
+    entry.firstDirectoryBlock = firstDirectoryBlock;
+    if (!legacyFormat_)
+        return journalWrite(0, &entry, sizeof(entry));
+    // Legacy index occupies place of the pointer, so it's written cleared together with the header.
+    char buffer[sizeof(StoreHeaderEntry) + sizeof(PendingJournalEntry)];
+    memzero(buffer, sizeof(buffer));
+    memmove(buffer, &entry, sizeof(entry));
+    return journalWrite(0, buffer, sizeof(buffer));
+}
+
+status_t DataStore::journalWrite(File::Position position, const void* data, ulong_t length)
+{
+    JournalRecordEntry record;
+    record.position = position;
+    record.length = length;
+    journal_.append(reinterpret_cast<const char*>(&record), sizeof(record));
+    journal_.append(static_cast<const char*>(data), length);
+    return errNone;
+}
+
+status_t DataStore::writeInPlace(File::Position position, const void* data, ulong_t length)
+{
+#ifndef NDEBUG
+    if (crashed_)
+        return errNone;
+    if (noCrash != crashAfterWrites_ && 0 == crashAfterWrites_--)
+    {
+        crashed_ = true;
+        length /= 2;
+    }
+#endif
+    status_t error = file_.seek(position, File::seekFromBeginning);
     if (errNone != error)
         return error;
-    StreamIndexEntry entry;
-    for (uint_t i=0; i<maxStreamsCount; ++i) 
+    return file_.write(data, length);
+}
+
+/**
+ * Journal read back from the file is replayed only if it's well-formed and each record overwrites either the store header
+ * or a fragment header or directory slot below the journal (end), so that damaged journal can't write over arbitrary data.
+ */
+bool DataStore::journalValid(const char* journal, ulong_t length, File::Position end) const
+{
+    ulong_t offset = 0;
+    while (offset < length)
+    {
+        JournalRecordEntry record;
+        if (length - offset < sizeof(record))
+            return false;
+        memmove(&record, journal + offset, sizeof(record));
+        offset += sizeof(record);
+        if (length - offset < record.length)
+            return false;
+        offset += record.length;
+        if (0 == record.position && sizeof(StoreHeaderEntry) == record.length)
+            continue;
+        if (sizeof(FragmentHeaderEntry) != record.length && sizeof(StreamIndexEntry) != record.length)
+            return false;
+        if (record.position < fragmentsStart() || record.position > end || end - record.position < record.length)
+            return false;
+    }
+    return true;
+}
+
+status_t DataStore::applyJournal(const char* journal, ulong_t length)
+{
+    ulong_t offset = 0;
+    while (offset < length)
     {
-        error = file_.write(&entry, sizeof(entry));
+        JournalRecordEntry record;
+        if (length - offset < sizeof(record))
+            return errStoreCorrupted;
+        memmove(&record, journal + offset, sizeof(record));
+        offset += sizeof(record);
+        if (length - offset < record.length)
+            return errStoreCorrupted;
+        status_t error = writeInPlace(record.position, journal + offset, record.length);
         if (errNone != error)
             return error;
+        offset += record.length;
     }
-    error = findEof();
-    return error;
+    return file_.flush();
+}
+
+/**
+ * Makes header writes recorded in the journal since last commit durable as a whole.
+ * Journal (with its checksum) is appended after the last fragment and flushed together with fragment data written so far,
+ * then PendingJournalEntry pointing to it is written and flushed, and only then headers are overwritten in place. 
+ * Journal is truncated away and the pointer cleared afterwards.
+ * If we're interrupted before the pointer is written, open() discards the journal and the store stays in its previous state,
+ * if after that, recoverJournal() replays it.
+ * Legacy index has no room for the pointer, so migrating it (the only commit of legacy store) is applied directly, 
+ * and the header written clears the pointer; new directory block is written to free space first, so interrupted migration
+ * is simply done again.
+ */
+status_t DataStore::commit()
+{
+    if (journal_.empty())
+        return errNone;
+#ifndef NDEBUG
+    if (crashed_)
+        return errNone;
+#endif
+    PendingJournalEntry pending;
+    pending.length = journal_.length();
+    pending.checksum = hashBytes(journal_.data(), journal_.length());
+    pending.start = precedingFragmentEnd(fragmentHeaders_.end());
+    JournalTrailerEntry trailer;
+    trailer.length = pending.length;
+    trailer.checksum = pending.checksum;
+    memmove(trailer.signature, journalSignature, sizeof(journalSignature));
+    
+    // Fragment data must reach the disk before the journal that makes it reachable.
+    status_t error = file_.flush();
+    if (errNone != error)
+        return error;
+    if (errNone != (error = file_.seek(pending.start, File::seekFromBeginning)))
+        return error;
+    if (errNone != (error = file_.write(journal_.data(), journal_.length())))
+        return error;
+    if (errNone != (error = file_.write(&trailer, sizeof(trailer))))
+        return error;
+    if (errNone != (error = file_.flush()))
+        return error;
+    bool legacy = legacyFormat_;
+    if (!legacy && errNone != (error = writeInPlace(sizeof(StoreHeaderEntry), &pending, sizeof(pending))))
+        return error;
+    if (errNone != (error = file_.flush()))
+        return error;
+    if (errNone != (error = applyJournal(journal_.data(), journal_.length())))
+        return error;
+#ifndef NDEBUG
+    if (crashed_)
+        return errNone;
+#endif
+    journal_.clear();
+    if (errNone != (error = file_.seek(pending.start, File::seekFromBeginning)))
+        return error;
+    if (errNone != (error = file_.truncate()))
+        return error;
+    if (legacy)
+        return errNone;
+    memzero(&pending, sizeof(pending));
+    if (errNone != (error = writeInPlace(sizeof(StoreHeaderEntry), &pending, sizeof(pending))))
+        return error;
+    return file_.flush();
 }
 
+/**
+ * Replays journal of interrupted commit() if the store header points to it and it's intact and valid, 
+ * otherwise discards it. Either way it's truncated away and the pointer cleared, so that it isn't replayed twice.
+ * File is truncated only where the pointer leads to journal trailer, damaged pointer is just cleared.
+ */
+status_t DataStore::recoverJournal()
+{
+    status_t error = file_.seek(0, File::seekFromBeginning);
+    if (errNone != error)
+        return error;
+    StoreHeaderEntry header;
+    PendingJournalEntry pending;
+    File::Size read;
+    if (errNone != (error = file_.read(&header, sizeof(header), read)))
+        return error;
+    // Legacy store has no pointer, file too short for the header is rejected by readIndex().
+    if (sizeof(header) != read || 0 != memcmp(header.signature, storeSignature, sizeof(storeSignature)))
+        return errNone;
+    legacyFormat_ = false;
+    if (errNone != (error = file_.read(&pending, sizeof(pending), read)))
+        return error;
+    if (sizeof(pending) != read || 0 == pending.length)
+        return errNone;
+    
+    File::Size size;
+    if (errNone != (error = file_.size(size)))
+        return error;
+    char* journal = NULL;
+    bool valid = false;
+    bool found = false;
+    if (pending.start >= fragmentsStart() && pending.start <= size && size - pending.start >= sizeof(JournalTrailerEntry) 
+        && size - pending.start - sizeof(JournalTrailerEntry) >= pending.length)
+    {
+        JournalTrailerEntry trailer;
+        if (errNone != (error = file_.read(pending.start + pending.length, &trailer, sizeof(trailer), read)))
+            return error;
+        found = (sizeof(trailer) == read && 0 == memcmp(trailer.signature, journalSignature, sizeof(journalSignature))
+            && pending.length == trailer.length && pending.checksum == trailer.checksum);
+    }
+    if (found)
+    {
+        journal = (char*)malloc(pending.length);
+        if (NULL == journal)
+            return memErrNotEnoughSpace;
+        if (errNone != (error = file_.read(pending.start, journal, pending.length, read)))
+            goto Finish;
+        valid = (pending.length == read && pending.checksum == hashBytes(journal, pending.length) 
+            && journalValid(journal, pending.length, pending.start));
+    }
+    if (valid)
+    {
+        LogStrUlong(eLogDebug, _T("DataStore::recoverJournal(): replaying journal, bytes: "), pending.length);
+        if (errNone != (error = applyJournal(journal, pending.length)))
+            goto Finish;
+    }
+    if (found)
+    {
+        if (errNone != (error = file_.seek(pending.start, File::seekFromBeginning)))
+            goto Finish;
+        if (errNone != (error = file_.truncate()))
+            goto Finish;
+    }
+    memzero(&pending, sizeof(pending));
+    if (errNone != (error = writeInPlace(sizeof(StoreHeaderEntry), &pending, sizeof(pending))))
+        goto Finish;
+    error = file_.flush();
+Finish:
+    free(journal);
+    return error;
+}
 
 status_t DataStore::readIndex()
 {
-    assert(streamHeaders_.empty());
+    assert(0 == streamsCount_);
+    status_t error = file_.seek(0, File::seekFromBeginning);
+    if (errNone != error)
+        return error;
+    StoreHeaderEntry entry;
+    File::Size size;
+    if (errNone != (error = file_.read(&entry, sizeof(entry), size)))
+        return error;
+    if (sizeof(entry) != size)
+        return errStoreCorrupted;
+    // First byte of v1 file is 'used' flag of the first index entry, so it can't match the signature.
+    if (0 != memcmp(entry.signature, storeSignature, sizeof(storeSignature)))
+        return readLegacyIndex();
+    if (storeVersion != entry.version)
+        return errStoreCorrupted;
+    legacyFormat_ = false;
+    return readDirectory(entry.firstDirectoryBlock);
+}
+
+status_t DataStore::readDirectory(File::Position block)
+{
+    while (invalidFragmentStart != block)
+    {
+        status_t error = file_.seek(block, File::seekFromBeginning);
+        if (errNone != error)
+            return error;
+        FragmentHeaderEntry header;
+        File::Size size;
+        if (errNone != (error = file_.read(&header, sizeof(header), size)))
+            return error;
+        if (sizeof(header) != size)
+            return errStoreCorrupted;
+        if (directoryOwnerIndex != header.ownerIndex || sizeof(header) + directorySlotsCount * sizeof(StreamIndexEntry) != header.length)
+            return errStoreCorrupted;
+            
+        uint_t firstIndex = directoryBlocks_.size() * directorySlotsCount;
+        for (uint_t i = 0; i < directorySlotsCount; ++i)
+        {
+            StreamIndexEntry entry;
+            if (errNone != (error = file_.read(&entry, sizeof(entry), size)))
+                return error;
+            if (sizeof(entry) != size)
+                return errStoreCorrupted;
+            if (0 != (entry.flags & StreamIndexEntry::flagUsed))
+            {
+                ulong_t nameLength = std::find(entry.name, entry.name + maxStreamNameLength, '\0') - entry.name;
+                StreamHeader* stream = new StreamHeader(entry.name, nameLength, firstIndex + i, entry.firstFragment);
+                stream->compressed = (0 != (entry.flags & StreamIndexEntry::flagCompressed));
+                insertStream(stream);
+            }
+        }
+        fragmentHeaders_.insert(new FragmentHeader(block, directoryOwnerIndex, header.length, header.nextFragment));
+        directoryBlocks_.push_back(block);
+        block = header.nextFragment;
+    }
+    return errNone;
+}
+
+status_t DataStore::readLegacyIndex()
+{
     status_t error = file_.seek(0, File::seekFromBeginning);
     if (errNone != error)
         return error;
     File::Size size;
     if (errNone != (error = file_.size(size)))
         return error;
-    if (size < sizeof(StreamIndexEntry) * maxStreamsCount)
+    if (size < sizeof(LegacyStreamIndexEntry) * LegacyStreamIndexEntry::streamsCount)
         return errStoreCorrupted;
-    for (uint_t i=0; i<maxStreamsCount; ++i) 
+    legacyFormat_ = true;
+    for (uint_t i=0; i<LegacyStreamIndexEntry::streamsCount; ++i) 
     {
-        StreamIndexEntry entry;
+        LegacyStreamIndexEntry entry;
         if (errNone != (error = file_.read(&entry, sizeof(entry), size)))
             return error;
         if (sizeof(entry) != size)
             return errStoreCorrupted;
         if (entry.used)
         {
-            ulong_t nameLength = std::find(entry.name, entry.name + maxStreamNameLength, '\0') - entry.name;
-            streamHeaders_.insert(new StreamHeader(entry.name, nameLength, i, entry.firstFragment));
+            ulong_t nameLength = std::find(entry.name, entry.name + LegacyStreamIndexEntry::maxNameLength, '\0') - entry.name;
+            insertStream(new StreamHeader(entry.name, nameLength, i, entry.firstFragment));
+        }
+    }
+    return errNone;
+}
+
+// Writes directory block holding all the legacy entries into free space and only then replaces legacy index with store header, 
+// so that store interrupted in the middle is still read as v1 next time.
+status_t DataStore::migrateLegacyIndex()
+{
+    assert(legacyFormat_);
+    assert(ulong_t(LegacyStreamIndexEntry::streamsCount) <= directorySlotsCount);
+    ulong_t length = sizeof(FragmentHeaderEntry) + directorySlotsCount * sizeof(StreamIndexEntry);
+    File::Position start = fragmentStartFor(length);
+    status_t error = writeDirectoryBlock(start, 0);
+    if (errNone != error)
+        return error;
+    directoryBlocks_.push_back(start);
+    insertFragment(new FragmentHeader(start, directoryOwnerIndex, length, invalidFragmentStart));
+    if (errNone != (error = writeStoreHeader(start)))
+        return error;
+    if (errNone != (error = commit()))
+        return error;
+        
+    legacyFormat_ = false;
+    // Space occupied by legacy index is free now.
+    updateFreeExtent(fragmentHeaders_.begin());
+    return errNone;
+}
+
+File::Position DataStore::slotPosition(uint_t index) const
+{
+    assert(index / directorySlotsCount < directoryBlocks_.size());
+    return directoryBlocks_[index / directorySlotsCount] + sizeof(FragmentHeaderEntry) + (index % directorySlotsCount) * sizeof(StreamIndexEntry);
+}
+
+status_t DataStore::writeDirectoryBlock(File::Position start, uint_t firstIndex)
+{
+    status_t error = file_.seek(start, File::seekFromBeginning);
+    if (errNone != error)
+        return error;
+    FragmentHeaderEntry header;
+    header.ownerIndex = directoryOwnerIndex;
+    header.length = sizeof(header) + directorySlotsCount * sizeof(StreamIndexEntry);
+    if (errNone != (error = file_.write(&header, sizeof(header))))
+        return error;
+    for (uint_t i = firstIndex; i < firstIndex + directorySlotsCount; ++i)
+    {
+        StreamIndexEntry entry;
+        if (i < streamHeaders_.size() && NULL != streamHeaders_[i])
+        {
+            const StreamHeader& stream = *streamHeaders_[i];
+            entry.flags = StreamIndexEntry::flagUsed;
+            if (stream.compressed)
+                entry.flags |= StreamIndexEntry::flagCompressed;
+            memmove(entry.name, stream.name.data(), stream.name.length());
+            entry.firstFragment = stream.firstFragment;
         }
+        if (errNone != (error = file_.write(&entry, sizeof(entry))))
+            return error;
+    }
+    return errNone;
+}
+
+status_t DataStore::appendDirectoryBlock()
+{
+    ulong_t length = sizeof(FragmentHeaderEntry) + directorySlotsCount * sizeof(StreamIndexEntry);
+    File::Position start = fragmentStartFor(length);
+    status_t error = writeDirectoryBlock(start, directoryBlocks_.size() * directorySlotsCount);
+    if (errNone != error)
+        return error;
+    if (directoryBlocks_.empty())
+        error = writeStoreHeader(start);
+    else
+    {
+        FragmentHeader* last = fragmentAt(directoryBlocks_.back());
+        last->nextFragment = start;
+        error = writeFragmentHeader(*last);
     }
+    if (errNone != error)
+        return error;
+    directoryBlocks_.push_back(start);
+    insertFragment(new FragmentHeader(start, directoryOwnerIndex, length, invalidFragmentStart));
     return errNone;
 }
 
+static ulong_t streamNameHash(const char* name, ulong_t length)
+{
+    return hashBytes(name, length);
+}
+
+DataStore::StreamHeader* DataStore::lookupStream(const char* name, ulong_t nameLength) const
+{
+    if (streamBuckets_.empty())
+        return NULL;
+    StreamHeader* header = streamBuckets_[streamNameHash(name, nameLength) % streamBuckets_.size()];
+    while (NULL != header)
+    {
+        if (header->name.length() == nameLength && 0 == memcmp(header->name.data(), name, nameLength))
+            return header;
+        header = header->nextInBucket;
+    }
+    return NULL;
+}
+
+void DataStore::rehashStreams(ulong_t bucketsCount)
+{
+    streamBuckets_.assign(bucketsCount, NULL);
+    StreamHeaders_t::const_iterator end = streamHeaders_.end();
+    for (StreamHeaders_t::const_iterator it = streamHeaders_.begin(); it != end; ++it)
+    {
+        if (NULL == *it)
+            continue;
+        StreamHeader*& bucket = streamBuckets_[streamNameHash((*it)->name.data(), (*it)->name.length()) % bucketsCount];
+        (*it)->nextInBucket = bucket;
+        bucket = *it;
+    }
+}
+
+void DataStore::insertStream(StreamHeader* header)
+{
+    if (streamHeaders_.size() <= header->index)
+    {
+        for (uint_t index = streamHeaders_.size(); index < header->index; ++index)
+            freeSlots_.insert(freeSlots_.end(), index);
+        streamHeaders_.resize(header->index + 1, NULL);
+    }
+    else
+        freeSlots_.erase(header->index);
+    assert(NULL == streamHeaders_[header->index]);
+    streamHeaders_[header->index] = header;
+    ++streamsCount_;
+    if (streamsCount_ > streamBuckets_.size())
+    {
+        rehashStreams(std::max<ulong_t>(directorySlotsCount, streamBuckets_.size() * 2));
+        return;
+    }
+    StreamHeader*& bucket = streamBuckets_[streamNameHash(header->name.data(), header->name.length()) % streamBuckets_.size()];
+    header->nextInBucket = bucket;
+    bucket = header;
+}
+
+void DataStore::eraseStream(StreamHeader* header)
+{
+    assert(streamHeaders_[header->index] == header);
+    streamHeaders_[header->index] = NULL;
+    freeSlots_.insert(header->index);
+    --streamsCount_;
+    StreamHeader** link = &streamBuckets_[streamNameHash(header->name.data(), header->name.length()) % streamBuckets_.size()];
+    while (*link != header)
+    {
+        assert(NULL != *link);
+        link = &(*link)->nextInBucket;
+    }
+    *link = header->nextInBucket;
+}
+
 status_t DataStore::open(const char_t* fileName)
 {
     free(fileName_);
@@ -160,10 +698,16 @@ status_t DataStore::open(const char_t* fileName)
     status_t error = file_.open(fileName_, GENERIC_WRITE|GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS);
 #elif defined(_PALM_OS)
     status_t error = file_.open(fileName_, fileModeUpdate);
+#elif defined(_POSIX)
+    status_t error = file_.open(fileName_, O_RDWR);
 #endif  
     if (errNone != error)
         goto OnError;
 
+    error = recoverJournal();
+    if (errNone != error)
+        goto OnError;
+        
     error = readIndex();
     if (errNone != error)
         goto OnError;
@@ -172,6 +716,13 @@ status_t DataStore::open(const char_t* fileName)
     if (errNone != error)
         goto OnError;
         
+    if (legacyFormat_ && errNone != (error = migrateLegacyIndex()))
+        goto OnError;
+        
+    // Journal of commit() interrupted before it was pointed to, or fragment data it would have made reachable.
+    if (errNone != (error = findEof()))
+        goto OnError;
+        
     return errNone;
 OnError:    
     file_.close();
@@ -202,6 +753,8 @@ status_t DataStore::create(const char_t* fileName)
     status_t error = file_.open(fileName_, GENERIC_WRITE|GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_FLAG_RANDOM_ACCESS);
 #elif defined(_PALM_OS)
     status_t error = file_.open(fileName_, fileModeUpdate);
+#elif defined(_POSIX)
+    status_t error = file_.open(fileName_, O_RDWR|O_CREAT);
 #endif  
     if (errNone != error)
         return error;
@@ -219,10 +772,15 @@ status_t DataStore::readHeaders()
     StreamHeaders_t::const_iterator end = streamHeaders_.end();
     for (StreamHeaders_t::const_iterator it = streamHeaders_.begin(); it != end; ++it)
     {
+        if (NULL == *it)
+            continue;
         status_t error = readHeadersForOwner(*(*it));
         if (errNone != error)
             return error;
     }
+    FragmentHeaders_t::iterator fend = fragmentHeaders_.end();
+    for (FragmentHeaders_t::iterator it = fragmentHeaders_.begin(); it != fend; ++it)
+        updateFreeExtent(it);
     return errNone;
 }
 
@@ -240,7 +798,8 @@ status_t DataStore::readHeadersForOwner(const DataStore::StreamHeader& streamHea
             return error;
         if (sizeof(entry) != size)
             return errStoreCorrupted;
-        fragmentHeaders_.insert(new FragmentHeader(nextFragment, streamHeader.index, entry.length, entry.nextFragment));
+        uint_t length = std::max<uint_t>(entry.length, sizeof(entry));
+        fragmentHeaders_.insert(new FragmentHeader(nextFragment, streamHeader.index, length, entry.nextFragment));
         nextFragment=entry.nextFragment;
     }
     return errNone;
@@ -248,101 +807,184 @@ status_t DataStore::readHeadersForOwner(const DataStore::StreamHeader& streamHea
 
 status_t DataStore::removeStream(const char* name)
 {  
-    StreamHeader sh(name, Len(name), 0, 0);
-    StreamHeaders_t::iterator it = streamHeaders_.find(&sh);
-    if (streamHeaders_.end() == it)
+    WriteLockGuard lock(lock_);
+    StreamHeader* header = lookupStream(name, Len(name));
+    if (NULL == header)
         return errNotFound;
-    File::Position pos = (*it)->index * sizeof(StreamIndexEntry);
-    status_t error = file_.seek(pos, File::seekFromBeginning);
+    status_t error = releaseStream(header);
     if (errNone != error)
         return error;
+    return flushHeaders();
+}
+
+// Removal becomes durable with the next commit, so that stream being replaced survives until the new one is complete.
+status_t DataStore::releaseStream(StreamHeader* header)
+{
     StreamIndexEntry sie;
-    error=file_.write(&sie, sizeof(sie));
+    status_t error = journalWrite(slotPosition(header->index), &sie, sizeof(sie));
     if (errNone != error)
         return error;
-    removeFragments((*it)->firstFragment);
-    delete *it;
-    streamHeaders_.erase(it);
+    removeFragments(header->firstFragment);
+    dirtyStreamHeaders_.erase(header);
+    eraseStream(header);
+    delete header;
     return errNone;
 }
 
-status_t DataStore::createStream(const char* name, StreamHeader*& header)
+status_t DataStore::createStream(const char* name, bool compressed, StreamHeader*& header)
 {
     ulong_t nlen = Len(name);
     if (maxStreamNameLength < nlen)
         return errNameTooLong;
-    if (maxStreamsCount == streamHeaders_.size())
-        return errTooManyStreams;
-    StreamHeaders_t::const_iterator end = streamHeaders_.end();
-    StreamHeader sh(name, nlen, 0, 0);
-    if (end != streamHeaders_.find(&sh))
+    StreamHeader* existing = lookupStream(name, nlen);
+    if (NULL != existing)
     {
-        status_t error = removeStream(name);
+        status_t error = releaseStream(existing);
         if (errNone != error)
             return error;
     }
-    typedef std::bitset<maxStreamsCount> StreamsUsage_t;
-    StreamsUsage_t usage;
-    for (StreamHeaders_t::const_iterator it = streamHeaders_.begin(); it != end; ++it)
-        usage.set((*it)->index);
-    uint_t index;
-    for (index = 0; index < maxStreamsCount; ++index)
-        if (!usage.test(index))
-            break;
-    assert(index < maxStreamsCount);
-    status_t error = file_.seek(index * sizeof(StreamIndexEntry), File::seekFromBeginning);
-    if (errNone != error)
-        return error;
-    StreamIndexEntry indexEntry;
-    indexEntry.used = true;
-    memmove(indexEntry.name, name, nlen);
-    error = file_.write(&indexEntry, sizeof(indexEntry));
-    if (errNone != error)
-        return error;
-    header = *streamHeaders_.insert(new StreamHeader(name, nlen, index, invalidFragmentStart)).first;
+    uint_t index = streamHeaders_.size();
+    if (!freeSlots_.empty())
+        index = *freeSlots_.begin();
+    if (index >= directoryBlocks_.size() * directorySlotsCount)
+    {
+        status_t error = appendDirectoryBlock();
+        if (errNone != error)
+            return error;
+    }
+    header = new StreamHeader(name, nlen, index, invalidFragmentStart);
+    header->compressed = compressed;
+    insertStream(header);
+    markDirty(*header);
     return errNone;
 }
 
 status_t DataStore::writeFragmentHeader(const DataStore::FragmentHeader& header)
 {
-    status_t error = file_.seek(header.start, File::seekFromBeginning);
-    if (errNone != error)
-        return error;
     FragmentHeaderEntry entry;
     entry.ownerIndex = header.ownerIndex;
     entry.length = header.length;
     entry.nextFragment = header.nextFragment;
-    error = file_.write(&entry, sizeof(entry));
-    return error;
+    return journalWrite(header.start, &entry, sizeof(entry));
 }
 
 status_t DataStore::writeStreamHeader(const DataStore::StreamHeader& header)
 {
-    status_t error = file_.seek(header.index*sizeof(StreamIndexEntry), File::seekFromBeginning);
-    if (errNone != error)
-        return error;
     StreamIndexEntry indexEntry;
-    indexEntry.used = true;
+    indexEntry.flags = StreamIndexEntry::flagUsed;
+    if (header.compressed)
+        indexEntry.flags |= StreamIndexEntry::flagCompressed;
     memmove(indexEntry.name, header.name.data(), header.name.length());
     indexEntry.firstFragment=header.firstFragment;
-    error = file_.write(&indexEntry, sizeof(indexEntry));
-    if (errNone != error)
-        return error;
-    return errNone;
+    return journalWrite(slotPosition(header.index), &indexEntry, sizeof(indexEntry));
 }
 
-File::Position DataStore::nextAvailableFragmentStart() const
+// Commits headers modified since last call in one transaction, so that header touched by several writes hits the file only once.
+status_t DataStore::flushHeaders()
 {
-    File::Position start = maxStreamsCount*sizeof(StreamIndexEntry);
-    FragmentHeaders_t::const_iterator end=fragmentHeaders_.end();
-    for (FragmentHeaders_t::const_iterator it = fragmentHeaders_.begin(); it != end; ++it)
+    status_t error;
+    DirtyStreamHeaders_t::iterator send = dirtyStreamHeaders_.end();
+    for (DirtyStreamHeaders_t::iterator it = dirtyStreamHeaders_.begin(); it != send; ++it)
+        if (errNone != (error = writeStreamHeader(*(*it))))
+            return error;
+    dirtyStreamHeaders_.clear();
+    
+    FragmentHeaders_t::iterator fend = dirtyFragmentHeaders_.end();
+    for (FragmentHeaders_t::iterator it = dirtyFragmentHeaders_.begin(); it != fend; ++it)
     {
-        if ((*it)->start - start >= minFragmentLength)
-            return start;
-        start = (*it)->start + (*it)->length;
+        if (errNone != (error = writeFragmentHeader(*(*it))))
+            return error;
+        (*it)->committed = true;
     }
-    return start;
-}
+    dirtyFragmentHeaders_.clear();
+    
+    if (errNone != (error = commit()))
+        return error;
+    
+    // Nothing on disk points to released fragments any more, so their space may be reused.
+    ReleasedFragments_t::iterator rend = releasedFragments_.end();
+    for (ReleasedFragments_t::iterator it = releasedFragments_.begin(); it != rend; ++it)
+        eraseFragment(fragmentHeaders_.find(*it));
+    releasedFragments_.clear();
+    return errNone;
+}
+
+File::Position DataStore::fragmentsStart() const
+{
+    if (legacyFormat_)
+        return LegacyStreamIndexEntry::streamsCount * sizeof(LegacyStreamIndexEntry);
+    return sizeof(StoreHeaderEntry) + sizeof(PendingJournalEntry);
+}
+
+File::Position DataStore::precedingFragmentEnd(FragmentHeaders_t::const_iterator it) const
+{
+    if (fragmentHeaders_.begin() == it)
+        return fragmentsStart();
+    const FragmentHeader* prev = *--it;
+    return prev->start + prev->length;
+}
+
+void DataStore::eraseFreeExtent(FragmentHeader& header)
+{
+    if (!header.hasFreeExtent)
+        return;
+    freeExtents_.erase(header.freeExtent);
+    header.hasFreeExtent = false;
+}
+
+// Recalculates the hole between fragment pointed to by it and its predecessor.
+void DataStore::updateFreeExtent(FragmentHeaders_t::iterator it)
+{
+    FragmentHeader& header = *(*it);
+    eraseFreeExtent(header);
+    File::Position start = precedingFragmentEnd(it);
+    assert(start <= header.start);
+    if (start >= header.start)
+        return;
+    header.freeExtent = freeExtents_.insert(FreeExtents_t::value_type(header.start - start, &header));
+    header.hasFreeExtent = true;
+    if (start < compactCursor_)
+        compactCursor_ = start;
+}
+
+void DataStore::updateFreeExtentAfter(FragmentHeaders_t::iterator it)
+{
+    if (fragmentHeaders_.end() != ++it)
+        updateFreeExtent(it);
+}
+
+void DataStore::insertFragment(FragmentHeader* header)
+{
+    FragmentHeaders_t::iterator it = fragmentHeaders_.insert(header).first;
+    assert(*it == header);
+    updateFreeExtent(it);
+    updateFreeExtentAfter(it);
+}
+
+void DataStore::eraseFragment(FragmentHeaders_t::iterator it)
+{
+    FragmentHeaders_t::iterator next = it;
+    ++next;
+    dirtyFragmentHeaders_.erase(*it);
+    eraseFreeExtent(*(*it));
+    delete *it;
+    fragmentHeaders_.erase(it);
+    if (fragmentHeaders_.end() != next)
+        updateFreeExtent(next);
+}
+
+// Uses the largest hole so that the fragment has as much room to grow as possible, otherwise appends at the end of file.
+File::Position DataStore::nextAvailableFragmentStart() const
+{
+    if (!freeExtents_.empty())
+    {
+        FreeExtents_t::const_iterator largest = freeExtents_.end();
+        --largest;
+        if (largest->first >= minFragmentLength)
+            return largest->second->start - largest->first;
+    }
+    return precedingFragmentEnd(fragmentHeaders_.end());
+}
 
 ulong_t DataStore::maxAllowedFragmentLength(FragmentHeader& header) const
 {
@@ -358,21 +1000,30 @@ ulong_t DataStore::maxAllowedFragmentLength(FragmentHeader& header) const
 status_t DataStore::createFragment(uint_t ownerIndex, FragmentHeader*& header)
 {
     File::Position start = nextAvailableFragmentStart();
-    std::auto_ptr<FragmentHeader> fh(new FragmentHeader(start, ownerIndex, 0, invalidFragmentStart));
-    status_t error = writeFragmentHeader(*fh);
-    if (errNone != error)
-        return error;
-    header=*fragmentHeaders_.insert(fh.release()).first;
+    header = new FragmentHeader(start, ownerIndex, sizeof(FragmentHeaderEntry), invalidFragmentStart);
+    header->committed = false;
+    insertFragment(header);
+    markDirty(*header);
+    // Stream behind compaction cursor got fragmented again.
+    if (ownerIndex < compactStream_)
+    {
+        compactStream_ = ownerIndex;
+        compactFragment_ = invalidFragmentStart;
+    }
     return errNone;
 }
 
 status_t DataStore::truncateFragment(FragmentHeader& fragment, uint_t length)
 {
     removeFragments(fragment.nextFragment);
+    fragment.nextFragment = invalidFragmentStart;
     fragment.length = length;
-    return writeFragmentHeader(fragment);
+    updateFreeExtentAfter(fragmentHeaders_.find(&fragment));
+    markDirty(fragment);
+    return errNone;
 }
 
+// Fragments that may be still referenced from the disk are only released, so that their space isn't reused before the next commit().
 void DataStore::removeFragments(File::Position start)
 {
     while (invalidFragmentStart != start) 
@@ -381,8 +1032,13 @@ void DataStore::removeFragments(File::Position start)
         FragmentHeaders_t::iterator it = fragmentHeaders_.find(&fh);
         assert(fragmentHeaders_.end() != it);
         start = (*it)->nextFragment;
-        delete *it;
-        fragmentHeaders_.erase(it);
+        if ((*it)->committed)
+        {
+            dirtyFragmentHeaders_.erase(*it);
+            releasedFragments_.push_back(*it);
+        }
+        else
+            eraseFragment(it);
     }
 }
 
@@ -394,13 +1050,9 @@ DataStore::StreamPosition::StreamPosition(DataStore::StreamHeader& s):
 
 status_t DataStore::readFragment(const FragmentHeader& fragment, uint_t& startOffset, void*& buffer, uint_t& length)
 {
-    status_t error = file_.seek(fragment.start+sizeof(FragmentHeaderEntry)+startOffset, File::seekFromBeginning);
-    if (errNone != error)
-        return error;
-        
     File::Size toRead = std::min<File::Size>(length, fragment.length-sizeof(FragmentHeaderEntry)-startOffset);
     File::Size read;
-    error = file_.read(buffer, toRead, read);
+    status_t error = file_.read(fragment.start+sizeof(FragmentHeaderEntry)+startOffset, buffer, toRead, read);
     if (errNone != error)
         return error;
     
@@ -413,6 +1065,58 @@ status_t DataStore::readFragment(const FragmentHeader& fragment, uint_t& startOf
     return errNone;
 }
 
+#ifdef FILE_HAS_MAPPING
+
+status_t DataStore::viewFragment(const FragmentHeader& fragment, uint_t& startOffset, const void*& data, uint_t& length)
+{
+    uint_t toView = std::min<uint_t>(length, fragment.length-sizeof(FragmentHeaderEntry)-startOffset);
+    LockGuard lock(mapLock_);
+    status_t error = file_.view(fragment.start+sizeof(FragmentHeaderEntry)+startOffset, toView, data);
+    if (errNone != error)
+        return error;
+    length = toView;
+    startOffset += length;
+    return errNone;
+}
+
+status_t DataStore::viewStream(StreamPosition& position, const void*& data, ulong_t& length)
+{
+    if (0 == length || invalidFragmentStart == position.stream.firstFragment)
+    {
+        length = 0;
+        return errNone;
+    }
+    
+    if (NULL == position.fragment)
+    {
+        FragmentHeader fh(position.stream.firstFragment, 0, 0, 0);
+        FragmentHeaders_t::iterator it = fragmentHeaders_.find(&fh);
+        assert(fragmentHeaders_.end() != it);
+        position.fragment = *it;
+    }
+    while (position.fragment->length == position.position+sizeof(FragmentHeaderEntry)) 
+    {
+        if (invalidFragmentStart == position.fragment->nextFragment)
+        {
+            length = 0;
+            return errNone;
+        }
+        position.position = 0;
+        FragmentHeader fh(position.fragment->nextFragment, 0, 0, 0);
+        FragmentHeaders_t::iterator it = fragmentHeaders_.find(&fh);
+        assert(fragmentHeaders_.end() != it);
+        position.fragment = *it; 
+    }
+    uint_t len = std::min<ulong_t>(length, uint_t(-1));
+    status_t error = viewFragment(*position.fragment, position.position, data, len);
+    if (errNone != error)
+        return error;
+    length = len;
+    return errNone;
+}
+
+#endif // FILE_HAS_MAPPING
+
 status_t DataStore::writeFragment(FragmentHeader& fragment, uint_t& startOffset, const void*& buffer, uint_t& length)
 {
     status_t error = file_.seek(fragment.start+sizeof(FragmentHeaderEntry)+startOffset, File::seekFromBeginning);
@@ -431,10 +1135,8 @@ status_t DataStore::writeFragment(FragmentHeader& fragment, uint_t& startOffset,
         removeFragments(fragment.nextFragment);
         fragment.nextFragment = invalidFragmentStart;
     }
-        
-    error=writeFragmentHeader(fragment);
-    if (errNone != error)
-        return error;
+    updateFreeExtentAfter(fragmentHeaders_.find(&fragment));
+    markDirty(fragment);
     
     length = toWrite;
     buffer = (static_cast<const char*>(buffer)+length);
@@ -496,9 +1198,7 @@ status_t DataStore::writeStream(StreamPosition& position, const void* buffer, ul
             return error;            
         assert(NULL != position.fragment);
         position.stream.firstFragment=position.fragment->start;        
-        error = writeStreamHeader(position.stream);
-        if (errNone != error)
-            return error;
+        markDirty(position.stream);
     }
     while (length > 0)
     {
@@ -514,118 +1214,1552 @@ status_t DataStore::writeStream(StreamPosition& position, const void* buffer, ul
             if (errNone != error)
                 return error;
             prevFragment->nextFragment = position.fragment->start;
-            error = writeFragmentHeader(*prevFragment);
-            if (errNone != error)
-                return error;
+            markDirty(*prevFragment);
             position.position = 0;
         }
     }
     return errNone;        
 }
 
+void DataStore::seekToEnd(StreamPosition& position)
+{
+    if (invalidFragmentStart == position.stream.firstFragment)
+        return;
+    FragmentHeader* fragment = fragmentAt(position.stream.firstFragment);
+    while (invalidFragmentStart != fragment->nextFragment)
+        fragment = fragmentAt(fragment->nextFragment);
+    position.fragment = fragment;
+    position.position = fragment->length - sizeof(FragmentHeaderEntry);
+}
+
 status_t DataStore::findStream(const char* name, StreamHeader*& header)
 {
-    StreamHeader sh(name, Len(name), 0, 0);
-    StreamHeaders_t::iterator it = streamHeaders_.find(&sh);
-    if (streamHeaders_.end() == it)
+    StreamHeader* sh = lookupStream(name, Len(name));
+    if (NULL == sh)
         return errNotFound;
-    header = *it;
+    header = sh;
     return errNone;
 }
 
 status_t DataStore::findEof()
 {
-    File::Position pos = sizeof(StreamIndexEntry) * maxStreamsCount;
-    if (!fragmentHeaders_.empty())
-    {
-        FragmentHeaders_t::const_iterator it = fragmentHeaders_.end();
-        const FragmentHeader* last = *--it;
-        pos = last->start + last->length;
-    }
+#ifndef NDEBUG
+    if (crashed_)
+        return errNone;
+#endif
+    File::Position pos = precedingFragmentEnd(fragmentHeaders_.end());
     status_t error = file_.seek(pos, File::seekFromBeginning);
     if (errNone != error)
         return error;
     error = file_.truncate();
     if (errNone != error)
         return error;
+#ifdef FILE_HAS_MAPPING
+    // Open readers may still use views into the mapping truncate() retired; the last one to close releases it then.
+    if (0 == openReadersCount_)
+        file_.releaseRetiredMaps();
+#endif
     return errNone;
 }
 
-DataStoreReader::DataStoreReader(DataStore& store): store_(store) {}    
+DataStore::FragmentHeader* DataStore::fragmentAt(File::Position start) const
+{
+    FragmentHeader fh(start, 0, 0, 0);
+    FragmentHeaders_t::const_iterator it = fragmentHeaders_.find(&fh);
+    assert(fragmentHeaders_.end() != it);
+    return *it;
+}
+
+DataStore::StreamHeader* DataStore::fragmentOwner(const FragmentHeader& fragment) const
+{
+    if (fragment.ownerIndex >= streamHeaders_.size())
+        return NULL;
+    return streamHeaders_[fragment.ownerIndex];
+}
+
+// Smallest hole that fits length bytes or end of file.
+File::Position DataStore::fragmentStartFor(ulong_t length) const
+{
+    FreeExtents_t::const_iterator hole = freeExtents_.lower_bound(length);
+    if (freeExtents_.end() != hole)
+        return hole->second->start - hole->first;
+    return precedingFragmentEnd(fragmentHeaders_.end());
+}
+
+status_t DataStore::copyData(File::Position from, File::Position to, ulong_t length, char* buffer)
+{
+    while (length > 0)
+    {
+        File::Size chunk = std::min<ulong_t>(length, compactBufferSize);
+        status_t error = file_.seek(from, File::seekFromBeginning);
+        if (errNone != error)
+            return error;
+        File::Size read;
+        if (errNone != (error = file_.read(buffer, chunk, read)))
+            return error;
+        if (chunk != read)
+            return errStoreCorrupted;
+        if (errNone != (error = file_.seek(to, File::seekFromBeginning)))
+            return error;
+        if (errNone != (error = file_.write(buffer, chunk)))
+            return error;
+        from += chunk;
+        to += chunk;
+        length -= chunk;
+    }
+    return errNone;
+}
 
-DataStoreReader::~DataStoreReader() {}
+// Makes whatever points to fragment (stream header or preceding fragment) point to newStart instead and writes it immediately.
+status_t DataStore::relinkFragment(const FragmentHeader& fragment, File::Position newStart)
+{
+    if (directoryOwnerIndex == fragment.ownerIndex)
+    {
+        DirectoryBlocks_t::iterator block = std::find(directoryBlocks_.begin(), directoryBlocks_.end(), fragment.start);
+        assert(directoryBlocks_.end() != block);
+        *block = newStart;
+        if (directoryBlocks_.begin() == block)
+            return writeStoreHeader(newStart);
+        FragmentHeader* prev = fragmentAt(*--block);
+        prev->nextFragment = newStart;
+        return writeFragmentHeader(*prev);
+    }
+    StreamHeader* stream = fragmentOwner(fragment);
+    if (NULL == stream)
+        return errStoreCorrupted;
+    if (stream->firstFragment == fragment.start)
+    {
+        stream->firstFragment = newStart;
+        return writeStreamHeader(*stream);
+    }
+    File::Position pos = stream->firstFragment;
+    while (invalidFragmentStart != pos)
+    {
+        FragmentHeader* prev = fragmentAt(pos);
+        if (prev->nextFragment == fragment.start)
+        {
+            prev->nextFragment = newStart;
+            return writeFragmentHeader(*prev);
+        }
+        pos = prev->nextFragment;
+    }
+    return errStoreCorrupted;
+}
 
-status_t DataStoreReader::open(const char* name)
+// Copies data of count fragments starting with first into a single new fragment placed in the smallest hole it fits in (or at the end of file), then switches stream to it.
+status_t DataStore::mergeFragments(FragmentHeader* first, ulong_t count, ulong_t dataLength)
 {
-    DataStore::StreamHeader* header = NULL;
-    status_t error = store_.findStream(name, header);
+    assert(count > 1);
+    ulong_t length = sizeof(FragmentHeaderEntry) + dataLength;
+    File::Position target = fragmentStartFor(length);
+        
+    char* buffer = (char*)malloc(compactBufferSize);
+    if (NULL == buffer)
+        return memErrNotEnoughSpace;
+    status_t error = errNone;
+    File::Position to = target + sizeof(FragmentHeaderEntry);
+    FragmentHeader* fragment = first;
+    for (ulong_t i = 0; i < count; ++i)
+    {
+        if (0 != i)
+            fragment = fragmentAt(fragment->nextFragment);
+        ulong_t len = fragment->length - sizeof(FragmentHeaderEntry);
+        if (errNone != (error = copyData(fragment->start + sizeof(FragmentHeaderEntry), to, len, buffer)))
+            break;
+        to += len;
+    }
+    free(buffer);
     if (errNone != error)
         return error;
-    assert(NULL != header);
-    position_.reset(new DataStore::StreamPosition(*header));
+        
+    std::auto_ptr<FragmentHeader> merged(new FragmentHeader(target, first->ownerIndex, length, fragment->nextFragment));
+    if (errNone != (error = writeFragmentHeader(*merged)))
+        return error;
+    insertFragment(merged.release());
+    
+    File::Position start = first->start;
+    if (errNone != (error = relinkFragment(*first, target)))
+        return error;
+    if (errNone != (error = commit()))
+        return error;
+    for (ulong_t i = 0; i < count; ++i)
+    {
+        FragmentHeader fh(start, 0, 0, 0);
+        FragmentHeaders_t::iterator it = fragmentHeaders_.find(&fh);
+        assert(fragmentHeaders_.end() != it);
+        start = (*it)->nextFragment;
+        eraseFragment(it);
+    }
     return errNone;
 }
 
-status_t DataStoreReader::readRaw(void* buffer, ulong_t& length)
+// Copies fragment (its header stays the same, so it's copied along with data) to target in free space and switches whatever points to it there.
+status_t DataStore::moveFragment(FragmentHeader*& fragment, File::Position target)
 {
-    assert(NULL != position_.get());
-    return store_.readStream(*position_, buffer, length);
+    char* buffer = (char*)malloc(compactBufferSize);
+    if (NULL == buffer)
+        return memErrNotEnoughSpace;
+    status_t error = copyData(fragment->start, target, fragment->length, buffer);
+    free(buffer);
+    if (errNone != error)
+        return error;
+    FragmentHeader* moved = new FragmentHeader(target, fragment->ownerIndex, fragment->length, fragment->nextFragment);
+    insertFragment(moved);
+    
+    if (errNone != (error = relinkFragment(*fragment, target)))
+        return error;
+    if (errNone != (error = commit()))
+        return error;
+    eraseFragment(fragmentHeaders_.find(fragment));
+    fragment = moved;
+    return errNone;
 }
 
-DataStoreWriter::DataStoreWriter(DataStore& store): store_(store) {}
+// Advances compaction over streams kept in a single fragment. Each pass over a stream merges runs of fragments 
+// starting where the previous one ended, so that run merged once isn't copied again with every next fragment.
+DataStore::FragmentHeader* DataStore::nextFragmentToMerge()
+{
+    while (compactStream_ < streamHeaders_.size())
+    {
+        const StreamHeader* stream = streamHeaders_[compactStream_];
+        if (NULL != stream && invalidFragmentStart != stream->firstFragment)
+        {
+            FragmentHeader* fragment = fragmentAt(stream->firstFragment);
+            if (invalidFragmentStart != compactFragment_)
+            {
+                // Fragment may be gone if stream was rewritten since the previous step.
+                FragmentHeader fh(compactFragment_, 0, 0, 0);
+                FragmentHeaders_t::const_iterator it = fragmentHeaders_.find(&fh);
+                if (fragmentHeaders_.end() != it && compactStream_ == (*it)->ownerIndex && invalidFragmentStart != (*it)->nextFragment)
+                    fragment = *it;
+            }
+            if (invalidFragmentStart != fragment->nextFragment)
+                return fragment;
+        }
+        ++compactStream_;
+        compactFragment_ = invalidFragmentStart;
+    }
+    return NULL;
+}
 
-DataStoreWriter::~DataStoreWriter() 
+// Moves the first fragment that follows a hole down into it, so that holes move towards the end of file, which is truncated.
+status_t DataStore::slideFragment(bool& moved)
 {
-    store_.findEof();
+    moved = false;
+    FragmentHeader fh(compactCursor_, 0, 0, 0);
+    FragmentHeaders_t::iterator it = fragmentHeaders_.lower_bound(&fh);
+    while (fragmentHeaders_.end() != it && !(*it)->hasFreeExtent)
+        ++it;
+    if (fragmentHeaders_.end() == it)
+    {
+        compactCursor_ = precedingFragmentEnd(it);
+        return errNone;
+    }
+    FragmentHeader* fragment = *it;
+    File::Size holeLength = fragment->freeExtent->first;
+    File::Position hole = fragment->start - holeLength;
+    compactCursor_ = hole;
+    
+    status_t error;
+    if (fragment->length > holeLength)
+    {
+        // Copy would overwrite fragment's own data before the header is switched to it. Last fragment in the file
+        // is moved into the hole instead if it fits, otherwise fragment is moved out of the way to the end of file first.
+        FragmentHeader* last = *fragmentHeaders_.rbegin();
+        if (last != fragment && last->length <= holeLength)
+            fragment = last;
+        else if (errNone != (error = moveFragment(fragment, precedingFragmentEnd(fragmentHeaders_.end()))))
+            return error;
+    }
+    if (errNone != (error = moveFragment(fragment, hole)))
+        return error;
+    moved = true;
+    return errNone;
 }
 
-status_t DataStoreWriter::open(const char* name, bool dontCreate)
+status_t DataStore::compactStep(ulong_t maxBytes, bool& done)
 {
-    DataStore::StreamHeader* header = NULL;
-    status_t error = store_.findStream(name, header);
-    if (DataStore::errNotFound == error && !dontCreate)
-        error = store_.createStream(name, header);
+    done = false;
+    WriteLockGuard lock(lock_);
+    if (0 != openStreamsCount_)
+        return errStreamsOpen;
+    status_t error = flushHeaders();
     if (errNone != error)
         return error;
-    assert(NULL != header);
-    position_.reset(new DataStore::StreamPosition(*header));
-    return errNone;
+        
+    FragmentHeader* first = nextFragmentToMerge();
+    if (NULL != first)
+    {
+        // Run is at least a pair of fragments, even if it's larger than maxBytes.
+        ulong_t count = 1;
+        ulong_t dataLength = first->length - sizeof(FragmentHeaderEntry);
+        FragmentHeader* fragment = first;
+        while (invalidFragmentStart != fragment->nextFragment)
+        {
+            FragmentHeader* next = fragmentAt(fragment->nextFragment);
+            ulong_t len = next->length - sizeof(FragmentHeaderEntry);
+            if (count > 1 && dataLength + len > maxBytes)
+                break;
+            dataLength += len;
+            ++count;
+            fragment = next;
+        }
+        File::Position next = fragment->nextFragment;
+        if (errNone == (error = mergeFragments(first, count, dataLength)))
+            compactFragment_ = next;
+    }
+    else
+    {
+        bool moved;
+        error = slideFragment(moved);
+        done = !moved;
+    }
+    if (errNone != error)
+        return error;
+    return findEof();
 }
 
-status_t DataStoreWriter::writeRaw(const void* buffer, ulong_t length)
+uint_t DataStore::fragmentationRatio() const
 {
-    assert(NULL != position_.get());
-    return store_.writeStream(*position_, buffer, length);
+    ReadLockGuard lock(lock_);
+    ulong_t fragments = fragmentHeaders_.size() - directoryBlocks_.size();
+    if (0 == fragments)
+        return 0;
+    ulong_t streams = 0;
+    StreamHeaders_t::const_iterator end = streamHeaders_.end();
+    for (StreamHeaders_t::const_iterator it = streamHeaders_.begin(); it != end; ++it)
+        if (NULL != *it && invalidFragmentStart != (*it)->firstFragment)
+            ++streams;
+    return uint_t((fragments - streams) * 100 / fragments);
 }
 
-status_t DataStoreWriter::flush()
+File::Size DataStore::freeSpace() const
+{
+    ReadLockGuard lock(lock_);
+    File::Size size = 0;
+    FreeExtents_t::const_iterator end = freeExtents_.end();
+    for (FreeExtents_t::const_iterator it = freeExtents_.begin(); it != end; ++it)
+        size += it->first;
+    return size;
+}
+
+status_t DataStore::streamSize(const char* name, File::Size& size) const
 {
+    ReadLockGuard lock(lock_);
+    const StreamHeader* header = lookupStream(name, Len(name));
+    if (NULL == header)
+        return errNotFound;
+    size = 0;
+    File::Position start = header->firstFragment;
+    while (invalidFragmentStart != start)
+    {
+        const FragmentHeader* fragment = fragmentAt(start);
+        size += fragment->length;
+        start = fragment->nextFragment;
+    }
     return errNone;
 }
 
-namespace {
-    static DataStore* store = NULL;
+DataStoreReader::DataStoreReader(DataStore& store): 
+    store_(store),
+    compressed_(false),
+    block_(NULL),
+    blockLength_(0),
+    blockOffset_(0)
+#ifndef FILE_HAS_MAPPING
+    , buffer_(NULL)
+#endif
+{}    
+
+DataStoreReader::~DataStoreReader() 
+{
+    if (NULL != position_.get())
+    {
+        WriteLockGuard lock(store_.lock_);
+        --store_.openStreamsCount_;
+#ifdef FILE_HAS_MAPPING
+        if (0 == --store_.openReadersCount_)
+            store_.file_.releaseRetiredMaps();
+#endif
+    }
+    free(block_);
+#ifndef FILE_HAS_MAPPING
+    free(buffer_);
+#endif
 }
 
-DataStore* DataStore::instance()
+status_t DataStoreReader::open(const char* name)
 {
-    return store;
+    WriteLockGuard lock(store_.lock_);
+    DataStore::StreamHeader* header = NULL;
+    status_t error = store_.findStream(name, header);
+    if (errNone != error)
+        return error;
+    assert(NULL != header);
+    if (NULL == position_.get())
+    {
+        ++store_.openStreamsCount_;
+#ifdef FILE_HAS_MAPPING
+        ++store_.openReadersCount_;
+#endif
+    }
+    position_.reset(new DataStore::StreamPosition(*header));
+    compressed_ = header->compressed;
+    blockLength_ = blockOffset_ = 0;
+    return errNone;
 }
 
-status_t DataStore::initialize(const char_t* fileName)
+// Reads and decompresses next block of compressed stream, leaves blockLength_ 0 at the end of stream.
+status_t DataStoreReader::readBlock()
 {
-    assert(NULL == store);
-    std::auto_ptr<DataStore> ds(new DataStore());
-    status_t error = ds->open(fileName, DataStore::createAsNeeded);
+    blockLength_ = blockOffset_ = 0;
+    if (NULL == block_)
+    {
+        block_ = (char*)malloc(2 * DataStore::compressedBlockLength);
+        if (NULL == block_)
+            return memErrNotEnoughSpace;
+    }
+    ReadLockGuard lock(store_.lock_);
+    unsigned char header[DataStore::blockHeaderLength];
+    ulong_t length = sizeof(header);
+    status_t error = store_.readStream(*position_, header, length);
     if (errNone != error)
         return error;
-    store = ds.release();
+    if (0 == length)
+        return errNone;
+    if (sizeof(header) != length)
+        return DataStore::errStoreCorrupted;
+    ulong_t rawLength = header[0] | (ulong_t(header[1]) << 8);
+    ulong_t storedLength = header[2] | (ulong_t(header[3]) << 8);
+    if (rawLength > DataStore::compressedBlockLength || storedLength > rawLength)
+        return DataStore::errStoreCorrupted;
+        
+    char* stored = block_ + DataStore::compressedBlockLength;
+    length = storedLength;
+    if (errNone != (error = store_.readStream(*position_, stored, length)))
+        return error;
+    if (storedLength != length)
+        return DataStore::errStoreCorrupted;
+    if (storedLength == rawLength)
+        memmove(block_, stored, rawLength);
+    else 
+    {
+        length = rawLength;
+        if (!LZ77_Decompress(stored, storedLength, block_, length) || rawLength != length)
+            return DataStore::errStoreCorrupted;
+    }
+    blockLength_ = rawLength;
     return errNone;
 }
 
-void DataStore::dispose()
+status_t DataStoreReader::readRaw(void* buffer, ulong_t& length)
 {
-    delete store;
-    store = NULL;
+    assert(NULL != position_.get());
+    if (!compressed_)
+    {
+        ReadLockGuard lock(store_.lock_);
+        return store_.readStream(*position_, buffer, length);
+    }
+    ulong_t read = 0;
+    while (read < length)
+    {
+        if (blockOffset_ == blockLength_)
+        {
+            status_t error = readBlock();
+            if (errNone != error)
+                return error;
+            if (0 == blockLength_)
+                break;
+        }
+        ulong_t len = std::min(length - read, blockLength_ - blockOffset_);
+        memmove(static_cast<char*>(buffer) + read, block_ + blockOffset_, len);
+        blockOffset_ += len;
+        read += len;
+    }
+    length = read;
+    return errNone;
 }
 
+status_t DataStoreReader::readView(const void*& data, ulong_t& length)
+{
+    assert(NULL != position_.get());
+    if (compressed_)
+    {
+        if (0 != length && blockOffset_ == blockLength_)
+        {
+            status_t error = readBlock();
+            if (errNone != error)
+                return error;
+        }
+        length = std::min(length, blockLength_ - blockOffset_);
+        data = block_ + blockOffset_;
+        blockOffset_ += length;
+        return errNone;
+    }
+    ReadLockGuard lock(store_.lock_);
+#ifdef FILE_HAS_MAPPING
+    return store_.viewStream(*position_, data, length);
+#else
+    if (NULL == buffer_)
+    {
+        buffer_ = (char*)malloc(bufferSize);
+        if (NULL == buffer_)
+            return memErrNotEnoughSpace;
+    }
+    length = std::min<ulong_t>(length, bufferSize);
+    data = buffer_;
+    return store_.readStream(*position_, buffer_, length);
+#endif
+}
+
+DataStoreWriter::DataStoreWriter(DataStore& store): 
+    store_(store),
+    buffer_(NULL),
+    bufferLength_(0),
+    compressed_(false)
+{}
+
+DataStoreWriter::~DataStoreWriter() 
+{
+    WriteLockGuard lock(store_.lock_);
+    flushBuffer();
+    store_.flushHeaders();
+    free(buffer_);
+    store_.findEof();
+    if (NULL != position_.get())
+        --store_.openStreamsCount_;
+}
+
+status_t DataStoreWriter::open(const char* name, bool dontCreate, bool compressed)
+{
+    WriteLockGuard lock(store_.lock_);
+    status_t error = flushBuffer();
+    if (errNone != error)
+        return error;
+    DataStore::StreamHeader* header = NULL;
+    error = store_.findStream(name, header);
+    if (DataStore::errNotFound == error && !dontCreate)
+        error = store_.createStream(name, compressed, header);
+    else if (errNone == error && compressed != header->compressed)
+        error = store_.createStream(name, compressed, header);
+    if (errNone != error)
+        return error;
+    assert(NULL != header);
+    if (compressed != compressed_)
+    {
+        // Buffer size depends on compression.
+        free(buffer_);
+        buffer_ = NULL;
+        compressed_ = compressed;
+    }
+    if (NULL == position_.get())
+        ++store_.openStreamsCount_;
+    position_.reset(new DataStore::StreamPosition(*header));
+    return errNone;
+}
+
+status_t DataStoreWriter::flushBuffer()
+{
+    if (0 == bufferLength_)
+        return errNone;
+    assert(NULL != position_.get());
+    ulong_t length = bufferLength_;
+    bufferLength_ = 0;
+    if (compressed_)
+        return writeBlock(length);
+    return store_.writeStream(*position_, buffer_, length);
+}
+
+// Block goes to the store as is if it doesn't compress.
+status_t DataStoreWriter::writeBlock(ulong_t length)
+{
+    char* block = (char*)malloc(DataStore::blockHeaderLength + length);
+    if (NULL == block)
+        return memErrNotEnoughSpace;
+    ulong_t storedLength = LZ77_Compress(buffer_, length, block + DataStore::blockHeaderLength);
+    if (0 == storedLength)
+    {
+        memmove(block + DataStore::blockHeaderLength, buffer_, length);
+        storedLength = length;
+    }
+    block[0] = char(length);
+    block[1] = char(length >> 8);
+    block[2] = char(storedLength);
+    block[3] = char(storedLength >> 8);
+    status_t error = store_.writeStream(*position_, block, DataStore::blockHeaderLength + storedLength);
+    free(block);
+    return error;
+}
+
+// Store is locked only when buffer has to be written out.
+status_t DataStoreWriter::writeRaw(const void* buffer, ulong_t length)
+{
+    assert(NULL != position_.get());
+    if (compressed_)
+    {
+        if (NULL == buffer_ && NULL == (buffer_ = (char*)malloc(DataStore::compressedBlockLength)))
+            return memErrNotEnoughSpace;
+        const char* data = static_cast<const char*>(buffer);
+        while (0 != length)
+        {
+            ulong_t len = std::min<ulong_t>(length, DataStore::compressedBlockLength - bufferLength_);
+            memmove(buffer_ + bufferLength_, data, len);
+            bufferLength_ += len;
+            data += len;
+            length -= len;
+            if (DataStore::compressedBlockLength == bufferLength_)
+            {
+                WriteLockGuard lock(store_.lock_);
+                status_t error = flushBuffer();
+                if (errNone != error)
+                    return error;
+            }
+        }
+        return errNone;
+    }
+    if (length < bufferSize && bufferLength_ + length <= bufferSize)
+    {
+        if (NULL == buffer_)
+            buffer_ = (char*)malloc(bufferSize);
+        if (NULL != buffer_)
+        {
+            memmove(buffer_ + bufferLength_, buffer, length);
+            bufferLength_ += length;
+            return errNone;
+        }
+    }
+    WriteLockGuard lock(store_.lock_);
+    status_t error = flushBuffer();
+    if (errNone != error)
+        return error;
+    if (length >= bufferSize || NULL == buffer_)
+        return store_.writeStream(*position_, buffer, length);
+    memmove(buffer_, buffer, length);
+    bufferLength_ = length;
+    return errNone;
+}
+
+status_t DataStoreWriter::flush()
+{
+    WriteLockGuard lock(store_.lock_);
+    status_t error = flushBuffer();
+    if (errNone != error)
+        return error;
+    return store_.flushHeaders();
+}
+
+status_t DataStoreWriter::seekToEnd()
+{
+    assert(NULL != position_.get());
+    WriteLockGuard lock(store_.lock_);
+    status_t error = flushBuffer();
+    if (errNone != error)
+        return error;
+    store_.seekToEnd(*position_);
+    return errNone;
+}
+
+namespace {
+    static DataStore* store = NULL;
+}
+
+DataStore* DataStore::instance()
+{
+    return store;
+}
+
+status_t DataStore::initialize(const char_t* fileName)
+{
+    assert(NULL == store);
+    std::auto_ptr<DataStore> ds(new DataStore());
+    status_t error = ds->open(fileName, DataStore::createAsNeeded);
+    if (errNone != error)
+        return error;
+    store = ds.release();
+    return errNone;
+}
+
+void DataStore::dispose()
+{
+    delete store;
+    store = NULL;
+}
+
+#ifndef NDEBUG
+
+#ifdef _WIN32
+static const char_t* unitTestStoreName = _T("UnitTest DataStore.dat");
+#endif
+#ifdef _PALM_OS
+static const char_t* unitTestStoreName = _T("UnitTest DataStore");
+#endif
+#ifdef _POSIX
+static const char_t* unitTestStoreName = _T("UnitTest DataStore.dat");
+#endif
+
+static void test_DataStoreFill(char* buffer, ulong_t length, ulong_t seed)
+{
+    for (ulong_t i = 0; i < length; ++i)
+        buffer[i] = char(seed + i * 7);
+}
+
+// Writes and removes streams of various sizes many times, so that the free space index gets exercised, then reads them back.
+static void test_DataStoreFragmentAllocation()
+{
+    enum {
+        iterationsCount = 10000,
+        streamsCount = 32,
+        maxStreamLength = 1024
+    };
+    DataStore store;
+    status_t err = store.create(unitTestStoreName);
+    assert(errNone == err);
+
+    // Iteration (plus one) that last wrote each stream, 0 if stream is removed.
+    ulong_t written[streamsCount] = {0};
+    char* buffer = (char*)malloc(maxStreamLength);
+    assert(NULL != buffer);
+    char name[DataStore::maxStreamNameLength];
+
+    tick_t start = ticks();
+    for (ulong_t i = 0; i < iterationsCount; ++i)
+    {
+        ulong_t index = (i * 13) % streamsCount;
+        StrPrintF(name, "stream %lu", index);
+        if (0 == i % 5 && 0 != written[index])
+        {
+            err = store.removeStream(name);
+            assert(errNone == err);
+            written[index] = 0;
+            continue;
+        }
+        ulong_t length = 1 + (i * 37) % maxStreamLength;
+        test_DataStoreFill(buffer, length, i);
+        DataStoreWriter writer(store);
+        err = writer.open(name);
+        assert(errNone == err);
+        err = writer.writeRaw(buffer, length);
+        assert(errNone == err);
+        written[index] = i + 1;
+    }
+    LogStrUlong(eLogDebug, _T("test_DataStoreFragmentAllocation(): ticks spent writing: "), ticks() - start);
+
+    char* read = (char*)malloc(maxStreamLength);
+    assert(NULL != read);
+    for (ulong_t index = 0; index < streamsCount; ++index)
+    {
+        if (0 == written[index])
+            continue;
+        ulong_t i = written[index] - 1;
+        ulong_t length = 1 + (i * 37) % maxStreamLength;
+        test_DataStoreFill(buffer, length, i);
+        StrPrintF(name, "stream %lu", index);
+        DataStoreReader reader(store);
+        err = reader.open(name);
+        assert(errNone == err);
+        ulong_t readLength = maxStreamLength;
+        err = reader.readRaw(read, readLength);
+        assert(errNone == err);
+        assert(length == readLength);
+        assert(0 == memcmp(buffer, read, length));
+    }
+    free(read);
+    free(buffer);
+}
+
+// Writes stream in many small chunks, so that they go through writer's buffer, then reopens store to check that headers got flushed.
+static void test_DataStoreSmallWrites()
+{
+    enum {
+        chunksCount = 1000,
+        chunkLength = 3
+    };
+    char chunk[chunkLength];
+    {
+        DataStore store;
+        status_t err = store.create(unitTestStoreName);
+        assert(errNone == err);
+        DataStoreWriter writer(store);
+        err = writer.open("small writes");
+        assert(errNone == err);
+        for (ulong_t i = 0; i < chunksCount; ++i)
+        {
+            test_DataStoreFill(chunk, chunkLength, i);
+            err = writer.writeRaw(chunk, chunkLength);
+            assert(errNone == err);
+        }
+        err = writer.flush();
+        assert(errNone == err);
+    }
+    DataStore store;
+    status_t err = store.open(unitTestStoreName);
+    assert(errNone == err);
+    DataStoreReader reader(store);
+    err = reader.open("small writes");
+    assert(errNone == err);
+    char read[chunkLength];
+    for (ulong_t i = 0; i < chunksCount; ++i)
+    {
+        test_DataStoreFill(chunk, chunkLength, i);
+        ulong_t length = chunkLength;
+        err = reader.readRaw(read, length);
+        assert(errNone == err);
+        assert(chunkLength == length);
+        assert(0 == memcmp(chunk, read, chunkLength));
+    }
+    ulong_t length = chunkLength;
+    err = reader.readRaw(read, length);
+    assert(errNone == err);
+    assert(0 == length);
+}
+
+static void test_DataStoreOpenFile(File& file)
+{
+#if defined(_WIN32)
+    status_t err = file.open(unitTestStoreName, GENERIC_WRITE|GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_ALWAYS);
+#elif defined(_PALM_OS)
+    status_t err = file.open(unitTestStoreName, fileModeUpdate);
+#elif defined(_POSIX)
+    status_t err = file.open(unitTestStoreName, O_RDWR);
+#endif
+    assert(errNone == err);
+}
+
+static void test_DataStoreFileSize(File::Size& size)
+{
+    File file;
+    test_DataStoreOpenFile(file);
+    status_t err = file.size(size);
+    assert(errNone == err);
+}
+
+// Reads stream spanning several fragments through readView() and compares it with what readRaw() returns.
+static void test_DataStoreReadView()
+{
+    enum {
+        streamLength = 4000,
+        streamsCount = 4
+    };
+    DataStore store;
+    status_t err = store.create(unitTestStoreName);
+    assert(errNone == err);
+    
+    char* buffer = (char*)malloc(streamLength);
+    assert(NULL != buffer);
+    char name[DataStore::maxStreamNameLength];
+    // Interleave writes to several streams so that each of them gets fragmented.
+    for (ulong_t offset = 0; offset < streamLength; offset += streamLength / 8)
+    {
+        for (ulong_t i = 0; i < streamsCount; ++i)
+        {
+            StrPrintF(name, "view %lu", i);
+            DataStoreWriter writer(store);
+            err = writer.open(name);
+            assert(errNone == err);
+            test_DataStoreFill(buffer, offset + streamLength / 8, i);
+            err = writer.writeRaw(buffer, offset + streamLength / 8);
+            assert(errNone == err);
+        }
+    }
+    // Stream written last ends the file.
+    test_DataStoreFill(buffer, streamLength, streamsCount);
+    {
+        DataStoreWriter writer(store);
+        err = writer.open("view tail");
+        assert(errNone == err);
+        err = writer.writeRaw(buffer, streamLength);
+        assert(errNone == err);
+    }
+    for (ulong_t i = 0; i <= streamsCount; ++i)
+    {
+        StrPrintF(name, streamsCount == i ? "view tail" : "view %lu", i);
+        test_DataStoreFill(buffer, streamLength, i);
+        DataStoreReader reader(store);
+        err = reader.open(name);
+        assert(errNone == err);
+        ulong_t total = 0;
+        while (true)
+        {
+            const void* data;
+            ulong_t length = streamLength;
+            err = reader.readView(data, length);
+            assert(errNone == err);
+            if (0 == length)
+                break;
+            assert(total + length <= streamLength);
+            assert(0 == memcmp(buffer + total, data, length));
+            total += length;
+        }
+        assert(streamLength == total);
+    }
+    
+    // View has to stay valid while writer shrinks the file (stream at its end mapped above is removed), until the reader is closed.
+    test_DataStoreFill(buffer, streamLength, 0);
+    DataStoreReader reader(store);
+    err = reader.open("view 0");
+    assert(errNone == err);
+    const void* data;
+    ulong_t length = streamLength;
+    err = reader.readView(data, length);
+    assert(errNone == err && 0 != length);
+    File::Size sizeBefore = 0;
+    test_DataStoreFileSize(sizeBefore);
+    err = store.removeStream("view tail");
+    assert(errNone == err);
+    {
+        DataStoreWriter writer(store);
+        err = writer.open("view 1", true);
+        assert(errNone == err);
+    }
+    File::Size sizeAfter = 0;
+    test_DataStoreFileSize(sizeAfter);
+    assert(sizeAfter < sizeBefore);
+    assert(0 == memcmp(buffer, data, length));
+    free(buffer);
+}
+
+static void test_DataStoreVerifyStream(DataStore& store, const char* name, ulong_t length, ulong_t seed)
+{
+    char* buffer = (char*)malloc(length + 1);
+    char* read = (char*)malloc(length + 1);
+    assert(NULL != buffer && NULL != read);
+    test_DataStoreFill(buffer, length, seed);
+    DataStoreReader reader(store);
+    status_t err = reader.open(name);
+    assert(errNone == err);
+    ulong_t readLength = length + 1;
+    err = reader.readRaw(read, readLength);
+    assert(errNone == err);
+    assert(length == readLength);
+    assert(0 == memcmp(buffer, read, length));
+    free(read);
+    free(buffer);
+}
+
+// Fragments streams by interleaving appends and removals, then compacts the store step by step and checks that contents survived
+// and that neither the file nor holes in it grew.
+static void test_DataStoreCompaction()
+{
+    enum {
+        streamsCount = 8,
+        chunkLength = 300,
+        chunksCount = 10,
+        maxStepBytes = 1024
+    };
+    char name[DataStore::maxStreamNameLength];
+    char* buffer = (char*)malloc(chunkLength * chunksCount);
+    assert(NULL != buffer);
+    File::Size freeBefore;
+    {
+        DataStore store;
+        status_t err = store.create(unitTestStoreName);
+        assert(errNone == err);
+        
+        for (ulong_t chunk = 1; chunk <= chunksCount; ++chunk)
+        {
+            for (ulong_t i = 0; i < streamsCount; ++i)
+            {
+                StrPrintF(name, "compact %lu", i);
+                DataStoreWriter writer(store);
+                err = writer.open(name);
+                assert(errNone == err);
+                test_DataStoreFill(buffer, chunk * chunkLength, i);
+                err = writer.writeRaw(buffer, chunk * chunkLength);
+                assert(errNone == err);
+            }
+            StrPrintF(name, "compact %lu", (chunk * 3) % streamsCount);
+            err = store.removeStream(name);
+            assert(errNone == err);
+        }
+        freeBefore = store.freeSpace();
+        LogStrUlong(eLogDebug, _T("test_DataStoreCompaction(): fragmentation before: "), store.fragmentationRatio());
+        LogStrUlong(eLogDebug, _T("test_DataStoreCompaction(): free space before: "), freeBefore);
+    }
+    File::Size sizeBefore = 0;
+    test_DataStoreFileSize(sizeBefore);
+    LogStrUlong(eLogDebug, _T("test_DataStoreCompaction(): file size before: "), sizeBefore);
+    {
+        DataStore store;
+        status_t err = store.open(unitTestStoreName);
+        assert(errNone == err);
+        {
+            DataStoreReader reader(store);
+            err = reader.open("compact 0");
+            assert(errNone == err);
+            bool done;
+            err = store.compactStep(maxStepBytes, done);
+            assert(DataStore::errStreamsOpen == err);
+        }
+        
+        ulong_t steps = 0;
+        bool done = false;
+        while (!done)
+        {
+            err = store.compactStep(maxStepBytes, done);
+            assert(errNone == err);
+            ++steps;
+            assert(steps < 1000);
+        }
+        LogStrUlong(eLogDebug, _T("test_DataStoreCompaction(): steps: "), steps);
+        LogStrUlong(eLogDebug, _T("test_DataStoreCompaction(): free space after: "), store.freeSpace());
+        assert(0 == store.fragmentationRatio());
+        assert(store.freeSpace() <= freeBefore);
+        assert(0 == store.freeSpace());
+        
+        for (ulong_t i = 0; i < streamsCount; ++i)
+        {
+            if ((chunksCount * 3) % streamsCount == i)
+                continue;
+            StrPrintF(name, "compact %lu", i);
+            test_DataStoreVerifyStream(store, name, chunksCount * chunkLength, i);
+        }
+    }
+    File::Size sizeAfter = 0;
+    test_DataStoreFileSize(sizeAfter);
+    LogStrUlong(eLogDebug, _T("test_DataStoreCompaction(): file size after: "), sizeAfter);
+    assert(sizeAfter <= sizeBefore);
+    
+    // Reopen to check that headers on disk are consistent with the data moved around.
+    DataStore store;
+    status_t err = store.open(unitTestStoreName);
+    assert(errNone == err);
+    assert(0 == store.fragmentationRatio());
+    assert(0 == store.freeSpace());
+    for (ulong_t i = 0; i < streamsCount; ++i)
+    {
+        if ((chunksCount * 3) % streamsCount == i)
+            continue;
+        StrPrintF(name, "compact %lu", i);
+        test_DataStoreVerifyStream(store, name, chunksCount * chunkLength, i);
+    }
+    free(buffer);
+}
+
+// Creates many more streams than v1 format could hold, with long names, and checks they're all found after reopening the store.
+static void test_DataStoreManyStreams()
+{
+    enum {
+        streamsCount = 300
+    };
+    char name[DataStore::maxStreamNameLength + 1];
+    {
+        DataStore store;
+        status_t err = store.create(unitTestStoreName);
+        assert(errNone == err);
+        for (ulong_t i = 0; i < streamsCount; ++i)
+        {
+            StrPrintF(name, "stream with quite a long name, longer than 32 chars: %lu", i);
+            assert(Len(name) <= DataStore::maxStreamNameLength);
+            DataStoreWriter writer(store);
+            err = writer.open(name);
+            assert(errNone == err);
+            err = writer.writeRaw(&i, sizeof(i));
+            assert(errNone == err);
+        }
+        // Free some slots in the middle so that they get reused.
+        for (ulong_t i = 0; i < streamsCount; i += 7)
+        {
+            StrPrintF(name, "stream with quite a long name, longer than 32 chars: %lu", i);
+            err = store.removeStream(name);
+            assert(errNone == err);
+        }
+        for (ulong_t i = 0; i < streamsCount; i += 14)
+        {
+            StrPrintF(name, "stream with quite a long name, longer than 32 chars: %lu", i);
+            DataStoreWriter writer(store);
+            err = writer.open(name);
+            assert(errNone == err);
+            err = writer.writeRaw(&i, sizeof(i));
+            assert(errNone == err);
+        }
+        DataStoreWriter writer(store);
+        err = writer.open("a name that is definitely too long to be used as a name of any stream at all");
+        assert(DataStore::errNameTooLong == err);
+    }
+    DataStore store;
+    status_t err = store.open(unitTestStoreName);
+    assert(errNone == err);
+    for (ulong_t i = 0; i < streamsCount; ++i)
+    {
+        StrPrintF(name, "stream with quite a long name, longer than 32 chars: %lu", i);
+        DataStoreReader reader(store);
+        err = reader.open(name);
+        if (0 == i % 7 && 0 != i % 14)
+        {
+            assert(DataStore::errNotFound == err);
+            continue;
+        }
+        assert(errNone == err);
+        ulong_t value;
+        ulong_t length = sizeof(value);
+        err = reader.readRaw(&value, length);
+        assert(errNone == err);
+        assert(sizeof(value) == length);
+        assert(i == value);
+    }
+    // Slots left free before reopening are taken by new streams.
+    for (ulong_t i = 7; i < streamsCount; i += 14)
+    {
+        StrPrintF(name, "reused %lu", i);
+        DataStoreWriter writer(store);
+        err = writer.open(name);
+        assert(errNone == err);
+        err = writer.writeRaw(&i, sizeof(i));
+        assert(errNone == err);
+    }
+    for (ulong_t i = 7; i < streamsCount; i += 14)
+    {
+        StrPrintF(name, "reused %lu", i);
+        DataStoreReader reader(store);
+        err = reader.open(name);
+        assert(errNone == err);
+        ulong_t value;
+        ulong_t length = sizeof(value);
+        err = reader.readRaw(&value, length);
+        assert(errNone == err && sizeof(value) == length && i == value);
+    }
+}
+
+// Builds v1 store by hand (fixed index followed by single fragment) and checks that it's migrated on open.
+static void test_DataStoreMigration()
+{
+    enum {
+        legacyIndex = 5,
+        dataLength = 100
+    };
+    char buffer[dataLength];
+    {
+        File file;
+#if defined(_WIN32)
+        status_t err = file.open(unitTestStoreName, GENERIC_WRITE|GENERIC_READ, FILE_SHARE_READ, NULL, CREATE_ALWAYS);
+#elif defined(_PALM_OS)
+        status_t err = file.open(unitTestStoreName, fileModeReadWrite);
+#elif defined(_POSIX)
+        status_t err = file.open(unitTestStoreName, O_RDWR|O_CREAT|O_TRUNC);
+#endif
+        assert(errNone == err);
+        for (uint_t i = 0; i < LegacyStreamIndexEntry::streamsCount; ++i)
+        {
+            LegacyStreamIndexEntry entry;
+            memzero(&entry, sizeof(entry));
+            if (legacyIndex == i)
+            {
+                entry.used = true;
+                memmove(entry.name, "legacy", 6);
+                entry.firstFragment = LegacyStreamIndexEntry::streamsCount * sizeof(LegacyStreamIndexEntry);
+            }
+            err = file.write(&entry, sizeof(entry));
+            assert(errNone == err);
+        }
+        FragmentHeaderEntry fragment;
+        fragment.ownerIndex = legacyIndex;
+        fragment.length = sizeof(fragment) + dataLength;
+        err = file.write(&fragment, sizeof(fragment));
+        assert(errNone == err);
+        test_DataStoreFill(buffer, dataLength, legacyIndex);
+        err = file.write(buffer, dataLength);
+        assert(errNone == err);
+    }
+    char name[DataStore::maxStreamNameLength];
+    {
+        DataStore store;
+        status_t err = store.open(unitTestStoreName);
+        assert(errNone == err);
+        test_DataStoreVerifyStream(store, "legacy", dataLength, legacyIndex);
+        for (ulong_t i = 0; i < 40; ++i)
+        {
+            StrPrintF(name, "migrated %lu", i);
+            DataStoreWriter writer(store);
+            err = writer.open(name);
+            assert(errNone == err);
+            test_DataStoreFill(buffer, dataLength, i);
+            err = writer.writeRaw(buffer, dataLength);
+            assert(errNone == err);
+        }
+    }
+    DataStore store;
+    status_t err = store.open(unitTestStoreName);
+    assert(errNone == err);
+    test_DataStoreVerifyStream(store, "legacy", dataLength, legacyIndex);
+    for (ulong_t i = 0; i < 40; ++i)
+    {
+        StrPrintF(name, "migrated %lu", i);
+        test_DataStoreVerifyStream(store, name, dataLength, i);
+    }
+}
+
+// Image of the store file, saved so that it can be restored before each simulated crash.
+static char* test_DataStoreReadImage(File::Size& size)
+{
+    File file;
+    test_DataStoreOpenFile(file);
+    status_t err = file.size(size);
+    assert(errNone == err);
+    char* image = (char*)malloc(size);
+    assert(NULL != image);
+    File::Size read;
+    err = file.read(image, size, read);
+    assert(errNone == err && size == read);
+    return image;
+}
+
+static void test_DataStoreWriteImage(const char* image, File::Size size)
+{
+    File file;
+    test_DataStoreOpenFile(file);
+    status_t err = file.write(image, size);
+    assert(errNone == err);
+    err = file.truncate();
+    assert(errNone == err);
+}
+
+enum {
+    testCrashOldLength = 1000,
+    testCrashNewLength = 3000
+};
+
+// Rewrites the stream with crash injected after given number of in-place writes of commit(). @return false if there was no crash.
+bool test_DataStoreCrashingRewrite(ulong_t writesCount)
+{
+    char buffer[testCrashNewLength];
+    DataStore store;
+    status_t err = store.open(unitTestStoreName);
+    assert(errNone == err);
+    store.crashAfterWrites_ = writesCount;
+    DataStoreWriter writer(store);
+    err = writer.open("crash");
+    assert(errNone == err);
+    test_DataStoreFill(buffer, testCrashNewLength, 2);
+    err = writer.writeRaw(buffer, testCrashNewLength);
+    assert(errNone == err);
+    err = writer.flush();
+    assert(errNone == err);
+    return store.crashed_;
+}
+
+/**
+ * Rewrites a stream and "crashes" while writing the pointer to its journal, then opens every prefix of the file left behind
+ * to simulate the journal being torn at any point: store has to come up with the old contents and the journal truncated away.
+ * Then crashes after each in-place write of the commit (tearing the next one): once the pointer is written, store has to come up 
+ * with the new contents. Last, journal which the pointer doesn't point to mustn't be replayed even if it's complete.
+ */
+void test_DataStoreJournalRecovery()
+{
+    char buffer[testCrashOldLength];
+    File::Size oldSize;
+    {
+        DataStore store;
+        status_t err = store.create(unitTestStoreName);
+        assert(errNone == err);
+        DataStoreWriter writer(store);
+        err = writer.open("crash");
+        assert(errNone == err);
+        test_DataStoreFill(buffer, testCrashOldLength, 1);
+        err = writer.writeRaw(buffer, testCrashOldLength);
+        assert(errNone == err);
+        err = writer.flush();
+        assert(errNone == err);
+    }
+    char* oldImage = test_DataStoreReadImage(oldSize);
+    
+    bool crashed = test_DataStoreCrashingRewrite(0);
+    assert(crashed);
+    File::Size size;
+    char* image = test_DataStoreReadImage(size);
+    assert(size > oldSize);
+    for (File::Size length = oldSize; length <= size; ++length)
+    {
+        test_DataStoreWriteImage(image, length);
+        {
+            DataStore store;
+            status_t err = store.open(unitTestStoreName);
+            assert(errNone == err);
+            test_DataStoreVerifyStream(store, "crash", testCrashOldLength, 1);
+        }
+        File::Size recoveredSize;
+        test_DataStoreFileSize(recoveredSize);
+        assert(oldSize == recoveredSize);
+    }
+    free(image);
+    
+    File::Size newSize = 0;
+    for (ulong_t writesCount = 1; ; ++writesCount)
+    {
+        test_DataStoreWriteImage(oldImage, oldSize);
+        crashed = test_DataStoreCrashingRewrite(writesCount);
+        if (!crashed)
+        {
+            assert(writesCount > 2);
+            break;
+        }
+        {
+            DataStore store;
+            status_t err = store.open(unitTestStoreName);
+            assert(errNone == err);
+            test_DataStoreVerifyStream(store, "crash", testCrashNewLength, 2);
+        }
+        File::Size recoveredSize;
+        test_DataStoreFileSize(recoveredSize);
+        assert(0 == newSize || newSize == recoveredSize);
+        newSize = recoveredSize;
+    }
+    File::Size completedSize;
+    test_DataStoreFileSize(completedSize);
+    assert(newSize == completedSize);
+    
+    // Complete journal (with valid trailer) left at the end of file by someone else than commit() isn't replayed.
+    test_DataStoreWriteImage(oldImage, oldSize);
+    crashed = test_DataStoreCrashingRewrite(0);
+    assert(crashed);
+    image = test_DataStoreReadImage(size);
+    const File::Position pointerPosition = sizeof(StoreHeaderEntry);
+    memzero(image + pointerPosition, sizeof(PendingJournalEntry));
+    test_DataStoreWriteImage(image, size);
+    free(image);
+    {
+        DataStore store;
+        status_t err = store.open(unitTestStoreName);
+        assert(errNone == err);
+        test_DataStoreVerifyStream(store, "crash", testCrashOldLength, 1);
+    }
+    test_DataStoreFileSize(size);
+    assert(oldSize == size);
+    free(oldImage);
+}
+
+static void test_DataStoreReadAll(DataStore& store, const char* name, const char* expected, ulong_t length, bool view)
+{
+    DataStoreReader reader(store);
+    status_t err = reader.open(name);
+    assert(errNone == err);
+    char chunk[256];
+    ulong_t offset = 0;
+    while (true)
+    {
+        const void* data = chunk;
+        ulong_t len = sizeof(chunk);
+        if (view)
+            err = reader.readView(data, len);
+        else
+            err = reader.readRaw(chunk, len);
+        assert(errNone == err);
+        if (0 == len)
+            break;
+        assert(offset + len <= length);
+        assert(0 == memcmp(expected + offset, data, len));
+        offset += len;
+    }
+    assert(length == offset);
+}
+
+// Benchmark: stores the same page-like text in plain and in compressed stream and compares their size on disk and time needed to read them.
+void test_DataStoreCompression()
+{
+    enum {
+        textLength = 60000,
+        readsCount = 20,
+        writeChunkLength = 100
+    };
+    static const char* words[] = {"the ", "encyclopedia ", "Wikipedia ", "article ", "of ", "and ", "history ", 
+        "[[link|", "]] ", ",  ", "city ", "is ", "a ", "in ", "population ", "\n", "== Section ==\n", "* "};
+    char* text = (char*)malloc(textLength);
+    assert(NULL != text);
+    ulong_t seed = 1;
+    ulong_t length = 0;
+    while (length < textLength)
+    {
+        seed = seed * 1103515245UL + 12345UL;
+        const char* word = words[(seed >> 16) % (sizeof(words) / sizeof(words[0]))];
+        ulong_t len = std::min<ulong_t>(Len(word), textLength - length);
+        memmove(text + length, word, len);
+        length += len;
+    }
+    
+    const char* names[] = {"plain", "compressed"};
+    File::Size sizes[2];
+    {
+        DataStore store;
+        status_t err = store.create(unitTestStoreName);
+        assert(errNone == err);
+        for (ulong_t i = 0; i < 2; ++i)
+        {
+            File::Size before;
+            err = store.file_.size(before);
+            assert(errNone == err);
+            {
+                DataStoreWriter writer(store);
+                err = writer.open(names[i], false, 0 != i);
+                assert(errNone == err);
+                for (ulong_t offset = 0; offset < textLength; offset += writeChunkLength)
+                {
+                    err = writer.writeRaw(text + offset, std::min<ulong_t>(writeChunkLength, textLength - offset));
+                    assert(errNone == err);
+                }
+            }
+            err = store.file_.size(sizes[i]);
+            assert(errNone == err);
+            sizes[i] -= before;
+            
+            ulong_t start = ticks();
+            for (ulong_t j = 0; j < readsCount; ++j)
+                test_DataStoreReadAll(store, names[i], text, textLength, false);
+            LogStrUlong(eLogDebug, _T("test_DataStoreCompression(): ticks spent reading: "), ticks() - start);
+            LogStrUlong(eLogDebug, _T("test_DataStoreCompression(): bytes stored: "), sizes[i]);
+        }
+        assert(2 * sizes[1] < sizes[0]);
+        test_DataStoreReadAll(store, "compressed", text, textLength, true);
+        
+        // Reopening stream with different compression replaces it.
+        DataStoreWriter writer(store);
+        err = writer.open("plain", false, true);
+        assert(errNone == err);
+        err = writer.writeRaw(text, 10);
+        assert(errNone == err);
+    }
+    DataStore store;
+    status_t err = store.open(unitTestStoreName);
+    assert(errNone == err);
+    test_DataStoreReadAll(store, "compressed", text, textLength, false);
+    test_DataStoreReadAll(store, "plain", text, 10, true);
+    free(text);
+}
+
+#ifdef _POSIX
+
+#include <pthread.h>
+
+enum {
+    test_concurrentStreamsCount = 4,
+    test_concurrentLength = 2000,
+    test_concurrentIterations = 200
+};
+
+// Reads back streams that nobody writes, alternating readRaw() and readView().
+static void* test_DataStoreConcurrentReader(void* param)
+{
+    DataStore& store = *static_cast<DataStore*>(param);
+    char name[DataStore::maxStreamNameLength];
+    char expected[test_concurrentLength];
+    for (ulong_t i = 0; i < test_concurrentIterations; ++i)
+    {
+        ulong_t index = i % test_concurrentStreamsCount;
+        StrPrintF(name, "read %lu", index);
+        if (0 == i % 2)
+        {
+            test_DataStoreVerifyStream(store, name, test_concurrentLength, index);
+            continue;
+        }
+        test_DataStoreFill(expected, test_concurrentLength, index);
+        DataStoreReader reader(store);
+        status_t err = reader.open(name);
+        assert(errNone == err);
+        ulong_t offset = 0;
+        while (true)
+        {
+            const void* data;
+            ulong_t length = test_concurrentLength;
+            err = reader.readView(data, length);
+            assert(errNone == err);
+            if (0 == length)
+                break;
+            assert(offset + length <= test_concurrentLength);
+            assert(0 == memcmp(expected + offset, data, length));
+            offset += length;
+        }
+        assert(test_concurrentLength == offset);
+    }
+    return NULL;
+}
+
+// Keeps rewriting and removing its own streams, so that fragments read by other threads get neighbours allocated and freed.
+static void* test_DataStoreConcurrentWriter(void* param)
+{
+    DataStore& store = *static_cast<DataStore*>(param);
+    char name[DataStore::maxStreamNameLength];
+    char buffer[test_concurrentLength];
+    for (ulong_t i = 0; i < test_concurrentIterations; ++i)
+    {
+        StrPrintF(name, "write %lu", i % 3);
+        if (0 == i % 7)
+        {
+            status_t err = store.removeStream(name);
+            assert(errNone == err || DataStore::errNotFound == err);
+            bool done;
+            err = store.compactStep(1024, done);
+            assert(errNone == err || DataStore::errStreamsOpen == err);
+            continue;
+        }
+        DataStoreWriter writer(store);
+        status_t err = writer.open(name);
+        assert(errNone == err);
+        ulong_t length = 100 + (i * 37) % (test_concurrentLength - 100);
+        test_DataStoreFill(buffer, length, i);
+        for (ulong_t offset = 0; offset < length; offset += 50)
+        {
+            err = writer.writeRaw(buffer + offset, std::min<ulong_t>(50, length - offset));
+            assert(errNone == err);
+        }
+        err = writer.flush();
+        assert(errNone == err);
+    }
+    return NULL;
+}
+
+// Meant to be run under ThreadSanitizer as well.
+static void test_DataStoreConcurrentAccess()
+{
+    enum {readersCount = 4};
+    char buffer[test_concurrentLength];
+    char name[DataStore::maxStreamNameLength];
+    DataStore store;
+    status_t err = store.create(unitTestStoreName);
+    assert(errNone == err);
+    for (ulong_t i = 0; i < test_concurrentStreamsCount; ++i)
+    {
+        StrPrintF(name, "read %lu", i);
+        DataStoreWriter writer(store);
+        err = writer.open(name);
+        assert(errNone == err);
+        test_DataStoreFill(buffer, test_concurrentLength, i);
+        err = writer.writeRaw(buffer, test_concurrentLength);
+        assert(errNone == err);
+    }
+    
+    pthread_t readers[readersCount];
+    pthread_t writer;
+    for (ulong_t i = 0; i < readersCount; ++i)
+    {
+        int res = pthread_create(&readers[i], NULL, test_DataStoreConcurrentReader, &store);
+        assert(0 == res);
+    }
+    int res = pthread_create(&writer, NULL, test_DataStoreConcurrentWriter, &store);
+    assert(0 == res);
+    for (ulong_t i = 0; i < readersCount; ++i)
+        pthread_join(readers[i], NULL);
+    pthread_join(writer, NULL);
+    
+    for (ulong_t i = 0; i < test_concurrentStreamsCount; ++i)
+    {
+        StrPrintF(name, "read %lu", i);
+        test_DataStoreVerifyStream(store, name, test_concurrentLength, i);
+    }
+}
+
+#endif // _POSIX
+
+void test_DataStore()
+{
+    test_DataStoreFragmentAllocation();
+    test_DataStoreSmallWrites();
+    test_DataStoreReadView();
+    test_DataStoreCompaction();
+    test_DataStoreManyStreams();
+    test_DataStoreMigration();
+    test_DataStoreJournalRecovery();
+    test_DataStoreCompression();
+#ifdef _POSIX
+    test_DataStoreConcurrentAccess();
+#endif
+}
+
+#endif
@@ -7,8 +7,17 @@
 #include <Reader.hpp>
 #include <Writer.hpp>
 #include <File.hpp>
+#include <Lock.hpp>
 #include <set>
+#include <map>
+#include <vector>
 
+/**
+ * Store of named streams kept in a single file.
+ * Any number of DataStoreReaders may read concurrently from different threads, while DataStoreWriters,
+ * removeStream() and compactStep() take the store exclusively for the duration of each call.
+ * @note stream mustn't be replaced or removed while some other thread reads it.
+ */
 class DataStore: private NonCopyable {
 
 public:
@@ -16,8 +25,7 @@ public:
     explicit DataStore();
 
     enum {
-        maxStreamNameLength=32,
-        maxStreamsCount=32
+        maxStreamNameLength=64
     };
     
     ~DataStore();
@@ -40,10 +48,33 @@ public:
         errStoreCorrupted=dsErrorClass,
         errNotFound,
         errAlreadyExists,
-        errTooManyStreams,
+        errTooManyStreams, // not used since v2 format, which doesn't limit number of streams
         errNameTooLong,
+        errStreamsOpen
     };            
     
+    /**
+     * Performs single bounded step of incremental compaction, so that it may be run from idle event handler. 
+     * Steps first merge runs of fragments of each stream into one, so that stream can be read without hopping over the file,
+     * then slide fragments down into holes before them one by one and truncate the file, until there are no holes left.
+     * Data is always copied to free space first and only then single header is rewritten to point to it, 
+     * so interrupted step leaves the store in its previous state.
+     * Progress is kept between the steps, so that each of them doesn't start over from the first stream and fragment.
+     * @param maxBytes limit of data bytes merged in one step (it's exceeded if the first pair of fragments is larger, and by sliding single fragment).
+     * @param done set to true when there's nothing left to compact.
+     * @return errStreamsOpen if any DataStoreReader or DataStoreWriter is open.
+     */
+    status_t compactStep(ulong_t maxBytes, bool& done);
+    
+    //! @return percentage of fragments that wouldn't be present if each stream was kept in a single fragment.
+    uint_t fragmentationRatio() const;
+    
+    //! @return number of bytes in holes between fragments.
+    File::Size freeSpace() const;
+    
+    //! @param size set to number of bytes stream occupies in the file (its fragments with their headers, after compression).
+    status_t streamSize(const char* name, File::Size& size) const;
+    
     static DataStore* instance();
     
     static status_t initialize(const char_t* fileName);
@@ -56,6 +87,12 @@ private:
 
     status_t readIndex();
     
+    status_t readDirectory(File::Position firstBlock);
+    
+    status_t readLegacyIndex();
+    
+    status_t migrateLegacyIndex();
+    
     status_t createIndex();
     
     status_t readHeaders();
@@ -63,31 +100,105 @@ private:
     char_t* fileName_;
     File file_;
     
+    //! Guards the headers; readers hold it shared and read the file with positional reads, so they don't share file position.
+    mutable ReadWriteLock lock_;
+    
+#ifdef FILE_HAS_MAPPING
+    //! Serializes (re)mapping of the file by concurrent readers.
+    Lock mapLock_;
+#endif
+    
+    //! Store was opened in v1 format (fixed index of 32 streams at the start of file) and is yet to be migrated.
+    bool legacyFormat_;
+    
+    //! Starts of directory blocks (fragments holding directorySlotsCount stream index entries each) in their order.
+    typedef std::vector<File::Position> DirectoryBlocks_t;
+    DirectoryBlocks_t directoryBlocks_;
+    
+    enum {
+        directorySlotsCount = 32,
+        directoryOwnerIndex = uint_t(-1)
+    };
+    
+    File::Position slotPosition(uint_t index) const;
+    
+    status_t writeStoreHeader(File::Position firstDirectoryBlock);
+    
+    status_t writeDirectoryBlock(File::Position start, uint_t firstIndex);
+    
+    status_t appendDirectoryBlock();
+    
+    //! Number of open DataStoreReaders and DataStoreWriters; compaction can't run while streams are open.
+    uint_t openStreamsCount_;
+    
+#ifdef FILE_HAS_MAPPING
+    //! Views into the file are only handed out by readers, so retired mappings are released when the last reader is closed.
+    uint_t openReadersCount_;
+#endif
+    
     struct StreamHeader {
         NarrowString name;
         uint_t index;
         File::Position firstFragment;
+        StreamHeader* nextInBucket;
+        
+        //! Stream consists of LZ77-compressed blocks (see DataStoreWriter::open()).
+        bool compressed;
         
         StreamHeader(const char* name, ulong_t nameLength, uint_t index, File::Position firstFragment);
         
     };
     
-    struct StreamHeaderLess {
+    //! Stream headers indexed by their slot in the directory, NULL for unused slots.
+    typedef std::vector<StreamHeader*> StreamHeaders_t;
+    StreamHeaders_t streamHeaders_;
+    
+    //! Hash table of stream headers by name, chained through StreamHeader::nextInBucket.
+    StreamHeaders_t streamBuckets_;
+    ulong_t streamsCount_;
+    
+    //! Unused slots below streamHeaders_.size(), so that new stream takes the lowest one without scanning the directory.
+    typedef std::set<uint_t> FreeSlots_t;
+    FreeSlots_t freeSlots_;
+    
+    StreamHeader* lookupStream(const char* name, ulong_t nameLength) const;
+    
+    void insertStream(StreamHeader* header);
+    
+    void eraseStream(StreamHeader* header);
+    
+    void rehashStreams(ulong_t bucketsCount);
+    
+    struct StreamHeaderIndexLess {
         bool operator()(const StreamHeader* h1, const StreamHeader* h2) const
-        {return h1->name < h2->name;}
+        {return h1->index < h2->index;}
     };
     
-    typedef std::set<StreamHeader*, StreamHeaderLess> StreamHeaders_t;
-    StreamHeaders_t streamHeaders_;
+    //! Stream headers modified since last flushHeaders(), ordered by their position in the index.
+    typedef std::set<StreamHeader*, StreamHeaderIndexLess> DirtyStreamHeaders_t;
+    DirtyStreamHeaders_t dirtyStreamHeaders_;
     
     status_t readHeadersForOwner(const StreamHeader& streamHeader);
     
+    struct FragmentHeader;
+    
+    //! Holes between fragments ordered by their length. Each hole is keyed by its length and points to the fragment that follows it.
+    typedef std::multimap<File::Size, FragmentHeader*> FreeExtents_t;
+    FreeExtents_t freeExtents_;
+    
     struct FragmentHeader {
         File::Position start;
         uint_t ownerIndex;
         uint_t length;
         File::Position nextFragment;
         
+        //! Entry in freeExtents_ describing the hole that precedes this fragment (valid only if hasFreeExtent is set).
+        FreeExtents_t::iterator freeExtent;
+        bool hasFreeExtent;
+        
+        //! Fragment may be referenced by headers on disk (it wasn't created by the pending transaction).
+        bool committed;
+        
         FragmentHeader(File::Position start, uint_t ownerIndex, uint_t length, File::Position nextFragment);
         
 //            FragmentHeader();
@@ -102,9 +213,50 @@ private:
     typedef std::set<FragmentHeader*, FragmentHeaderLess> FragmentHeaders_t;
     FragmentHeaders_t fragmentHeaders_;
     
+    //! Fragment headers modified since last flushHeaders(), ordered by their position in file.
+    FragmentHeaders_t dirtyFragmentHeaders_;
+    
+    //! Committed fragments removed by the pending transaction; they keep occupying their space until it's committed.
+    typedef std::vector<FragmentHeader*> ReleasedFragments_t;
+    ReleasedFragments_t releasedFragments_;
+    
+    //! Header writes (JournalRecordEntry followed by data) of the pending transaction.
+    NarrowString journal_;
+    
+    status_t journalWrite(File::Position position, const void* data, ulong_t length);
+    
+    //! Overwrites headers in place, the writes fault injection tears.
+    status_t writeInPlace(File::Position position, const void* data, ulong_t length);
+    
+    bool journalValid(const char* journal, ulong_t length, File::Position end) const;
+    
+    status_t applyJournal(const char* journal, ulong_t length);
+    
+    status_t commit();
+    
+    status_t recoverJournal();
+    
+    status_t releaseStream(StreamHeader* header);
+    
+    File::Position fragmentsStart() const;
+    
+    File::Position precedingFragmentEnd(FragmentHeaders_t::const_iterator it) const;
+    
+    void eraseFreeExtent(FragmentHeader& header);
+    
+    void updateFreeExtent(FragmentHeaders_t::iterator it);
+    
+    void updateFreeExtentAfter(FragmentHeaders_t::iterator it);
+    
+    void insertFragment(FragmentHeader* header);
+    
+    void eraseFragment(FragmentHeaders_t::iterator it);
+    
+    void clearHeaders();
+    
     status_t findStream(const char* name, StreamHeader*& header);
     
-    status_t createStream(const char* name, StreamHeader*& header);
+    status_t createStream(const char* name, bool compressed, StreamHeader*& header);
     
     enum { minFragmentLength = sizeof(FragmentHeader) + 128};
     
@@ -114,6 +266,12 @@ private:
     
     status_t writeStreamHeader(const StreamHeader& header);
     
+    void markDirty(FragmentHeader& header) {dirtyFragmentHeaders_.insert(&header);}
+    
+    void markDirty(StreamHeader& header) {dirtyStreamHeaders_.insert(&header);}
+    
+    status_t flushHeaders();
+    
     ulong_t maxAllowedFragmentLength(FragmentHeader& header) const;
     
     File::Position nextAvailableFragmentStart() const;
@@ -138,12 +296,68 @@ private:
     
     status_t readStream(StreamPosition& position, void* buffer, ulong_t& length);
     
+#ifdef FILE_HAS_MAPPING
+
+    status_t viewFragment(const FragmentHeader& fragment, uint_t& startOffset, const void*& data, uint_t& length);
+    
+    status_t viewStream(StreamPosition& position, const void*& data, ulong_t& length);
+    
+#endif
+    
     status_t writeFragment(FragmentHeader& fragment, uint_t& startOffset, const void*& buffer, uint_t& length);
     
     status_t writeStream(StreamPosition& position, const void* buffer, ulong_t length);
     
+    void seekToEnd(StreamPosition& position);
+    
     status_t findEof();
     
+    FragmentHeader* fragmentAt(File::Position start) const;
+    
+    StreamHeader* fragmentOwner(const FragmentHeader& fragment) const;
+    
+    File::Position fragmentStartFor(ulong_t length) const;
+    
+    status_t copyData(File::Position from, File::Position to, ulong_t length, char* buffer);
+    
+    status_t relinkFragment(const FragmentHeader& fragment, File::Position newStart);
+    
+    status_t mergeFragments(FragmentHeader* first, ulong_t count, ulong_t dataLength);
+    
+    status_t moveFragment(FragmentHeader*& fragment, File::Position target);
+    
+    FragmentHeader* nextFragmentToMerge();
+    
+    status_t slideFragment(bool& moved);
+    
+    //! Index of the stream compaction merges fragments of, and its fragment the next run starts with (invalidFragmentStart for its first one).
+    uint_t compactStream_;
+    File::Position compactFragment_;
+    
+    //! No hole starts below this position, so sliding fragments down doesn't look at the packed start of file again.
+    File::Position compactCursor_;
+    
+    enum {compactBufferSize = 512};
+    
+    enum {
+        //! Length of data compressed at once in compressed streams, and so of buffers needed by their readers and writers.
+        compressedBlockLength = 4096,
+        //! Each block starts with 16-bit lengths of its data before and after compression (equal if block is stored uncompressed).
+        blockHeaderLength = 4
+    };
+    
+#ifndef NDEBUG
+    enum {noCrash = ulong_t(-1)};
+    
+    //! Fault injection: after this many writeInPlace() calls the next one writes only half of its data and store doesn't touch the file any more.
+    ulong_t crashAfterWrites_;
+    bool crashed_;
+    
+    friend void test_DataStoreJournalRecovery();
+    friend bool test_DataStoreCrashingRewrite(ulong_t writesCount);
+    friend void test_DataStoreCompression();
+#endif    
+    
     friend class DataStoreReader;
     friend class DataStoreWriter;
 };
@@ -152,6 +366,22 @@ class DataStoreReader: public Reader {
     DataStore& store_;
     DataStore::StreamPositionPtr position_;
     
+    bool compressed_;
+    
+    //! Decompressed block of compressed stream followed by space for the block as stored, allocated on first use.
+    char* block_;
+    ulong_t blockLength_;
+    ulong_t blockOffset_;
+    
+    status_t readBlock();
+    
+#ifndef FILE_HAS_MAPPING
+    enum {bufferSize = 512};
+    
+    //! Buffer used by readView() when file can't be mapped, allocated on first use.
+    char* buffer_;
+#endif
+    
 public:
     
     DataStoreReader(DataStore& store);
@@ -162,6 +392,15 @@ public:
     
     status_t readRaw(void* buffer, ulong_t& length);
     
+    /**
+     * Returns next contiguous chunk of the stream (at most length bytes) and moves past it. 
+     * Where file can be mapped into memory (FILE_HAS_MAPPING) chunk points directly into the mapping and spans at most one fragment,
+     * otherwise it's copied into reader's internal buffer.
+     * @note data remains valid only until next operation on the reader or modification of the store. 
+     * @param length on return holds length of the chunk, 0 at the end of stream.
+     */
+    status_t readView(const void*& data, ulong_t& length);
+    
 };
 
 class DataStoreWriter: public Writer {
@@ -169,18 +408,44 @@ class DataStoreWriter: public Writer {
     DataStore& store_;
     DataStore::StreamPositionPtr position_;
     
+    enum {bufferSize = 512};
+    
+    //! Write-back buffer coalescing small writes, allocated on first use. For compressed streams it holds whole block.
+    char* buffer_;
+    ulong_t bufferLength_;
+    
+    bool compressed_;
+    
+    status_t flushBuffer();
+    
+    status_t writeBlock(ulong_t length);
+    
 public:
 
     DataStoreWriter(DataStore& store);
     
     ~DataStoreWriter();
     
-    status_t open(const char* name, bool dontCreate = false);
+    /**
+     * @param compressed stream is written in LZ77-compressed blocks, which DataStoreReader decompresses transparently. 
+     * Existing stream compressed differently is replaced with an empty one.
+     */
+    status_t open(const char* name, bool dontCreate = false, bool compressed = false);
     
     status_t writeRaw(const void* buffer, ulong_t length);
     
     status_t flush();
     
+    /**
+     * Moves to the end of stream, so that following writes are appended to its contents instead of replacing them.
+     * Blocks of compressed stream are independent, so it may be appended to as well.
+     */
+    status_t seekToEnd();
+    
 };
     
+#ifdef DEBUG
+void test_DataStore();
+#endif
+
 #endif
\ No newline at end of file
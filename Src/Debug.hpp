@@ -23,6 +23,10 @@ using std::size_t;
 # include <cassert>
 #endif
 
+#if defined(_POSIX)
+# include <cassert>
+#endif
+
 #if defined(_MSC_VER)
 #if _MSC_VER >= 1400
 #include <cassert>
@@ -123,7 +127,8 @@ inline void operator delete[](void* p, NewDontThrowTag, const char*, int) {::ope
 #define ARSLEXIS_DEBUG_NEW
 #define ARSLEXIS_DEBUG_NEW_MODE 0
 #endif
-#else
+#elif !defined(_POSIX)
+// libstdc++ headers use placement new, which redefined new would break.
 #define ARSLEXIS_DEBUG_NEW
 #define ARSLEXIS_DEBUG_NEW_MODE 1
 #endif
@@ -1284,6 +1284,20 @@ bool Definition::navigateHyperlink(Graphics& graphics, bool next)
     return true;
 }
 
+void Definition::shownElements(const_iterator& begin, const_iterator& end) const
+{
+    begin = end = elements_.end();
+    if (firstLine_ >= lines_.size())
+        return;
+    begin = lines_[firstLine_].firstElement;
+    if (lastLine_ >= lines_.size())
+        return;
+    end = lines_[lastLine_].firstElement;
+    // Element broken between last shown line and the next one is displayed partially.
+    if (0 != lines_[lastLine_].renderingProgress && elements_.end() != end)
+        ++end;
+}
+
 bool Definition::hasSelection() const
 {
     return selectionStartElement_ != elements_.end();
@@ -252,6 +252,12 @@ public:
     uint_t shownLinesCount() const
     {return lastLine_-firstLine_;}
     
+    /**
+     * Gets range of elements that are at least partially displayed in shown lines.
+     * Range is empty if layout wasn't calculated yet.
+     */
+    void shownElements(const_iterator& begin, const_iterator& end) const;
+    
     /**
      * Scrolls this @c Definition by @c delta lines, bounding it as neccessary.
      */
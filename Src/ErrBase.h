@@ -66,6 +66,18 @@
 // The next lines probably will have to be uncommented for portable SocketConnection to work
 // #  define netErrTimeout WSAETIMEDOUT
 // #  define netErrWouldBlock WSAEWOULDBLOCK
+#elif defined(_POSIX)
+#include <errno.h>
+
+// errno values are small positive numbers, keep our codes well above them
+#define appErrorClass 0x10000
+#define errNone 0
+
+#define sysErrParamErr EINVAL
+#define memErrNotEnoughSpace ENOMEM
+
+#define errConnectionFailed appErrorClass+1
+
 #else
  #error "Define appErrorClass for your build target."    
 #endif  // _WIN32 || _WIN32_WCE
@@ -71,18 +71,13 @@ status_t FieldPayloadProtocolConnection::processResponseIncrement(bool finish)
                 if (goOn)
                 {
                     error = processLine(toConsume);
-                    assert(responseLen_ >= ulong_t(toConsume + 1));
-                    StrErase(response_, responseLen_, 0, toConsume + 1);
-                    responseLen_ -= toConsume + 1;
+                    consumeResponse(toConsume + 1);
                 }
                 else
                 {
                     toConsume = responseLen_;
                     error = processLine(toConsume);
-                    assert('\0' == response_[toConsume]);
-                    free(response_);
-                    response_ = NULL;
-                    responseLen_ = 0;
+                    consumeResponse(toConsume);
                 }
             }
         }
@@ -101,9 +96,7 @@ status_t FieldPayloadProtocolConnection::processResponseIncrement(bool finish)
 
                 error = notifyPayloadFinished();
 
-                assert(responseLen_ >= payloadLengthLeft_ + lineSeparatorLength);
-                StrErase(response_, responseLen_, 0, payloadLengthLeft_ + lineSeparatorLength);
-                responseLen_ -= payloadLengthLeft_ + lineSeparatorLength;
+                consumeResponse(payloadLengthLeft_ + lineSeparatorLength);
                 goOn = true;
             }
             else
@@ -119,9 +112,7 @@ status_t FieldPayloadProtocolConnection::processResponseIncrement(bool finish)
                 if (finishPayload)
                     error = notifyPayloadFinished();
 
-                assert(responseLen_ >= length);
-                StrErase(response_, responseLen_, 0, length);
-                responseLen_ -= length;
+                consumeResponse(length);
                 payloadLengthLeft_ -= length;
                 goOn = false;
             }
@@ -5,6 +5,13 @@
 #include <BaseTypes.hpp>
 #include <Utility.hpp>
 
+#if defined(_POSIX)
+# include <fcntl.h>
+# include <vector>
+//! File can map its contents into memory for zero-copy reads (see File::view()).
+# define FILE_HAS_MAPPING
+#endif
+
 class File: private NonCopyable {
     
 #if defined(_PALM_OS)
@@ -21,6 +28,12 @@ class File: private NonCopyable {
     
     enum {invalidFileHandle=reinterpret_cast<ulong_t>(INVALID_HANDLE_VALUE)};
     
+#elif defined(_POSIX)
+
+    typedef int FileHandle_t;
+    
+    enum {invalidFileHandle=-1};
+    
 #else
 
 # error "Define FileReader::FileHandle_t for your system."
@@ -37,6 +50,9 @@ public:
 #elif defined(_WIN32)
     typedef ulong_t Position;
     typedef long SeekOffset;
+#elif defined(_POSIX)
+    typedef ulong_t Position;
+    typedef long SeekOffset;
 #endif
     
     typedef Position Size;
@@ -66,12 +82,17 @@ public:
         ulong_t flagsAndAttributes = FILE_FLAG_SEQUENTIAL_SCAN,
         HANDLE templateFile = NULL);
         
+#elif defined(_POSIX)
+
+    //! @param flags, mode are passed to open(2).
+    status_t open(const char_t* fileName, int flags, int mode = 0644);
+    
 #else
 # error "Declare FileReader::open() for your system."
 #endif
     
     bool isOpen() const
-    {return reinterpret_cast<FileHandle_t>(invalidFileHandle) != handle_;}
+    {return FileHandle_t(invalidFileHandle) != handle_;}
 
     status_t close();
 
@@ -89,12 +110,42 @@ public:
 
     status_t read(void* buffer, Size bytesToRead, Size& bytesRead);
     
+    //! Reads from given position without using (where system allows, without moving) file position, 
+    //! so that it can be called from several threads at once on systems that support it (pread(2) on POSIX).
+    status_t read(Position position, void* buffer, Size bytesToRead, Size& bytesRead);
+    
     status_t write(const void* buffer, Size bytesToWrite);
     
     status_t flush();
     
     status_t truncate();
     
+#ifdef FILE_HAS_MAPPING
+
+    //! Gives read-only access to length bytes starting at start without copying them.
+    //! @note view is invalidated by releaseRetiredMaps() and close(); mapping replaced by a larger one or by truncate() is kept until then,
+    //! so that earlier views stay valid. 
+    //! Data written with write() is visible through the view. Calls to view() must be serialized by the caller.
+    status_t view(Position start, Size length, const void*& data);
+    
+    //! Unmaps mappings replaced by larger ones or by truncate(), invalidating views obtained before the last remapping. 
+    //! Caller must make sure none of them is used anymore.
+    void releaseRetiredMaps();
+    
+private:
+
+    void retireMap();
+    
+    void unmap();
+    
+    char* map_;
+    Size mapSize_;
+    
+    typedef std::vector<std::pair<char*, Size> > RetiredMaps_t;
+    RetiredMaps_t retiredMaps_;
+    
+#endif
+    
 };
 
 #endif
\ No newline at end of file
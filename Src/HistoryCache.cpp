@@ -4,6 +4,8 @@
 #include <DataStore.hpp>
 #include <Text.hpp>
 #include <Logging.hpp>
+#include <algorithm>
+#include <climits>
 
 #ifdef __MWERKS__
 using std::memcpy;
@@ -12,37 +14,144 @@ using std::memcpy;
 //#define DEBUG_URLS
 
 #define HISTORY_CACHE_INDEX_STREAM "_History Cache Index"
+#define HISTORY_CACHE_LOG_STREAM "_History Cache Log"
 
 enum {
     serialIdIndexVersion,
     serialIdItemsCount
 };
 
-HistoryCache::HistoryCache():
-    indexEntries_(NULL),
+// Version 2 adds content hash and length to entries, version 3 generation of the index log.
+enum {indexVersion = 3};
+
+// Log starts with its generation, followed by records consisting of operation and its arguments.
+enum LogOperation {
+    // url; entry is appended and update follows
+    logOpAppend,
+    // index
+    logOpRemove,
+    // index, new index
+    logOpMove,
+    // index, url, stream name, title, only link, content hash, content length
+    logOpUpdate,
+    // url; latest entry with url is removed
+    logOpRemoveUrl,
+    // url; latest entry with url is moved to the end
+    logOpMoveUrlToEnd
+};
+
+// Log shorter than this isn't checkpointed even if index is.
+enum {minCheckpointInterval = 32};
+
+static void logNumber(NarrowString& log, ulong_t value)
+{
+    log.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static void logData(NarrowString& log, const void* data, ulong_t length)
+{
+    logNumber(log, length);
+    log.append(static_cast<const char*>(data), length);
+}
+
+static bool replayNumber(const char*& log, const char* end, ulong_t& value)
+{
+    if (ulong_t(end - log) < sizeof(value))
+        return false;
+    memmove(&value, log, sizeof(value));
+    log += sizeof(value);
+    return true;
+}
+
+static bool replayData(const char*& log, const char* end, const char*& data, ulong_t& length)
+{
+    if (!replayNumber(log, end, length) || ulong_t(end - log) < length)
+        return false;
+    data = log;
+    log += length;
+    return true;
+}
+
+enum {initialBucketsCount = 16};
+
+// FNV-1a, used for urls and computed incrementally for content as entry is written.
+static const ulong_t contentHashSeed = 2166136261UL;
+
+static ulong_t contentHashUpdate(ulong_t hash, const void* data, ulong_t length)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (ulong_t i = 0; i < length; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+class HistoryCache::EntryWriter: public DataStoreWriter {
+    HistoryCache& cache_;
+    NarrowString streamName_;
+    ulong_t hash_;
+    ulong_t length_;
+
+public:
+
+    EntryWriter(HistoryCache& cache, const char* streamName):
+        DataStoreWriter(*cache.dataStore),
+        cache_(cache),
+        streamName_(streamName),
+        hash_(contentHashSeed),
+        length_(0)
+    {}
+
+    ~EntryWriter()
+    {
+        if (errNone == flush())
+            cache_.entryWritten(streamName_.c_str(), hash_, length_);
+    }
+
+    status_t writeRaw(const void* buffer, ulong_t length)
+    {
+        hash_ = contentHashUpdate(hash_, buffer, length);
+        length_ += length;
+        return DataStoreWriter::writeRaw(buffer, length);
+    }
+
+};
+
+HistoryCache::HistoryCache(ulong_t capacity):
+    first_(NULL),
+    last_(NULL),
     indexEntriesCount_(0),
-    indexCapacity_(0),
-    dataStore(NULL),
-    dataStoreOwner_(false)
+    capacity_(capacity),
+    cursor_(NULL),
+    cursorIndex_(0),
+    bytesUsed_(0),
+    dataStoreOwner_(false),
+    byteBudget_(0),
+    evictionPolicy_(evictLeastRecentlyUsed),
+    logGeneration_(0),
+    logValid_(false),
+    logRecordsCount_(0),
+    dataStore(NULL)
 {
+    assert(0 != capacity_);
 }
 
 HistoryCache::~HistoryCache()
 {
-    close();    
+    close();
 }
 
 void HistoryCache::close()
 {
-    if (NULL != indexEntries_)
+    if (!buckets_.empty())
     {
         if (NULL != dataStore)
-            writeIndex();
-            
-        delete [] indexEntries_;
-        indexEntries_ = NULL;
-        indexEntriesCount_ = 0;
-        indexCapacity_ = 0;
+            flushIndex();
+
+        clearEntries();
+        buckets_.clear();
     }
     if (dataStoreOwner_)
         delete dataStore;
@@ -70,64 +179,324 @@ status_t HistoryCache::open(const char_t* dsName)
     return readIndex();
 }
 
-HistoryCache::IndexEntry::IndexEntry()
+HistoryCache::IndexEntry::IndexEntry():
+    url(NULL),
+    streamName(NULL),
+    title(NULL),
+    onlyLink(false),
+    contentHash(0),
+    contentLength(0),
+    prev(NULL),
+    next(NULL),
+    nextInBucket(NULL),
+    nextInStream(NULL)
+{}
+
+HistoryCache::IndexEntry::~IndexEntry()
 {
-    memzero(this, sizeof(*this));
+    free(url);
+    free(streamName);
+    free(title);
+}
+
+void HistoryCache::clearEntries()
+{
+    while (NULL != first_)
+    {
+        IndexEntry* entry = first_;
+        first_ = entry->next;
+        delete entry;
+    }
+    last_ = NULL;
+    indexEntriesCount_ = 0;
+    cursor_ = NULL;
+    std::fill(buckets_.begin(), buckets_.end(), (IndexEntry*)NULL);
+    streams_.clear();
+    contentHashes_.clear();
+    bytesUsed_ = 0;
+}
+
+// Walks from the nearest of list ends and cursor_.
+HistoryCache::IndexEntry* HistoryCache::entryAt(ulong_t index) const
+{
+    assert(index < indexEntriesCount_);
+    IndexEntry* entry = first_;
+    ulong_t i = 0;
+    if (indexEntriesCount_ - 1 - index < index)
+    {
+        entry = last_;
+        i = indexEntriesCount_ - 1;
+    }
+    if (NULL != cursor_)
+    {
+        ulong_t cursorDistance = (cursorIndex_ > index ? cursorIndex_ - index : index - cursorIndex_);
+        ulong_t distance = (i > index ? i - index : index - i);
+        if (cursorDistance < distance)
+        {
+            entry = cursor_;
+            i = cursorIndex_;
+        }
+    }
+    for (; i < index; ++i)
+        entry = entry->next;
+    for (; i > index; --i)
+        entry = entry->prev;
+    cursor_ = entry;
+    cursorIndex_ = index;
+    return entry;
+}
+
+// Walks from entry in both directions until it meets an entry with known index.
+ulong_t HistoryCache::indexOf(const IndexEntry* entry) const
+{
+    const IndexEntry* back = entry;
+    const IndexEntry* forward = entry;
+    for (ulong_t distance = 0; ; ++distance)
+    {
+        if (back == first_)
+            return distance;
+        if (forward == last_)
+            return indexEntriesCount_ - 1 - distance;
+        if (back == cursor_)
+            return cursorIndex_ + distance;
+        if (forward == cursor_)
+            return cursorIndex_ - distance;
+        back = back->prev;
+        forward = forward->next;
+    }
+}
+
+// Links entry in front of before, or at the end if it's NULL.
+void HistoryCache::linkEntry(IndexEntry* entry, IndexEntry* before)
+{
+    entry->next = before;
+    entry->prev = (NULL == before ? last_ : before->prev);
+    if (NULL == entry->prev)
+        first_ = entry;
+    else
+        entry->prev->next = entry;
+    if (NULL == before)
+        last_ = entry;
+    else
+        before->prev = entry;
+    ++indexEntriesCount_;
+    cursor_ = NULL;
+}
+
+void HistoryCache::unlinkEntry(IndexEntry* entry)
+{
+    if (NULL == entry->prev)
+        first_ = entry->next;
+    else
+        entry->prev->next = entry->next;
+    if (NULL == entry->next)
+        last_ = entry->prev;
+    else
+        entry->next->prev = entry->prev;
+    entry->prev = entry->next = NULL;
+    --indexEntriesCount_;
+    cursor_ = NULL;
+}
+
+void HistoryCache::insertUrl(IndexEntry* entry)
+{
+    IndexEntry*& bucket = buckets_[contentHashUpdate(contentHashSeed, entry->url, Len(entry->url)) % buckets_.size()];
+    entry->nextInBucket = bucket;
+    bucket = entry;
+    if (indexEntriesCount_ > buckets_.size())
+        rehashUrls(2 * buckets_.size());
+}
+
+void HistoryCache::eraseUrl(IndexEntry* entry)
+{
+    IndexEntry** link = &buckets_[contentHashUpdate(contentHashSeed, entry->url, Len(entry->url)) % buckets_.size()];
+    while (entry != *link)
+    {
+        assert(NULL != *link);
+        link = &(*link)->nextInBucket;
+    }
+    *link = entry->nextInBucket;
+    entry->nextInBucket = NULL;
+}
+
+void HistoryCache::rehashUrls(ulong_t bucketsCount)
+{
+    buckets_.assign(bucketsCount, (IndexEntry*)NULL);
+    for (IndexEntry* entry = first_; NULL != entry; entry = entry->next)
+    {
+        if (NULL == entry->url)
+            continue;
+        IndexEntry*& bucket = buckets_[contentHashUpdate(contentHashSeed, entry->url, Len(entry->url)) % bucketsCount];
+        entry->nextInBucket = bucket;
+        bucket = entry;
+    }
+}
+
+ulong_t HistoryCache::streamReferencesCount(const char* streamName) const
+{
+    Streams_t::const_iterator it = streams_.find(streamName);
+    if (streams_.end() == it)
+        return 0;
+    return it->second.references;
+}
+
+void HistoryCache::updateStreamSize(const char* streamName)
+{
+    Streams_t::iterator it = streams_.find(streamName);
+    if (streams_.end() == it)
+        return;
+    File::Size size = 0;
+    if (errNone != dataStore->streamSize(streamName, size))
+        size = 0;
+    bytesUsed_ -= it->second.size;
+    it->second.size = ulong_t(size);
+    bytesUsed_ += it->second.size;
+}
+
+// Stream previously used by the entry is removed if it's not shared.
+status_t HistoryCache::setEntryStream(IndexEntry& entry, const char* streamName)
+{
+    char* name = StringCopy2(streamName);
+    if (NULL == name)
+        return memErrNotEnoughSpace;
+    if (NULL != entry.streamName && 0 == releaseEntryStream(entry))
+        dataStore->removeStream(entry.streamName);
+    free(entry.streamName);
+    entry.streamName = name;
+    referenceStream(entry);
+    return errNone;
+}
+
+void HistoryCache::referenceStream(IndexEntry& entry)
+{
+    StreamInfo& info = streams_[entry.streamName];
+    ++info.references;
+    entry.nextInStream = info.entries;
+    info.entries = &entry;
+}
+
+ulong_t HistoryCache::releaseEntryStream(IndexEntry& entry)
+{
+    Streams_t::iterator it = streams_.find(entry.streamName);
+    assert(streams_.end() != it);
+    IndexEntry** link = &it->second.entries;
+    while (*link != &entry)
+    {
+        assert(NULL != *link);
+        link = &(*link)->nextInStream;
+    }
+    *link = entry.nextInStream;
+    entry.nextInStream = NULL;
+    ulong_t count = --it->second.references;
+    if (0 == count)
+    {
+        bytesUsed_ -= it->second.size;
+        unhashStream(it);
+        streams_.erase(it);
+    }
+    return count;
+}
+
+void HistoryCache::hashStream(Streams_t::iterator stream, ulong_t contentHash, ulong_t contentLength)
+{
+    unhashStream(stream);
+    if (0 == contentLength)
+        return;
+    stream->second.contentHash = contentHash;
+    stream->second.contentLength = contentLength;
+    contentHashes_.insert(ContentHashes_t::value_type(contentHash, &stream->first));
+}
+
+void HistoryCache::unhashStream(Streams_t::iterator stream)
+{
+    StreamInfo& info = stream->second;
+    if (0 == info.contentLength)
+        return;
+    std::pair<ContentHashes_t::iterator, ContentHashes_t::iterator> range = contentHashes_.equal_range(info.contentHash);
+    for (ContentHashes_t::iterator it = range.first; it != range.second; ++it)
+    {
+        if (&stream->first == it->second)
+        {
+            contentHashes_.erase(it);
+            break;
+        }
+    }
+    info.contentHash = 0;
+    info.contentLength = 0;
 }
 
 status_t HistoryCache::readIndex()
 {
     assert(NULL != dataStore);
+    clearEntries();
+    rehashUrls(initialBucketsCount);
+    // Log left by index that was lost mustn't be mistaken for one of the new index.
+    logGeneration_ = ticks();
+    logValid_ = false;
+    logRecordsCount_ = 0;
+    pendingLog_.clear();
     DataStoreReader reader(*dataStore);
 
     status_t err = reader.open(HISTORY_CACHE_INDEX_STREAM);
-    if (errNone != err)
+    if (errNone == err)
     {
-FreshIndex:    
-        indexCapacity_ = 0;
-        indexEntriesCount_ = 0;
-        delete [] indexEntries_;
-        indexEntries_ = new_nt IndexEntry[maxCacheEntries];
-        if (NULL == indexEntries_)
-            return memErrNotEnoughSpace;
-        indexCapacity_ = maxCacheEntries;
-        return errNone;        
-    }
-    Serializer serialize(reader);
-    err = serializeIndexIn(serialize);
-    if (errNone != err)
+        Serializer serialize(reader);
+        err = serializeIndexIn(serialize);
+        if (errNone != err)
+            LogStrUlong(eLogError, _T("HistoryCache::readIndex(): serializeIndexIn() returned error: "), err);
+        else if (errNone != (err = readLog()))
+            LogStrUlong(eLogError, _T("HistoryCache::readIndex(): readLog() returned error: "), err);
+        if (errNone != err)
+        {
+            clearEntries();
+            logValid_ = false;
+            logRecordsCount_ = 0;
+        }
+    }
+    // Sizes aren't part of the index, as streams may be compacted or lost independently of it.
+    Streams_t::iterator end = streams_.end();
+    for (Streams_t::iterator it = streams_.begin(); it != end; ++it)
+        updateStreamSize(it->first.c_str());
+    for (IndexEntry* entry = first_; NULL != entry; entry = entry->next)
     {
-        LogStrUlong(eLogError, _T("HistoryCache::readIndex(): serializeIndexIn() returned error: "), err);
-        goto FreshIndex;
+        Streams_t::iterator it = streams_.find(entry->streamName);
+        if (streams_.end() != it && 0 == it->second.contentLength)
+            hashStream(it, entry->contentHash, entry->contentLength);
     }
-    return err;
+    return errNone;
 }
 
 status_t HistoryCache::serializeIndexIn(Serializer& serialize)
 {
     ErrTry {
-        ulong_t cap = maxCacheEntries;
+        ulong_t version;
         ulong_t count;
-        serialize(count, serialIdIndexVersion);
+        serialize(version, serialIdIndexVersion);
         serialize(count, serialIdItemsCount);
-        if (count > maxCacheEntries)
-            cap = count;
-        indexEntries_ = new_nt IndexEntry[cap];
-        if (NULL == indexEntries_)
-            ErrReturn(memErrNotEnoughSpace);
-        indexCapacity_ = cap;
+        if (version >= 3)
+            serialize(logGeneration_);
         for (ulong_t i = 0; i < count; ++i)
         {
-            IndexEntry& entry = indexEntries_[i];
-            serialize.narrowBuffer(entry.url, maxCacheEntryUrlLength + 1);
+            IndexEntry* entry = new_nt IndexEntry();
+            if (NULL == entry)
+                ErrReturn(memErrNotEnoughSpace);
+            // Entry is linked at once, so that it's freed if reading fails.
+            linkEntry(entry, NULL);
+            serialize.narrowIn(entry->url);
 #ifdef DEBUG_URLS
-            assert('s' == *entry.url);
-#endif         
-            serialize.narrowBuffer(entry.streamName, DataStore::maxStreamNameLength + 1);
-            serialize.textBuffer(entry.title, maxCacheEntryTitleLength + 1);
-            serialize(entry.onlyLink);
+            assert('s' == *entry->url);
+#endif
+            serialize.narrowIn(entry->streamName);
+            referenceStream(*entry);
+            serialize.textIn(entry->title);
+            serialize(entry->onlyLink);
+            if (version >= 2)
+            {
+                serialize(entry->contentHash);
+                serialize(entry->contentLength);
+            }
+            insertUrl(entry);
         }
-        indexEntriesCount_ = count;
     }
     ErrCatch(ex) {
         return ex;
@@ -135,100 +504,446 @@ status_t HistoryCache::serializeIndexIn(Serializer& serialize)
     return errNone;
 }
 
+// Index of new generation is committed first, so that interrupted checkpoint leaves log which doesn't belong to it.
 status_t HistoryCache::writeIndex()
 {
     assert(NULL != dataStore);
+    ++logGeneration_;
+    logValid_ = false;
+    {
+        DataStoreWriter writer(*dataStore);
+        status_t err = writer.open(HISTORY_CACHE_INDEX_STREAM);
+        if (errNone != err)
+            return err;
+
+        Serializer serialize(writer);
+        if (errNone != (err = serializeIndexOut(serialize)))
+            return err;
+        if (errNone != (err = serialize.finish()))
+            return err;
+        if (errNone != (err = writer.flush()))
+            return err;
+    }
+    pendingLog_.clear();
+    logRecordsCount_ = 0;
+
     DataStoreWriter writer(*dataStore);
-    
-    status_t err = writer.open(HISTORY_CACHE_INDEX_STREAM);
+    status_t err = writer.open(HISTORY_CACHE_LOG_STREAM);
     if (errNone != err)
         return err;
-     
-    Serializer serialize(writer);
-    return serializeIndexOut(serialize);
+    NarrowString header;
+    logNumber(header, logGeneration_);
+    if (errNone != (err = writer.write(header)))
+        return err;
+    if (errNone != (err = writer.flush()))
+        return err;
+    logValid_ = true;
+    return errNone;
 }
 
-status_t HistoryCache::serializeIndexOut(Serializer& serialize)
+status_t HistoryCache::writeLog()
 {
-    ErrTry {
-        ulong_t indexVersion = 1;
-        serialize(indexVersion, serialIdIndexVersion);      
-        serialize(indexEntriesCount_, serialIdItemsCount);
-        for (ulong_t i = 0; i < indexEntriesCount_; ++i)
+    assert(NULL != dataStore);
+    assert(logValid_);
+    DataStoreWriter writer(*dataStore);
+    status_t err = writer.open(HISTORY_CACHE_LOG_STREAM, true);
+    if (errNone != err)
+        return err;
+    if (errNone != (err = writer.seekToEnd()))
+        return err;
+    if (errNone != (err = writer.write(pendingLog_)))
+        return err;
+    if (errNone != (err = writer.flush()))
+        return err;
+    pendingLog_.clear();
+    return errNone;
+}
+
+// Checkpoint keeps time spent replaying the log proportional to the size of index.
+status_t HistoryCache::flushIndex()
+{
+    if (pendingLog_.empty())
+        return errNone;
+    if (logValid_ && logRecordsCount_ <= std::max<ulong_t>(minCheckpointInterval, indexEntriesCount_) && errNone == writeLog())
+        return errNone;
+    return writeIndex();
+}
+
+status_t HistoryCache::readLog()
+{
+    DataStoreReader reader(*dataStore);
+    status_t err = reader.open(HISTORY_CACHE_LOG_STREAM);
+    if (errNone != err)
+        return errNone;
+    NarrowString log;
+    char buffer[256];
+    while (true)
+    {
+        ulong_t length = sizeof(buffer);
+        if (errNone != (err = reader.readRaw(buffer, length)))
+            return err;
+        if (0 == length)
+            break;
+        log.append(buffer, length);
+    }
+    return replayLog(log.data(), log.length());
+}
+
+// Records are applied to the entries only, streams they refer to were already created or removed.
+status_t HistoryCache::replayLog(const char* log, ulong_t length)
+{
+    const char* end = log + length;
+    ulong_t generation;
+    if (!replayNumber(log, end, generation))
+        return DataStore::errStoreCorrupted;
+    if (generation != logGeneration_)
+        return errNone;
+    logValid_ = true;
+
+    while (log != end)
+    {
+        char operation = *log++;
+        const char* data;
+        ulong_t dataLength;
+        ulong_t index;
+        IndexEntry* entry;
+        if (logOpAppend == operation)
         {
-            IndexEntry& entry = indexEntries_[i];
-#ifdef DEBUG_URLS
-            assert('s' == *entry.url);
-#endif         
-            serialize.narrowOut(entry.url);
+            if (!replayData(log, end, data, dataLength))
+                return DataStore::errStoreCorrupted;
+            if (NULL == (entry = new_nt IndexEntry()))
+                return memErrNotEnoughSpace;
+            if (NULL == (entry->url = StringCopy2N(data, dataLength)))
+            {
+                delete entry;
+                return memErrNotEnoughSpace;
+            }
+            linkEntry(entry, NULL);
+            insertUrl(entry);
+            ++logRecordsCount_;
+            continue;
+        }
+        if (logOpRemoveUrl == operation || logOpMoveUrlToEnd == operation)
+        {
+            if (!replayData(log, end, data, dataLength))
+                return DataStore::errStoreCorrupted;
+            if (NULL == (entry = findEntry(data, dataLength)))
+                return DataStore::errStoreCorrupted;
+            unlinkEntry(entry);
+            if (logOpMoveUrlToEnd == operation)
+                linkEntry(entry, NULL);
+            else
+            {
+                if (NULL != entry->streamName)
+                    releaseEntryStream(*entry);
+                eraseUrl(entry);
+                delete entry;
+            }
+            ++logRecordsCount_;
+            continue;
+        }
+
+        if (!replayNumber(log, end, index) || index >= indexEntriesCount_)
+            return DataStore::errStoreCorrupted;
+        entry = entryAt(index);
+        if (logOpRemove == operation)
+        {
+            if (NULL != entry->streamName)
+                releaseEntryStream(*entry);
+            eraseUrl(entry);
+            unlinkEntry(entry);
+            delete entry;
+        }
+        else if (logOpMove == operation)
+        {
+            if (!replayNumber(log, end, index) || index >= indexEntriesCount_)
+                return DataStore::errStoreCorrupted;
+            unlinkEntry(entry);
+            linkEntry(entry, (index == indexEntriesCount_ ? NULL : entryAt(index)));
+        }
+        else if (logOpUpdate == operation)
+        {
+            if (!replayData(log, end, data, dataLength))
+                return DataStore::errStoreCorrupted;
+            char* url = StringCopy2N(data, dataLength);
+            if (NULL == url)
+                return memErrNotEnoughSpace;
+            eraseUrl(entry);
+            free(entry->url);
+            entry->url = url;
+            insertUrl(entry);
+
+            if (!replayData(log, end, data, dataLength))
+                return DataStore::errStoreCorrupted;
+            char* streamName = StringCopy2N(data, dataLength);
+            if (NULL == streamName)
+                return memErrNotEnoughSpace;
+            if (NULL != entry->streamName)
+                releaseEntryStream(*entry);
+            free(entry->streamName);
+            entry->streamName = streamName;
+            referenceStream(*entry);
+
+            if (!replayData(log, end, data, dataLength))
+                return DataStore::errStoreCorrupted;
+            // Data isn't aligned for char_t.
+            char_t* title = (char_t*)malloc(dataLength + sizeof(char_t));
+            if (NULL == title)
+                return memErrNotEnoughSpace;
+            memmove(title, data, dataLength);
+            title[dataLength / sizeof(char_t)] = _T('\0');
+            free(entry->title);
+            entry->title = title;
+
+            if (log == end)
+                return DataStore::errStoreCorrupted;
+            entry->onlyLink = (0 != *log++);
+            if (!replayNumber(log, end, entry->contentHash) || !replayNumber(log, end, entry->contentLength))
+                return DataStore::errStoreCorrupted;
+        }
+        else
+            return DataStore::errStoreCorrupted;
+        ++logRecordsCount_;
+    }
+    return errNone;
+}
+
+void HistoryCache::logAppend(const IndexEntry& entry)
+{
+    pendingLog_.append(1, char(logOpAppend));
+    logData(pendingLog_, entry.url, Len(entry.url));
+    ++logRecordsCount_;
+    logUpdate(entry);
+}
+
+void HistoryCache::logRemove(const IndexEntry& entry)
+{
+    pendingLog_.append(1, char(logOpRemove));
+    logNumber(pendingLog_, indexOf(&entry));
+    ++logRecordsCount_;
+}
+
+// Entry is identified by url, replay finds the same entry with findEntry() as the log leaves entries in the same order.
+void HistoryCache::logRemoveUrl(const IndexEntry& entry)
+{
+    pendingLog_.append(1, char(logOpRemoveUrl));
+    logData(pendingLog_, entry.url, Len(entry.url));
+    ++logRecordsCount_;
+}
+
+void HistoryCache::logMoveUrlToEnd(const IndexEntry& entry)
+{
+    pendingLog_.append(1, char(logOpMoveUrlToEnd));
+    logData(pendingLog_, entry.url, Len(entry.url));
+    ++logRecordsCount_;
+}
+
+void HistoryCache::logMove(ulong_t from, ulong_t to)
+{
+    pendingLog_.append(1, char(logOpMove));
+    logNumber(pendingLog_, from);
+    logNumber(pendingLog_, to);
+    ++logRecordsCount_;
+}
+
+void HistoryCache::logUpdate(const IndexEntry& entry)
+{
+    pendingLog_.append(1, char(logOpUpdate));
+    logNumber(pendingLog_, indexOf(&entry));
+    logData(pendingLog_, entry.url, Len(entry.url));
+    logData(pendingLog_, entry.streamName, Len(entry.streamName));
+    const char_t* title = (NULL == entry.title ? _T("") : entry.title);
+    logData(pendingLog_, title, Len(title) * sizeof(char_t));
+    pendingLog_.append(1, char(entry.onlyLink));
+    logNumber(pendingLog_, entry.contentHash);
+    logNumber(pendingLog_, entry.contentLength);
+    ++logRecordsCount_;
+}
+
+// Partial output is never used, so errors are checked once at the end instead of setting up exception handler.
+status_t HistoryCache::serializeIndexOut(Serializer& serialize)
+{
+    serialize.setAccumulateErrors(true);
+    ulong_t version = indexVersion;
+    serialize(version, serialIdIndexVersion);
+    serialize(indexEntriesCount_, serialIdItemsCount);
+    serialize(logGeneration_);
+    for (IndexEntry* entry = first_; NULL != entry; entry = entry->next)
+    {
 #ifdef DEBUG_URLS
-            assert('s' == *entry.url);
-#endif         
-            serialize.narrowOut(entry.streamName);
-            serialize.textOut(entry.title);
-            serialize(entry.onlyLink);
+        assert('s' == *entry->url);
+#endif
+        serialize.narrowOut(entry->url);
+        serialize.narrowOut(entry->streamName);
+        serialize.textOut(NULL == entry->title ? _T("") : entry->title);
+        serialize(entry->onlyLink);
+        serialize(entry->contentHash);
+        serialize(entry->contentLength);
+    }
+    return serialize.error();
+}
+
+// Same url may be present more than once, the latest entry wins; only then indices are compared.
+HistoryCache::IndexEntry* HistoryCache::findEntry(const char* url, ulong_t length) const
+{
+    if (buckets_.empty())
+        return NULL;
+    IndexEntry* found = NULL;
+    ulong_t foundIndex = entryNotFound;
+    for (IndexEntry* e = buckets_[contentHashUpdate(contentHashSeed, url, length) % buckets_.size()]; NULL != e; e = e->nextInBucket)
+    {
+        if (length != Len(e->url) || 0 != memcmp(url, e->url, length))
+            continue;
+        if (NULL == found)
+        {
+            found = e;
+            continue;
+        }
+        if (entryNotFound == foundIndex)
+            foundIndex = indexOf(found);
+        ulong_t index = indexOf(e);
+        if (index > foundIndex)
+        {
+            found = e;
+            foundIndex = index;
         }
     }
-    ErrCatch(ex) {
-		return ex;
-    } ErrEndCatch
-    return errNone;    
+    return found;
 }
 
 ulong_t HistoryCache::entryIndex(const char* entry) const
 {
-    for (long i = long(indexEntriesCount_) - 1; i >= 0; --i)
-    {   
-        if (StrEquals(entry, indexEntries_[i].url))
-            return ulong_t(i);
-    }
-    return entryNotFound;
+    ++statistics_.lookups;
+    const IndexEntry* found = findEntry(entry, Len(entry));
+    if (NULL == found)
+        return entryNotFound;
+    ++statistics_.hits;
+    return indexOf(found);
+}
+
+uint_t HistoryCache::hitRate() const
+{
+    if (0 == statistics_.lookups)
+        return 0;
+    return uint_t(statistics_.hits * 100 / statistics_.lookups);
 }
 
 const char* HistoryCache::entryUrl(ulong_t index) const
 {
-    assert(index < indexEntriesCount_);
-    return indexEntries_[index].url;
+    return entryAt(index)->url;
 }
 
 const char_t* HistoryCache::entryTitle(ulong_t index) const
 {
-    assert(index < indexEntriesCount_);
-    return indexEntries_[index].title;
+    const char_t* title = entryAt(index)->title;
+    return (NULL == title ? _T("") : title);
 }
 
 bool HistoryCache::entryIsOnlyLink(ulong_t index) const
 {
-    assert(index < indexEntriesCount_);
-    return indexEntries_[index].onlyLink;
+    return entryAt(index)->onlyLink;
 }
 
 void HistoryCache::setEntryTitle(ulong_t index, const char_t* str)
 {
-    assert(index < indexEntriesCount_);
-    size_t len = Len(str);
-    if (len > maxCacheEntryTitleLength)
-        len = maxCacheEntryTitleLength;
+    char_t* title = StringCopy2(str);
+    if (NULL == title)
+        return;
+    IndexEntry* entry = entryAt(index);
+    free(entry->title);
+    entry->title = title;
+    logUpdate(*entry);
+}
+
+status_t HistoryCache::setEntryUrl(ulong_t index, const char* str)
+{
+    assert(0 != Len(str));
+    char* url = StringCopy2(str);
+    if (NULL == url)
+        return memErrNotEnoughSpace;
+    IndexEntry* entry = entryAt(index);
+    eraseUrl(entry);
+    free(entry->url);
+    entry->url = url;
+    insertUrl(entry);
+    logUpdate(*entry);
+    return errNone;
+}
+
+status_t HistoryCache::setCapacity(ulong_t capacity)
+{
+    assert(0 != capacity);
+    capacity_ = capacity;
+    return evict(0);
+}
+
+status_t HistoryCache::setByteBudget(ulong_t bytes)
+{
+    byteBudget_ = bytes;
+    return evict(0);
+}
+
+HistoryCache::IndexEntry* HistoryCache::evictionCandidate() const
+{
+    if (evictLeastRecentlyUsed == evictionPolicy_)
+        return first_;
     
-    IndexEntry& entry = indexEntries_[index];
-    memmove(entry.title, str, len * sizeof(char_t));
-    entry.title[len] = _T('\0');
-#ifdef DEBUG_URLS
-    assert('s' == *entry.url);
-#endif         
+    // Entries sharing their stream free nothing, if no entry does the oldest one goes.
+    IndexEntry* candidate = first_;
+    ulong_t maxCost = 0;
+    ulong_t age = indexEntriesCount_;
+    for (IndexEntry* entry = first_; NULL != entry; entry = entry->next, --age)
+    {
+        Streams_t::const_iterator it = streams_.find(entry->streamName);
+        if (streams_.end() == it || 1 != it->second.references)
+            continue;
+        // Product could overflow ulong_t with large pages, so cost is computed in kilobytes.
+        ulong_t cost = (it->second.size / 1024 + 1) * age;
+        if (cost > maxCost)
+        {
+            candidate = entry;
+            maxCost = cost;
+        }
+    }
+    return candidate;
+}
+
+status_t HistoryCache::evict(ulong_t reserve)
+{
+    while (0 != indexEntriesCount_ && (indexEntriesCount_ + reserve > capacity_ || (0 != byteBudget_ && bytesUsed_ > byteBudget_)))
+    {
+        ulong_t bytes = bytesUsed_;
+        status_t err = removeIndexEntry(evictionCandidate());
+        if (errNone != err)
+            return err;
+        ++statistics_.entriesEvicted;
+        statistics_.bytesEvicted += bytes - bytesUsed_;
+    }
+    return errNone;
 }
 
 status_t HistoryCache::removeEntry(ulong_t index)
 {
-    assert(index < indexEntriesCount_);
+    return removeIndexEntry(entryAt(index));
+}
+
+status_t HistoryCache::removeIndexEntry(IndexEntry* entry, bool foundByUrl)
+{
     assert(NULL != dataStore);
-    const char* streamName = indexEntries_[index].streamName;
-    status_t err = dataStore->removeStream(streamName);
-    if (errNone != err)
-        return err;
-    
-    memmove(indexEntries_ + index, indexEntries_ + index + 1, (indexEntriesCount_ - (index + 1)) * sizeof(IndexEntry));
-    --indexEntriesCount_;
+    if (1 == streamReferencesCount(entry->streamName))
+    {
+        status_t err = dataStore->removeStream(entry->streamName);
+        if (errNone != err)
+            return err;
+    }
+    if (foundByUrl)
+        logRemoveUrl(*entry);
+    else
+        logRemove(*entry);
+    releaseEntryStream(*entry);
+    eraseUrl(entry);
+    unlinkEntry(entry);
+    delete entry;
     return errNone;
 }
 
@@ -247,33 +962,116 @@ status_t HistoryCache::appendEntry(const char* url, ulong_t& index)
 {
     assert(0 != Len(url));
 
-    status_t err;
-    if (indexEntriesCount_ == indexCapacity_)
-        if (errNone != (err = removeEntry(0UL)))
-            return err;
-    
-    ulong_t len = Len(url);
-    if (len > maxCacheEntryUrlLength)
-        len = maxCacheEntryUrlLength;
-    
-    IndexEntry& entry = indexEntries_[indexEntriesCount_];
-    memmove(entry.url, url, len);
-    entry.url[len] = '\0';
-	StrPrintF(entry.streamName, "_History %lx%lx", ticks(), random(ULONG_MAX));
+    status_t err = evict(1);
+    if (errNone != err)
+        return err;
+
+    IndexEntry* entry = new_nt IndexEntry();
+    if (NULL == entry)
+        return memErrNotEnoughSpace;
+    entry->url = StringCopy2(url);
+    if (NULL == entry->url)
+    {
+        delete entry;
+        return memErrNotEnoughSpace;
+    }
 
 #ifdef DEBUG_URLS
-    assert('s' == *entry.url);
-#endif         
-    
-    DataStoreWriter writer(*dataStore);
-    
-    if (errNone != (err = writer.open(entry.streamName)))
+    assert('s' == *entry->url);
+#endif
+
+    if (errNone != (err = assignNewStream(*entry)))
+    {
+        if (NULL != entry->streamName)
+            releaseEntryStream(*entry);
+        delete entry;
         return err;
-        
-    index = indexEntriesCount_++;
+    }
+    linkEntry(entry, NULL);
+    insertUrl(entry);
+    logAppend(*entry);
+    index = indexEntriesCount_ - 1;
     return errNone;
 }
 
+status_t HistoryCache::assignNewStream(IndexEntry& entry)
+{
+    char streamName[DataStore::maxStreamNameLength + 1];
+	StrPrintF(streamName, "_History %lx%lx", ticks(), random(ULONG_MAX));
+    status_t err = setEntryStream(entry, streamName);
+    if (errNone != err)
+        return err;
+    entry.contentHash = 0;
+    entry.contentLength = 0;
+    DataStoreWriter writer(*dataStore);
+    return writer.open(streamName, false, true);
+}
+
+bool HistoryCache::streamsEqual(const char* streamName1, const char* streamName2)
+{
+    DataStoreReader reader1(*dataStore);
+    DataStoreReader reader2(*dataStore);
+    if (errNone != reader1.open(streamName1) || errNone != reader2.open(streamName2))
+        return false;
+    char buffer1[256];
+    char buffer2[256];
+    while (true)
+    {
+        ulong_t length1 = sizeof(buffer1);
+        ulong_t length2 = sizeof(buffer2);
+        if (errNone != reader1.readRaw(buffer1, length1) || errNone != reader2.readRaw(buffer2, length2))
+            return false;
+        if (length1 != length2 || 0 != memcmp(buffer1, buffer2, length1))
+            return false;
+        if (0 == length1)
+            return true;
+    }
+}
+
+// Hash only selects candidates, content is compared before entries are made to share the stream.
+// Entries of the older stream are moved to the new one, as the one just written may be still open.
+void HistoryCache::entryWritten(const char* streamName, ulong_t contentHash, ulong_t contentLength)
+{
+    Streams_t::iterator stream = streams_.find(streamName);
+    if (streams_.end() == stream)
+        return;
+    for (IndexEntry* entry = stream->second.entries; NULL != entry; entry = entry->nextInStream)
+    {
+        entry->contentHash = contentHash;
+        entry->contentLength = contentLength;
+        logUpdate(*entry);
+    }
+    updateStreamSize(streamName);
+    unhashStream(stream);
+    if (0 == contentLength)
+        return;
+
+    NarrowString duplicate;
+    std::pair<ContentHashes_t::iterator, ContentHashes_t::iterator> range = contentHashes_.equal_range(contentHash);
+    for (ContentHashes_t::iterator it = range.first; it != range.second; ++it)
+    {
+        Streams_t::iterator other = streams_.find(*it->second);
+        assert(streams_.end() != other);
+        if (contentLength == other->second.contentLength && streamsEqual(streamName, other->first.c_str()))
+        {
+            duplicate = other->first;
+            break;
+        }
+    }
+    hashStream(stream, contentHash, contentLength);
+    if (duplicate.empty())
+        return;
+    // Last entry moved away removes the duplicate (and its StreamInfo with it).
+    IndexEntry* entry = streams_[duplicate].entries;
+    while (NULL != entry)
+    {
+        IndexEntry* next = entry->nextInStream;
+        if (errNone == setEntryStream(*entry, streamName))
+            logUpdate(*entry);
+        entry = next;
+    }
+}
+
 status_t HistoryCache::appendLink(const char* url, const char_t* title)
 {
     assert(0 != Len(url));
@@ -282,41 +1080,29 @@ status_t HistoryCache::appendLink(const char* url, const char_t* title)
     status_t err = appendEntry(url, index);
     if (errNone != err)
         return err;
-    
-    setEntryTitle(index, title);
-    indexEntries_[index].onlyLink = true;
-
-#ifdef DEBUG_URLS
-    assert('s' == *indexEntries_[index].url);
-#endif         
 
+    setEntryTitle(index, title);
+    last_->onlyLink = true;
+    logUpdate(*last_);
     return errNone;
 }
 
 status_t HistoryCache::insertLink(ulong_t index, const char* url, const char_t* title)
 {
     assert(0 != Len(url));
-    
+
     status_t err = appendLink(url, title);
     if (errNone != err)
         return err;
-     
-    IndexEntry* tmp = new_nt IndexEntry();
-    if (NULL == tmp)
-        return memErrNotEnoughSpace;
-    
-    ulong_t count = indexEntriesCount_ - (index + 1);
-    memmove(tmp, indexEntries_ + (indexEntriesCount_ - 1), sizeof(IndexEntry));
-    memmove(indexEntries_ + (index + 1), indexEntries_ + index, count * sizeof(IndexEntry));
-    memmove(indexEntries_ + index, tmp, sizeof(IndexEntry));
-    
-    delete tmp;
-
-#ifdef DEBUG_URLS
-    assert('s' == *indexEntries_[index].url);
-#endif         
 
-    return errNone;    
+    if (index >= indexEntriesCount_ - 1)
+        return errNone;
+    IndexEntry* entry = last_;
+    IndexEntry* before = entryAt(index);
+    logMove(indexEntriesCount_ - 1, index);
+    unlinkEntry(entry);
+    linkEntry(entry, before);
+    return errNone;
 }
 
 
@@ -330,13 +1116,13 @@ status_t HistoryCache::replaceEntries(ulong_t from, const char* newEntryUrl)
 
 DataStoreReader* HistoryCache::readerForEntry(ulong_t index)
 {
-    assert(index < indexEntriesCount_);
-    assert(!indexEntries_[index].onlyLink);
-    
+    IndexEntry* entry = entryAt(index);
+    assert(!entry->onlyLink);
+
     DataStoreReader* reader = new_nt DataStoreReader(*dataStore);
     if (NULL == reader)
         return NULL;
-    status_t err = reader->open(indexEntries_[index].streamName);
+    status_t err = reader->open(entry->streamName);
     if (errNone != err)
     {
         delete reader;
@@ -344,21 +1130,30 @@ DataStoreReader* HistoryCache::readerForEntry(ulong_t index)
     }
 
 #ifdef DEBUG_URLS
-    assert('s' == *indexEntries_[index].url);
-#endif         
+    assert('s' == *entry->url);
+#endif
 
     return reader;
 }
 
 DataStoreWriter* HistoryCache::writerForEntry(ulong_t index)
 {
-    assert(index < indexEntriesCount_);
-    assert(!indexEntries_[index].onlyLink);
+    IndexEntry* entry = entryAt(index);
+    assert(!entry->onlyLink);
 
-    DataStoreWriter* writer = new_nt DataStoreWriter(*dataStore);
+    // Stream shared with other entries mustn't be overwritten.
+    if (1 != streamReferencesCount(entry->streamName))
+    {
+        if (errNone != assignNewStream(*entry))
+            return NULL;
+        logUpdate(*entry);
+    }
+
+    DataStoreWriter* writer = new_nt EntryWriter(*this, entry->streamName);
     if (NULL == writer)
         return NULL;
-    status_t err = writer->open(indexEntries_[index].streamName);
+    // Cached pages are verbose text, so they're kept compressed.
+    status_t err = writer->open(entry->streamName, false, true);
     if (errNone != err)
     {
         delete writer;
@@ -366,44 +1161,47 @@ DataStoreWriter* HistoryCache::writerForEntry(ulong_t index)
     }
 
 #ifdef DEBUG_URLS
-    assert('s' == *indexEntries_[index].url);
-#endif         
+    assert('s' == *entry->url);
+#endif
 
     return writer;
 }
 
 status_t HistoryCache::moveEntryToEnd(ulong_t& index)
-{   
-    assert(index < indexEntriesCount_);
-    if (index == indexEntriesCount_ - 1)
-        return errNone;
-        
-    // IndexEntry is quite big, so better not to use stack to allocate it.
-    IndexEntry* tmp = new_nt IndexEntry;
-    if (NULL == tmp)
-        return memErrNotEnoughSpace;
-    
-    memmove(tmp, indexEntries_ + index, sizeof(*tmp));
-    memmove(indexEntries_ + index, indexEntries_ + (index + 1), (indexEntriesCount_ - (index + 1)) * sizeof(*tmp));
-    memmove(indexEntries_ + (indexEntriesCount_ - 1), tmp, sizeof(*tmp));
-    
-    delete tmp;
-    
+{
+    IndexEntry* entry = entryAt(index);
+    if (entry != last_)
+    {
+        logMove(index, indexEntriesCount_ - 1);
+        unlinkEntry(entry);
+        linkEntry(entry, NULL);
+    }
     index = (indexEntriesCount_ - 1);
-
-#ifdef DEBUG_URLS
-    assert('s' == *indexEntries_[index].url);
-#endif         
-
     return errNone;
 }
 
+bool HistoryCache::moveEntryToEnd(const char* url)
+{
+    ++statistics_.lookups;
+    IndexEntry* entry = findEntry(url, Len(url));
+    if (NULL == entry)
+        return false;
+    ++statistics_.hits;
+    if (entry != last_)
+    {
+        logMoveUrlToEnd(*entry);
+        unlinkEntry(entry);
+        linkEntry(entry, NULL);
+    }
+    return true;
+}
+
 status_t HistoryCache::removeEntry(const char* url)
 {
-    ulong_t index = entryIndex(url);
-    if (entryNotFound == index)
+    IndexEntry* entry = findEntry(url, Len(url));
+    if (NULL == entry)
         return errNone;
-    return removeEntry(index);
+    return removeIndexEntry(entry, true);
 }
 
 
@@ -415,12 +1213,15 @@ static const char_t* unitTestCacheName = _T("UnitTest HistoryCache.dat");
 #ifdef _PALM_OS
 static const char_t* unitTestCacheName = _T("UnitTest HistoryCache");
 #endif
+#ifdef _POSIX
+static const char_t* unitTestCacheName = _T("UnitTest HistoryCache.dat");
+#endif
 static void test_HistoryCacheWrite()
 {
     HistoryCache cache;
     status_t err = cache.open(unitTestCacheName);
     assert(errNone == err);
-    
+
     assert(0 == cache.entriesCount());
     char buffer[33];
     ulong_t index;
@@ -431,7 +1232,7 @@ static void test_HistoryCacheWrite()
     }
     assert(HistoryCache::maxCacheEntries == cache.entriesCount());
     assert(0 == cache.entryIndex("test 1"));
-    
+
     cache.replaceEntries(0, "test 11");
     assert(0 == cache.entryIndex("test 11"));
 }
@@ -441,14 +1242,306 @@ static void test_HistoryCacheRead()
     HistoryCache cache;
     status_t err = cache.open(unitTestCacheName);
     assert(errNone == err);
-    
+
     assert(1 == cache.entriesCount());
     assert(0 == cache.entryIndex("test 11"));
     cache.removeEntry(0UL);
-    
+
     assert(0 == cache.entriesCount());
 }
 
+static void test_HistoryCacheWriteEntry(HistoryCache& cache, ulong_t index, const char* content)
+{
+    DataStoreWriter* writer = cache.writerForEntry(index);
+    assert(NULL != writer);
+    status_t err = writer->write(content);
+    assert(errNone == err);
+    delete writer;
+}
+
+static void test_HistoryCacheVerifyEntry(HistoryCache& cache, ulong_t index, const char* content)
+{
+    DataStoreReader* reader = cache.readerForEntry(index);
+    assert(NULL != reader);
+    char buffer[64];
+    ulong_t length = sizeof(buffer);
+    status_t err = reader->readRaw(buffer, length);
+    assert(errNone == err);
+    assert(equals(content, buffer, length));
+    delete reader;
+}
+
+// Same page reached through different urls is stored once and survives removal of either entry.
+void test_HistoryCacheDedup()
+{
+    HistoryCache cache;
+    status_t err = cache.open(unitTestCacheName);
+    assert(errNone == err);
+    err = cache.removeEntriesAfter(0);
+    assert(errNone == err);
+
+    ulong_t index;
+    const char* urls[] = {"dup 1", "other", "dup 2"};
+    const char* contents[] = {"same article", "other article", "same article"};
+    for (ulong_t i = 0; i < 3; ++i)
+    {
+        err = cache.appendEntry(urls[i], index);
+        assert(errNone == err);
+        test_HistoryCacheWriteEntry(cache, index, contents[i]);
+    }
+    assert(equals(cache.entryAt(0)->streamName, cache.entryAt(2)->streamName));
+    assert(!equals(cache.entryAt(0)->streamName, cache.entryAt(1)->streamName));
+
+    // Rewriting shared entry gives it its own stream again.
+    test_HistoryCacheWriteEntry(cache, 2, "changed article");
+    assert(!equals(cache.entryAt(0)->streamName, cache.entryAt(2)->streamName));
+    test_HistoryCacheVerifyEntry(cache, 0, "same article");
+    test_HistoryCacheVerifyEntry(cache, 2, "changed article");
+
+    test_HistoryCacheWriteEntry(cache, 2, "same article");
+    err = cache.removeEntry(0UL);
+    assert(errNone == err);
+    test_HistoryCacheVerifyEntry(cache, 1, "same article");
+
+    // Content hashes are known again after reopening.
+    cache.close();
+    err = cache.open(unitTestCacheName);
+    assert(errNone == err);
+    err = cache.appendEntry("dup 3", index);
+    assert(errNone == err);
+    test_HistoryCacheWriteEntry(cache, index, "same article");
+    assert(equals(cache.entryAt(1)->streamName, cache.entryAt(index)->streamName));
+    test_HistoryCacheVerifyEntry(cache, index, "same article");
+    err = cache.removeEntriesAfter(0);
+    assert(errNone == err);
+}
+
+// Fills cache of hundreds of entries with long urls, promotes some of them and checks that the oldest ones get evicted.
+static void test_HistoryCacheCapacity()
+{
+    enum {
+        capacity = 300,
+        appendsCount = 500
+    };
+    char url[400];
+    memset(url, 'x', sizeof(url));
+    ulong_t prefixLength = HistoryCache::maxCacheEntryUrlLength;
+    {
+        HistoryCache cache(capacity);
+        status_t err = cache.open(unitTestCacheName);
+        assert(errNone == err);
+        ulong_t index;
+        for (ulong_t i = 0; i < appendsCount; ++i)
+        {
+            StrPrintF(url + prefixLength, "%lu", i);
+            err = cache.appendEntry(url, index);
+            assert(errNone == err);
+            assert(cache.entriesCount() - 1 == index);
+        }
+        assert(capacity == cache.entriesCount());
+        StrPrintF(url + prefixLength, "%lu", ulong_t(appendsCount - capacity - 1));
+        assert(HistoryCache::entryNotFound == cache.entryIndex(url));
+        StrPrintF(url + prefixLength, "%lu", ulong_t(appendsCount - capacity));
+        assert(0 == cache.entryIndex(url));
+        assert(equals(url, cache.entryUrl(0)));
+
+        // Promoted entry is evicted last.
+        index = 0;
+        err = cache.moveEntryToEnd(index);
+        assert(errNone == err);
+        assert(capacity - 1 == index);
+        assert(capacity - 1 == cache.entryIndex(url));
+        StrPrintF(url + prefixLength, "%lu", ulong_t(appendsCount));
+        err = cache.appendEntry(url, index);
+        assert(errNone == err);
+        StrPrintF(url + prefixLength, "%lu", ulong_t(appendsCount - capacity));
+        assert(capacity - 2 == cache.entryIndex(url));
+        StrPrintF(url + prefixLength, "%lu", ulong_t(appendsCount - capacity + 1));
+        assert(HistoryCache::entryNotFound == cache.entryIndex(url));
+        StrPrintF(url + prefixLength, "%lu", ulong_t(appendsCount - capacity + 2));
+        assert(0 == cache.entryIndex(url));
+
+        // Renamed entry is found only under its new url.
+        err = cache.setEntryUrl(0, "renamed");
+        assert(errNone == err);
+        assert(0 == cache.entryIndex("renamed"));
+        assert(HistoryCache::entryNotFound == cache.entryIndex(url));
+        err = cache.setEntryUrl(0, url);
+        assert(errNone == err);
+        assert(0 == cache.entryIndex(url));
+    }
+    HistoryCache cache(capacity);
+    status_t err = cache.open(unitTestCacheName);
+    assert(errNone == err);
+    assert(capacity == cache.entriesCount());
+    StrPrintF(url + prefixLength, "%lu", ulong_t(appendsCount - capacity));
+    assert(capacity - 2 == cache.entryIndex(url));
+    err = cache.setCapacity(10);
+    assert(errNone == err);
+    assert(10 == cache.entriesCount());
+    assert(8 == cache.entryIndex(url));
+    err = cache.removeEntriesAfter(0);
+    assert(errNone == err);
+}
+
+// Appends entry with length bytes of content that doesn't compress, so that its size in the store is close to length.
+static void test_HistoryCacheAppendPage(HistoryCache& cache, ulong_t number, ulong_t length)
+{
+    char url[32];
+    StrPrintF(url, "page %lu", number);
+    ulong_t index;
+    status_t err = cache.appendEntry(url, index);
+    assert(errNone == err);
+    DataStoreWriter* writer = cache.writerForEntry(index);
+    assert(NULL != writer);
+    ulong_t seed = number + 1;
+    for (ulong_t i = 0; i < length; ++i)
+    {
+        seed = seed * 1103515245UL + 12345UL;
+        char chr = char(seed >> 16);
+        err = writer->writeRaw(&chr, 1);
+        assert(errNone == err);
+    }
+    delete writer;
+}
+
+static void test_HistoryCacheByteBudget()
+{
+    HistoryCache cache(100);
+    status_t err = cache.open(unitTestCacheName);
+    assert(errNone == err);
+    err = cache.removeEntriesAfter(0);
+    assert(errNone == err);
+    assert(0 == cache.bytesUsed());
+    cache.resetStatistics();
+
+    for (ulong_t i = 0; i < 10; ++i)
+        test_HistoryCacheAppendPage(cache, i, 2000);
+    assert(10 * 2000 <= cache.bytesUsed());
+    ulong_t used = cache.bytesUsed();
+
+    // Least recently used entries go first, regardless of their size.
+    err = cache.setByteBudget(used / 2);
+    assert(errNone == err);
+    assert(cache.bytesUsed() <= used / 2);
+    assert(5 == cache.entriesCount());
+    assert(5 == cache.statistics().entriesEvicted);
+    assert(used - cache.bytesUsed() == cache.statistics().bytesEvicted);
+    assert(0 == cache.entryIndex("page 5"));
+    assert(HistoryCache::entryNotFound == cache.entryIndex("page 4"));
+    assert(50 == cache.hitRate());
+
+    // Large old page is evicted instead of the oldest small ones.
+    err = cache.setByteBudget(0);
+    assert(errNone == err);
+    err = cache.removeEntriesAfter(0);
+    assert(errNone == err);
+    test_HistoryCacheAppendPage(cache, 0, 1000);
+    test_HistoryCacheAppendPage(cache, 1, 20000);
+    for (ulong_t i = 2; i < 6; ++i)
+        test_HistoryCacheAppendPage(cache, i, 1000);
+    cache.setEvictionPolicy(HistoryCache::evictLargestOldest);
+    err = cache.setByteBudget(cache.bytesUsed() - 1);
+    assert(errNone == err);
+    assert(5 == cache.entriesCount());
+    assert(HistoryCache::entryNotFound == cache.entryIndex("page 1"));
+    assert(0 == cache.entryIndex("page 0"));
+
+    // Page written over budget is accounted for when next entry is appended.
+    ulong_t budget = cache.bytesUsed();
+    err = cache.setByteBudget(budget);
+    assert(errNone == err);
+    test_HistoryCacheAppendPage(cache, 6, 3000);
+    assert(cache.bytesUsed() > budget);
+    test_HistoryCacheAppendPage(cache, 7, 0);
+    assert(cache.bytesUsed() <= budget);
+    assert(0 != cache.entryIndex("page 6"));
+
+    err = cache.removeEntriesAfter(0);
+    assert(errNone == err);
+}
+
+static void test_HistoryCacheVerifyOrder(HistoryCache& cache, const char* const* urls, ulong_t count)
+{
+    assert(count == cache.entriesCount());
+    for (ulong_t i = 0; i < count; ++i)
+        assert(equals(urls[i], cache.entryUrl(i)));
+}
+
+// Changes are appended to the log and replayed, until log grows long enough to be checkpointed.
+void test_HistoryCacheIndexLog()
+{
+    {
+        HistoryCache cache;
+        status_t err = cache.open(unitTestCacheName);
+        assert(errNone == err);
+        err = cache.removeEntriesAfter(0);
+        assert(errNone == err);
+        ulong_t index;
+        err = cache.appendEntry("log 1", index);
+        assert(errNone == err);
+        err = cache.writeIndex();
+        assert(errNone == err);
+    }
+    {
+        HistoryCache cache;
+        status_t err = cache.open(unitTestCacheName);
+        assert(errNone == err);
+        assert(cache.logValid_);
+        assert(0 == cache.logRecordsCount_);
+        ulong_t index;
+        err = cache.appendEntry("log 2", index);
+        assert(errNone == err);
+        err = cache.appendLink("log 3", _T("Link"));
+        assert(errNone == err);
+        err = cache.insertLink(1, "log 4", _T("Inserted"));
+        assert(errNone == err);
+        cache.setEntryTitle(0, _T("First"));
+        index = 0;
+        err = cache.moveEntryToEnd(index);
+        assert(errNone == err);
+        err = cache.removeEntry("log 2");
+        assert(errNone == err);
+        err = cache.setEntryUrl(0, "log 0");
+        assert(errNone == err);
+        err = cache.setEntryUrl(0, "log 4");
+        assert(errNone == err);
+        assert(0 == cache.entryIndex("log 4"));
+        assert(HistoryCache::entryNotFound == cache.entryIndex("log 0"));
+        // Promotions by url are logged by url and leave the order as it was.
+        assert(cache.moveEntryToEnd("log 3"));
+        assert(cache.moveEntryToEnd("log 1"));
+        assert(!cache.moveEntryToEnd("log 2"));
+        test_HistoryCacheWriteEntry(cache, 2, "logged");
+    }
+    const char* urls[] = {"log 4", "log 3", "log 1"};
+    {
+        HistoryCache cache;
+        status_t err = cache.open(unitTestCacheName);
+        assert(errNone == err);
+        assert(0 != cache.logRecordsCount_);
+        test_HistoryCacheVerifyOrder(cache, urls, 3);
+        assert(equals(_T("Inserted"), cache.entryTitle(0)));
+        assert(cache.entryIsOnlyLink(0));
+        assert(equals(_T("Link"), cache.entryTitle(1)));
+        assert(equals(_T("First"), cache.entryTitle(2)));
+        assert(!cache.entryIsOnlyLink(2));
+        test_HistoryCacheVerifyEntry(cache, 2, "logged");
+        assert(0 != cache.entryAt(2)->contentLength);
+
+        for (ulong_t i = 0; i < 40; ++i)
+            cache.setEntryTitle(1, _T("Renamed"));
+    }
+    HistoryCache cache;
+    status_t err = cache.open(unitTestCacheName);
+    assert(errNone == err);
+    assert(0 == cache.logRecordsCount_);
+    test_HistoryCacheVerifyOrder(cache, urls, 3);
+    assert(equals(_T("Renamed"), cache.entryTitle(1)));
+    err = cache.removeEntriesAfter(0);
+    assert(errNone == err);
+}
+
 void test_HistoryCache()
 {
 #ifndef DEBUG_URLS
@@ -456,7 +1549,11 @@ void test_HistoryCache()
     test_HistoryCacheRead();
     test_HistoryCacheWrite();
     test_HistoryCacheRead();
+    test_HistoryCacheDedup();
+    test_HistoryCacheCapacity();
+    test_HistoryCacheByteBudget();
+    test_HistoryCacheIndexLog();
 #endif
-}   
+}
 
 #endif
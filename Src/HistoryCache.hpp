@@ -3,6 +3,8 @@
 
 #include <DataStore.hpp>
 #include <Utility.hpp>
+#include <vector>
+#include <map>
 
 class Serializer;
 
@@ -11,33 +13,145 @@ class HistoryCache: private NonCopyable
 public:
 
     enum {
+        //! Default capacity, see setCapacity().
         maxCacheEntries = 10, 
+        // Strings are no longer truncated, these are kept for code which sized its buffers after them.
         maxCacheEntryUrlLength = 255,
         maxCacheEntryTitleLength = 63
     };
     
+    enum EvictionPolicy {
+        //! Oldest entry is evicted first.
+        evictLeastRecentlyUsed,
+        //! Entry with the highest product of bytes its removal frees and its age (position counted from the newest entry) is evicted first.
+        evictLargestOldest
+    };
+    
+    struct Statistics 
+    {
+        //! Calls to entryIndex() and moveEntryToEnd(url), and how many of them found the entry.
+        ulong_t lookups;
+        ulong_t hits;
+        ulong_t entriesEvicted;
+        ulong_t bytesEvicted;
+        
+        Statistics(): lookups(0), hits(0), entriesEvicted(0), bytesEvicted(0) {}
+    };
+    
 private:
     
-    typedef char CacheEntryUrlBuffer_t[maxCacheEntryUrlLength + 1];
-    typedef char_t CacheEntryTitleBuffer_t[maxCacheEntryTitleLength + 1];
-    typedef char StreamNameBuffer_t[DataStore::maxStreamNameLength + 1];
-
+    /**
+     * Entries form intrusive doubly-linked list in their order (which is also the order of recency, oldest first),
+     * and are chained through nextInBucket in hash table keyed by url.
+     */
     struct IndexEntry 
     {
-        CacheEntryUrlBuffer_t url;
-        StreamNameBuffer_t streamName;
-        CacheEntryTitleBuffer_t title;
+        char* url;
+        char* streamName;
+        char_t* title;
         bool onlyLink;
         
+        //! Hash and length of what was written to the stream, contentLength 0 if it's not known.
+        ulong_t contentHash;
+        ulong_t contentLength;
+        
+        IndexEntry* prev;
+        IndexEntry* next;
+        IndexEntry* nextInBucket;
+        //! Next entry sharing the stream, see StreamInfo::entries.
+        IndexEntry* nextInStream;
+        
         IndexEntry();
+        
+        ~IndexEntry();
     };
     
-    IndexEntry* indexEntries_;    
+    IndexEntry* first_;
+    IndexEntry* last_;
     ulong_t indexEntriesCount_;
-    ulong_t indexCapacity_;
+    ulong_t capacity_;
+    
+    typedef std::vector<IndexEntry*> Buckets_t;
+    Buckets_t buckets_;
+    
+    //! Recently accessed position, so that walking the list to given index is short for the usual back/forward access.
+    mutable IndexEntry* cursor_;
+    mutable ulong_t cursorIndex_;
+    
+    IndexEntry* entryAt(ulong_t index) const;
+    
+    ulong_t indexOf(const IndexEntry* entry) const;
+    
+    //! Latest entry with url, found without resolving its index unless the url is present more than once.
+    IndexEntry* findEntry(const char* url, ulong_t length) const;
+    
+    void linkEntry(IndexEntry* entry, IndexEntry* before);
+    
+    void unlinkEntry(IndexEntry* entry);
+    
+    void insertUrl(IndexEntry* entry);
+    
+    void eraseUrl(IndexEntry* entry);
+    
+    void rehashUrls(ulong_t bucketsCount);
+    
+    void clearEntries();
+    
+    struct StreamInfo 
+    {
+        //! Number of entries sharing the stream; entries with identical content share one stream, which is removed together with its last entry.
+        ulong_t references;
+        //! Bytes stream occupies in DataStore, as of the last time it was written.
+        ulong_t size;
+        //! Entries referencing the stream, chained through IndexEntry::nextInStream.
+        IndexEntry* entries;
+        //! Hash and length of stream's content, under which it's registered in contentHashes_ (contentLength 0 if it isn't).
+        ulong_t contentHash;
+        ulong_t contentLength;
+        
+        StreamInfo(): references(0), size(0), entries(NULL), contentHash(0), contentLength(0) {}
+    };
+    
+    typedef std::map<NarrowString, StreamInfo> Streams_t;
+    Streams_t streams_;
+    
+    //! Streams (their names, which are keys of streams_) by hash of their content, so that written entry finds its duplicates at once.
+    typedef std::multimap<ulong_t, const NarrowString*> ContentHashes_t;
+    ContentHashes_t contentHashes_;
+    
+    void hashStream(Streams_t::iterator stream, ulong_t contentHash, ulong_t contentLength);
+    
+    void unhashStream(Streams_t::iterator stream);
+    
+    //! Links entry to the stream it names.
+    void referenceStream(IndexEntry& entry);
+    
+    //! Sum of sizes of all streams.
+    ulong_t bytesUsed_;
+    
+    ulong_t streamReferencesCount(const char* streamName) const;
+    
+    void updateStreamSize(const char* streamName);
+    
+    status_t setEntryStream(IndexEntry& entry, const char* streamName);
+    
+    //! @return number of entries still referencing the stream entry used.
+    ulong_t releaseEntryStream(IndexEntry& entry);
     
     bool dataStoreOwner_;
     
+    ulong_t byteBudget_;
+    EvictionPolicy evictionPolicy_;
+    mutable Statistics statistics_;
+    
+    //! Entry returned by findEntry() is logged by its url, which doesn't need its index.
+    status_t removeIndexEntry(IndexEntry* entry, bool foundByUrl = false);
+    
+    IndexEntry* evictionCandidate() const;
+    
+    //! Removes entries until there's room for reserve more entries and bytes used fit into budget.
+    status_t evict(ulong_t reserve);
+    
     status_t readIndex();
     
     status_t writeIndex();
@@ -46,19 +160,98 @@ private:
     
     status_t serializeIndexOut(Serializer& serialize);
     
+    /**
+     * Changes made since the index was written are recorded in a log of small records replayed on top of it when it's read.
+     * Index is rewritten (checkpointed) only when the log grows longer than the index itself, 
+     * and log belongs to the index only if their generations match, so that checkpoint is atomic.
+     */
+    ulong_t logGeneration_;
+    
+    //! Log stream of the current generation exists, so that records may be appended to it.
+    bool logValid_;
+    
+    //! Records appended to the log or pending in pendingLog_.
+    ulong_t logRecordsCount_;
+    
+    //! Records not yet written to the log stream.
+    NarrowString pendingLog_;
+    
+    void logAppend(const IndexEntry& entry);
+    
+    void logRemove(const IndexEntry& entry);
+    
+    void logRemoveUrl(const IndexEntry& entry);
+    
+    void logMoveUrlToEnd(const IndexEntry& entry);
+    
+    void logMove(ulong_t from, ulong_t to);
+    
+    void logUpdate(const IndexEntry& entry);
+    
+    status_t readLog();
+    
+    status_t replayLog(const char* log, ulong_t length);
+    
+    status_t writeLog();
+    
+    //! Appends pending records to the log or makes a checkpoint.
+    status_t flushIndex();
+    
+    status_t assignNewStream(IndexEntry& entry);
+    
+    bool streamsEqual(const char* streamName1, const char* streamName2);
+    
+    void entryWritten(const char* streamName, ulong_t contentHash, ulong_t contentLength);
+    
+    class EntryWriter;
+    friend class EntryWriter;
+    
+#ifndef NDEBUG
+    friend void test_HistoryCacheDedup();
+    friend void test_HistoryCacheIndexLog();
+#endif
+    
 public:
     
     DataStore* dataStore;
 
-    HistoryCache();
+    explicit HistoryCache(ulong_t capacity = maxCacheEntries);
     
     ~HistoryCache();
+    
 
     status_t open(DataStore& ds);
     status_t open(const char_t* dataStoreName);
     
     ulong_t entriesCount() const {return indexEntriesCount_;}
     
+    ulong_t capacity() const {return capacity_;}
+    
+    //! Removes oldest entries if there's more than capacity of them.
+    status_t setCapacity(ulong_t capacity);
+    
+    ulong_t byteBudget() const {return byteBudget_;}
+    
+    /**
+     * Limits number of bytes cached pages may occupy in DataStore, 0 meaning there's no limit.
+     * Entry's size is known only after it's written, so budget is enforced by removing entries as new ones are appended 
+     * (and by this call), which keeps indices held by caller valid in between.
+     */
+    status_t setByteBudget(ulong_t bytes);
+    
+    ulong_t bytesUsed() const {return bytesUsed_;}
+    
+    EvictionPolicy evictionPolicy() const {return evictionPolicy_;}
+    
+    void setEvictionPolicy(EvictionPolicy policy) {evictionPolicy_ = policy;}
+    
+    const Statistics& statistics() const {return statistics_;}
+    
+    void resetStatistics() {statistics_ = Statistics();}
+    
+    //! @return percentage of lookups that found the entry.
+    uint_t hitRate() const;
+    
     enum {entryNotFound = ulong_t(-1)};
     
     ulong_t entryIndex(const char* entry) const;
@@ -71,12 +264,16 @@ public:
     
     void setEntryTitle(ulong_t index, const char_t* title);
     
+    //! Entries are hashed by url, so it mustn't be modified in place.
+    status_t setEntryUrl(ulong_t index, const char* url);
+    
     status_t removeEntry(ulong_t index);
     
     status_t removeEntry(const char* url);
     
     status_t removeEntriesAfter(ulong_t startIndex);
     
+    //! Evicts entries according to eviction policy if cache is full or over its byte budget.
     status_t appendEntry(const char* url, ulong_t& index);
     
     status_t insertLink(ulong_t index, const char* url, const char_t* title);
@@ -87,13 +284,18 @@ public:
     
     DataStoreReader* readerForEntry(ulong_t index);
     
+    //! Content is hashed while it's written. When returned writer is deleted, entry is made to share the stream of another entry 
+    //! with the same content, if there's such. So writer mustn't outlive the cache.
     DataStoreWriter* writerForEntry(ulong_t index);
     
     void close();
     
-    // Moves the entry to be the last in the cache. 
+    // Moves the entry to be the last in the cache, so that it's evicted last. 
     // On succesful return index is updated to new value.
     status_t moveEntryToEnd(ulong_t& index);
+    
+    //! Same as moveEntryToEnd(entryIndex(url)), but takes constant time. @return false if there's no entry with url.
+    bool moveEntryToEnd(const char* url);
    
 };
 
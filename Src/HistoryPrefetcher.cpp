@@ -0,0 +1,416 @@
+#include <HistoryPrefetcher.hpp>
+#include <HistoryCache.hpp>
+#include <DefinitionElement.hpp>
+#include <SocketConnection.hpp>
+#include <Text.hpp>
+#include <algorithm>
+
+HistoryPrefetcher::HistoryPrefetcher(SocketConnectionManager& manager):
+    manager_(manager),
+    cacheName_(NULL),
+    connection_(NULL),
+    bytesFetched_(0),
+#ifdef INFOMAN
+    hyperlinkType(hyperlinkUrl),
+#else
+    hyperlinkType(hyperlinkTerm),
+#endif
+    maxPagesCount(3),
+    byteBudget(64 * 1024),
+    cacheCapacity(20),
+    cacheByteBudget(256 * 1024),
+    historyCacheName(NULL)
+{
+}
+
+HistoryPrefetcher::~HistoryPrefetcher()
+{
+    cancel();
+    free(cacheName_);
+}
+
+status_t HistoryPrefetcher::setCacheName(const char_t* cacheName)
+{
+    char_t* name = StringCopy2(cacheName);
+    if (NULL == name)
+        return memErrNotEnoughSpace;
+    free(cacheName_);
+    cacheName_ = name;
+    return errNone;
+}
+
+status_t HistoryPrefetcher::prefetchShownHyperlinks(const Definition& definition)
+{
+    Urls_t urls;
+    Definition::const_iterator it, end;
+    definition.shownElements(it, end);
+    for (; it != end; ++it)
+    {
+        const DefinitionElement::HyperlinkProperties* hyperlink = (*it)->hyperlinkProperties();
+        if (NULL == hyperlink || hyperlinkType != hyperlink->type || 0 == hyperlink->resourceLength)
+            continue;
+        urls.push_back(NarrowString(hyperlink->resource, hyperlink->resourceLength));
+    }
+    return prefetchUrls(urls);
+}
+
+status_t HistoryPrefetcher::prefetchUrls(const Urls_t& urls)
+{
+    assert(NULL != cacheName_);
+    cancel();
+
+    // Caches that can't be opened are treated as empty.
+    HistoryCache cache(cacheCapacity);
+    bool cacheOpen = (errNone == cache.open(cacheName_));
+    HistoryCache history;
+    bool historyOpen = (NULL != historyCacheName && errNone == history.open(historyCacheName));
+
+    Urls_t::const_iterator end = urls.end();
+    for (Urls_t::const_iterator url = urls.begin(); url != end && pendingUrls_.size() < maxPagesCount; ++url)
+    {
+        // Hyperlink text is often split into several elements, which share the target.
+        if (pendingUrls_.end() != std::find(pendingUrls_.begin(), pendingUrls_.end(), *url))
+            continue;
+        if (cacheOpen && HistoryCache::entryNotFound != cache.entryIndex(url->c_str()))
+            continue;
+        if (historyOpen && HistoryCache::entryNotFound != history.entryIndex(url->c_str()))
+            continue;
+        pendingUrls_.push_back(*url);
+    }
+    return errNone;
+}
+
+void HistoryPrefetcher::cancel()
+{
+    pendingUrls_.clear();
+    bytesFetched_ = 0;
+    if (NULL == connection_)
+        return;
+    // Connection reports its abort back, which must be ignored.
+    SocketConnection* connection = connection_;
+    connection_ = NULL;
+    manager_.abortConnection(*connection);
+}
+
+status_t HistoryPrefetcher::idle()
+{
+    if (NULL != connection_ || pendingUrls_.empty() || manager_.active())
+        return errNone;
+    if (0 != byteBudget && bytesFetched_ >= byteBudget)
+    {
+        pendingUrls_.clear();
+        return errNone;
+    }
+
+    SocketConnection* connection = NULL;
+    status_t err = createConnection(manager_, pendingUrls_.front().c_str(), connection);
+    if (errNone != err)
+    {
+        pendingUrls_.erase(pendingUrls_.begin());
+        return err;
+    }
+    assert(NULL != connection);
+    connection_ = connection;
+    err = connection->enqueue();
+    if (errNone != err)
+    {
+        connection_ = NULL;
+        delete connection;
+        pendingUrls_.erase(pendingUrls_.begin());
+    }
+    return err;
+}
+
+status_t HistoryPrefetcher::fetchSucceeded(SocketConnection& connection, const void* data, ulong_t length, const char_t* title)
+{
+    if (&connection != connection_)
+        return errNone;
+    connection_ = NULL;
+    NarrowString url;
+    url.swap(pendingUrls_.front());
+    pendingUrls_.erase(pendingUrls_.begin());
+    bytesFetched_ += length;
+
+    HistoryCache cache(cacheCapacity);
+    status_t err = cache.open(cacheName_);
+    if (errNone != err)
+        return err;
+    if (errNone != (err = cache.setByteBudget(cacheByteBudget)))
+        return err;
+    // Page fetched again replaces its old copy.
+    if (errNone != (err = cache.removeEntry(url.c_str())))
+        return err;
+    ulong_t index;
+    if (errNone != (err = cache.appendEntry(url.c_str(), index)))
+        return err;
+    if (NULL != title)
+        cache.setEntryTitle(index, title);
+
+    DataStoreWriter* writer = cache.writerForEntry(index);
+    if (NULL == writer)
+        err = memErrNotEnoughSpace;
+    else
+    {
+        err = writer->writeRaw(data, length);
+        if (errNone == err)
+            err = writer->flush();
+        delete writer;
+    }
+    if (errNone != err)
+        cache.removeEntry(index);
+    return err;
+}
+
+void HistoryPrefetcher::fetchFailed(SocketConnection& connection)
+{
+    if (&connection != connection_)
+        return;
+    connection_ = NULL;
+    pendingUrls_.erase(pendingUrls_.begin());
+}
+
+bool HistoryPrefetcher::readPrefetched(const char* url, HistorySupport::CacheReadHandler_t handler)
+{
+    if (NULL == cacheName_)
+        return false;
+    HistoryCache cache(cacheCapacity);
+    if (errNone != cache.open(cacheName_))
+        return false;
+    // Page that was read is evicted last.
+    if (!cache.moveEntryToEnd(url))
+        return false;
+    return handler(cache, url);
+}
+
+bool HistoryPrefetcher::movePrefetched(const char* url, HistoryCache& history, ulong_t& index)
+{
+    if (NULL == cacheName_)
+        return false;
+    HistoryCache cache(cacheCapacity);
+    if (errNone != cache.open(cacheName_))
+        return false;
+    ulong_t prefetchedIndex = cache.entryIndex(url);
+    if (HistoryCache::entryNotFound == prefetchedIndex)
+        return false;
+    status_t err = history.appendEntry(url, index);
+    if (errNone != err)
+        return false;
+    const char_t* title = cache.entryTitle(prefetchedIndex);
+    if (NULL != title)
+        history.setEntryTitle(index, title);
+
+    DataStoreReader* reader = cache.readerForEntry(prefetchedIndex);
+    DataStoreWriter* writer = history.writerForEntry(index);
+    if (NULL == reader || NULL == writer)
+        err = memErrNotEnoughSpace;
+    while (errNone == err)
+    {
+        const void* data;
+        ulong_t length = ulong_t(-1);
+        if (errNone != (err = reader->readView(data, length)) || 0 == length)
+            break;
+        err = writer->writeRaw(data, length);
+    }
+    if (errNone == err)
+        err = writer->flush();
+    delete writer;
+    delete reader;
+    if (errNone != err)
+    {
+        history.removeEntry(index);
+        return false;
+    }
+    // Page lives on in history, which isn't prefetched again.
+    cache.removeEntry(prefetchedIndex);
+    return true;
+}
+
+#ifndef NDEBUG
+
+#ifdef _WIN32
+static const char_t* unitTestPrefetchCacheName = _T("UnitTest PrefetchCache.dat");
+static const char_t* unitTestPrefetchHistoryName = _T("UnitTest PrefetchHistory.dat");
+#endif
+#ifdef _PALM_OS
+static const char_t* unitTestPrefetchCacheName = _T("UnitTest PrefetchCache");
+static const char_t* unitTestPrefetchHistoryName = _T("UnitTest PrefetchHistory");
+#endif
+#ifdef _POSIX
+static const char_t* unitTestPrefetchCacheName = _T("UnitTest PrefetchCache.dat");
+static const char_t* unitTestPrefetchHistoryName = _T("UnitTest PrefetchHistory.dat");
+#endif
+
+static const char unitTestPrefetchPage[] = "page";
+
+// Connection that is never opened, test completes fetches itself.
+class TestPrefetchConnection: public SocketConnection
+{
+    HistoryPrefetcher& prefetcher_;
+    ulong_t& abortsCount_;
+
+protected:
+
+    void abortConnection()
+    {
+        ++abortsCount_;
+        prefetcher_.fetchFailed(*this);
+        SocketConnection::abortConnection();
+    }
+
+public:
+
+    TestPrefetchConnection(SocketConnectionManager& manager, HistoryPrefetcher& prefetcher, ulong_t& abortsCount):
+        SocketConnection(manager),
+        prefetcher_(prefetcher),
+        abortsCount_(abortsCount)
+    {}
+
+};
+
+class TestPrefetcher: public HistoryPrefetcher
+{
+protected:
+
+    status_t createConnection(SocketConnectionManager& manager, const char* url, SocketConnection*& connection)
+    {
+        connection = new_nt TestPrefetchConnection(manager, *this, abortsCount);
+        if (NULL == connection)
+            return memErrNotEnoughSpace;
+        lastConnection = connection;
+        lastUrl = url;
+        ++connectionsCount;
+        return errNone;
+    }
+
+public:
+
+    SocketConnection* lastConnection;
+    NarrowString lastUrl;
+    ulong_t connectionsCount;
+    ulong_t abortsCount;
+
+    explicit TestPrefetcher(SocketConnectionManager& manager):
+        HistoryPrefetcher(manager),
+        lastConnection(NULL),
+        connectionsCount(0),
+        abortsCount(0)
+    {}
+
+};
+
+static bool test_HistoryPrefetcherRead(HistoryCache& cache, const char* url)
+{
+    ulong_t index = cache.entryIndex(url);
+    assert(HistoryCache::entryNotFound != index);
+    DataStoreReader* reader = cache.readerForEntry(index);
+    assert(NULL != reader);
+    char buffer[32];
+    ulong_t length = sizeof(buffer);
+    status_t err = reader->readRaw(buffer, length);
+    delete reader;
+    assert(errNone == err);
+    return sizeof(unitTestPrefetchPage) == length && 0 == memcmp(unitTestPrefetchPage, buffer, length);
+}
+
+// Starts fetching next page and completes it like connection would.
+static void test_HistoryPrefetcherFetch(SocketConnectionManager& manager, TestPrefetcher& prefetcher, const char* url)
+{
+    ulong_t count = prefetcher.connectionsCount;
+    status_t err = prefetcher.idle();
+    assert(errNone == err);
+    assert(count + 1 == prefetcher.connectionsCount);
+    assert(url == prefetcher.lastUrl);
+    // Only one page is fetched at a time.
+    err = prefetcher.idle();
+    assert(errNone == err);
+    assert(count + 1 == prefetcher.connectionsCount);
+    err = prefetcher.fetchSucceeded(*prefetcher.lastConnection, unitTestPrefetchPage, sizeof(unitTestPrefetchPage), _T("Title"));
+    assert(errNone == err);
+    // Abort reported by finished connection is ignored.
+    manager.abortConnection(*prefetcher.lastConnection);
+    assert(!manager.active());
+}
+
+/**
+ * Checks that pages already present in either cache aren't fetched, that per-definition page count and byte budget
+ * are kept, and that cancel() aborts the page being fetched.
+ */
+void test_HistoryPrefetcher()
+{
+    {
+        HistoryCache cache;
+        status_t err = cache.open(unitTestPrefetchCacheName);
+        assert(errNone == err);
+        err = cache.removeEntriesAfter(0);
+        assert(errNone == err);
+        err = cache.appendLink("cached", _T("Cached"));
+        assert(errNone == err);
+    }
+    {
+        HistoryCache history;
+        status_t err = history.open(unitTestPrefetchHistoryName);
+        assert(errNone == err);
+        err = history.removeEntriesAfter(0);
+        assert(errNone == err);
+        err = history.appendLink("in history", _T("History"));
+        assert(errNone == err);
+    }
+
+    SocketConnectionManager manager;
+    TestPrefetcher prefetcher(manager);
+    status_t err = prefetcher.setCacheName(unitTestPrefetchCacheName);
+    assert(errNone == err);
+    prefetcher.historyCacheName = unitTestPrefetchHistoryName;
+    prefetcher.maxPagesCount = 3;
+    prefetcher.byteBudget = sizeof(unitTestPrefetchPage) + 1;
+
+    const char* urls[] = {"cached", "a", "in history", "a", "b", "c", "d"};
+    HistoryPrefetcher::Urls_t shown(urls, urls + sizeof(urls) / sizeof(urls[0]));
+    err = prefetcher.prefetchUrls(shown);
+    assert(errNone == err);
+    assert(3 == prefetcher.pendingUrls_.size());
+    assert("a" == prefetcher.pendingUrls_[0] && "b" == prefetcher.pendingUrls_[1] && "c" == prefetcher.pendingUrls_[2]);
+
+    test_HistoryPrefetcherFetch(manager, prefetcher, "a");
+    assert(prefetcher.readPrefetched("a", test_HistoryPrefetcherRead));
+    assert(!prefetcher.readPrefetched("b", test_HistoryPrefetcherRead));
+
+    // Second page exceeds byte budget, so the third one isn't fetched.
+    test_HistoryPrefetcherFetch(manager, prefetcher, "b");
+    assert(prefetcher.active());
+    err = prefetcher.idle();
+    assert(errNone == err);
+    assert(2 == prefetcher.connectionsCount);
+    assert(!prefetcher.active());
+
+    // Pages fetched before aren't fetched again, cancel() aborts the one being fetched.
+    err = prefetcher.prefetchUrls(shown);
+    assert(errNone == err);
+    assert(2 == prefetcher.pendingUrls_.size());
+    err = prefetcher.idle();
+    assert(errNone == err);
+    assert("c" == prefetcher.lastUrl);
+    assert(manager.active());
+    // Abort reported back by the connection is ignored.
+    ulong_t abortsCount = prefetcher.abortsCount;
+    prefetcher.cancel();
+    assert(abortsCount + 1 == prefetcher.abortsCount);
+    assert(!manager.active());
+    assert(!prefetcher.active());
+    assert(!prefetcher.readPrefetched("c", test_HistoryPrefetcherRead));
+
+    // Prefetched page that is followed becomes regular history entry.
+    HistoryCache history;
+    err = history.open(unitTestPrefetchHistoryName);
+    assert(errNone == err);
+    ulong_t index;
+    assert(prefetcher.movePrefetched("a", history, index));
+    assert(history.entriesCount() - 1 == index);
+    assert(!history.entryIsOnlyLink(index));
+    assert(0 == tstrcmp(_T("Title"), history.entryTitle(index)));
+    assert(test_HistoryPrefetcherRead(history, "a"));
+    assert(!prefetcher.readPrefetched("a", test_HistoryPrefetcherRead));
+    assert(!prefetcher.movePrefetched("c", history, index));
+}
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef ARSLEXIS_HISTORY_PREFETCHER_HPP__
+#define ARSLEXIS_HISTORY_PREFETCHER_HPP__
+
+#include <Definition.hpp>
+#include <HistorySupport.hpp>
+#include <vector>
+
+class SocketConnection;
+class SocketConnectionManager;
+
+/**
+ * Fetches pages that hyperlinks shown in a definition point to while user reads it, so that following them is a local load.
+ * Pages are kept in a HistoryCache of their own (which evicts them according to its capacity and byte budget), so that
+ * back/forward history isn't affected; the same CacheReadHandler_t that reads history entries reads them (see readPrefetched()
+ * and HistorySupport::prefetcher).
+ * Fetching is done one page at a time and only when no other connection is active, so it should be driven from idle events.
+ * Protocol is application-specific: subclass creates connection for given url in createConnection(), and the connection
+ * reports back with exactly one call to fetchSucceeded() or fetchFailed() (from its finish, error and abort handlers).
+ */
+class HistoryPrefetcher: private NonCopyable
+{
+public:
+
+    typedef std::vector<NarrowString> Urls_t;
+
+private:
+
+    SocketConnectionManager& manager_;
+    char_t* cacheName_;
+
+    Urls_t pendingUrls_;
+
+    //! Connection fetching pendingUrls_.front(), NULL if there's none.
+    SocketConnection* connection_;
+
+    ulong_t bytesFetched_;
+
+#ifndef NDEBUG
+    friend void test_HistoryPrefetcher();
+#endif
+
+protected:
+
+    virtual status_t createConnection(SocketConnectionManager& manager, const char* url, SocketConnection*& connection) = 0;
+
+public:
+
+    //! Type of hyperlinks that are prefetched.
+    HyperlinkType hyperlinkType;
+
+    //! Maximum number of pages prefetched for single shown definition.
+    ulong_t maxPagesCount;
+
+    //! Prefetching stops when pages fetched for single shown definition exceed this number of bytes, 0 meaning there's no limit.
+    ulong_t byteBudget;
+
+    //! Limits of the cache pages are stored in.
+    ulong_t cacheCapacity;
+    ulong_t cacheByteBudget;
+
+    //! Pages already present in this cache (usually history cache) aren't fetched, NULL if it shouldn't be checked.
+    const char_t* historyCacheName;
+
+    HistoryPrefetcher(SocketConnectionManager& manager);
+
+    virtual ~HistoryPrefetcher();
+
+    status_t setCacheName(const char_t* cacheName);
+
+    const char_t* cacheName() const {return cacheName_;}
+
+    /**
+     * Replaces pending pages with targets of hyperlinks of hyperlinkType in shown part of definition, in their reading order.
+     * Should be called after definition is rendered or scrolled.
+     */
+    status_t prefetchShownHyperlinks(const Definition& definition);
+
+    //! Replaces pending pages with urls (in their order) which aren't cached yet, up to maxPagesCount of them.
+    status_t prefetchUrls(const Urls_t& urls);
+
+    //! Drops pending pages and aborts the one being fetched, should be called when user navigates elsewhere.
+    void cancel();
+
+    //! Starts fetching next pending page if there's no other connection active.
+    status_t idle();
+
+    bool active() const {return NULL != connection_ || !pendingUrls_.empty();}
+
+    //! Stores page contents, which should be in the format handler passed to readPrefetched() reads.
+    status_t fetchSucceeded(SocketConnection& connection, const void* data, ulong_t length, const char_t* title);
+
+    void fetchFailed(SocketConnection& connection);
+
+    //! @return result of handler if page for url was prefetched, false otherwise.
+    bool readPrefetched(const char* url, HistorySupport::CacheReadHandler_t handler);
+
+    /**
+     * Moves page prefetched for url (with its title) into new entry appended to history, so that following hyperlink 
+     * to it leaves the same history entry as fetching it would.
+     * @param index set to index of the new entry.
+     * @return false if page wasn't prefetched or couldn't be copied.
+     */
+    bool movePrefetched(const char* url, HistoryCache& history, ulong_t& index);
+
+};
+
+#ifdef DEBUG
+void test_HistoryPrefetcher();
+#endif
+
+#endif
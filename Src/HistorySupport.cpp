@@ -2,6 +2,7 @@
 #include <HistoryCache.hpp>
 #include <Text.hpp>
 #include <HyperlinkHandlerBase.hpp>
+#include <HistoryPrefetcher.hpp>
 
 /*
 status_t FillPopupMenuModelFromHistory(const char_t* cacheName, PopupMenuModel& model)
@@ -83,7 +84,8 @@ popupMenuFillHandler(FillPopupMenuModelFromHistory),
 popupMenuFillHandlerData(NULL),
 hyperlinkHandler(NULL),
 lastAction_(actionNewSearch),
-cacheReadHandler(NULL)
+cacheReadHandler(NULL),
+prefetcher(NULL)
 {
 }
 
@@ -338,14 +340,20 @@ long HistorySupport::lookupFinished(bool success, const char_t* entryTitle)
 
         // Special history flags 'h' and 'H'
         // TODO: write this better!
-        char* url = (char*) cache.entryUrl(currentHistoryIndex);
+        const char* url = cache.entryUrl(currentHistoryIndex);
         bool wasSpecialHistory = false;
         // TODO: change 'h' to 'H'
         if (Len(url) > 2)
             if ('h' == url[0] && 's' == url[1] && '+' == url[2])
             {
-                url[0] = 'H';
-                wasSpecialHistory = true;
+                char* specialUrl = StringCopy2(url);
+                if (NULL != specialUrl)
+                {
+                    specialUrl[0] = 'H';
+                    wasSpecialHistory = (errNone == cache.setEntryUrl(currentHistoryIndex, specialUrl));
+                    free(specialUrl);
+                    url = cache.entryUrl(currentHistoryIndex);
+                }
             }    
 
             // TODO: remove all other entries with this url
@@ -362,7 +370,7 @@ long HistorySupport::lookupFinished(bool success, const char_t* entryTitle)
                             {
                                 cache.removeEntry(i);
                                 currentHistoryIndex--;
-                                url = (char*) cache.entryUrl(currentHistoryIndex);
+                                url = cache.entryUrl(currentHistoryIndex);
                             }
                         }
                 }        
@@ -408,6 +416,8 @@ bool HistorySupport::followUrl(HistoryCache& cache, const char* url)
     assert(NULL != cacheReadHandler);
     if (cacheReadHandler(cache, url))
         return true;
+    if (NULL != prefetcher && prefetcher->readPrefetched(url, cacheReadHandler))
+        return true;
     if (NULL == hyperlinkHandler)
         return false;
 
@@ -417,4 +427,23 @@ bool HistorySupport::followUrl(HistoryCache& cache, const char* url)
     return true;
 }
 
+bool HistorySupport::followHyperlink(const char* url)
+{
+    if (NULL != prefetcher)
+    {
+        // Fetching other pages shouldn't compete with lookup of the chosen one.
+        prefetcher->cancel();
+        HistoryCache cache;
+        ulong_t index;
+        if (NULL != cacheReadHandler && errNone == cache.open(cacheName_) && prefetcher->movePrefetched(url, cache, index))
+            return selectEntry(cache, index);
+    }
+    if (NULL == hyperlinkHandler)
+        return false;
+
+    lastAction_ = actionNewSearch;
+    hyperlinkHandler->handleHyperlink(url, Len(url), NULL);
+    return true;
+}
+
 
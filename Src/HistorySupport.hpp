@@ -4,6 +4,7 @@
 #include <PopupMenu.hpp>
 
 class HistoryCache;
+class HistoryPrefetcher;
 
 status_t FillPopupMenuModelFromHistory(const HistoryCache& cache, PopupMenuModel& model, void* data);
 
@@ -49,6 +50,9 @@ public:
     typedef bool (* CacheReadHandler_t)(HistoryCache& cache, const char* url);
     
     CacheReadHandler_t cacheReadHandler;
+    
+    //! Pages not found in history cache are read from its cache (with cacheReadHandler) before they're fetched, NULL if there's none.
+    HistoryPrefetcher* prefetcher;
 
 #ifdef _PALM_OS
     HistorySupport(Form& form);
@@ -83,6 +87,13 @@ public:
      */
     bool fetchHistoryEntry(ulong_t index); 
     
+    /**
+     * Follows hyperlink chosen in a definition: page prefetched by prefetcher is moved into new history entry and read from there,
+     * otherwise hyperlinkHandler fetches it as a new search.
+     * @return false if page wasn't prefetched and there's no hyperlinkHandler.
+     */
+    bool followHyperlink(const char* url);
+    
     long lookupFinished(bool success, const char_t* entryTitle);
     
     bool move(int delta);
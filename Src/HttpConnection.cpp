@@ -9,27 +9,30 @@
 namespace ArsLexis {
 
     namespace {
-        
+
         enum {
             requestMethodLength=8,
-            requestMethodsCount=8
+            requestMethodsCount=8,
+            // Chunk header is hexadecimal length with optional extensions, anything longer is garbage.
+            maxChunkHeaderLength=256,
+            inflateInputLength=256
         };
-        
-        typedef char_t RequestMethodStorage_t[requestMethodLength];
+
+        typedef char RequestMethodStorage_t[requestMethodLength];
         typedef RequestMethodStorage_t RequestMethodsArray_t[requestMethodsCount];
         RequestMethodsArray_t requestMethods=
         {
-            _T("OPTIONS"),
-            _T("GET"),
-            _T("HEAD"),
-            _T("POST"),
-            _T("PUT"),
-            _T("DELETE"),
-            _T("TRACE"),
-            _T("CONNECT")
+            "OPTIONS",
+            "GET",
+            "HEAD",
+            "POST",
+            "PUT",
+            "DELETE",
+            "TRACE",
+            "CONNECT"
         };
-        
-        const char_t* crLf=_T("\r\n");
+
+        const char* crLf="\r\n";
 
     }
 
@@ -38,85 +41,160 @@ namespace ArsLexis {
         protocolVersionMajor_(1),
         protocolVersionMinor_(1),
         requestMethod_(methodGet),
-        uri_(_T("/")),
         insideResponseHeaders_(false),
         insideResponseBody_(false),
         chunkedEncoding_(false),
         skippingInfoResponse_(false),
         bodyContentsAvailable_(false),
-        finished_(false),
         chunkedBodyFinished_(false),
+        responseFinished_(false),
+        keepAlive_(true),
+        responseKeepAlive_(false),
+        reusedSocket_(false),
+        acceptCompression_(true),
+        requestHasBody_(false),
+        contentEncoding_(encodingIdentity),
         contentLength_(contentLengthUnavailable),
-        readContentLength_(0)
-    {}        
+        readContentLength_(0),
+        responseIndex_(0),
+        retryResponseIndex_(0),
+        uri_("/")
+    {}
 
-    HttpConnection::~HttpConnection() 
+    HttpConnection::~HttpConnection()
     {
         std::for_each(requestFields_.begin(), requestFields_.end(), ObjectDeleter<RequestField_t>());
     }
 
-    void HttpConnection::renderRequestLine(String& out) 
+    void HttpConnection::renderRequestLine(NarrowString& out, RequestMethod method, const NarrowString& uri)
     {
-        assert(requestMethod_<requestMethodsCount);
-        const char_t* method=requestMethods[requestMethod_];
+        assert(int(method)<requestMethodsCount);
         static const int versionBufferLength=16;
-        char_t versionBuffer[versionBufferLength];
+        char versionBuffer[versionBufferLength];
         uint_t major=protocolVersionMajor_;
         uint_t minor=protocolVersionMinor_;
-        int verLen=tprintf(versionBuffer, _T("%u.%u"), major, minor);
-        out.append(method).append(1, _T(' ')).append(uri_).append(_T(" HTTP/"), 6).append(versionBuffer, verLen).append(crLf);
+        int verLen=sprintf(versionBuffer, "%u.%u", major, minor);
+        out.append(requestMethods[method]).append(1, ' ').append(uri).append(" HTTP/", 6).append(versionBuffer, verLen).append(crLf);
     }
 
-    void HttpConnection::renderHeaderField(String& out, const RequestField_t& field)
+    void HttpConnection::renderHeaderField(NarrowString& out, const NarrowString& field, const NarrowString& value)
     {
-        out.append(field.first).append(_T(": "), 2).append(field.second).append(crLf);
+        out.append(field).append(": ", 2).append(value).append(crLf);
     }
 
-    status_t HttpConnection::commitRequest() 
+    bool HttpConnection::hasRequestHeader(const char* field) const
     {
-        String request;
-        renderRequestLine(request);
         RequestFields_t::const_iterator end=requestFields_.end();
         for (RequestFields_t::const_iterator it=requestFields_.begin(); it!=end; ++it)
-            renderHeaderField(request, *(*it));
+            if (equalsIgnoreCase((*it)->first, field))
+                return true;
+        return false;
+    }
+
+    // All pipelined requests are rendered at once, they differ only in request line and connection fields.
+    status_t HttpConnection::commitRequest()
+    {
+        // Pipelining requests with side effects isn't safe, as they may need to be sent again.
+        assert(pipelinedUris_.empty() || methodGet==requestMethod_ || methodHead==requestMethod_);
+        NarrowString fields;
+        if (NULL!=serverAddress && !hasRequestHeader("Host"))
+        {
+            NarrowString host(serverAddress);
+            if (host.length()>3 && 0==host.compare(host.length()-3, 3, ":80"))
+                host.resize(host.length()-3);
+            renderHeaderField(fields, "Host", host);
+        }
+        if (acceptCompression_ && !hasRequestHeader("Accept-Encoding"))
+            renderHeaderField(fields, "Accept-Encoding", "gzip, deflate");
+        bool http11=(protocolVersionMajor_>1 || (1==protocolVersionMajor_ && protocolVersionMinor_>=1));
+        bool connectionField=hasRequestHeader("Connection");
+        bool contentLengthField=hasRequestHeader("Content-Length");
+        RequestFields_t::const_iterator end=requestFields_.end();
+        for (RequestFields_t::const_iterator it=requestFields_.begin(); it!=end; ++it)
+            renderHeaderField(fields, (*it)->first, (*it)->second);
         std::for_each(requestFields_.begin(), requestFields_.end(), ObjectDeleter<RequestField_t>());
         requestFields_.clear();
-        request.append(crLf);
-        if (!messageBody_.empty())
+
+        NarrowString request;
+        ulong_t count=pipelinedUris_.size()+1;
+        requestOffsets_.clear();
+        for (ulong_t i=0; i<count; ++i)
         {
-            request.append(messageBody_);
-            messageBody_.clear();
+            requestOffsets_.push_back(request.length());
+            if (0==i)
+                renderRequestLine(request, requestMethod_, uri_);
+            else
+                renderRequestLine(request, methodGet, pipelinedUris_[i-1]);
+            request.append(fields);
+            // HTTP/1.1 connections are persistent unless told otherwise, HTTP/1.0 ones the other way round.
+            // Only the last request may ask to close, server would drop the ones after it.
+            bool keepAlive=(keepAlive_ || count-1!=i);
+            if (!connectionField && keepAlive && !http11)
+                renderHeaderField(request, "Connection", "keep-alive");
+            else if (!connectionField && !keepAlive && http11)
+                renderHeaderField(request, "Connection", "close");
+            if (0==i && !messageBody_.empty() && !contentLengthField)
+            {
+                // Large enough for 64-bit ulong_t.
+                char buffer[24];
+                int len=sprintf(buffer, "%lu", ulong_t(messageBody_.length()));
+                renderHeaderField(request, "Content-Length", NarrowString(buffer, len));
+            }
+            request.append(crLf);
+            if (0==i && !messageBody_.empty())
+            {
+                requestHasBody_=true;
+                request.append(messageBody_);
+                messageBody_.clear();
+            }
         }
-        setRequest(request);
-        return errNone;
+        // Socket stays open for reuse, so server mustn't see end of request stream.
+        setShutdownAfterSend(!keepAlive_);
+        return setRequest(request.data(), request.length());
     }
 
-    status_t HttpConnection::handleResponseField(const String& field, const String& value)
+    status_t HttpConnection::handleResponseField(const NarrowString& field, const NarrowString& value)
     {
         status_t error=errNone;
-        if (equalsIgnoreCase(field, _T("Transfer-Encoding")))
+        if (equalsIgnoreCase(field, "Transfer-Encoding"))
         {
-            if (equalsIgnoreCase(value, _T("chunked")))
+            if (equalsIgnoreCase(value, "chunked"))
                 chunkedEncoding_=true;
-            else 
+            else if (!equalsIgnoreCase(value, "identity"))
                 error=errHttpUnknownTransferEncoding;
         }
-        else if (equalsIgnoreCase(field, _T("Content-Length")))
+        else if (equalsIgnoreCase(field, "Content-Length"))
         {
-            String::size_type len=value.find_first_of(_T("; \t"));
+            NarrowString::size_type len=value.find_first_of("; \t");
             if (value.npos==len)
                 len=value.length();
             long val;
             error=numericValue(value.data(), value.data()+len, val);
-            if (errNone==error)
+            if (errNone==error && val>=0)
                 contentLength_=val;
             else
                 error=errResponseMalformed;
         }
+        else if (acceptCompression_ && equalsIgnoreCase(field, "Content-Encoding"))
+        {
+            if (equalsIgnoreCase(value, "gzip") || equalsIgnoreCase(value, "x-gzip"))
+                contentEncoding_=encodingGzip;
+            else if (equalsIgnoreCase(value, "deflate"))
+                contentEncoding_=encodingDeflate;
+            else if (!equalsIgnoreCase(value, "identity"))
+                error=errHttpUnsupportedContentEncoding;
+        }
+        else if (equalsIgnoreCase(field, "Connection"))
+        {
+            if (equalsIgnoreCase(value, "close"))
+                responseKeepAlive_=false;
+            else if (equalsIgnoreCase(value, "keep-alive"))
+                responseKeepAlive_=true;
+        }
         return error;
     }
 
-    status_t HttpConnection::handleStatusLine(uint_t versionMajor, uint_t versionMinor, uint_t statusCode, const String& reason)
+    status_t HttpConnection::handleStatusLine(uint_t versionMajor, uint_t versionMinor, uint_t statusCode, const NarrowString& reason)
     {
         status_t error=errNone;
         if (statusCode>=100 && statusCode<200)
@@ -125,92 +203,246 @@ namespace ArsLexis {
             error=errHttpUnsupportedStatusCode;
         return error;
     }
-    
-    status_t HttpConnection::open() 
+
+    bool HttpConnection::idempotentRequest() const
+    {
+        if (methodGet!=requestMethod_ && methodHead!=requestMethod_)
+            return false;
+        return messageBody_.empty() && !requestHasBody_;
+    }
+
+    status_t HttpConnection::resolve()
     {
-        commitRequest();
+        // Address of idle socket is already known, so resolving is skipped altogether.
+        // Server may have closed it meanwhile, so it's used only for request which is safe to send again.
+        if (keepAlive_ && idempotentRequest() && reuseIdleSocket())
+        {
+            reusedSocket_=true;
+            setState(stateUnopened);
+            return errNone;
+        }
+        return SimpleSocketConnection::resolve();
+    }
+
+    status_t HttpConnection::open()
+    {
+        // Request is already there if we're reconnecting in retryRequest().
+        if (!fRequestExists())
+        {
+            status_t error=commitRequest();
+            if (errNone!=error)
+                return error;
+        }
         return SimpleSocketConnection::open();
     }
 
-    void HttpConnection::addRequestHeader(const String& field, const String& value) 
+    void HttpConnection::addRequestHeader(const NarrowString& field, const NarrowString& value)
     {
         requestFields_.push_back(new RequestField_t(field, value));
     }
-    
-    void HttpConnection::setUri(const String& uri) 
+
+    void HttpConnection::setUri(const NarrowString& uri)
     {
         uri_=uri;
         static const int prefixLength=7;
-        if (uri.find(_T("http://"))==0)
+        if (uri.find("http://")==0)
         {
-            String::size_type end=uri.find(_T("/"), prefixLength);
-            String address(uri, prefixLength, end-prefixLength);
-            if (address.npos==address.find(_T(':')))
-                address.append(_T(":80"), 3);
-            setAddress(address);            
+            NarrowString::size_type end=uri.find('/', prefixLength);
+            address_.assign(uri, prefixLength, end-prefixLength);
+            if (address_.npos==address_.find(':'))
+                address_.append(":80", 3);
+            serverAddress=address_.c_str();
         }
     }
-    
-    status_t HttpConnection::notifyReadable() 
+
+    /**
+     * Server may close idle connection any time, which we notice only when we try to reuse it. It may also close
+     * connection after any response, dropping requests pipelined after it. In both cases nothing of current response
+     * arrives, and request is safe to send again, unless it's the first one and has side effects (pipelined ones are GETs).
+     * Fresh connection is retried only if it made some progress.
+     */
+    bool HttpConnection::canRetryRequest() const
     {
-        if (!insideResponseBody_)
-            return SimpleSocketConnection::notifyReadable();
-        else
-            return processResponseBody();
+        if (0!=responseLen_ || insideResponseHeaders_ || insideResponseBody_ || responseFinished_)
+            return false;
+        if (0==responseIndex_ && !idempotentRequest())
+            return false;
+        return reusedSocket_ || responseIndex_>retryResponseIndex_;
     }
 
-    //! @todo Handle case when field value spans through multiple lines
-    bool HttpConnection::nextResponseLine(String& out, bool finish)
+    status_t HttpConnection::retryRequest()
     {
-        String& resp=response();
-        String::size_type pos=resp.find(crLf);
-        if (resp.npos==pos && !finish)
-            return false;
-        out.assign(resp, 0, pos);
-        eraseStart(resp, resp.npos==pos?pos:pos+2);
-        return true;
+        LogStrUlong(eLogInfo, _T("retryRequest(): connection was closed by server, reconnecting to send request "), responseIndex_);
+        abortConnection();
+        socket().close();
+        reusedSocket_=false;
+        retryResponseIndex_=responseIndex_;
+        restartRequest(requestOffsets_[responseIndex_]);
+        setState(stateUnresolved);
+        return errNone;
     }
-    
-    status_t HttpConnection::processResponseHeaders(bool finish)
+
+    status_t HttpConnection::notifyWritable()
+    {
+        status_t error=SimpleSocketConnection::notifyWritable();
+        if (errNone!=error && canRetryRequest())
+            return retryRequest();
+        return error;
+    }
+
+    status_t HttpConnection::notifyReadable()
+    {
+        status_t error=SimpleSocketConnection::notifyReadable();
+        if ((errNone!=error || stateFinished==state()) && canRetryRequest())
+            return retryRequest();
+        return error;
+    }
+
+    status_t HttpConnection::notifyProgress()
+    {
+        if (responseFinished_ || 0==responseLen_)
+            return errNone;
+        return processResponse(false);
+    }
+
+    status_t HttpConnection::notifyFinished()
+    {
+        // Nothing of current response was received, notifyReadable() will retry.
+        if (canRetryRequest())
+            return errNone;
+        if (responseFinished_)
+            return errNone;
+        return processResponse(true);
+    }
+
+    status_t HttpConnection::processResponse(bool finish)
     {
         status_t error=errNone;
-        String line;
-        bool ready=nextResponseLine(line, finish);
-        while (ready && !insideResponseBody_) {
-            if (line.empty())
+        while (errNone==error)
+        {
+            if (responseFinished_)
             {
-                if (skippingInfoResponse_)
-                    skippingInfoResponse_=insideResponseBody_=insideResponseHeaders_=false;
-                else
+                error=handleResponseFinished();
+                if (errNone!=error)
+                    break;
+                if (pipelinedUris_.size()==responseIndex_)
                 {
-                    if (!chunkedBodyFinished_)
-                    {
-                        insideResponseBody_=true;
-                        insideResponseHeaders_=false;
-                    }
+                    error=finishResponse();
                     break;
                 }
+                startNextResponse();
+                // Next response may have arrived already, otherwise we'd report it as truncated.
+                if (0==responseLen_)
+                    break;
             }
-            else 
+            else if (insideResponseBody_)
             {
-                if (!insideResponseHeaders_)
-                {
-                    error=processStatusLine(line);
-                    insideResponseHeaders_=true;
-                }
-                else
-                    error=processHeaderLine(line);
+                error=processResponseBody(finish);
+                if (insideResponseBody_)
+                    break;
+            }
+            else
+            {
+                error=processResponseHeaders(finish);
+                if (!insideResponseBody_ && !responseFinished_)
+                    break;
+            }
+        }
+        return error;
+    }
+
+    void HttpConnection::startNextResponse()
+    {
+        ++responseIndex_;
+        insideResponseHeaders_=false;
+        insideResponseBody_=false;
+        chunkedEncoding_=false;
+        skippingInfoResponse_=false;
+        chunkedBodyFinished_=false;
+        responseFinished_=false;
+        contentEncoding_=encodingIdentity;
+        contentLength_=contentLengthUnavailable;
+        readContentLength_=0;
+        inflatingReader_.reset();
+        reader_.reset();
+    }
+
+    status_t HttpConnection::handleResponseFinished()
+    {
+        return errNone;
+    }
+
+    status_t HttpConnection::finishResponse()
+    {
+        if (stateOpened!=state())
+            return errNone;
+        if (keepAlive_ && responseKeepAlive_ && 0==responseLen_ && !sending())
+            keepSocketIdle();
+        else
+            abortConnection();
+        return errNone;
+    }
+
+    status_t HttpConnection::processResponseHeaders(bool finish)
+    {
+        status_t error=errNone;
+        while (errNone==error && !insideResponseBody_ && !responseFinished_)
+        {
+            long end=StrFind(response_, responseLen_, '\n');
+            if (-1==end)
+            {
+                if (finish)
+                    error=errResponseMalformed;
+                break;
+            }
+            NarrowString line(response_, end);
+            if (!line.empty() && '\r'==line[line.length()-1])
+                line.resize(line.length()-1);
+            consumeResponse(end+1);
+
+            if (line.empty())
+            {
+                if (insideResponseHeaders_)
+                    processHeadersEnd();
             }
-            ready=nextResponseLine(line, finish);
+            else if (!insideResponseHeaders_)
+            {
+                error=processStatusLine(line);
+                insideResponseHeaders_=true;
+            }
+            else
+                error=processHeaderLine(line);
         }
-        return error;    
+        return error;
     }
-    
-    status_t HttpConnection::processStatusLine(const String& line)
+
+    void HttpConnection::processHeadersEnd()
     {
-        if (line.find(_T("HTTP/"))!=0)
+        insideResponseHeaders_=false;
+        if (skippingInfoResponse_)
+        {
+            skippingInfoResponse_=false;
+            return;
+        }
+        if (chunkedBodyFinished_ || (0==responseIndex_ && methodHead==requestMethod_) || (!chunkedEncoding_ && 0==contentLength_))
+        {
+            responseFinished_=true;
+            return;
+        }
+        insideResponseBody_=true;
+        // Transfer-Encoding takes precedence over Content-Length.
+        if (chunkedEncoding_)
+            contentLength_=contentLengthUnavailable;
+        // Body that ends with connection can't be followed by anything.
+        if (!chunkedEncoding_ && contentLengthUnavailable==contentLength_)
+            responseKeepAlive_=false;
+    }
+
+    status_t HttpConnection::processStatusLine(const NarrowString& line)
+    {
+        if (line.find("HTTP/")!=0)
             return errResponseMalformed;
-        String::size_type pos0=line.find(_T('.'), 6);
+        NarrowString::size_type pos0=line.find('.', 6);
         if (line.npos==pos0)
             return errResponseMalformed;
         long value;
@@ -218,165 +450,145 @@ namespace ArsLexis {
         if (error)
             return errResponseMalformed;
         uint_t major=value;
-        String::size_type pos1=line.find_first_of(_T(" \t"), pos0+1);
+        NarrowString::size_type pos1=line.find_first_of(" \t", pos0+1);
         if (line.npos==pos1)
             return errResponseMalformed;
         error=numericValue(&line[pos0+1],&line[pos1], value);
         if (error)
             return errResponseMalformed;
         uint_t minor=value;
-        pos0=line.find_first_not_of(_T(" \t"), pos1);
+        pos0=line.find_first_not_of(" \t", pos1);
         if (line.npos==pos0)
             return errResponseMalformed;
-        pos1=line.find_first_of(_T(" \t"), pos0);
+        pos1=line.find_first_of(" \t", pos0);
         if (line.npos==pos1)
-            return errResponseMalformed;
-        error=numericValue(&line[pos0], &line[pos1], value);
+            pos1=line.length();
+        error=numericValue(&line[pos0], &line[0]+pos1, value);
         if (error)
             return errResponseMalformed;
         uint_t statusCode=value;
-        pos0=line.find_first_not_of(_T(" \t"), pos1);
-        if (line.npos==pos0)
-            return errResponseMalformed;
-        String reason(line, pos0);
+        NarrowString reason;
+        pos0=line.find_first_not_of(" \t", pos1);
+        if (line.npos!=pos0)
+            reason.assign(line, pos0, line.npos);
+        // Header fields (Connection) may override the default.
+        responseKeepAlive_=(major>1 || (1==major && minor>=1));
         return handleStatusLine(major, minor, statusCode, reason);
     }
 
-    status_t HttpConnection::processHeaderLine(const String& line)
+    status_t HttpConnection::processHeaderLine(const NarrowString& line)
     {
-        String::size_type pos=line.find(_T(':'));
+        NarrowString::size_type pos=line.find(':');
         if (line.npos==pos)
             return errResponseMalformed;
-        String field(line, 0, pos);
-        String value;
-        pos=line.find_first_not_of(_T(" \t"), pos+1);
+        NarrowString field(line, 0, pos);
+        NarrowString value;
+        pos=line.find_first_not_of(" \t", pos+1);
         if (line.npos!=pos)
             value.assign(line, pos, line.npos);
         return handleResponseField(field, value);
     }
-    
-    status_t HttpConnection::processResponseBody()
+
+    status_t HttpConnection::processResponseBody(bool finish)
     {
-        bodyContentsAvailable_=true;
         if (!reader_.get())
+        {
             reader_.reset(chunkedEncoding_?new ChunkedBodyReader(*this):new BodyReader(*this));
-        return processBodyContents(*reader_);
-    }
+            // Content encoding is applied over transfer encoding.
+            if (encodingIdentity!=contentEncoding_)
+                inflatingReader_.reset(new InflatingReader(*reader_, encodingGzip==contentEncoding_?Inflater::formatGzip:Inflater::formatZlib));
+        }
+        bodyContentsAvailable_=true;
+        status_t error;
+        if (NULL!=inflatingReader_.get())
+            error=processBodyContents(*inflatingReader_);
+        else
+            error=processBodyContents(*reader_);
+        bodyContentsAvailable_=false;
+        reader_->flush();
+        if (errNone!=error)
+            return error;
 
-    HttpConnection::BodyReader::BodyReader(HttpConnection& conn):
-        connection_(conn),
-        charsRead_(0)
-    {
-    }  
-    
-    status_t HttpConnection::BodyReader::readNextChunk()
-    {
-        connection_.bodyContentsAvailable_=false;
-        const uint_t sizeBefore=connection_.response().length();
-        status_t error=connection_.SimpleSocketConnection::notifyReadable();
-        connection_.finished_=(sizeBefore==connection_.response().length());
-        if (eof())
-            log().debug()<<_T("BodyReader::readNextChunk(): last read didn't change data length, setting eof flag");
-        return error;
-    }
-    
-    void HttpConnection::BodyReader::flush()
-    {
-        eraseStart(body(), charsRead_);
-        charsRead_=0;
-    }
-    
-    status_t HttpConnection::BodyReader::read(int& chr) 
-    {
-        if (body().length()==charsRead_) 
+        // Compressed stream must end together with body.
+        bool inflatingFinished=(NULL==inflatingReader_.get() || inflatingReader_->finished());
+        if (reader_->bodyFinished())
         {
-            if (eof())
-            {
-                log().debug()<<_T("BodyReader::read(): server shut socket down and buffer is empty, returning npos");
-                chr=npos;
-                flush();
-                return errNone;
-            }
-            status_t error=readNextChunk();
-            if (errNone!=error)
-                return error;
-            if (body().length()==charsRead_)
-            {
-                log().debug()<<_T("BodyReader::read(): body().length() didn't change, returning npos");
-                chr=npos;
-                flush();
-                return errNone;
-            }
+            if (!inflatingFinished)
+                return errResponseMalformed;
+            insideResponseBody_=false;
+            // Last chunk is followed by optional trailer fields and empty line.
+            if (chunkedEncoding_)
+                chunkedBodyFinished_=insideResponseHeaders_=true;
             else
-                goto charAvailable;
+                responseFinished_=true;
         }
-        else 
+        else if (finish)
         {
-charAvailable:        
-            ++connection_.readContentLength_;
-            chr=body()[charsRead_++];
-        }            
-        if (chunkLength==charsRead_) 
-            flush();
+            if (chunkedEncoding_)
+                return errHttpUnexpectedEndOfChunk;
+            if (contentLengthUnavailable!=contentLength_ || !inflatingFinished)
+                return errResponseMalformed;
+            insideResponseBody_=false;
+            responseFinished_=true;
+        }
         return errNone;
     }
-    
-    status_t HttpConnection::BodyReader::read(int& num, String& dst, int offset, int range) 
+
+    status_t HttpConnection::processBodyContents(Reader& reader)
     {
-        if (body().empty() && eof())
-        {
-            log().debug()<<_T("BodyReader::read(): body().empty() and eof(), returning npos");
-            num=npos;
-            return errNone;
-        }
-        for (int pos=0; pos<range; pos++)
+        char buffer[256];
+        while (bodyContentsAvailable())
         {
-            int chr;
-            status_t error=read(chr);
+            ulong_t length=sizeof(buffer);
+            status_t error=reader.readRaw(buffer, length);
             if (errNone!=error)
                 return error;
-            if (npos!=chr)
-                dst[offset+pos]=chr;
-            else
-            {
-                num=pos;
-                log().debug()<<_T("BodyReader::read(): encountered npos, last part of data: ")<<String(dst, offset, num);
-                return errNone;
-            }
+            if (0==length)
+                break;
         }
-        num=range;
-        return errNone;      
+        return errNone;
     }
 
-    status_t HttpConnection::processBodyContents(Reader& reader) 
+    HttpConnection::BodyReader::BodyReader(HttpConnection& conn):
+        connection_(conn),
+        position_(0),
+        rawLength_(0)
     {
-        while (bodyContentsAvailable()) 
-        {
-            int chr;
-            status_t error=reader.read(chr);
-            if (errNone!=error)
-                return error;
-            if (reader.npos==chr)
-                break;
-            char_t c=chr;                
-        }                   
-        return errNone;
     }
 
-    status_t HttpConnection::notifyFinished()
+    ulong_t HttpConnection::BodyReader::readTransferred(char* buffer, ulong_t length)
     {
-        if (!insideResponseBody_)
-            return processResponseHeaders(true);
-        return errNone;
+        ulong_t available=connection_.responseLen_-position_;
+        if (contentLengthUnavailable!=connection_.contentLength_ && connection_.contentLength_-rawLength_<available)
+            available=connection_.contentLength_-rawLength_;
+        if (length>available)
+            length=available;
+        memcpy(buffer, connection_.response_+position_, length);
+        position_+=length;
+        rawLength_+=length;
+        return length;
     }
-    
-    status_t HttpConnection::notifyProgress()
+
+    status_t HttpConnection::BodyReader::readRaw(void* buffer, ulong_t& length)
     {
-        if (!insideResponseBody_)
-            return processResponseHeaders(false);
+        length=readTransferred(static_cast<char*>(buffer), length);
+        connection_.readContentLength_+=length;
         return errNone;
     }
 
+    void HttpConnection::BodyReader::flush()
+    {
+        if (0==position_)
+            return;
+        connection_.consumeResponse(position_);
+        position_=0;
+    }
+
+    bool HttpConnection::BodyReader::bodyFinished() const
+    {
+        return contentLengthUnavailable!=connection_.contentLength_ && rawLength_==connection_.contentLength_;
+    }
+
     HttpConnection::ChunkedBodyReader::ChunkedBodyReader(HttpConnection& conn):
         BodyReader(conn),
         state_(stateInHeader),
@@ -384,126 +596,541 @@ charAvailable:
         chunkLength_(0)
     {}
 
-    status_t HttpConnection::ChunkedBodyReader::read(int& chr) 
+    /**
+     * Chunk data is copied in spans up to chunk boundary, only chunk headers and line ends are read byte by byte.
+     * Any state may be interrupted by the end of data received so far, so it's resumed with next call.
+     */
+    status_t HttpConnection::ChunkedBodyReader::readRaw(void* buffer, ulong_t& length)
     {
-        status_t error;
-        int c;
-    start:
-        if (stateAfterBodyCr==state_ || stateAfterLastChunkCr==state_)
-        {
-            if (stateAfterBodyCr==state_)
-                log().debug()<<_T("ChunkedBodyReader::read(): stateAfterBodyCr");
-            else 
-                log().debug()<<_T("ChunkedBodyReader::read(): stateAfterLastChunkCr");
-            error=BodyReader::read(c);
-            if (errNone!=error)
-                return error;
-            if (_T('\r')!=c)
-                return SocketConnection::errResponseMalformed;
-            state_=stateAfterBodyCr==state_?stateAfterBodyLf:stateAfterLastChunkLf;
-        }
-        if (stateAfterBodyLf==state_ || stateAfterLastChunkLf==state_)
+        char* out=static_cast<char*>(buffer);
+        ulong_t count=0;
+        while (count<length && stateFinished!=state_)
         {
-            if (stateAfterBodyLf==state_)
-                log().debug()<<_T("ChunkedBodyReader::read(): stateAfterBodyLf");
-            else 
-                log().debug()<<_T("ChunkedBodyReader::read(): stateAfterLastChunkLf");
-            error=BodyReader::read(c);
-            if (errNone!=error)
-                return error;
-            if (_T('\n')!=c)
-                return SocketConnection::errResponseMalformed;
-            if (stateAfterBodyLf==state_)
-            {
-                state_=stateInHeader;
-                chunkHeader_.clear();
-            }
-            else
+            if (stateInBody==state_)
             {
-                state_=stateFinished;
-                flush();
-                connection_.insideResponseBody_=false;
-                connection_.chunkedBodyFinished_=true;
-                connection_.insideResponseHeaders_=true;
-                chr=npos;
-                connection_.registerEvent(SocketSelector::eventRead);
-                return errNone;
+                ulong_t span=chunkLength_-chunkPosition_;
+                if (span>length-count)
+                    span=length-count;
+                span=readTransferred(out+count, span);
+                if (0==span)
+                    break;
+                count+=span;
+                chunkPosition_+=span;
+                if (chunkPosition_==chunkLength_)
+                    state_=stateAfterBodyCr;
+                continue;
             }
-        }
-        if (stateInHeader==state_)
-        {
-            log().debug()<<_T("ChunkedBodyReader::read(): stateInHeader");
-            while (stateInHeader==state_)
+            char c;
+            if (0==readTransferred(&c, 1))
+                break;
+            switch (state_)
             {
-                error=BodyReader::read(c);
-                if (errNone!=error)
-                    return error;
-                if (npos==c)
-                    return SocketConnection::errResponseMalformed;
-                if (_T('\r')==c)
-                {
-                    state_=stateAfterHeader;
-                    error=parseChunkHeader();
-                    if (errNone!=error)
-                        return error;
-                    log().debug()<<_T("ChunkedBodyReader::read(): chunkLength_: ")<<chunkLength_;
+                case stateInHeader:
+                    if ('\r'==c)
+                    {
+                        status_t error=parseChunkHeader();
+                        if (errNone!=error)
+                            return error;
+                        state_=stateAfterHeader;
+                    }
+                    else if (chunkHeader_.length()==maxChunkHeaderLength)
+                        return SocketConnection::errResponseMalformed;
+                    else
+                        chunkHeader_.append(1, c);
+                    break;
+
+                case stateAfterHeader:
+                    if ('\n'!=c)
+                        return SocketConnection::errResponseMalformed;
+                    chunkHeader_.clear();
                     chunkPosition_=0;
-                }
-                else
-                    chunkHeader_.append(1, c);
-            }
-        }
-        if (stateAfterHeader==state_)
-        {
-            log().debug()<<_T("ChunkedBodyReader::read(): stateAfterHeader");
-            error=BodyReader::read(c);
-            if (errNone!=error)
-                return error;
-            if (_T('\n')!=c)
-                return SocketConnection::errResponseMalformed;
-            if (0!=chunkLength_)                
-                state_=stateInBody;
-            else
-            {
-                state_=stateAfterLastChunkCr;
-                goto start;
+                    state_=(0==chunkLength_?stateFinished:stateInBody);
+                    break;
+
+                case stateAfterBodyCr:
+                    if ('\r'!=c)
+                        return SocketConnection::errResponseMalformed;
+                    state_=stateAfterBodyLf;
+                    break;
+
+                case stateAfterBodyLf:
+                    if ('\n'!=c)
+                        return SocketConnection::errResponseMalformed;
+                    state_=stateInHeader;
+                    break;
+
+                default:
+                    assert(false);
             }
         }
-        if (stateFinished==state_)
-        {
-            log().debug()<<_T("ChunkedBodyReader::read(): stateFinished");
-            chr=npos;
-            return errNone;
-        }
-        assert(stateInBody==state_);
-        assert(chunkPosition_<chunkLength_);
-        error=BodyReader::read(chr);
-        if (errNone!=error)
-            return error;
-        if (++chunkPosition_==chunkLength_)
-            state_=stateAfterBodyCr;
-        else if (npos==chr)
-            return errHttpUnexpectedEndOfChunk;
+        connection_.readContentLength_+=count;
+        length=count;
         return errNone;
-    }   
-    
+    }
+
     status_t HttpConnection::ChunkedBodyReader::parseChunkHeader()
     {
-        String::size_type end=chunkHeader_.find_first_of(_T("; \t"));
+        NarrowString::size_type end=chunkHeader_.find_first_of("; \t");
         if (chunkHeader_.npos==end)
             end=chunkHeader_.length();
         long val;
         status_t error=numericValue(chunkHeader_.data(), chunkHeader_.data()+end, val, 16);
-        if (errNone!=error)
+        if (errNone!=error || val<0)
             return SocketConnection::errResponseMalformed;
         chunkLength_=val;
         return errNone;
-    }   
-    
+    }
+
     HttpConnection::ChunkedBodyReader::~ChunkedBodyReader()
     {}
-    
+
+    HttpConnection::InflatingReader::InflatingReader(Reader& source, Inflater::Format format):
+        source_(source),
+        inflater_(format)
+    {}
+
+    // Compressed body is fed to inflater in small pieces whenever it runs out of input, so it's never buffered whole.
+    status_t HttpConnection::InflatingReader::readRaw(void* buffer, ulong_t& length)
+    {
+        char* out=static_cast<char*>(buffer);
+        char input[inflateInputLength];
+        ulong_t count=0;
+        while (count<length)
+        {
+            ulong_t produced=length-count;
+            if (!inflater_.inflate(out+count, produced))
+                return SocketConnection::errResponseMalformed;
+            count+=produced;
+            if (count==length)
+                break;
+            ulong_t inputLength=sizeof(input);
+            status_t error=source_.readRaw(input, inputLength);
+            if (errNone!=error)
+                return error;
+            if (0==inputLength)
+                break;
+            // Anything after the end of compressed stream is ignored.
+            if (!inflater_.finished() && !inflater_.feed(input, inputLength))
+                return memErrNotEnoughSpace;
+        }
+        length=count;
+        return errNone;
+    }
+
+    HttpConnection::InflatingReader::~InflatingReader()
+    {}
+
     HttpConnection::BodyReader::~BodyReader()
     {}
 
-}
\ No newline at end of file
+}
+
+#if defined(_POSIX) && !defined(NDEBUG)
+
+#include <LoopbackTestServer.hpp>
+#include <unistd.h>
+
+using namespace ArsLexis;
+
+enum {
+    httpTestChunkLength = 100,
+    httpTestBodyRepeats = 40,
+    httpBenchmarkRequestsCount = 8,
+    httpBenchmarkRoundTripTime = 300,
+    httpTestCompressedLines = 150
+};
+
+// httpTestCompressedText() deflated with zlib level 9.
+static const unsigned char httpTestDeflated[] = {
+    0xa5, 0xda, 0xed, 0x4d, 0x1b, 0x41, 0x14, 0x86, 0xd1, 0xff, 0xa9, 0x62, 0x0b, 0x48, 0xd0, 0xdc,
+    0xf9, 0x9e, 0x1e, 0x68, 0xc2, 0x82, 0x89, 0x40, 0x32, 0x18, 0xd9, 0x56, 0x48, 0xba, 0x8f, 0x68,
+    0x81, 0x53, 0xc0, 0xfd, 0x77, 0xb4, 0xf6, 0xbe, 0xcf, 0x3e, 0xbe, 0xbe, 0xef, 0x23, 0x1d, 0x97,
+    0xdf, 0xc7, 0xe9, 0xb8, 0xef, 0xbf, 0xf7, 0x5f, 0x2f, 0xfb, 0xf4, 0xe7, 0xdf, 0x71, 0xba, 0xde,
+    0x5f, 0x9f, 0xce, 0xfb, 0xe7, 0x71, 0xdd, 0x1f, 0xfb, 0x74, 0xdf, 0xcf, 0xc7, 0xe7, 0xe5, 0xfa,
+    0x7c, 0x3b, 0x9e, 0x2e, 0x6f, 0x1f, 0xd7, 0x7d, 0xbb, 0x1d, 0x9f, 0xfb, 0x7c, 0x7e, 0xf8, 0xf1,
+    0xf8, 0x75, 0x1d, 0x74, 0x9d, 0xe9, 0xba, 0xd0, 0x75, 0xa5, 0xeb, 0x46, 0xd7, 0x9d, 0xae, 0x07,
+    0x5d, 0x4f, 0xba, 0x5e, 0xa6, 0x05, 0xb1, 0x99, 0xb6, 0x30, 0x6e, 0x61, 0xde, 0xc2, 0xc0, 0x85,
+    0x89, 0x0b, 0x23, 0x17, 0x66, 0x2e, 0x0c, 0x5d, 0x98, 0xba, 0x6c, 0xea, 0x32, 0x3e, 0xe3, 0x4c,
+    0x5d, 0x36, 0x75, 0xd9, 0xd4, 0x65, 0x53, 0x97, 0x4d, 0x5d, 0x36, 0x75, 0xd9, 0xd4, 0x65, 0x53,
+    0x57, 0x4c, 0x5d, 0x31, 0x75, 0x05, 0x7f, 0x5a, 0x4d, 0x5d, 0x31, 0x75, 0xc5, 0xd4, 0x15, 0x53,
+    0x57, 0x4c, 0x5d, 0x31, 0x75, 0xc5, 0xd4, 0x55, 0x53, 0x57, 0x4d, 0x5d, 0x35, 0x75, 0x15, 0xff,
+    0xd1, 0x99, 0xba, 0x6a, 0xea, 0xaa, 0xa9, 0xab, 0xa6, 0xae, 0x9a, 0xba, 0x6a, 0xea, 0x9a, 0xa9,
+    0x6b, 0xa6, 0xae, 0x99, 0xba, 0x66, 0xea, 0x1a, 0xbe, 0x48, 0x98, 0xba, 0x66, 0xea, 0x9a, 0xa9,
+    0x6b, 0xa6, 0xae, 0x99, 0xba, 0x6e, 0xea, 0xba, 0xa9, 0xeb, 0xa6, 0xae, 0x9b, 0xba, 0x6e, 0xea,
+    0x3a, 0xbe, 0xbf, 0x9a, 0xba, 0x6e, 0xea, 0xba, 0xa9, 0xeb, 0xa6, 0x6e, 0x98, 0xba, 0x61, 0xea,
+    0x86, 0xa9, 0x1b, 0xa6, 0x6e, 0x98, 0xba, 0x61, 0xea, 0x06, 0xce, 0x26, 0xa6, 0x6e, 0x98, 0xba,
+    0x61, 0xea, 0xa6, 0xa9, 0x9b, 0xa6, 0x6e, 0x9a, 0xba, 0x69, 0xea, 0xa6, 0xa9, 0x9b, 0xa6, 0x6e,
+    0x9a, 0xba, 0x89, 0x6b, 0x9d, 0xa9, 0x9b, 0xa6, 0x6e, 0x99, 0xba, 0x65, 0xea, 0x96, 0xa9, 0x5b,
+    0xa6, 0x6e, 0x99, 0xba, 0x65, 0xea, 0x96, 0xa9, 0x5b, 0xa6, 0x6e, 0xe1, 0x48, 0xac, 0x2b, 0x31,
+    0xce, 0xc4, 0x09, 0x77, 0xe2, 0x84, 0x43, 0x71, 0xc2, 0xa5, 0x38, 0xe1, 0x54, 0x9c, 0x70, 0x2b,
+    0x4e, 0x38, 0x16, 0x27, 0x5c, 0x8b, 0x13, 0xce, 0xc5, 0x09, 0xfd, 0x71, 0xa6, 0x40, 0x7f, 0x1a,
+    0x2a, 0xb4, 0x54, 0x68, 0xaa, 0xd0, 0x56, 0xa1, 0xb1, 0x42, 0x6b, 0x85, 0xe6, 0x0a, 0xec, 0x15,
+    0x81, 0xc1, 0x22, 0xb2, 0x76, 0x32, 0xf4, 0x87, 0xcd, 0x22, 0x30, 0x5a, 0x04, 0x56, 0x8b, 0xc0,
+    0x6c, 0x11, 0xd8, 0x2d, 0x02, 0xc3, 0x45, 0x60, 0xb9, 0x08, 0x4c, 0x17, 0x81, 0xed, 0x22, 0x8a,
+    0x86, 0x5a, 0xf4, 0x87, 0xf9, 0x22, 0xb0, 0x5f, 0x04, 0x06, 0x8c, 0xc0, 0x82, 0x11, 0x98, 0x30,
+    0x02, 0x1b, 0x46, 0x60, 0xc4, 0x08, 0xac, 0x18, 0x81, 0x19, 0x23, 0xaa, 0x7e, 0x29, 0x80, 0xfe,
+    0xb0, 0x64, 0x04, 0xa6, 0x8c, 0xc0, 0x96, 0x11, 0x18, 0x33, 0xe2, 0xfb, 0x35, 0xe3, 0x3f
+};
+
+static const unsigned char httpTestGzipHeader[] = {0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03};
+static const unsigned char httpTestGzipTrailer[] = {0xe1, 0xcd, 0x70, 0x34, 0x12, 0x25, 0x00, 0x00};
+static const unsigned char httpTestZlibHeader[] = {0x78, 0xda};
+static const unsigned char httpTestZlibTrailer[] = {0x34, 0xc5, 0x0c, 0x33};
+
+/**
+ * Loopback HTTP server, answers each GET with body generated by httpTestBody().
+ * Settings are changed only while client side is idle.
+ */
+struct HttpTestServer: LoopbackTestServer
+{
+    ulong_t requestsCount;
+    bool chunked;
+    //! Server closes connection silently (without Connection: close) after this many responses, 0 meaning never.
+    ulong_t maxRequestsPerConnection;
+    //! Simulated round trip time in milliseconds, responses to requests that arrive together are delayed by it once.
+    ulong_t delay;
+    ulong_t compressedCount;
+};
+
+static NarrowString httpTestCompressedText()
+{
+    NarrowString text;
+    char buffer[80];
+    for (ulong_t i = 0; i < httpTestCompressedLines; ++i)
+        text.append(buffer, sprintf(buffer, "Line %lu of a text-heavy article, repeated words compress well.\n", i));
+    return text;
+}
+
+static bool httpTestCompressedPath(const NarrowString& path)
+{
+    return "/gzip" == path || "/deflate" == path || "/raw-deflate" == path;
+}
+
+static NarrowString httpTestBody(const NarrowString& path)
+{
+    if (httpTestCompressedPath(path))
+        return httpTestCompressedText();
+    NarrowString body;
+    for (ulong_t i = 0; i < httpTestBodyRepeats; ++i)
+        body.append(path).append(1, char('a' + i % 26));
+    return body;
+}
+
+static void httpTestAnswer(HttpTestServer& server, int fd, const NarrowString& request, bool close)
+{
+    NarrowString::size_type pos = request.find(' ') + 1;
+    NarrowString path(request, pos, request.find(' ', pos) - pos);
+    // Absolute uri is sent by HttpConnection::setUri().
+    if (0 == path.find("http://"))
+        path.erase(0, path.find('/', 7));
+    NarrowString body = httpTestBody(path);
+    NarrowString response = "HTTP/1.1 200 OK\r\n";
+    char buffer[32];
+    if (close)
+        response.append("Connection: close\r\n");
+    if (httpTestCompressedPath(path) && NarrowString::npos != request.find("\r\nAccept-Encoding: gzip, deflate\r\n"))
+    {
+        const char* deflated = reinterpret_cast<const char*>(httpTestDeflated);
+        body.assign(deflated, sizeof(httpTestDeflated));
+        if ("/gzip" == path)
+        {
+            body.insert(0, reinterpret_cast<const char*>(httpTestGzipHeader), sizeof(httpTestGzipHeader));
+            body.append(reinterpret_cast<const char*>(httpTestGzipTrailer), sizeof(httpTestGzipTrailer));
+            response.append("Content-Encoding: gzip\r\n");
+        }
+        else
+        {
+            // Some servers send raw deflate stream instead of zlib format.
+            if ("/deflate" == path)
+            {
+                body.insert(0, reinterpret_cast<const char*>(httpTestZlibHeader), sizeof(httpTestZlibHeader));
+                body.append(reinterpret_cast<const char*>(httpTestZlibTrailer), sizeof(httpTestZlibTrailer));
+            }
+            response.append("Content-Encoding: deflate\r\n");
+        }
+        ++server.compressedCount;
+    }
+    if (server.chunked)
+    {
+        response.append("Transfer-Encoding: chunked\r\n\r\n");
+        for (NarrowString::size_type i = 0; i < body.length(); i += httpTestChunkLength)
+        {
+            NarrowString chunk(body, i, httpTestChunkLength);
+            response.append(buffer, sprintf(buffer, "%lx\r\n", ulong_t(chunk.length()))).append(chunk).append("\r\n");
+        }
+        response.append("0\r\n\r\n");
+    }
+    else
+        response.append(buffer, sprintf(buffer, "Content-Length: %lu\r\n\r\n", ulong_t(body.length()))).append(body);
+    // Responses are short enough to always fit into socket buffer.
+    ssize_t res = write(fd, response.data(), response.length());
+    assert(ssize_t(response.length()) == res);
+}
+
+static bool httpTestRespond(LoopbackTestServer& base, int fd, NarrowString& received, ulong_t& requestsCount)
+{
+    HttpTestServer& server = static_cast<HttpTestServer&>(base);
+    NarrowString::size_type end = received.find("\r\n\r\n");
+    if (received.npos != end && 0 != server.delay)
+        usleep(server.delay * 1000);
+    bool closing = false;
+    for (; !closing && received.npos != end; end = received.find("\r\n\r\n"))
+    {
+        NarrowString request(received, 0, end + 4);
+        received.erase(0, end + 4);
+        ++server.requestsCount;
+        ++requestsCount;
+        bool closeRequested = (request.npos != request.find("Connection: close"));
+        // Settings may change as soon as client gets the response.
+        closing = closeRequested || (0 != server.maxRequestsPerConnection && requestsCount >= server.maxRequestsPerConnection);
+        httpTestAnswer(server, fd, request, closeRequested);
+    }
+    return !closing;
+}
+
+static void httpTestServerStart(HttpTestServer& server)
+{
+    server.requestsCount = 0;
+    server.chunked = false;
+    server.maxRequestsPerConnection = 0;
+    server.delay = 0;
+    server.compressedCount = 0;
+    loopbackTestServerStart(server, httpTestRespond);
+}
+
+struct HttpTestResult
+{
+    std::vector<NarrowString> bodies;
+    ulong_t finishedCount;
+    status_t error;
+    bool reusedSocket;
+};
+
+class HttpTestConnection: public HttpConnection
+{
+    HttpTestResult& result_;
+
+protected:
+
+    status_t processBodyContents(Reader& reader)
+    {
+        assert(responseIndex() < result_.bodies.size());
+        NarrowString& body = result_.bodies[responseIndex()];
+        // Every other response is read char by char, which must give the same result as reading in blocks.
+        while (0 != responseIndex() % 2)
+        {
+            int chr;
+            status_t error = reader.read(chr);
+            if (errNone != error)
+                return error;
+            if (reader.npos == chr)
+                return errNone;
+            body.append(1, char(chr));
+        }
+        char buffer[64];
+        while (true)
+        {
+            ulong_t length = sizeof(buffer);
+            status_t error = reader.readRaw(buffer, length);
+            if (errNone != error)
+                return error;
+            if (0 == length)
+                break;
+            body.append(buffer, length);
+        }
+        return errNone;
+    }
+
+    status_t handleResponseFinished()
+    {
+        assert(responseIndex() == result_.finishedCount);
+        ++result_.finishedCount;
+        return errNone;
+    }
+
+    void handleError(status_t error)
+    {
+        result_.error = error;
+        HttpConnection::handleError(error);
+    }
+
+public:
+
+    HttpTestConnection(SocketConnectionManager& manager, HttpTestResult& result):
+        HttpConnection(manager),
+        result_(result)
+    {
+        result_.finishedCount = 0;
+        result_.error = errNone;
+    }
+
+    ~HttpTestConnection()
+    {
+        result_.reusedSocket = reusedSocket();
+    }
+
+};
+
+// Fetches paths with requests pipelined on single connection.
+static void httpTestFetch(SocketConnectionManager& manager, ushort_t port, const char* const* paths, ulong_t count, bool keepAlive = true, bool acceptCompression = true, HttpConnection::RequestMethod method = HttpConnection::methodGet)
+{
+    HttpTestResult result;
+    result.bodies.resize(count);
+    HttpTestConnection* conn = new HttpTestConnection(manager, result);
+    char uri[256];
+    for (ulong_t i = 0; i < count; ++i)
+    {
+        StrPrintF(uri, "http://127.0.0.1:%u%s", uint_t(port), paths[i]);
+        if (0 == i)
+            conn->setUri(uri);
+        else
+            conn->addPipelinedUri(uri);
+    }
+    conn->setRequestMethod(method);
+    conn->setKeepAlive(keepAlive);
+    conn->setAcceptCompression(acceptCompression);
+    conn->setTransferTimeout(10000);
+    status_t error = conn->enqueue();
+    assert(errNone == error);
+    while (manager.active())
+    {
+        error = manager.manageConnectionEvents(1000);
+        assert(errNone == error);
+    }
+    assert(errNone == result.error);
+    assert(count == result.finishedCount);
+    for (ulong_t i = 0; i < count; ++i)
+        assert(httpTestBody(paths[i]) == result.bodies[i]);
+}
+
+static void httpTestFetch(SocketConnectionManager& manager, ushort_t port, const char* path, bool keepAlive = true, bool acceptCompression = true, HttpConnection::RequestMethod method = HttpConnection::methodGet)
+{
+    httpTestFetch(manager, port, &path, 1, keepAlive, acceptCompression, method);
+}
+
+/**
+ * Checks that sequential requests to the same host go over single connection, that stale idle socket is replaced,
+ * and that pipelined responses are demultiplexed in order, also when server closes connection in the middle.
+ * Compressed bodies must decode to the same text whatever the framing, and POST must never go over pooled socket.
+ */
+void test_HttpConnection()
+{
+    HttpTestServer server;
+    httpTestServerStart(server);
+    ushort_t port = server.port;
+    {
+        SocketConnectionManager manager;
+        httpTestFetch(manager, port, "/first");
+        httpTestFetch(manager, port, "/second");
+        httpTestFetch(manager, port, "/third");
+        assert(1 == server.acceptedCount);
+        assert(1 == manager.idleSocketsCount());
+
+        server.chunked = true;
+        httpTestFetch(manager, port, "/chunked");
+        httpTestFetch(manager, port, "/chunked-again");
+        assert(1 == server.acceptedCount);
+        assert(5 == server.requestsCount);
+
+        // Server drops the pooled connection after the next response, so the one after it is retried on a new socket.
+        server.chunked = false;
+        server.maxRequestsPerConnection = 1;
+        httpTestFetch(manager, port, "/dropped");
+        assert(1 == server.acceptedCount);
+        httpTestFetch(manager, port, "/retried");
+        assert(2 == server.acceptedCount);
+        server.maxRequestsPerConnection = 0;
+
+        manager.closeIdleSockets();
+        httpTestFetch(manager, port, "/close", false);
+        assert(3 == server.acceptedCount);
+        assert(0 == manager.idleSocketsCount());
+        httpTestFetch(manager, port, "/reopened");
+        assert(4 == server.acceptedCount);
+        assert(1 == manager.idleSocketsCount());
+
+        manager.setIdleTimeout(0);
+        usleep(10000);
+        httpTestFetch(manager, port, "/expired");
+        assert(5 == server.acceptedCount);
+        manager.setIdleTimeout(15 * ticksPerSecond());
+
+        const char* paths[] = {"/p0", "/p1", "/p2", "/p3", "/p4"};
+        const ulong_t pathsCount = sizeof(paths) / sizeof(paths[0]);
+        httpTestFetch(manager, port, paths, pathsCount);
+        assert(5 == server.acceptedCount);
+
+        server.chunked = true;
+        httpTestFetch(manager, port, paths, pathsCount);
+        assert(5 == server.acceptedCount);
+
+        // Bodies span many receive chunks, so response buffer is both compacted and grown.
+        NarrowString longPath(1, '/');
+        longPath.append(150, 'x');
+        const char* longPaths[] = {longPath.c_str(), "/short", longPath.c_str()};
+        httpTestFetch(manager, port, longPaths, 3);
+        server.chunked = false;
+        httpTestFetch(manager, port, longPaths, 3);
+        assert(5 == server.acceptedCount);
+
+        // Remaining requests are sent again on new connections: 2 + 2 + 1 responses.
+        server.chunked = true;
+        manager.closeIdleSockets();
+        server.maxRequestsPerConnection = 2;
+        httpTestFetch(manager, port, paths, pathsCount, false);
+        assert(8 == server.acceptedCount);
+        server.maxRequestsPerConnection = 0;
+
+        const char* compressedPaths[] = {"/gzip", "/deflate", "/raw-deflate", "/gzip"};
+        httpTestFetch(manager, port, compressedPaths, 4);
+        server.chunked = false;
+        httpTestFetch(manager, port, compressedPaths, 4);
+        assert(8 == server.compressedCount);
+        httpTestFetch(manager, port, "/gzip", true, false);
+        assert(8 == server.compressedCount);
+
+        // Request with side effects isn't sent on pooled socket, though its own socket is pooled afterwards.
+        assert(0 != manager.idleSocketsCount());
+        ulong_t acceptedCount = server.acceptedCount;
+        httpTestFetch(manager, port, "/post", true, true, HttpConnection::methodPost);
+        assert(acceptedCount + 1 == server.acceptedCount);
+        httpTestFetch(manager, port, "/get");
+        assert(acceptedCount + 1 == server.acceptedCount);
+    }
+    loopbackTestServerStop(server);
+}
+
+// Compares sequential and pipelined fetching of httpBenchmarkRequestsCount pages over persistent connection to server with long round trip time.
+void test_HttpPipeliningBenchmark()
+{
+    HttpTestServer server;
+    httpTestServerStart(server);
+    server.delay = httpBenchmarkRoundTripTime;
+
+    char paths[httpBenchmarkRequestsCount][16];
+    const char* pathPointers[httpBenchmarkRequestsCount];
+    for (ulong_t i = 0; i < httpBenchmarkRequestsCount; ++i)
+    {
+        StrPrintF(paths[i], "/item%lu", i);
+        pathPointers[i] = paths[i];
+    }
+    tick_t sequential, pipelined;
+    {
+        SocketConnectionManager manager;
+        tick_t start = ticks();
+        for (ulong_t i = 0; i < httpBenchmarkRequestsCount; ++i)
+            httpTestFetch(manager, server.port, pathPointers[i]);
+        sequential = ticks() - start;
+
+        start = ticks();
+        httpTestFetch(manager, server.port, pathPointers, httpBenchmarkRequestsCount);
+        pipelined = ticks() - start;
+    }
+    assert(1 == server.acceptedCount);
+    LogStrUlong(eLogDebug, _T("test_HttpPipeliningBenchmark(): sequential requests, ticks spent: "), sequential);
+    LogStrUlong(eLogDebug, _T("test_HttpPipeliningBenchmark(): pipelined requests, ticks spent: "), pipelined);
+    assert(pipelined < sequential);
+    loopbackTestServerStop(server);
+}
+
+#endif
@@ -3,19 +3,30 @@
 
 #include <SimpleSocketConnection.hpp>
 #include <Reader.hpp>
+#include <Inflater.hpp>
 #include <vector>
 #include <utility>
-#include <list>
 #include <memory>
 
 namespace ArsLexis {
 
+    /**
+     * HTTP/1.1 client connection.
+     * Persistent connections are used by default: when response is complete and server agrees to keep the connection,
+     * socket is handed over to SocketConnectionManager, and next HttpConnection to the same serverAddress reuses it
+     * instead of resolving and connecting again. If reused socket turns out to be closed by server before any response
+     * arrives, request is transparently repeated on a new one.
+     * More GET requests may be pipelined after the first one with addPipelinedUri(): they are all sent at once and
+     * responses are processed in order, each with its own Reader (see responseIndex()). Requests whose responses
+     * didn't arrive before server closed the connection are sent again on a new one.
+     * Bodies compressed with gzip or deflate Content-Encoding are decompressed on the fly before processBodyContents().
+     */
     class HttpConnection: public SimpleSocketConnection {
-    
+
     public:
-    
+
         explicit HttpConnection(SocketConnectionManager& manager);
-        
+
         ~HttpConnection();
 
         void setProtocolVersion(uint_t major, uint_t minor)
@@ -23,7 +34,7 @@ namespace ArsLexis {
             protocolVersionMajor_=major;
             protocolVersionMinor_=minor;
         }
-        
+
         enum RequestMethod {
             methodOptions,
             methodGet,
@@ -37,173 +48,271 @@ namespace ArsLexis {
 
         void setRequestMethod(RequestMethod rm)
         {requestMethod_=rm;}
-        
-        void setMessageBody(const String& mb)
+
+        void setMessageBody(const NarrowString& mb)
         {messageBody_=mb;}
-        
-        void setUri(const String& uri);
-        
+
+        //! Absolute http:// uri also sets serverAddress (with port 80 unless given).
+        void setUri(const NarrowString& uri);
+
         enum Error {
             errHttpUnknownTransferEncoding=errFirstAvailable,
             errHttpUnsupportedStatusCode,
             errHttpUnexpectedEndOfChunk,
+            errHttpUnsupportedContentEncoding,
             errFirstAvailable
         };
-        
-        void addRequestHeader(const String& field, const String& value);
+
+        void addRequestHeader(const NarrowString& field, const NarrowString& value);
+
+        //! Queues GET request for uri (on the same server) to be sent right after the one set with setUri().
+        void addPipelinedUri(const NarrowString& uri)
+        {pipelinedUris_.push_back(uri);}
+
+        ulong_t pipelinedUrisCount() const
+        {return pipelinedUris_.size();}
+
+        //! Asks server to keep connection open for reuse after response, on by default.
+        void setKeepAlive(bool value)
+        {keepAlive_=value;}
+
+        bool keepAlive() const
+        {return keepAlive_;}
+
+        //! Sends Accept-Encoding for gzip and deflate and decompresses such bodies, on by default.
+        void setAcceptCompression(bool value)
+        {acceptCompression_=value;}
+
+        //! True if request was sent on idle socket of previous connection.
+        bool reusedSocket() const
+        {return reusedSocket_;}
 
     private:
-    
+
         uint_t protocolVersionMajor_:4;
         uint_t protocolVersionMinor_:4;
         RequestMethod requestMethod_:8;
-        
+
         bool insideResponseHeaders_:1;
         bool insideResponseBody_:1;
         bool chunkedEncoding_:1;
         bool skippingInfoResponse_:1;
         bool bodyContentsAvailable_:1;
-        bool finished_:1;
         bool chunkedBodyFinished_:1;
+        bool responseFinished_:1;
+        bool keepAlive_:1;
+        bool responseKeepAlive_:1;
+        bool reusedSocket_:1;
+        bool acceptCompression_:1;
+        //! Message body was sent with request, which is cleared from messageBody_ once it's rendered.
+        bool requestHasBody_:1;
+
+        enum ContentEncoding {
+            encodingIdentity,
+            encodingGzip,
+            encodingDeflate
+        };
+        ContentEncoding contentEncoding_:4;
+
+    protected:
 
-    protected:        
-        
         static const ulong_t contentLengthUnavailable=(ulong_t)-1;
-        
-    private:        
-        
+
+    private:
+
         ulong_t contentLength_;
         ulong_t readContentLength_;
-        
-        String uri_;
-        String messageBody_;
-        typedef std::pair<String, String> RequestField_t;
+
+        //! Response being processed, 0 for the one to request set with setUri(), i+1 for pipelinedUris_[i].
+        ulong_t responseIndex_;
+        //! Value of responseIndex_ when request was last retried on a new socket.
+        ulong_t retryResponseIndex_;
+
+        NarrowString uri_;
+        typedef std::vector<NarrowString> Uris_t;
+        Uris_t pipelinedUris_;
+        //! Where each request starts in the rendered one, so that only ones without response are sent again.
+        typedef std::vector<ulong_t> RequestOffsets_t;
+        RequestOffsets_t requestOffsets_;
+        NarrowString address_;
+        NarrowString messageBody_;
+        typedef std::pair<NarrowString, NarrowString> RequestField_t;
         typedef std::vector<RequestField_t*> RequestFields_t;
         RequestFields_t requestFields_;
 
-        void renderRequestLine(String& out);
+        void renderRequestLine(NarrowString& out, RequestMethod method, const NarrowString& uri);
+
+        void renderHeaderField(NarrowString& out, const NarrowString& field, const NarrowString& value);
 
-        void renderHeaderField(String& out, const RequestField_t& field);
+        bool hasRequestHeader(const char* field) const;
 
         status_t commitRequest();
-        
-        typedef std::list<String> Chunks_t;
-        Chunks_t chunks_;
-        
-        bool nextResponseLine(String& line, bool finish);
-        
+
+        //! Only GET and HEAD requests without body may be sent on a pooled socket or sent again, as server may have acted on them already.
+        bool idempotentRequest() const;
+
+        status_t processResponse(bool finish);
+
         status_t processResponseHeaders(bool finish);
-        
-        status_t processStatusLine(const String& line);
-        
-        status_t processHeaderLine(const String& line);
 
+        void processHeadersEnd();
+
+        status_t processStatusLine(const NarrowString& line);
+
+        status_t processHeaderLine(const NarrowString& line);
+
+        status_t finishResponse();
+
+        void startNextResponse();
+
+        bool canRetryRequest() const;
+
+        status_t retryRequest();
+
+        /**
+         * Reads body from response buffer, up to Content-Length if it's known, in as large blocks as were received.
+         * Returns no more data (0 length) when buffer is exhausted, reading continues when next part of response arrives.
+         */
         class BodyReader: public Reader {
         protected:
-        
+
             HttpConnection& connection_;
-            
+
         private:
-        
-            uint_t charsRead_;
-            
-            
-            String& body() 
-            {return connection_.response();}
-            
-            status_t readNextChunk();
-            
-            bool eof() const
-            {return connection_.finished_;}
-            
-        protected:            
-            
-            void flush();
-            
-            Logger& log() 
-            {return connection_.log();}
-                
+
+            ulong_t position_;
+            ulong_t rawLength_;
+
+        protected:
+
+            //! Copies up to length bytes of body as transferred (with chunk framing), returns number of bytes copied.
+            ulong_t readTransferred(char* buffer, ulong_t length);
+
         public:
-        
-            //! Number of chars to read before we start removing them from start of body.
-            enum {chunkLength=512};
-            
+
             explicit BodyReader(HttpConnection& conn);
-            
-            status_t read(int& chr);
-            
-            status_t read(int& num, String& dst, int offset, int range);
-            
+
+            status_t readRaw(void* buffer, ulong_t& length);
+
+            //! Removes consumed part of body from response buffer.
+            void flush();
+
+            virtual bool bodyFinished() const;
+
             ~BodyReader();
-            
+
         };
-        
+
         class ChunkedBodyReader: public BodyReader {
-            
-            String chunkHeader_;
+
+            NarrowString chunkHeader_;
             enum State {
                 stateInHeader,
                 stateAfterHeader,
                 stateInBody,
                 stateAfterBodyCr,
                 stateAfterBodyLf,
-                stateAfterLastChunkCr,
-                stateAfterLastChunkLf,
                 stateFinished
             } state_;
             ulong_t chunkPosition_;
             ulong_t chunkLength_;
-            
+
             status_t parseChunkHeader();
-            
+
         public:
 
             explicit ChunkedBodyReader(HttpConnection& conn);
 
-            status_t read(int& chr);
-            
+            status_t readRaw(void* buffer, ulong_t& length);
+
+            bool bodyFinished() const
+            {return stateFinished==state_;}
+
             ~ChunkedBodyReader();
-            
+
+        };
+
+        //! Decompresses body read from BodyReader.
+        class InflatingReader: public Reader {
+
+            Reader& source_;
+            Inflater inflater_;
+
+        public:
+
+            InflatingReader(Reader& source, Inflater::Format format);
+
+            status_t readRaw(void* buffer, ulong_t& length);
+
+            bool finished() const
+            {return inflater_.finished();}
+
+            ~InflatingReader();
+
         };
-        
+
         friend class BodyReader;
         friend class ChunkedBodyReader;
 
         typedef std::auto_ptr<BodyReader> ReaderPtr;
         ReaderPtr reader_;
-        
-        status_t processResponseBody();
-        
+
+        typedef std::auto_ptr<InflatingReader> InflatingReaderPtr;
+        InflatingReaderPtr inflatingReader_;
+
+        status_t processResponseBody(bool finish);
+
     protected:
-    
+
+        status_t resolve();
+
         status_t open();
-    
-        virtual status_t handleResponseField(const String& field, const String& value);
-        
-        virtual status_t handleStatusLine(uint_t versionMajor, uint_t versionMinor, uint_t statusCode, const String& reason);
-        
+
+        virtual status_t handleResponseField(const NarrowString& field, const NarrowString& value);
+
+        virtual status_t handleStatusLine(uint_t versionMajor, uint_t versionMinor, uint_t statusCode, const NarrowString& reason);
+
+        status_t notifyWritable();
+
         status_t notifyReadable();
-        
+
         status_t notifyFinished();
-        
+
         status_t notifyProgress();
-        
+
+        /**
+         * Called whenever part of body arrives, should read from reader until it returns no more data.
+         * Default implementation discards body.
+         */
         virtual status_t processBodyContents(Reader& reader);
-        
+
+        //! Called when response (each of pipelined ones) is complete.
+        virtual status_t handleResponseFinished();
+
     public:
-        
+
         ulong_t contentLength() const
         {return contentLength_;}
-        
+
         ulong_t readContentLength() const
         {return readContentLength_;}
 
         bool bodyContentsAvailable() const
         {return bodyContentsAvailable_;}
-        
-        
+
+        bool responseFinished() const
+        {return responseFinished_;}
+
+        ulong_t responseIndex() const
+        {return responseIndex_;}
+
     };
 
 }
 
-#endif
\ No newline at end of file
+#if defined(_POSIX) && defined(DEBUG)
+void test_HttpConnection();
+void test_HttpPipeliningBenchmark();
+#endif
+
+#endif
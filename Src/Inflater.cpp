@@ -0,0 +1,687 @@
+#include <Inflater.hpp>
+#include <algorithm>
+
+typedef unsigned char byte_t;
+
+enum {
+    windowSize = 32768,
+    windowMask = windowSize - 1,
+    maxCodeLength = 15,
+    lengthCodesCount = 288,
+    distanceCodesCount = 30,
+    codeLengthCodesCount = 19,
+    endOfBlock = 256,
+    adlerBase = 65521,
+    gzipFlagHeaderCrc = 2,
+    gzipFlagExtra = 4,
+    gzipFlagName = 8,
+    gzipFlagComment = 16
+};
+
+static const ushort_t lengthBase[] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const byte_t lengthExtra[] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static const ushort_t distanceBase[] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+
+static const byte_t distanceExtra[] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+static const byte_t codeLengthOrder[codeLengthCodesCount] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+static ulong_t crcTable[256];
+static bool crcTableReady = false;
+
+static void buildCrcTable()
+{
+    for (ulong_t i = 0; i < 256; ++i)
+    {
+        ulong_t crc = i;
+        for (int k = 0; k < 8; ++k)
+            crc = (crc & 1) ? (0xedb88320UL ^ (crc >> 1)) : (crc >> 1);
+        crcTable[i] = crc;
+    }
+    crcTableReady = true;
+}
+
+// Incomplete codes are allowed (deflate uses them for single distance code), oversubscribed ones aren't.
+static bool buildHuffman(ushort_t* count, ushort_t* symbol, const byte_t* lengths, ulong_t n)
+{
+    for (int len = 0; len <= maxCodeLength; ++len)
+        count[len] = 0;
+    for (ulong_t i = 0; i < n; ++i)
+        ++count[lengths[i]];
+
+    long left = 1;
+    for (int len = 1; len <= maxCodeLength; ++len)
+    {
+        left <<= 1;
+        left -= count[len];
+        if (left < 0)
+            return false;
+    }
+
+    ushort_t offsets[maxCodeLength + 1];
+    offsets[1] = 0;
+    for (int len = 1; len < maxCodeLength; ++len)
+        offsets[len + 1] = offsets[len] + count[len];
+    for (ulong_t i = 0; i < n; ++i)
+        if (0 != lengths[i])
+            symbol[offsets[lengths[i]]++] = ushort_t(i);
+    return true;
+}
+
+Inflater::Inflater(Format format):
+    format_(format),
+    state_(formatRaw == format ? stateBlockHeader : stateHeader),
+    inputPosition_(0),
+    bitBuffer_(0),
+    bitCount_(0),
+    window_(NULL),
+    outputCount_(0),
+    checksum_(formatGzip == format ? 0 : 1),
+    lastBlock_(false),
+    storedLeft_(0),
+    copyLength_(0),
+    copyDistance_(0)
+{
+    if (!crcTableReady)
+        buildCrcTable();
+}
+
+Inflater::~Inflater()
+{
+    free(window_);
+}
+
+bool Inflater::feed(const char* input, ulong_t length)
+{
+    ErrTry {
+        input_.append(input, length);
+    }
+    ErrCatch (ex) {
+        return false;
+    }
+    ErrEndCatch
+    return true;
+}
+
+void Inflater::save(Checkpoint& checkpoint) const
+{
+    checkpoint.position = inputPosition_;
+    checkpoint.bitBuffer = bitBuffer_;
+    checkpoint.bitCount = bitCount_;
+}
+
+void Inflater::restore(const Checkpoint& checkpoint)
+{
+    inputPosition_ = checkpoint.position;
+    bitBuffer_ = checkpoint.bitBuffer;
+    bitCount_ = checkpoint.bitCount;
+}
+
+// Bits are taken starting with the least significant bit of each byte, count is at most 16.
+bool Inflater::bits(uint_t count, ulong_t& value)
+{
+    while (bitCount_ < count)
+    {
+        if (input_.length() == inputPosition_)
+            return false;
+        bitBuffer_ |= ulong_t(byte_t(input_[inputPosition_++])) << bitCount_;
+        bitCount_ += 8;
+    }
+    value = bitBuffer_ & ((1UL << count) - 1);
+    bitBuffer_ >>= count;
+    bitCount_ -= count;
+    return true;
+}
+
+// Huffman codes are stored starting with their most significant bit, so they're read bit by bit.
+bool Inflater::decode(const Huffman& huffman, ulong_t& symbol)
+{
+    long code = 0;
+    long first = 0;
+    long index = 0;
+    for (int len = 1; len <= maxCodeLength; ++len)
+    {
+        ulong_t bit;
+        if (!bits(1, bit))
+            return false;
+        code |= bit;
+        long count = huffman.count[len];
+        if (code - first < count)
+        {
+            symbol = huffman.symbol[index + code - first];
+            return true;
+        }
+        index += count;
+        first += count;
+        first <<= 1;
+        code <<= 1;
+    }
+    // Incomplete code with bits that don't match any symbol.
+    symbol = ulong_t(-1);
+    return true;
+}
+
+Inflater::Result Inflater::readHeader()
+{
+    ulong_t b0, b1;
+    if (!bits(8, b0) || !bits(8, b1))
+        return resultNeedInput;
+
+    if (formatZlib == format_)
+    {
+        if (8 != (b0 & 15) || 0 != (b0 * 256 + b1) % 31)
+        {
+            // Not zlib header, so it's raw deflate data.
+            bitBuffer_ = 0;
+            bitCount_ = 0;
+            inputPosition_ = 0;
+            format_ = formatRaw;
+            state_ = stateBlockHeader;
+            return resultOk;
+        }
+        // Preset dictionary isn't used in HTTP.
+        if (0 != (b1 & 0x20))
+            return resultError;
+        state_ = stateBlockHeader;
+        return resultOk;
+    }
+
+    assert(formatGzip == format_);
+    ulong_t method, flags, ignore;
+    if (!bits(8, method) || !bits(8, flags))
+        return resultNeedInput;
+    if (0x1f != b0 || 0x8b != b1 || 8 != method)
+        return resultError;
+    // Modification time, extra flags and OS.
+    for (int i = 0; i < 6; ++i)
+        if (!bits(8, ignore))
+            return resultNeedInput;
+    if (0 != (flags & gzipFlagExtra))
+    {
+        ulong_t length;
+        if (!bits(16, length))
+            return resultNeedInput;
+        if (input_.length() - inputPosition_ < length)
+            return resultNeedInput;
+        inputPosition_ += length;
+    }
+    for (ulong_t flag = gzipFlagName; flag <= gzipFlagComment; flag <<= 1)
+    {
+        if (0 == (flags & flag))
+            continue;
+        ulong_t chr;
+        do {
+            if (!bits(8, chr))
+                return resultNeedInput;
+        } while (0 != chr);
+    }
+    if (0 != (flags & gzipFlagHeaderCrc) && !bits(16, ignore))
+        return resultNeedInput;
+    state_ = stateBlockHeader;
+    return resultOk;
+}
+
+Inflater::Result Inflater::readBlockHeader()
+{
+    ulong_t last, type;
+    if (!bits(1, last) || !bits(2, type))
+        return resultNeedInput;
+    lastBlock_ = (0 != last);
+
+    if (0 == type)
+    {
+        // Stored block starts at byte boundary, and less than 8 bits are ever left in bitBuffer_.
+        bitBuffer_ = 0;
+        bitCount_ = 0;
+        ulong_t length, complement;
+        if (!bits(16, length) || !bits(16, complement))
+            return resultNeedInput;
+        if (length != (~complement & 0xffff))
+            return resultError;
+        storedLeft_ = length;
+        state_ = stateStored;
+        return resultOk;
+    }
+    if (1 == type)
+    {
+        byte_t lengths[lengthCodesCount];
+        ulong_t i = 0;
+        for (; i < 144; ++i)
+            lengths[i] = 8;
+        for (; i < 256; ++i)
+            lengths[i] = 9;
+        for (; i < 280; ++i)
+            lengths[i] = 7;
+        for (; i < lengthCodesCount; ++i)
+            lengths[i] = 8;
+        buildHuffman(lengthCodes_.count, lengthCodes_.symbol, lengths, lengthCodesCount);
+        for (i = 0; i < distanceCodesCount; ++i)
+            lengths[i] = 5;
+        buildHuffman(distanceCodes_.count, distanceCodes_.symbol, lengths, distanceCodesCount);
+        state_ = stateCodes;
+        return resultOk;
+    }
+    if (2 == type)
+        return readDynamicCodes();
+    return resultError;
+}
+
+// Whole table description must be available, it's up to about 300 bytes long.
+Inflater::Result Inflater::readDynamicCodes()
+{
+    ulong_t lengthsCount, distancesCount, codeLengthsCount;
+    if (!bits(5, lengthsCount) || !bits(5, distancesCount) || !bits(4, codeLengthsCount))
+        return resultNeedInput;
+    lengthsCount += 257;
+    distancesCount += 1;
+    codeLengthsCount += 4;
+    if (lengthsCount > 286 || distancesCount > distanceCodesCount)
+        return resultError;
+
+    byte_t lengths[lengthCodesCount + distanceCodesCount];
+    ulong_t i;
+    for (i = 0; i < codeLengthCodesCount; ++i)
+        lengths[codeLengthOrder[i]] = 0;
+    for (i = 0; i < codeLengthsCount; ++i)
+    {
+        ulong_t length;
+        if (!bits(3, length))
+            return resultNeedInput;
+        lengths[codeLengthOrder[i]] = byte_t(length);
+    }
+    Huffman codeLengths;
+    if (!buildHuffman(codeLengths.count, codeLengths.symbol, lengths, codeLengthCodesCount))
+        return resultError;
+
+    ulong_t total = lengthsCount + distancesCount;
+    for (i = 0; i < total; )
+    {
+        ulong_t symbol;
+        if (!decode(codeLengths, symbol))
+            return resultNeedInput;
+        if (symbol < 16)
+        {
+            lengths[i++] = byte_t(symbol);
+            continue;
+        }
+        ulong_t repeat;
+        byte_t length = 0;
+        if (16 == symbol)
+        {
+            if (0 == i)
+                return resultError;
+            length = lengths[i - 1];
+            if (!bits(2, repeat))
+                return resultNeedInput;
+            repeat += 3;
+        }
+        else if (17 == symbol)
+        {
+            if (!bits(3, repeat))
+                return resultNeedInput;
+            repeat += 3;
+        }
+        else if (18 == symbol)
+        {
+            if (!bits(7, repeat))
+                return resultNeedInput;
+            repeat += 11;
+        }
+        else
+            return resultError;
+        if (i + repeat > total)
+            return resultError;
+        while (0 != repeat--)
+            lengths[i++] = length;
+    }
+    if (0 == lengths[endOfBlock])
+        return resultError;
+    if (!buildHuffman(lengthCodes_.count, lengthCodes_.symbol, lengths, lengthsCount))
+        return resultError;
+    if (!buildHuffman(distanceCodes_.count, distanceCodes_.symbol, lengths + lengthsCount, distancesCount))
+        return resultError;
+    state_ = stateCodes;
+    return resultOk;
+}
+
+void Inflater::put(char chr, char* output, ulong_t& produced)
+{
+    window_[outputCount_++ & windowMask] = chr;
+    output[produced++] = chr;
+}
+
+// Literal is output right away, length and distance of back reference are read together and copied in stateCopy.
+Inflater::Result Inflater::readSymbol(char* output, ulong_t& produced)
+{
+    ulong_t symbol;
+    if (!decode(lengthCodes_, symbol))
+        return resultNeedInput;
+    if (symbol < endOfBlock)
+    {
+        put(char(symbol), output, produced);
+        return resultOk;
+    }
+    if (endOfBlock == symbol)
+    {
+        if (!lastBlock_)
+            state_ = stateBlockHeader;
+        else
+        {
+            // Trailer starts at byte boundary.
+            bitBuffer_ = 0;
+            bitCount_ = 0;
+            state_ = (formatRaw == format_ ? stateFinished : stateTrailer);
+        }
+        return resultOk;
+    }
+
+    symbol -= endOfBlock + 1;
+    if (symbol >= sizeof(lengthBase) / sizeof(lengthBase[0]))
+        return resultError;
+    ulong_t extra;
+    if (!bits(lengthExtra[symbol], extra))
+        return resultNeedInput;
+    ulong_t length = lengthBase[symbol] + extra;
+
+    if (!decode(distanceCodes_, symbol))
+        return resultNeedInput;
+    if (symbol >= distanceCodesCount)
+        return resultError;
+    if (!bits(distanceExtra[symbol], extra))
+        return resultNeedInput;
+    ulong_t distance = distanceBase[symbol] + extra;
+    if (distance > outputCount_ || distance > windowSize)
+        return resultError;
+
+    copyLength_ = length;
+    copyDistance_ = distance;
+    state_ = stateCopy;
+    return resultOk;
+}
+
+void Inflater::updateChecksum(const char* data, ulong_t length)
+{
+    const byte_t* p = (const byte_t*)data;
+    const byte_t* end = p + length;
+    if (formatGzip == format_)
+    {
+        ulong_t crc = checksum_ ^ 0xffffffffUL;
+        while (p != end)
+            crc = crcTable[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        checksum_ = (crc ^ 0xffffffffUL) & 0xffffffffUL;
+        return;
+    }
+    ulong_t a = checksum_ & 0xffff;
+    ulong_t b = (checksum_ >> 16) & 0xffff;
+    while (p != end)
+    {
+        // Sums can't overflow 32 bits in this many steps before reduction.
+        const byte_t* stop = p + std::min<ulong_t>(end - p, 5552);
+        while (p != stop)
+        {
+            a += *p++;
+            b += a;
+        }
+        a %= adlerBase;
+        b %= adlerBase;
+    }
+    checksum_ = (b << 16) | a;
+}
+
+Inflater::Result Inflater::readTrailer()
+{
+    ulong_t b[8];
+    ulong_t count = (formatGzip == format_ ? 8 : 4);
+    for (ulong_t i = 0; i < count; ++i)
+        if (!bits(8, b[i]))
+            return resultNeedInput;
+
+    if (formatGzip == format_)
+    {
+        ulong_t crc = b[0] | (b[1] << 8) | (b[2] << 16) | (b[3] << 24);
+        ulong_t size = b[4] | (b[5] << 8) | (b[6] << 16) | (b[7] << 24);
+        if (crc != checksum_ || size != (outputCount_ & 0xffffffffUL))
+            return resultError;
+    }
+    else
+    {
+        ulong_t adler = (b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+        if (adler != checksum_)
+            return resultError;
+    }
+    state_ = stateFinished;
+    return resultOk;
+}
+
+bool Inflater::inflate(char* output, ulong_t& outputLength)
+{
+    if (NULL == window_ && NULL == (window_ = (char*)malloc(windowSize)))
+        return false;
+
+    ulong_t produced = 0;
+    // Part of output already included in checksum.
+    ulong_t checked = 0;
+    Result result = resultOk;
+    while (resultOk == result && stateFinished != state_)
+    {
+        Checkpoint checkpoint;
+        save(checkpoint);
+        switch (state_)
+        {
+            case stateHeader:
+                result = readHeader();
+                break;
+
+            case stateBlockHeader:
+                result = readBlockHeader();
+                break;
+
+            case stateStored:
+            {
+                ulong_t length = std::min<ulong_t>(storedLeft_, outputLength - produced);
+                length = std::min<ulong_t>(length, input_.length() - inputPosition_);
+                const char* data = input_.data() + inputPosition_;
+                for (ulong_t i = 0; i < length; ++i)
+                    put(data[i], output, produced);
+                inputPosition_ += length;
+                storedLeft_ -= length;
+                // Copied bytes are consumed for good, so input can run out only on the next pass.
+                if (0 == storedLeft_)
+                    state_ = (!lastBlock_ ? stateBlockHeader : (formatRaw == format_ ? stateFinished : stateTrailer));
+                else if (produced == outputLength)
+                    result = resultOutputFull;
+                else if (0 == length)
+                    result = resultNeedInput;
+                break;
+            }
+
+            case stateCodes:
+                if (produced == outputLength)
+                    result = resultOutputFull;
+                else
+                    result = readSymbol(output, produced);
+                break;
+
+            case stateCopy:
+                while (0 != copyLength_ && produced != outputLength)
+                {
+                    put(window_[(outputCount_ - copyDistance_) & windowMask], output, produced);
+                    --copyLength_;
+                }
+                if (0 == copyLength_)
+                    state_ = stateCodes;
+                else
+                    result = resultOutputFull;
+                break;
+
+            case stateTrailer:
+                updateChecksum(output + checked, produced - checked);
+                checked = produced;
+                result = readTrailer();
+                break;
+
+            default:
+                assert(false);
+        }
+        if (resultNeedInput == result)
+            restore(checkpoint);
+    }
+    if (formatRaw != format_)
+        updateChecksum(output + checked, produced - checked);
+
+    input_.erase(0, inputPosition_);
+    inputPosition_ = 0;
+    outputLength = produced;
+    return resultError != result;
+}
+
+#ifndef NDEBUG
+
+// Raw deflate (fixed Huffman codes) of "hello hello hello world".
+static const byte_t testFixedDeflate[] = {
+    0xcb, 0x48, 0xcd, 0xc9, 0xc9, 0x57, 0xc8, 0x40, 0x22, 0xcb, 0xf3, 0x8b, 0x72, 0x52, 0x00
+};
+
+static const char testFixedText[] = "hello hello hello world";
+
+enum {
+    testDynamicRandomLength = 256,
+    testDynamicFillerLength = 32200
+};
+
+// Pseudo-random letters repeated 3 times with filler between them, so that each repeat is copied from over 32000 bytes back.
+static NarrowString testDynamicText()
+{
+    NarrowString random;
+    ulong_t seed = 1;
+    for (ulong_t i = 0; i < testDynamicRandomLength; ++i)
+    {
+        seed = (seed * 1103515245 + 12345) & 0xffffffff;
+        random.append(1, char('a' + (seed >> 16) % 26));
+    }
+    NarrowString text(random);
+    for (ulong_t i = 0; i < 2; ++i)
+    {
+        for (ulong_t j = 0; j < testDynamicFillerLength; ++j)
+            text.append(1, char('0' + j % 11));
+        text.append(random);
+    }
+    return text;
+}
+
+// testDynamicText() raw deflated with zlib level 9, a single block with dynamic Huffman codes.
+static const byte_t testDynamicDeflate[] = {
+    0xed, 0xdd, 0xc9, 0x95, 0x9c, 0x30, 0x00, 0x40, 0xc1, 0x94, 0xbc, 0xdb, 0x33, 0xd9, 0x08, 0xc4,
+    0xd2, 0x08, 0x9a, 0x4d, 0x6c, 0x8a, 0xde, 0x79, 0xcc, 0xab, 0x5b, 0x05, 0xf0, 0xef, 0x7f, 0x3d,
+    0x4a, 0x59, 0xf2, 0x6b, 0xbb, 0x9a, 0x5c, 0xa5, 0x66, 0xac, 0xfa, 0x2a, 0xae, 0xd3, 0xd1, 0x2f,
+    0xed, 0x53, 0xdd, 0x7b, 0xf3, 0xda, 0x52, 0x1d, 0xb7, 0xf9, 0xbd, 0x35, 0x53, 0x53, 0x0d, 0xe5,
+    0xc9, 0xe7, 0xd4, 0xdc, 0xfb, 0xde, 0xcf, 0x21, 0xb4, 0x6d, 0xbc, 0xdb, 0xb6, 0xae, 0xb7, 0x6e,
+    0x88, 0xc7, 0x5c, 0x1f, 0x29, 0xa5, 0xf5, 0x1e, 0xa6, 0x7c, 0x0d, 0xd7, 0x1e, 0xc7, 0xf7, 0x33,
+    0xbc, 0x96, 0x36, 0x54, 0x65, 0x8d, 0xf3, 0x50, 0xe7, 0x79, 0x3c, 0x62, 0x5a, 0xea, 0xa7, 0x34,
+    0xfd, 0x11, 0xf7, 0x2b, 0x84, 0xb2, 0x86, 0xee, 0xcc, 0xa1, 0x3a, 0xaf, 0xe5, 0x5e, 0xd3, 0x2b,
+    0x94, 0x26, 0xbd, 0x9b, 0x3b, 0xc6, 0xe1, 0x69, 0xe7, 0x92, 0xab, 0xa5, 0x8f, 0x63, 0xec, 0xf2,
+    0x3d, 0x9e, 0x39, 0x57, 0xd3, 0x35, 0xec, 0xf3, 0xf3, 0xcc, 0x69, 0x58, 0x86, 0xf1, 0x35, 0x0d,
+    0x5b, 0xd8, 0x9f, 0xb1, 0xdf, 0x4a, 0xea, 0x9b, 0x7c, 0x3e, 0x77, 0x5f, 0xc6, 0xee, 0x3c, 0xaa,
+    0x69, 0xca, 0x25, 0x0d, 0x7b, 0x8c, 0xf3, 0xfa, 0x4e, 0xe1, 0x68, 0xb6, 0x18, 0xf6, 0xb8, 0x77,
+    0x57, 0x5f, 0x97, 0xb3, 0x9f, 0xeb, 0xf1, 0x98, 0xd3, 0xf8, 0xc4, 0x98, 0xb7, 0x2e, 0x4d, 0xa5,
+    0x84, 0x30, 0x57, 0x7b, 0xc9, 0xdb, 0xfa, 0xed, 0xfb, 0x8f, 0x9f, 0xbf, 0x7e, 0xff, 0xf9, 0xfb,
+    0xef, 0xe3, 0x13, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+    0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+    0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+    0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+    0xf1, 0x4b, 0x70, 0xf5, 0xb1, 0x97, 0x02, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22,
+    0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22,
+    0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22,
+    0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22,
+    0x22, 0x22, 0x22, 0x22, 0xfa, 0xd8, 0x7f, 0xa1, 0x8f, 0xfd, 0x7f
+};
+
+// Decompresses input fed in pieces of inputStep bytes into output buffer of outputStep bytes.
+static bool testInflate(Inflater::Format format, const char* input, ulong_t length, ulong_t inputStep, ulong_t outputStep, NarrowString& out)
+{
+    Inflater inflater(format);
+    out.clear();
+    char buffer[64];
+    assert(outputStep <= sizeof(buffer));
+    ulong_t fed = 0;
+    while (!inflater.finished())
+    {
+        ulong_t produced = outputStep;
+        if (!inflater.inflate(buffer, produced))
+            return false;
+        out.append(buffer, produced);
+        if (produced == outputStep)
+            continue;
+        if (fed == length)
+            return inflater.finished();
+        ulong_t step = std::min(inputStep, length - fed);
+        inflater.feed(input + fed, step);
+        fed += step;
+    }
+    return true;
+}
+
+void test_Inflater()
+{
+    NarrowString out;
+    const char* fixed = (const char*)testFixedDeflate;
+    ulong_t fixedLength = sizeof(testFixedDeflate);
+    bool res = testInflate(Inflater::formatRaw, fixed, fixedLength, fixedLength, 64, out);
+    assert(res && testFixedText == out);
+    res = testInflate(Inflater::formatRaw, fixed, fixedLength, 1, 1, out);
+    assert(res && testFixedText == out);
+    // Raw data sent as "deflate".
+    res = testInflate(Inflater::formatZlib, fixed, fixedLength, 3, 5, out);
+    assert(res && testFixedText == out);
+
+    // Output is longer than the 32 KB window, so back-references wrap around it.
+    NarrowString dynamicText = testDynamicText();
+    NarrowString dynamic((const char*)testDynamicDeflate, sizeof(testDynamicDeflate));
+    assert(2 == ((dynamic[0] >> 1) & 3));
+    res = testInflate(Inflater::formatRaw, dynamic.data(), dynamic.length(), dynamic.length(), 64, out);
+    assert(res && dynamicText == out);
+    res = testInflate(Inflater::formatRaw, dynamic.data(), dynamic.length(), 1, 7, out);
+    assert(res && dynamicText == out);
+    dynamic.insert(0, "\x78\xda", 2);
+    dynamic.append("\x75\xdb\x5f\x9d", 4);
+    res = testInflate(Inflater::formatZlib, dynamic.data(), dynamic.length(), 5, 64, out);
+    assert(res && dynamicText == out);
+
+    // Stored block, wrapped in zlib format with Adler-32 of "abc" and in gzip format with CRC-32 and size.
+    NarrowString stored("\x01\x03\x00\xfc\xff" "abc", 8);
+    NarrowString zlib("\x78\x01", 2);
+    zlib.append(stored).append("\x02\x4d\x01\x27", 4);
+    res = testInflate(Inflater::formatZlib, zlib.data(), zlib.length(), 1, 2, out);
+    assert(res && "abc" == out);
+    NarrowString gzip("\x1f\x8b\x08\x08\0\0\0\0\0\x03name\0", 15);
+    gzip.append(stored).append("\xc2\x41\x24\x35\x03\0\0\0", 8);
+    res = testInflate(Inflater::formatGzip, gzip.data(), gzip.length(), 2, 64, out);
+    assert(res && "abc" == out);
+
+    gzip[gzip.length() - 8] ^= 1;
+    res = testInflate(Inflater::formatGzip, gzip.data(), gzip.length(), 64, 64, out);
+    assert(!res);
+    NarrowString broken(fixed, fixedLength);
+    // Reserved block type.
+    broken[0] = char(0x07);
+    res = testInflate(Inflater::formatRaw, broken.data(), broken.length(), 64, 64, out);
+    assert(!res);
+}
+
+#endif
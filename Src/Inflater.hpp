@@ -0,0 +1,113 @@
+#ifndef ARSLEXIS_INFLATER_HPP__
+#define ARSLEXIS_INFLATER_HPP__
+
+#include <Debug.hpp>
+#include <BaseTypes.hpp>
+#include <Utility.hpp>
+
+/**
+ * Streaming decompressor of deflate data (RFC 1951), raw or wrapped in zlib (RFC 1950) or gzip (RFC 1952) format,
+ * with no external dependencies. Compressed data may be fed in pieces of any size as it arrives: only the 32kB window
+ * of recent output and the part of input that doesn't make a complete code yet are kept.
+ */
+class Inflater: private NonCopyable
+{
+public:
+
+    enum Format {
+        formatRaw,
+        //! zlib format, falls back to raw deflate if header doesn't match (some HTTP servers send it as "deflate").
+        formatZlib,
+        formatGzip
+    };
+
+    explicit Inflater(Format format);
+
+    ~Inflater();
+
+    //! @return false if memory for input can't be allocated.
+    bool feed(const char* input, ulong_t length);
+
+    /**
+     * Decompresses as much of input fed so far as fits into output.
+     * @param outputLength on entry capacity of output, on return length of decompressed data, which is less than capacity
+     * only if more input is needed or stream is finished.
+     * @return false if input is malformed, checksum doesn't match or window can't be allocated.
+     */
+    bool inflate(char* output, ulong_t& outputLength);
+
+    //! True when the whole stream (including checksum) was decompressed and returned by inflate().
+    bool finished() const {return stateFinished == state_;}
+
+private:
+
+    enum State {
+        stateHeader,
+        stateBlockHeader,
+        stateStored,
+        stateCodes,
+        stateCopy,
+        stateTrailer,
+        stateFinished
+    };
+
+    enum Result {
+        resultOk,
+        resultNeedInput,
+        resultOutputFull,
+        resultError
+    };
+
+    //! Canonical Huffman code as number of codes of each length and symbols ordered by code.
+    struct Huffman {
+        ushort_t count[16];
+        ushort_t symbol[288];
+    };
+
+    struct Checkpoint {
+        ulong_t position;
+        ulong_t bitBuffer;
+        uint_t bitCount;
+    };
+
+    Format format_;
+    State state_;
+
+    NarrowString input_;
+    ulong_t inputPosition_;
+    ulong_t bitBuffer_;
+    uint_t bitCount_;
+
+    char* window_;
+    ulong_t outputCount_;
+    ulong_t checksum_;
+
+    bool lastBlock_;
+    ulong_t storedLeft_;
+    ulong_t copyLength_;
+    ulong_t copyDistance_;
+    Huffman lengthCodes_;
+    Huffman distanceCodes_;
+
+    void save(Checkpoint& checkpoint) const;
+    void restore(const Checkpoint& checkpoint);
+
+    bool bits(uint_t count, ulong_t& value);
+    bool decode(const Huffman& huffman, ulong_t& symbol);
+
+    Result readHeader();
+    Result readBlockHeader();
+    Result readDynamicCodes();
+    Result readSymbol(char* output, ulong_t& produced);
+    Result readTrailer();
+
+    void put(char chr, char* output, ulong_t& produced);
+    void updateChecksum(const char* data, ulong_t length);
+
+};
+
+#ifdef DEBUG
+void test_Inflater();
+#endif
+
+#endif // ARSLEXIS_INFLATER_HPP__
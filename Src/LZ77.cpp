@@ -0,0 +1,210 @@
+#include <LZ77.hpp>
+#include <algorithm>
+
+typedef unsigned char byte_t;
+
+enum {
+    minMatchLength = 4,
+    hashBits = 12,
+    hashSize = 1 << hashBits,
+    runMask = 15
+};
+
+static ulong_t hashPosition(const byte_t* p)
+{
+    ulong_t value = p[0] | (ulong_t(p[1]) << 8) | (ulong_t(p[2]) << 16) | (ulong_t(p[3]) << 24);
+    return ((value * 2654435761UL) & 0xffffffffUL) >> (32 - hashBits);
+}
+
+// Lengths not fitting into token nibble continue in following bytes, 255 meaning there's more.
+static bool writeLength(byte_t*& out, const byte_t* end, ulong_t length)
+{
+    while (length >= 255)
+    {
+        if (out == end)
+            return false;
+        *out++ = 255;
+        length -= 255;
+    }
+    if (out == end)
+        return false;
+    *out++ = byte_t(length);
+    return true;
+}
+
+static bool readLength(const byte_t*& in, const byte_t* end, ulong_t& length)
+{
+    byte_t b;
+    do {
+        if (in == end)
+            return false;
+        b = *in++;
+        length += b;
+    } while (255 == b);
+    return true;
+}
+
+// Sequence is token, literal run and (unless matchLength is 0, which ends the block) back reference.
+static bool writeSequence(byte_t*& out, const byte_t* end, const byte_t* literals, ulong_t literalsLength, ulong_t offset, ulong_t matchLength)
+{
+    if (out == end)
+        return false;
+    byte_t* token = out++;
+    *token = byte_t(std::min<ulong_t>(literalsLength, runMask) << 4);
+    if (literalsLength >= runMask && !writeLength(out, end, literalsLength - runMask))
+        return false;
+    if (ulong_t(end - out) < literalsLength)
+        return false;
+    memmove(out, literals, literalsLength);
+    out += literalsLength;
+    if (0 == matchLength)
+        return true;
+
+    if (end - out < 2)
+        return false;
+    *out++ = byte_t(offset);
+    *out++ = byte_t(offset >> 8);
+    matchLength -= minMatchLength;
+    *token |= byte_t(std::min<ulong_t>(matchLength, runMask));
+    if (matchLength >= runMask && !writeLength(out, end, matchLength - runMask))
+        return false;
+    return true;
+}
+
+ulong_t LZ77_Compress(const char* input, ulong_t length, char* output)
+{
+    assert(length <= LZ77_maxBlockLength);
+    if (length <= minMatchLength)
+        return 0;
+    // Positions are stored incremented by 1, so that 0 marks empty slot.
+    ushort_t* table = (ushort_t*)malloc(hashSize * sizeof(ushort_t));
+    if (NULL == table)
+        return 0;
+    memset(table, 0, hashSize * sizeof(ushort_t));
+
+    const byte_t* in = reinterpret_cast<const byte_t*>(input);
+    byte_t* out = reinterpret_cast<byte_t*>(output);
+    // Compressed block must be shorter than input to be worth it.
+    const byte_t* end = out + length - 1;
+    ulong_t anchor = 0;
+    ulong_t pos = 0;
+    bool fits = true;
+    while (fits && pos + minMatchLength <= length)
+    {
+        ulong_t hash = hashPosition(in + pos);
+        ulong_t candidate = table[hash];
+        table[hash] = ushort_t(pos + 1);
+        if (0 == candidate || 0 != memcmp(in + candidate - 1, in + pos, minMatchLength))
+        {
+            ++pos;
+            continue;
+        }
+        ulong_t ref = candidate - 1;
+        ulong_t matchLength = minMatchLength;
+        while (pos + matchLength < length && in[ref + matchLength] == in[pos + matchLength])
+            ++matchLength;
+        fits = writeSequence(out, end, in + anchor, pos - anchor, pos - ref, matchLength);
+        pos += matchLength;
+        anchor = pos;
+    }
+    if (fits)
+        fits = writeSequence(out, end, in + anchor, length - anchor, 0, 0);
+    free(table);
+    if (!fits)
+        return 0;
+    return out - reinterpret_cast<byte_t*>(output);
+}
+
+bool LZ77_Decompress(const char* input, ulong_t length, char* output, ulong_t& outputLength)
+{
+    const byte_t* in = reinterpret_cast<const byte_t*>(input);
+    const byte_t* inEnd = in + length;
+    byte_t* out = reinterpret_cast<byte_t*>(output);
+    const byte_t* outStart = out;
+    const byte_t* outEnd = out + outputLength;
+    while (in != inEnd)
+    {
+        byte_t token = *in++;
+        ulong_t literalsLength = token >> 4;
+        if (runMask == literalsLength && !readLength(in, inEnd, literalsLength))
+            return false;
+        if (ulong_t(inEnd - in) < literalsLength || ulong_t(outEnd - out) < literalsLength)
+            return false;
+        memmove(out, in, literalsLength);
+        in += literalsLength;
+        out += literalsLength;
+        if (in == inEnd)
+            break;
+
+        if (inEnd - in < 2)
+            return false;
+        ulong_t offset = in[0] | (ulong_t(in[1]) << 8);
+        in += 2;
+        ulong_t matchLength = token & runMask;
+        if (runMask == matchLength && !readLength(in, inEnd, matchLength))
+            return false;
+        matchLength += minMatchLength;
+        if (0 == offset || ulong_t(out - outStart) < offset || ulong_t(outEnd - out) < matchLength)
+            return false;
+        // Match may overlap the data it produces, so it's copied byte by byte.
+        const byte_t* ref = out - offset;
+        for (ulong_t i = 0; i < matchLength; ++i)
+            *out++ = *ref++;
+    }
+    outputLength = out - outStart;
+    return true;
+}
+
+#ifndef NDEBUG
+
+static void test_LZ77RoundTrip(const char* data, ulong_t length, bool compressible)
+{
+    char* compressed = (char*)malloc(length + 1);
+    char* decompressed = (char*)malloc(length + 1);
+    assert(NULL != compressed && NULL != decompressed);
+    ulong_t compressedLength = LZ77_Compress(data, length, compressed);
+    assert(compressible == (0 != compressedLength));
+    if (0 != compressedLength)
+    {
+        assert(compressedLength < length);
+        ulong_t decompressedLength = length;
+        bool res = LZ77_Decompress(compressed, compressedLength, decompressed, decompressedLength);
+        assert(res);
+        assert(length == decompressedLength);
+        assert(0 == memcmp(data, decompressed, length));
+
+        // Output buffer that's too short must be detected.
+        decompressedLength = length - 1;
+        res = LZ77_Decompress(compressed, compressedLength, decompressed, decompressedLength);
+        assert(!res);
+    }
+    free(decompressed);
+    free(compressed);
+}
+
+void test_LZ77()
+{
+    const char* text = "Wikipedia is a free encyclopedia. Wikipedia is written collaboratively by volunteers; "
+        "anyone can edit Wikipedia. Wikipedia is a free encyclopedia written collaboratively.";
+    test_LZ77RoundTrip(text, strlen(text), true);
+
+    char buffer[5000];
+    // Long runs exercise extended lengths and overlapping matches.
+    memset(buffer, 'a', sizeof(buffer));
+    test_LZ77RoundTrip(buffer, sizeof(buffer), true);
+
+    ulong_t seed = 1;
+    for (ulong_t i = 0; i < sizeof(buffer); ++i)
+    {
+        seed = seed * 1103515245UL + 12345UL;
+        buffer[i] = char(seed >> 16);
+    }
+    test_LZ77RoundTrip(buffer, sizeof(buffer), false);
+    test_LZ77RoundTrip("abc", 3, false);
+
+    for (ulong_t i = 0; i < sizeof(buffer); ++i)
+        buffer[i] = char('a' + (i * i) % 7);
+    test_LZ77RoundTrip(buffer, sizeof(buffer), true);
+}
+
+#endif
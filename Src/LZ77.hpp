@@ -0,0 +1,33 @@
+#ifndef ARSLEXIS_LZ77_HPP__
+#define ARSLEXIS_LZ77_HPP__
+
+#include <Debug.hpp>
+#include <BaseTypes.hpp>
+
+/**
+ * Small LZ77 block codec (LZ4-like sequences of literal run followed by back reference) with no external dependencies.
+ * Blocks are compressed independently, so that they can be decompressed one by one while streaming.
+ */
+
+enum {
+    //! Back references are 16-bit, so block can't be longer.
+    LZ77_maxBlockLength = 0xffff
+};
+
+/**
+ * @param output buffer of at least length bytes.
+ * @return length of compressed data, or 0 if it wouldn't be shorter than input (or memory for hash table can't be allocated).
+ */
+ulong_t LZ77_Compress(const char* input, ulong_t length, char* output);
+
+/**
+ * @param outputLength on entry capacity of output, on return length of decompressed data.
+ * @return false if input is malformed or doesn't fit into output.
+ */
+bool LZ77_Decompress(const char* input, ulong_t length, char* output, ulong_t& outputLength);
+
+#ifdef DEBUG
+void test_LZ77();
+#endif
+
+#endif // ARSLEXIS_LZ77_HPP__
@@ -26,7 +26,9 @@ Err DataStoreWriteBlob(DataStoreHandle handle, const char* streamName, const voi
     if (errNone != error)
         return error;
     error = writer.writeRaw(blob, blobSize);
-    return error;
+    if (errNone != error)
+        return error;
+    return writer.flush();
 }
 
 Err DataStoreReadBlob(DataStoreHandle handle, const char* streamName, void* buffer, UInt16* size)
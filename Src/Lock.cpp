@@ -22,4 +22,58 @@ void CriticalSection::release()
     LeaveCriticalSection(&section_);
 }
 
-#endif // _WIN32
\ No newline at end of file
+#endif // _WIN32
+
+#ifdef _POSIX
+
+Mutex::Mutex()
+{
+    pthread_mutex_init(&mutex_, NULL);
+}
+
+Mutex::~Mutex()
+{
+    pthread_mutex_destroy(&mutex_);
+}
+
+void Mutex::acquire()
+{
+    pthread_mutex_lock(&mutex_);
+}
+
+void Mutex::release()
+{
+    pthread_mutex_unlock(&mutex_);
+}
+
+PosixReadWriteLock::PosixReadWriteLock()
+{
+    pthread_rwlock_init(&lock_, NULL);
+}
+
+PosixReadWriteLock::~PosixReadWriteLock()
+{
+    pthread_rwlock_destroy(&lock_);
+}
+
+void PosixReadWriteLock::acquire()
+{
+    pthread_rwlock_wrlock(&lock_);
+}
+
+void PosixReadWriteLock::release()
+{
+    pthread_rwlock_unlock(&lock_);
+}
+
+void PosixReadWriteLock::acquireShared()
+{
+    pthread_rwlock_rdlock(&lock_);
+}
+
+void PosixReadWriteLock::releaseShared()
+{
+    pthread_rwlock_unlock(&lock_);
+}
+
+#endif // _POSIX
\ No newline at end of file
@@ -21,7 +21,7 @@ template<class L> class Guard: private NonCopyable {
     bool locked_; 
 
 public:
-    Guard(L& l, bool lock = true): lock_(l) {if (lock) acquire();}
+    Guard(L& l, bool lock = true): lock_(l), locked_(false) {if (lock) acquire();}
     void acquire() {lock_.acquire(); locked_ = true;}
     void release() {if (locked_) {lock_.release(); locked_ = false;}}  
     ~Guard() {release();}
@@ -35,6 +35,26 @@ public:
     ~Guard() {}   
 };
 
+//! Holds read-write lock L in shared mode.
+template<class L> class SharedGuard: private NonCopyable {
+    L& lock_;
+    
+public:
+    explicit SharedGuard(L& l): lock_(l) {lock_.acquireShared();}
+    ~SharedGuard() {lock_.releaseShared();}
+};
+
+//! Read-write lock for systems without native one: readers exclude each other as well.
+template<class L> class ExclusiveReadWriteLock: private NonCopyable {
+    L lock_;
+    
+public:
+    void acquire() {lock_.acquire();}
+    void release() {lock_.release();}
+    void acquireShared() {lock_.acquire();}
+    void releaseShared() {lock_.release();}
+};
+
 #ifdef _WIN32
 class CriticalSection: private NonCopyable {
     CRITICAL_SECTION section_;
@@ -47,11 +67,49 @@ public:
 };
 
 typedef CriticalSection Lock;
+
+// Slim reader/writer locks aren't available on Windows CE.
+typedef ExclusiveReadWriteLock<CriticalSection> ReadWriteLock;
 #endif // _WIN32
 
 #ifdef _PALM_OS
 typedef DummyLock Lock;
+typedef ExclusiveReadWriteLock<DummyLock> ReadWriteLock;
 #endif // _PALM_OS
 
+#ifdef _POSIX
+#include <pthread.h>
+
+class Mutex: private NonCopyable {
+    pthread_mutex_t mutex_;
+public:
+
+    Mutex();
+    ~Mutex();
+    void acquire();
+    void release();
+};
+
+typedef Mutex Lock;
+
+class PosixReadWriteLock: private NonCopyable {
+    pthread_rwlock_t lock_;
+public:
+
+    PosixReadWriteLock();
+    ~PosixReadWriteLock();
+    void acquire();
+    void release();
+    void acquireShared();
+    void releaseShared();
+};
+
+typedef PosixReadWriteLock ReadWriteLock;
+#endif // _POSIX
+
 typedef Guard<Lock> LockGuard;
+
+//! Holds ReadWriteLock exclusively.
+typedef Guard<ReadWriteLock> WriteLockGuard;
+typedef SharedGuard<ReadWriteLock> ReadLockGuard;
 #endif
\ No newline at end of file
@@ -0,0 +1,127 @@
+#include <LoopbackTestServer.hpp>
+#include <Debug.hpp>
+
+#if defined(_POSIX) && !defined(NDEBUG)
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <map>
+
+using namespace ArsLexis;
+
+namespace {
+
+    struct LoopbackTestClient
+    {
+        NarrowString received;
+        ulong_t requestsCount;
+        // Output is shut down, requests are ignored until client closes connection.
+        bool closing;
+    };
+
+}
+
+static void* loopbackTestServerThread(void* param)
+{
+    LoopbackTestServer& server = *static_cast<LoopbackTestServer*>(param);
+    int epoll = epoll_create(64);
+    assert(-1 != epoll);
+    epoll_event ev;
+    memzero(&ev, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = server.listenSocket;
+    epoll_ctl(epoll, EPOLL_CTL_ADD, server.listenSocket, &ev);
+    ev.data.fd = server.stopPipe[0];
+    epoll_ctl(epoll, EPOLL_CTL_ADD, server.stopPipe[0], &ev);
+
+    typedef std::map<int, LoopbackTestClient> Clients_t;
+    Clients_t clients;
+    epoll_event ready[64];
+    char buffer[4096];
+    bool stop = false;
+    while (!stop)
+    {
+        int count = epoll_wait(epoll, ready, 64, -1);
+        for (int i = 0; i < count; ++i)
+        {
+            int fd = ready[i].data.fd;
+            if (server.stopPipe[0] == fd)
+                stop = true;
+            else if (server.listenSocket == fd)
+            {
+                int client;
+                while (-1 != (client = accept(server.listenSocket, NULL, NULL)))
+                {
+                    ++server.acceptedCount;
+                    ev.data.fd = client;
+                    epoll_ctl(epoll, EPOLL_CTL_ADD, client, &ev);
+                    clients[client].requestsCount = 0;
+                    clients[client].closing = false;
+                }
+            }
+            else
+            {
+                LoopbackTestClient& client = clients[fd];
+                ssize_t length = read(fd, buffer, sizeof(buffer));
+                if (length <= 0)
+                {
+                    epoll_ctl(epoll, EPOLL_CTL_DEL, fd, NULL);
+                    close(fd);
+                    clients.erase(fd);
+                    continue;
+                }
+                if (client.closing)
+                    continue;
+                client.received.append(buffer, length);
+                client.closing = !server.responder(server, fd, client.received, client.requestsCount);
+                // Closing right away would reset connection if there are unread requests, and client could lose responses.
+                if (client.closing)
+                    shutdown(fd, SHUT_WR);
+            }
+        }
+    }
+    for (Clients_t::iterator it = clients.begin(); it != clients.end(); ++it)
+        close(it->first);
+    close(epoll);
+    return NULL;
+}
+
+void loopbackTestServerStart(LoopbackTestServer& server, LoopbackTestResponder responder)
+{
+    server.responder = responder;
+    server.acceptedCount = 0;
+    server.listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+    assert(-1 != server.listenSocket);
+    sockaddr_in address;
+    memzero(&address, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int res = bind(server.listenSocket, (sockaddr*)&address, sizeof(address));
+    assert(0 == res);
+    res = listen(server.listenSocket, SOMAXCONN);
+    assert(0 == res);
+    socklen_t addressLength = sizeof(address);
+    res = getsockname(server.listenSocket, (sockaddr*)&address, &addressLength);
+    assert(0 == res);
+    server.port = ntohs(address.sin_port);
+    fcntl(server.listenSocket, F_SETFL, O_NONBLOCK);
+    res = pipe(server.stopPipe);
+    assert(0 == res);
+    res = pthread_create(&server.thread, NULL, loopbackTestServerThread, &server);
+    assert(0 == res);
+}
+
+void loopbackTestServerStop(LoopbackTestServer& server)
+{
+    int res = write(server.stopPipe[1], "", 1);
+    assert(1 == res);
+    pthread_join(server.thread, NULL);
+    close(server.stopPipe[0]);
+    close(server.stopPipe[1]);
+    close(server.listenSocket);
+}
+
+#endif
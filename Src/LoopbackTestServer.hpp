@@ -0,0 +1,39 @@
+#ifndef __ARSLEXIS_LOOPBACK_TEST_SERVER_HPP__
+#define __ARSLEXIS_LOOPBACK_TEST_SERVER_HPP__
+
+#if defined(_POSIX) && !defined(NDEBUG)
+
+#include <BaseTypes.hpp>
+#include <pthread.h>
+
+struct LoopbackTestServer;
+
+/**
+ * Answers requests from a single client.
+ * @param received data read from client so far, responder removes the requests it answered.
+ * @param requestsCount number of requests answered on this connection, responder updates it.
+ * @return false if server should shut down output and ignore further requests on this connection.
+ */
+typedef bool (*LoopbackTestResponder)(LoopbackTestServer& server, int socket, ArsLexis::NarrowString& received, ulong_t& requestsCount);
+
+/**
+ * Loopback server for network tests, runs in its own thread and passes what each client sends to responder.
+ * Tests may embed it in a larger struct to keep responder settings next to it.
+ */
+struct LoopbackTestServer
+{
+    LoopbackTestResponder responder;
+    int listenSocket;
+    int stopPipe[2];
+    ushort_t port;
+    pthread_t thread;
+    ulong_t acceptedCount;
+};
+
+void loopbackTestServerStart(LoopbackTestServer& server, LoopbackTestResponder responder);
+
+void loopbackTestServerStop(LoopbackTestServer& server);
+
+#endif
+
+#endif
@@ -12,6 +12,18 @@
 
 #elif defined(_PALM_OS)
 #include <Library.hpp>
+
+#elif defined(_POSIX)
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <errno.h>
+#include <climits>
+#include <cstring>
 #endif
 #include <BaseTypes.hpp>
 
@@ -89,6 +101,39 @@ const int netSocketDirBoth = SD_BOTH;
 
 #define evtWaitForever	-1
 
+#elif defined(_POSIX)
+
+typedef struct sockaddr NativeSocketAddr_t;
+typedef struct in_addr NativeIPAddr_t;
+typedef struct sockaddr_in NativeSockAddrIN_t;
+typedef struct linger NativeSocketLinger_t;
+typedef fd_set NativeFDSet_t;
+typedef int NativeSocket_t;
+typedef int NativeSockAddrFamily_t;
+typedef int NativeSocketType_t;
+
+const NativeSocket_t invalidSocket = -1;
+const short socketTypeStream = SOCK_STREAM;
+const short socketAddrINET = AF_INET;
+const int socketOptSockLinger = SO_LINGER;
+const int socketOptLevelSocket = SOL_SOCKET;
+const int socketOptLevelTCP = IPPROTO_TCP;
+const int socketOptSockErrorStatus = SO_ERROR;
+const int socketOptTCPMaxSeg = TCP_MAXSEG;
+
+const int netSocketDirOutput = SHUT_WR;
+const int netSocketDirInput = SHUT_RD;
+const int netSocketDirBoth = SHUT_RDWR;
+
+#define netToHostS ntohs
+#define hostToNetS htons
+#define netFDSet(n,p) FD_SET(n, p)
+#define netFDClr(n,p) FD_CLR(n, p)
+#define netFDIsSet(n,p) FD_ISSET(n,p)
+#define netFDZero(p) FD_ZERO(p)
+
+#define evtWaitForever	-1
+
 #else
 
 # error "Define native sockets counterparts in NativeSocks.hpp before including Sockets.hpp"
@@ -117,7 +162,12 @@ union SocketAddr
 
 union IPAddr
 {
+#if defined(_POSIX)
+    // Must stay 32-bit where long isn't, as it's laid over sockaddr_in.
+    uint32_t ip;
+#else
     unsigned long ip;
+#endif
     NativeIPAddr_t native;
 } ;
 
@@ -136,7 +186,7 @@ public:
     }
 };
 
-#elif defined(_WIN32)	
+#elif defined(_WIN32) || defined(_POSIX)
 
 class HostInfoBuffer {
     struct hostent *hostInfo_;
@@ -145,7 +195,7 @@ public:
     //TODO: correct apropriately - set s_addr
     IPAddr getAddress() {  
         IPAddr ret; 
-        ret.ip = *(long*)hostInfo_->h_addr_list[0];
+        memcpy(&ret.ip, hostInfo_->h_addr_list[0], sizeof(ret.ip));
         return ret; 
     }
     void setHostInfo(struct hostent *hostInfo) { hostInfo_=hostInfo; }
@@ -164,6 +214,18 @@ const status_t netErrSocketBusy = WSAEADDRINUSE;
 const status_t netErrUnimplemented = WSAEOPNOTSUPP;
 const status_t netErrUnreachableDest = WSAEHOSTUNREACH;
 
+#elif defined(_POSIX)
+
+const status_t netErrorClass = 0;
+const status_t netErrParamErr = EINVAL;
+const status_t netErrTimeout = ETIMEDOUT;
+const status_t netErrSocketClosedByRemote = ECONNRESET;
+// Non-blocking connect() reports EINPROGRESS, NetLibrary::socketConnect() maps it to this.
+const status_t netErrWouldBlock = EWOULDBLOCK;
+const status_t netErrSocketBusy = EADDRINUSE;
+const status_t netErrUnimplemented = EOPNOTSUPP;
+const status_t netErrUnreachableDest = EHOSTUNREACH;
+
 #endif
 
 #endif //__ARSLEXIS_NATIVESOCKS_HPP__
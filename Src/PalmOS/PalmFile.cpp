@@ -79,6 +79,14 @@ status_t File::read(void* buffer, File::Size bytesToRead, File::Size& bytesRead)
     return error;        
 }
 
+status_t File::read(Position position, void* buffer, Size bytesToRead, Size& bytesRead)
+{
+    status_t error = seek(position, seekFromBeginning);
+    if (errNone != error)
+        return error;
+    return read(buffer, bytesToRead, bytesRead);
+}
+
 status_t File::write(const void* buffer, Size bytesToWrite)
 {
     if (!isOpen())
@@ -0,0 +1,195 @@
+#include <File.hpp>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+status_t File::open(const char_t* fileName, int flags, int mode)
+{
+    if (isOpen())
+        close();
+
+    handle_ = ::open(fileName, flags, mode);
+    if (invalidFileHandle == handle_)
+        return errno;
+
+    return errNone;
+}
+
+status_t File::close()
+{
+    if (!isOpen())
+        return errNone;
+
+    unmap();
+    int res = ::close(handle_);
+    handle_ = invalidFileHandle;
+    if (0 != res)
+        return errno;
+    return errNone;
+}
+
+status_t File::size(Size& val) const
+{
+    assert(isOpen());
+    struct stat st;
+    if (0 != fstat(handle_, &st))
+        return errno;
+    val = st.st_size;
+    return errNone;
+}
+
+status_t File::position(Position& val) const
+{
+    assert(isOpen());
+    off_t pos = lseek(handle_, 0, SEEK_CUR);
+    if (-1 == pos)
+        return errno;
+    val = pos;
+    return errNone;
+}
+
+status_t File::seek(SeekOffset offset, SeekType type)
+{
+    assert(isOpen());
+    int whence = SEEK_SET;
+    switch (type) {
+        case seekFromBeginning: whence = SEEK_SET; break;
+        case seekFromCurrentPosition: whence = SEEK_CUR; break;
+        case seekFromEnd: whence = SEEK_END; break;
+    }
+    if (-1 == lseek(handle_, offset, whence))
+        return errno;
+    return errNone;
+}
+
+status_t File::read(void* buffer, Size bytesToRead, Size& bytesRead)
+{
+    assert(isOpen());
+    bytesRead = 0;
+    while (bytesRead < bytesToRead)
+    {
+        ssize_t res = ::read(handle_, static_cast<char*>(buffer) + bytesRead, bytesToRead - bytesRead);
+        if (-1 == res)
+        {
+            if (EINTR == errno)
+                continue;
+            return errno;
+        }
+        if (0 == res)
+            break;
+        bytesRead += res;
+    }
+    return errNone;
+}
+
+status_t File::read(Position position, void* buffer, Size bytesToRead, Size& bytesRead)
+{
+    assert(isOpen());
+    bytesRead = 0;
+    while (bytesRead < bytesToRead)
+    {
+        ssize_t res = ::pread(handle_, static_cast<char*>(buffer) + bytesRead, bytesToRead - bytesRead, position + bytesRead);
+        if (-1 == res)
+        {
+            if (EINTR == errno)
+                continue;
+            return errno;
+        }
+        if (0 == res)
+            break;
+        bytesRead += res;
+    }
+    return errNone;
+}
+
+status_t File::write(const void* buffer, Size bytesToWrite)
+{
+    assert(isOpen());
+    Size written = 0;
+    while (written < bytesToWrite)
+    {
+        ssize_t res = ::write(handle_, static_cast<const char*>(buffer) + written, bytesToWrite - written);
+        if (-1 == res)
+        {
+            if (EINTR == errno)
+                continue;
+            return errno;
+        }
+        written += res;
+    }
+    return errNone;
+}
+
+status_t File::flush()
+{
+    assert(isOpen());
+    if (0 != fsync(handle_))
+        return errno;
+    return errNone;
+}
+
+status_t File::truncate()
+{
+    assert(isOpen());
+    Position pos;
+    status_t error = position(pos);
+    if (errNone != error)
+        return error;
+    // Pages past new end of file would cause SIGBUS when accessed, so mapping isn't used for new views any more.
+    // Views obtained earlier may still be in use, so it's only retired until releaseRetiredMaps().
+    if (pos < mapSize_)
+        retireMap();
+    if (0 != ftruncate(handle_, pos))
+        return errno;
+    return errNone;
+}
+
+status_t File::view(Position start, Size length, const void*& data)
+{
+    assert(isOpen());
+    if (start + length > mapSize_)
+    {
+        Size fileSize;
+        status_t error = size(fileSize);
+        if (errNone != error)
+            return error;
+        if (start + length > fileSize)
+            return sysErrParamErr;
+        void* map = mmap(NULL, fileSize, PROT_READ, MAP_SHARED, handle_, 0);
+        if (MAP_FAILED == map)
+            return errno;
+        retireMap();
+        map_ = static_cast<char*>(map);
+        mapSize_ = fileSize;
+    }
+    data = map_ + start;
+    return errNone;
+}
+
+void File::retireMap()
+{
+    if (NULL == map_)
+        return;
+    retiredMaps_.push_back(std::make_pair(map_, mapSize_));
+    map_ = NULL;
+    mapSize_ = 0;
+}
+
+void File::releaseRetiredMaps()
+{
+    RetiredMaps_t::iterator end = retiredMaps_.end();
+    for (RetiredMaps_t::iterator it = retiredMaps_.begin(); it != end; ++it)
+        munmap(it->first, it->second);
+    retiredMaps_.clear();
+}
+
+void File::unmap()
+{
+    releaseRetiredMaps();
+    if (NULL == map_)
+        return;
+    munmap(map_, mapSize_);
+    map_ = NULL;
+    mapSize_ = 0;
+}
@@ -0,0 +1,160 @@
+#include <NetLibrary.hpp>
+#include <SocketAddress.hpp>
+#include <unistd.h>
+#include <sys/time.h>
+
+NetLibrary::NetLibrary():
+    closed_(true)
+{
+}
+
+status_t NetLibrary::initialize(uint_t& ifError, uint_t configIndex, ulong_t openFlags)
+{
+    assert(closed());
+    ifError = errNone;
+    closed_ = false;
+    return errNone;
+}
+
+status_t NetLibrary::close(bool immediate)
+{
+    assert(!closed());
+    closed_ = true;
+    return errNone;
+}
+
+NetLibrary::~NetLibrary()
+{
+    if (!closed())
+        close();
+}
+
+status_t NetLibrary::getHostByName(const char* name, HostInfoBuffer& buffer, long timeout)
+{
+    struct hostent* hinfo = gethostbyname(name);
+    if (NULL == hinfo || AF_INET != hinfo->h_addrtype)
+        return netErrUnreachableDest;
+
+    buffer.setHostInfo(hinfo);
+    return errNone;
+}
+
+status_t NetLibrary::addrAToIN(const char* addr, INetSocketAddress& out)
+{
+    IPAddr ip;
+    ip.ip = inet_addr(addr);
+    if (INADDR_NONE == ip.ip)
+        return netErrParamErr;
+
+    out.setIpAddress(ip);
+    return errNone;
+}
+
+NativeSocket_t NetLibrary::socketOpen(NativeSockAddrFamily_t  domain,  NativeSocketType_t type, int protocol, long timeout, status_t& error)
+{
+    error = errNone;
+    NativeSocket_t sock = socket(domain, type, protocol);
+    if (invalidSocket == sock)
+        error = errno;
+    return sock;
+}
+
+int NetLibrary::socketClose(NativeSocket_t socket, long  timeout, status_t& error)
+{
+    error = errNone;
+    if (0 != ::close(socket))
+    {
+        error = errno;
+        return -1;
+    }
+    return 0;
+}
+
+int NetLibrary::socketShutdown(NativeSocket_t socket, int direction, long timeout, status_t& error)
+{
+    error = errNone;
+    if (0 != shutdown(socket, direction))
+    {
+        error = errno;
+        return -1;
+    }
+    return 0;
+}
+
+int NetLibrary::socketSend(NativeSocket_t socket, void* bufP, uint_t bufLen, uint_t flags, void* toAddrP, uint_t toLen, long timeout, status_t& error)
+{
+    error = errNone;
+    // Writing to connection closed by remote should be reported as error, not raise SIGPIPE.
+    int res = sendto(socket, bufP, bufLen, flags | MSG_NOSIGNAL, (const struct sockaddr*)toAddrP, toLen);
+    if (-1 == res)
+        error = (EPIPE == errno ? netErrSocketClosedByRemote : errno);
+    return res;
+}
+
+int NetLibrary::socketReceive(NativeSocket_t socket, void* bufP, uint_t bufLen, uint_t flags, void* fromAddrP, uint_t* fromLen, long  timeout, status_t& error)
+{
+    error = errNone;
+    socklen_t len = (NULL == fromLen ? 0 : *fromLen);
+    int res = recvfrom(socket, bufP, bufLen, flags, (struct sockaddr*)fromAddrP, (NULL == fromAddrP ? NULL : &len));
+    if (-1 == res)
+    {
+        error = errno;
+        return 0;
+    }
+    if (NULL != fromLen)
+        *fromLen = len;
+    return res;
+}
+
+int NetLibrary::socketConnect(NativeSocket_t socket, const SocketAddr& sockAddrP, uint_t addrLen, long timeout, status_t& error)
+{
+    error = errNone;
+    if (0 != connect(socket, &sockAddrP.native, addrLen))
+    {
+        error = (EINPROGRESS == errno ? netErrWouldBlock : errno);
+        return -1;
+    }
+    return 0;
+}
+
+int NetLibrary::socketOptionGet(NativeSocket_t socket, uint_t level, uint_t  option, void* optValueP, uint_t& optValueLen, long timeout, status_t& error)
+{
+    error = errNone;
+    socklen_t len = optValueLen;
+    if (0 != getsockopt(socket, level, option, optValueP, &len))
+    {
+        error = errno;
+        return -1;
+    }
+    optValueLen = len;
+    return 0;
+}
+
+int NetLibrary::socketOptionSet(NativeSocket_t socket, uint_t level, uint_t  option, void* optValueP, uint_t optValueLen, long timeout, status_t& error)
+{
+    error = errNone;
+    if (0 != setsockopt(socket, level, option, optValueP, optValueLen))
+    {
+        error = errno;
+        return -1;
+    }
+    return 0;
+}
+
+int NetLibrary::select(uint_t width, NativeFDSet_t* readFDs, NativeFDSet_t *writeFDs, NativeFDSet_t *exceptFDs, long timeout, status_t& error)
+{
+    error = errNone;
+    timeval to;
+    to.tv_sec = timeout / 1000;
+    to.tv_usec = (timeout % 1000) * 1000;
+    timeval* pto = &to;
+    if (evtWaitForever == timeout)
+        pto = NULL;
+    int res = ::select(width, readFDs, writeFDs, exceptFDs, pto);
+    if (-1 == res)
+    {
+        error = errno;
+        return -1;
+    }
+    return res;
+}
@@ -84,6 +84,9 @@ Serialization format:
 * first 4-bytes of a blob is a header (to provide some protection against
   reading stuff we didn't create)
 * then we have each item serialized
+* items that changed are appended to the end of the blob when saving, so
+  the last item with a given id is the current one; the blob is rewritten
+  without them when it grows too much
 
 Serialization of an item:
 * 2-byte unique id
@@ -265,13 +268,12 @@ void deserStringToBuf(char *buf, int bufSize, const unsigned char **data, long *
 
 static const char *deserStringInPlace(const unsigned char **data, long *pCurrBlobSize)
 {
-    Assert(*pCurrBlobSize>=2);
     if (*pCurrBlobSize<2)
         return NULL;
     int strLen = deserInt( data, pCurrBlobSize );
-    Assert(0 == (*data)[strLen-1]);
-    if (0!=(*data)[strLen-1])
-        return NULL;      // this means blob corruption
+    // this means blob corruption
+    if (strLen<1 || strLen>*pCurrBlobSize || 0!=(*data)[strLen-1])
+        return NULL;
     const char * str = (const char*)*data;
     *data += strLen;
     *pCurrBlobSize -= strLen;
@@ -280,7 +282,8 @@ static const char *deserStringInPlace(const unsigned char **data, long *pCurrBlo
 
 PrefsStoreReader::PrefsStoreReader(const char *dbName, UInt32 dbCreator, UInt32 dbType)
     : _dbName(dbName), _dbCreator(dbCreator), _dbType(dbType), _db(0),
-      _recHandle(NULL), _recData(NULL), _fDbNotFound(false)
+      _recHandle(NULL), _recData(NULL), _fDbNotFound(false),
+      _items(NULL), _itemsCount(0), _decodeErr(errNone)
 {
     Assert(dbName);
     Assert(StrLen(dbName) < dmDBNameLength);
@@ -288,6 +291,8 @@ PrefsStoreReader::PrefsStoreReader(const char *dbName, UInt32 dbCreator, UInt32
 
 PrefsStoreReader::~PrefsStoreReader()
 {
+    if (_items)
+        new_free(_items);
     if (_recHandle)
         MemHandleUnlock(_recHandle);
     if (_db)
@@ -295,7 +300,11 @@ PrefsStoreReader::~PrefsStoreReader()
 }
 
 #define PREFS_STORE_RECORD_ID "aRSp"  // comes from "ArsLexis preferences"
-#define FValidPrefsStoreRecord(recData) (0==MemCmp(recData,PREFS_STORE_RECORD_ID,StrLen(PREFS_STORE_RECORD_ID)))
+// record with items appended by ErrSavePreferences(), which may repeat ids;
+// readers that took the first item with given id don't recognize it
+#define PREFS_STORE_DELTA_RECORD_ID "aRSd"
+#define FDeltaPrefsStoreRecord(recData) (0==MemCmp(recData,PREFS_STORE_DELTA_RECORD_ID,StrLen(PREFS_STORE_DELTA_RECORD_ID)))
+#define FValidPrefsStoreRecord(recData) (0==MemCmp(recData,PREFS_STORE_RECORD_ID,StrLen(PREFS_STORE_RECORD_ID)) || FDeltaPrefsStoreRecord(recData))
 
 // Open preferences database and find a record that contains preferences.
 // Return errNone if opened succesfully, otherwise an error:
@@ -358,99 +367,156 @@ ExitAndMarkNotFound:
     return err;
 }
 
-// devnote: not very optimal implementation, we reparse the blob every
-// time. We could deserialize things once and store in a buffer or optimize for
-// a common pattern: reading in the same sequence as the data was written in which
-// case we could remember the current place in the blob and start from there when
-// we're called again (and re-start from the beginning if we don't find data)
-Err PrefsStoreReader::ErrGetPrefItemWithId(int uniqueId, PrefItem *prefItem)
+// Return position of the first item with id >= uniqueId
+static int FindPrefItemPos(const PrefItem *items, int itemsCount, int uniqueId)
 {
-    Assert(uniqueId>=0);
-    Assert(prefItem);
-
-    Err err = ErrOpenPrefsDatabase();
-    if (err)
-        return err;
+    int low = 0;
+    int high = itemsCount;
+    while (low < high)
+    {
+        int mid = (low + high) / 2;
+        if (items[mid].uniqueId < uniqueId)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
 
-    Assert(_db);
-    Assert(_recHandle);
-    Assert(_recData);
+// the shortest item (bool) takes 5 bytes, which bounds their number
+static int MaxPrefItemsCount(long blobSize)
+{
+    return (int)(blobSize / 5) + 1;
+}
 
-    // usually when we Assert() we don't error out on the same condition
-    // but in this case, while highly improbably, it's conceivable that some
-    // other app created a database with the same name, creator, type and a
-    // record that has the same magic header and we don't want to crash
-    // in this case
-    long recSizeLeft = (long)MemHandleSize(_recHandle);
-    Assert(recSizeLeft>=4);
-    if (recSizeLeft<4)
-        return psErrDatabaseCorrupted;
-    const unsigned char *currData = _recData;
-    Assert(FValidPrefsStoreRecord(currData));
-    // skip the header
-    currData += 4;
-    recSizeLeft-=4;
+// Decode items of the blob (past the header) into items (which must have room
+// for MaxPrefItemsCount(sizeLeft) of them) sorted by id. Strings point into the blob.
+// Items appended by ErrSavePreferences() replace earlier ones with the same id.
+// Return psErrDatabaseCorrupted if the blob is damaged, leaving items decoded
+// before the damage.
+static Err DecodePrefItems(const unsigned char *currData, long recSizeLeft, PrefItem *items, int *pItemsCount)
+{
+    int      itemsCount = 0;
+    PrefItem prefItem;
     while(recSizeLeft!=0)
     {
         // get unique id and type
-        Assert(recSizeLeft>=2);
         if (recSizeLeft<2)
-            return psErrDatabaseCorrupted;
+            goto Corrupted;
         int id = deserInt(&currData,&recSizeLeft);
-        Assert(id>=0);
-        Assert(recSizeLeft>=2);
+        if (id<0)
+            goto Corrupted;
         if (recSizeLeft<2)
-            return psErrDatabaseCorrupted;
+            goto Corrupted;
         PrefItemType type = (PrefItemType)deserInt(&currData,&recSizeLeft);
         switch (type)
         {
             case pitBool:
-                Assert(recSizeLeft>=1);
                 if (recSizeLeft<1)
-                    return psErrDatabaseCorrupted;
-                prefItem->value.boolVal = deserBool(&currData,&recSizeLeft);
+                    goto Corrupted;
+                prefItem.value.boolVal = deserBool(&currData,&recSizeLeft);
                 break;
+            // int and long are stored in 2 and 4 bytes, whatever their size is
             case pitInt:
-                Assert(recSizeLeft>=sizeof(int));
-                if (recSizeLeft<sizeof(int))
-                    return psErrDatabaseCorrupted;
-                prefItem->value.intVal = deserInt(&currData, &recSizeLeft);
+                if (recSizeLeft<2)
+                    goto Corrupted;
+                prefItem.value.intVal = deserInt(&currData, &recSizeLeft);
                 break;
             case pitLong:
-                Assert(recSizeLeft>=sizeof(long));
-                if (recSizeLeft<sizeof(long))
-                    return psErrDatabaseCorrupted;
-                prefItem->value.longVal = deserLong(&currData, &recSizeLeft);
+                if (recSizeLeft<4)
+                    goto Corrupted;
+                prefItem.value.longVal = deserLong(&currData, &recSizeLeft);
                 break;
             case pitUInt16:
-                Assert(recSizeLeft>=sizeof(UInt16));
                 if (recSizeLeft<sizeof(UInt16))
-                    return psErrDatabaseCorrupted;
-                prefItem->value.uint16Val = deserUInt16(&currData, &recSizeLeft);
+                    goto Corrupted;
+                prefItem.value.uint16Val = deserUInt16(&currData, &recSizeLeft);
                 break;
             case pitUInt32:
-                Assert(recSizeLeft>=sizeof(UInt32));
                 if (recSizeLeft<sizeof(UInt32))
-                    return psErrDatabaseCorrupted;
-                prefItem->value.uint32Val = deserUInt32(&currData, &recSizeLeft);
+                    goto Corrupted;
+                prefItem.value.uint32Val = deserUInt32(&currData, &recSizeLeft);
                 break;
             case pitStr:
-                prefItem->value.strVal = deserStringInPlace(&currData, &recSizeLeft);
-                if(NULL==prefItem->value.strVal)
-                    return psErrDatabaseCorrupted;
+                prefItem.value.strVal = deserStringInPlace(&currData, &recSizeLeft);
+                if(NULL==prefItem.value.strVal)
+                    goto Corrupted;
                 break;
             default:
-                Assert(0);
-                return psErrDatabaseCorrupted;
+                goto Corrupted;
         }
-        if (id==uniqueId)
+        prefItem.uniqueId = id;
+        prefItem.type = type;
+
+        // items are written in order of ids, so this is mostly an append
+        int pos = FindPrefItemPos(items, itemsCount, id);
+        if (pos == itemsCount || items[pos].uniqueId != id)
         {
-            prefItem->uniqueId=id;
-            prefItem->type=type;
-            return errNone;
+            MemMove(&items[pos+1], &items[pos], sizeof(PrefItem) * (itemsCount - pos));
+            ++itemsCount;
         }
+        items[pos] = prefItem;
     }
-    return psErrItemNotFound;
+    *pItemsCount = itemsCount;
+    return errNone;
+
+Corrupted:
+    *pItemsCount = itemsCount;
+    return psErrDatabaseCorrupted;
+}
+
+// Decode all items of the record at once into _items sorted by id, so that
+// each ErrGet*() is a binary search instead of reparsing the blob (which made
+// reading all prefs at startup quadratic). Strings still point into the record,
+// which stays locked while the object is alive.
+// If the record is corrupted, items before the damage are kept and the error
+// is remembered in _decodeErr.
+Err PrefsStoreReader::ErrDecodeItems()
+{
+    if (_items)
+        return errNone;
+
+    Err err = ErrOpenPrefsDatabase();
+    if (err)
+        return err;
+
+    Assert(_db);
+    Assert(_recHandle);
+    Assert(_recData);
+
+    // usually when we Assert() we don't error out on the same condition
+    // but in this case, while highly improbably, it's conceivable that some
+    // other app created a database with the same name, creator, type and a
+    // record that has the same magic header and we don't want to crash
+    // in this case
+    long recSize = (long)MemHandleSize(_recHandle);
+    Assert(recSize>=4);
+    if (recSize<4)
+        return psErrDatabaseCorrupted;
+    Assert(FValidPrefsStoreRecord(_recData));
+
+    // skip the header
+    _items = (PrefItem*)new_malloc(sizeof(PrefItem) * MaxPrefItemsCount(recSize-4));
+    if (NULL == _items)
+        return memErrNotEnoughSpace;
+    _decodeErr = DecodePrefItems(_recData+4, recSize-4, _items, &_itemsCount);
+    return errNone;
+}
+
+Err PrefsStoreReader::ErrGetPrefItemWithId(int uniqueId, PrefItem *prefItem)
+{
+    Assert(uniqueId>=0);
+    Assert(prefItem);
+
+    Err err = ErrDecodeItems();
+    if (err)
+        return err;
+
+    int pos = FindPrefItemPos(_items, _itemsCount, uniqueId);
+    if (pos == _itemsCount || _items[pos].uniqueId != uniqueId)
+        return _decodeErr ? _decodeErr : psErrItemNotFound;
+    *prefItem = _items[pos];
+    return errNone;
 }
 
 Err PrefsStoreReader::ErrGetBool(int uniqueId, Boolean *value)
@@ -535,7 +601,8 @@ Err PrefsStoreReader::ErrGetStr(int uniqueId, const char **value)
 }
 
 PrefsStoreWriter::PrefsStoreWriter(const char *dbName, UInt32 dbCreator, UInt32 dbType)
-    : _dbName(dbName), _dbCreator(dbCreator), _dbType(dbType), _itemsCount(0)
+    : _dbName(dbName), _dbCreator(dbCreator), _dbType(dbType),
+      _items(NULL), _itemsCount(0), _itemsCapacity(0)
 {
     Assert(dbName);
     Assert(StrLen(dbName) < dmDBNameLength);
@@ -543,33 +610,41 @@ PrefsStoreWriter::PrefsStoreWriter(const char *dbName, UInt32 dbCreator, UInt32
 
 PrefsStoreWriter::~PrefsStoreWriter()
 {
+    if (_items)
+        new_free(_items);
 }
 
-static PrefItem * FindPrefItemById(PrefItem *items, int itemsCount, int uniqueId)
-{
-    for(int i=0; i<itemsCount; i++)
-    {
-        if (items[i].uniqueId==uniqueId)
-            return &(items[i]);
-    }
-    return NULL;
-}
-
+// Items are kept sorted by id, so that duplicates are found with binary search
+// and they're written in the order in which the reader decodes them fastest.
 Err PrefsStoreWriter::ErrSetItem(PrefItem *item)
 {
     Assert(item->uniqueId>=0);
 
-    if ( NULL != FindPrefItemById((PrefItem*)_items, _itemsCount, item->uniqueId) )
+    int pos = FindPrefItemPos(_items, _itemsCount, item->uniqueId);
+    if (pos < _itemsCount && _items[pos].uniqueId == item->uniqueId)
     {
         Assert(0); // we assert because we never want this to happen
         return psErrDuplicateId;
     }
 
-    // TODO: make it grow dynamically in the future
-    if (_itemsCount>=MAX_PREFS_ITEMS)
-        return memErrNotEnoughSpace;
+    if (_itemsCount == _itemsCapacity)
+    {
+        int capacity = (0 == _itemsCapacity) ? 16 : 2 * _itemsCapacity;
+        PrefItem *items = (PrefItem*)new_malloc(sizeof(PrefItem) * capacity);
+        if (NULL == items)
+            return memErrNotEnoughSpace;
+        if (_items)
+        {
+            MemMove(items, _items, sizeof(PrefItem) * _itemsCount);
+            new_free(_items);
+        }
+        _items = items;
+        _itemsCapacity = capacity;
+    }
 
-    _items[_itemsCount++] = *item;
+    MemMove(&_items[pos+1], &_items[pos], sizeof(PrefItem) * (_itemsCount - pos));
+    _items[pos] = *item;
+    ++_itemsCount;
     return errNone;
 }
 
@@ -641,13 +716,45 @@ Err PrefsStoreWriter::ErrSetStr(int uniqueId, const char *value)
     return ErrSetItem( &prefItem );
 }
 
-// Create a blob containing serialized preferences.
+static void SerializeItem(const PrefItem *item, char *prefsBlob, long *pBlobSize)
+{
+    Assert( item->uniqueId >= 0 );
+    serInt( item->uniqueId, prefsBlob, pBlobSize);
+    serInt( (int)item->type, prefsBlob, pBlobSize);
+    switch( item->type )
+    {
+        case pitBool:
+            serBool(item->value.boolVal, prefsBlob, pBlobSize);
+            break;
+        case pitInt:
+            serInt(item->value.intVal, prefsBlob, pBlobSize);
+            break;
+        case pitLong:
+            serLong(item->value.longVal, prefsBlob, pBlobSize);
+            break;
+        case pitUInt16:
+            serUInt16(item->value.uint16Val, prefsBlob, pBlobSize);
+            break;
+        case pitUInt32:
+            serUInt32(item->value.uint32Val, prefsBlob, pBlobSize);
+            break;
+        case pitStr:
+            serString(item->value.strVal, prefsBlob, pBlobSize);
+            break;
+        default:
+            Assert(0);
+            break;
+    }            
+}
+
+// Create a blob containing serialized preferences, with the header unless
+// it's going to be appended to an existing record.
 // Devnote: caller needs to free memory returned.
 // TODO: move ser* (serData etc.) functions from common.c to here
 // after changing prefs in all apps to use PrefsStore
-static void* SerializeItems(PrefItem *items, int itemsCount, long *pBlobSize)
+static void* SerializeItems(const PrefItem *items, int itemsCount, Boolean fHeader, long *pBlobSize)
 {
-    Assert(items);
+    Assert(items || 0 == itemsCount);
     Assert(itemsCount>=0);
     Assert(pBlobSize);
 
@@ -660,37 +767,10 @@ static void* SerializeItems(PrefItem *items, int itemsCount, long *pBlobSize)
         blobSize = 0;
         Assert( 4 == StrLen(PREFS_STORE_RECORD_ID) );
 
-        serData( (char*)PREFS_STORE_RECORD_ID, StrLen(PREFS_STORE_RECORD_ID), prefsBlob, &blobSize );
+        if (fHeader)
+            serData( (char*)PREFS_STORE_RECORD_ID, StrLen(PREFS_STORE_RECORD_ID), prefsBlob, &blobSize );
         for(int item=0; item<itemsCount; item++)
-        {
-            Assert( items[item].uniqueId >= 0 );
-            serInt( items[item].uniqueId, prefsBlob, &blobSize);
-            serInt( (int)items[item].type, prefsBlob, &blobSize);
-            switch( items[item].type )
-            {
-                case pitBool:
-                    serBool(items[item].value.boolVal, prefsBlob, &blobSize);
-                    break;
-                case pitInt:
-                    serInt(items[item].value.intVal, prefsBlob, &blobSize);
-                    break;
-                case pitLong:
-                    serLong(items[item].value.longVal, prefsBlob, &blobSize);
-                    break;
-                case pitUInt16:
-                    serUInt16(items[item].value.uint16Val, prefsBlob, &blobSize);
-                    break;
-                case pitUInt32:
-                    serUInt32(items[item].value.uint32Val, prefsBlob, &blobSize);
-                    break;
-                case pitStr:
-                    serString(items[item].value.strVal, prefsBlob, &blobSize);
-                    break;
-                default:
-                    Assert(0);
-                    break;
-            }            
-        }
+            SerializeItem(&items[item], prefsBlob, &blobSize);
 
         if ( 1 == phase )
         {
@@ -709,7 +789,88 @@ static void* SerializeItems(PrefItem *items, int itemsCount, long *pBlobSize)
     return prefsBlob;
 }
 
+// Values are compared as they're stored (e.g. int is truncated to 2 bytes).
+static Boolean FPrefItemsEqual(const PrefItem *item1, const PrefItem *item2)
+{
+    if (item1->uniqueId != item2->uniqueId || item1->type != item2->type)
+        return false;
+    if (pitStr == item1->type)
+        return 0 == StrCompare(item1->value.strVal, item2->value.strVal);
+
+    char blob1[16];
+    char blob2[16];
+    long size1 = 0;
+    long size2 = 0;
+    SerializeItem(item1, blob1, &size1);
+    SerializeItem(item2, blob2, &size2);
+    return size1 == size2 && 0 == MemCmp(blob1, blob2, size1);
+}
+
+// Compare items with the ones stored in the record and put those that changed
+// into *pChanged (which caller must free if *pChangedCount isn't 0), so that
+// only they are appended to the record.
+// Return false if the record should be rewritten instead: when it can't be
+// decoded, has items that are no longer set (appending can't remove them) or
+// appended items would make it over twice the size of the whole blob, which
+// compacts it.
+static Boolean FPrepareDelta(const PrefItem *items, int itemsCount, const unsigned char *recData, long recSize, long blobSize, PrefItem **pChanged, int *pChangedCount)
+{
+    PrefItem *  stored = NULL;
+    int         storedCount = 0;
+    int         storedPos = 0;
+    PrefItem *  changed = NULL;
+    int         changedCount = 0;
+    long        deltaSize = 0;
+    Boolean     fDelta = false;
+
+    if (recSize<4 || !FValidPrefsStoreRecord(recData) || 0 == itemsCount)
+        return false;
+    stored = (PrefItem*)new_malloc(sizeof(PrefItem) * MaxPrefItemsCount(recSize-4));
+    changed = (PrefItem*)new_malloc(sizeof(PrefItem) * itemsCount);
+    if (NULL == stored || NULL == changed)
+        goto Exit;
+    if (errNone != DecodePrefItems(recData+4, recSize-4, stored, &storedCount))
+        goto Exit;
+
+    // both arrays are sorted by id
+    for (int i = 0; i < itemsCount; i++)
+    {
+        if (storedPos < storedCount && stored[storedPos].uniqueId < items[i].uniqueId)
+            goto Exit;
+        if (storedPos < storedCount && stored[storedPos].uniqueId == items[i].uniqueId)
+        {
+            Boolean fEqual = FPrefItemsEqual(&stored[storedPos], &items[i]);
+            ++storedPos;
+            if (fEqual)
+                continue;
+        }
+        changed[changedCount++] = items[i];
+        SerializeItem(&items[i], NULL, &deltaSize);
+    }
+    if (storedPos < storedCount || recSize + deltaSize > 2 * blobSize)
+        goto Exit;
+
+    fDelta = true;
+    *pChangedCount = changedCount;
+    if (0 != changedCount)
+    {
+        *pChanged = changed;
+        changed = NULL;
+    }
+Exit:
+    if (stored)
+        new_free(stored);
+    if (changed)
+        new_free(changed);
+    return fDelta;
+}
+
 // Save preferences previously set via ErrSet*() calls to a database.
+// Only items that changed since the last save are appended to the record
+// (the reader takes the last item with given id, and the record gets
+// PREFS_STORE_DELTA_RECORD_ID header), and nothing is written if none did,
+// so that frequent small updates don't rewrite all preferences.
+// The record is rewritten as a whole when it grows too much (see FPrepareDelta()).
 // If something goes wrong, returns an error
 // Possible errors:
 //   memErrNotEnoughSpace - not enough memory to allocate needed structures
@@ -718,7 +879,7 @@ Err PrefsStoreWriter::ErrSavePreferences()
 {
     Err     err = errNone;
     long    blobSize;
-    void *  prefsBlob = SerializeItems(_items, _itemsCount, &blobSize);
+    void *  prefsBlob = SerializeItems(_items, _itemsCount, true, &blobSize);
     if ( NULL == prefsBlob ) 
         return memErrNotEnoughSpace;
 
@@ -727,11 +888,17 @@ Err PrefsStoreWriter::ErrSavePreferences()
     {
         err = DmCreateDatabase(0, _dbName, _dbCreator, _dbType, false);
         if ( err)
+        {
+            new_free( prefsBlob );
             return err;
+        }
 
         db = DmOpenDatabaseByTypeCreator(_dbType, _dbCreator, dmModeReadWrite);
         if (!db)
+        {
+            new_free( prefsBlob );
             return DmGetLastErr();
+        }
     }
 
     // set backup bit on the database. code adapted from DataStore.cpp
@@ -762,6 +929,13 @@ Continue:
     Boolean   fRecFound = false;
     void *    recData;
     long      recSize;
+    // by default whole blob replaces record contents
+    void *    writeData = prefsBlob;
+    long      writeOffset = 0;
+    long      writeSize = blobSize;
+    long      newRecSize = blobSize;
+    PrefItem *changed = NULL;
+    int       changedCount = 0;
     while (recNo < recsCount)
     {
         recHandle = DmGetRecord(db, recNo);
@@ -779,17 +953,44 @@ Continue:
         ++recNo;
     }
 
-    if (fRecFound && blobSize>recSize)
+    if (fRecFound && FPrepareDelta(_items, _itemsCount, (const unsigned char*)recData, recSize, blobSize, &changed, &changedCount))
+    {
+        if (0 == changedCount)
+        {
+            // nothing changed, so the record isn't even marked dirty
+            MemPtrUnlock(recData);
+            DmReleaseRecord(db, recNo, false);
+            goto CloseDbExit;
+        }
+        new_free( prefsBlob );
+        prefsBlob = SerializeItems(changed, changedCount, false, &writeSize);
+        new_free( changed );
+        if (NULL == prefsBlob)
+        {
+            MemPtrUnlock(recData);
+            DmReleaseRecord(db, recNo, false);
+            err = memErrNotEnoughSpace;
+            goto CloseDbExit;
+        }
+        writeData = prefsBlob;
+        writeOffset = recSize;
+        newRecSize = recSize + writeSize;
+    }
+
+    // shrinking matters too, as the reader would decode stale tail of the record
+    if (fRecFound && newRecSize != recSize)
     {
-        /* need to resize the record */
         MemPtrUnlock(recData);
         DmReleaseRecord(db,recNo,true);
         fRecordBusy = false;
-        recHandle = DmResizeRecord(db, recNo, blobSize);
+        recHandle = DmResizeRecord(db, recNo, newRecSize);
         if ( NULL == recHandle )
-            return DmGetLastErr();
+        {
+            err = DmGetLastErr();
+            goto CloseDbExit;
+        }
         recData = MemHandleLock(recHandle);
-        Assert( MemHandleSize(recHandle) == blobSize );        
+        Assert( MemHandleSize(recHandle) == newRecSize );        
     }
 
     if (!fRecFound)
@@ -805,7 +1006,9 @@ Continue:
         fRecordBusy = true;
     }
 
-    err = DmWrite(recData, 0, prefsBlob, blobSize);
+    err = DmWrite(recData, writeOffset, writeData, writeSize);
+    if (errNone == err && 0 != writeOffset && !FDeltaPrefsStoreRecord(recData))
+        err = DmWrite(recData, 0, PREFS_STORE_DELTA_RECORD_ID, StrLen(PREFS_STORE_DELTA_RECORD_ID));
     MemPtrUnlock(recData);
     if (fRecordBusy)
         DmReleaseRecord(db, recNo, true);
@@ -816,7 +1019,181 @@ CloseDbExit:
         DmCloseDatabase(db);
     else
         err = DmCloseDatabase(db);
-    new_free( prefsBlob );
+    if (prefsBlob)
+        new_free( prefsBlob );
     return err;
 }
 
+#ifndef NDEBUG
+
+#define PREFS_STORE_TEST_DB_NAME "UnitTest PrefsStore"
+#define PREFS_STORE_TEST_DB_CREATOR 'ArsT'
+#define PREFS_STORE_TEST_DB_TYPE 'Test'
+#define PREFS_STORE_TEST_ITEMS_COUNT 100
+
+static void DeletePrefsStoreTestDb()
+{
+    LocalID dbId = DmFindDatabase(0, PREFS_STORE_TEST_DB_NAME);
+    if (0 != dbId)
+        DmDeleteDatabase(0, dbId);
+}
+
+// Return size of the preferences record and copy its header into header.
+static long PrefsStoreTestRecordSize(char *header)
+{
+    LocalID dbId = DmFindDatabase(0, PREFS_STORE_TEST_DB_NAME);
+    Assert(0 != dbId);
+    DmOpenRef db = DmOpenDatabase(0, dbId, dmModeReadOnly);
+    Assert(db);
+    MemHandle recHandle = DmQueryRecord(db, 0);
+    Assert(recHandle);
+    long recSize = (long)MemHandleSize(recHandle);
+    MemMove(header, MemHandleLock(recHandle), 4);
+    MemHandleUnlock(recHandle);
+    DmCloseDatabase(db);
+    return recSize;
+}
+
+// Item 1 is long, item 3 string and the rest are bools and ints.
+static Err PrefsStoreTestSave(long value, const char *str)
+{
+    PrefsStoreWriter writer(PREFS_STORE_TEST_DB_NAME, PREFS_STORE_TEST_DB_CREATOR, PREFS_STORE_TEST_DB_TYPE);
+    for (int id = PREFS_STORE_TEST_ITEMS_COUNT - 1; id >= 0; --id)
+    {
+        Err err;
+        if (1 == id)
+            err = writer.ErrSetLong(id, value);
+        else if (3 == id)
+            err = writer.ErrSetStr(id, str);
+        else if (0 == id % 2)
+            err = writer.ErrSetBool(id, true);
+        else
+            err = writer.ErrSetInt(id, id);
+        Assert(errNone == err);
+    }
+    return writer.ErrSavePreferences();
+}
+
+static void PrefsStoreTestCheck(long value, const char *str)
+{
+    PrefsStoreReader reader(PREFS_STORE_TEST_DB_NAME, PREFS_STORE_TEST_DB_CREATOR, PREFS_STORE_TEST_DB_TYPE);
+    long longVal;
+    Err err = reader.ErrGetLong(1, &longVal);
+    Assert(errNone == err && value == longVal);
+    const char *strVal;
+    err = reader.ErrGetStr(3, &strVal);
+    Assert(errNone == err && 0 == StrCompare(str, strVal));
+    int intVal;
+    err = reader.ErrGetInt(PREFS_STORE_TEST_ITEMS_COUNT - 1, &intVal);
+    Assert(errNone == err && PREFS_STORE_TEST_ITEMS_COUNT - 1 == intVal);
+}
+
+// Cut bytesCount bytes off the end of the preferences record.
+static void PrefsStoreTestTruncate(long bytesCount)
+{
+    LocalID dbId = DmFindDatabase(0, PREFS_STORE_TEST_DB_NAME);
+    Assert(0 != dbId);
+    DmOpenRef db = DmOpenDatabase(0, dbId, dmModeReadWrite);
+    Assert(db);
+    MemHandle recHandle = DmQueryRecord(db, 0);
+    Assert(recHandle);
+    recHandle = DmResizeRecord(db, 0, MemHandleSize(recHandle) - bytesCount);
+    Assert(recHandle);
+    DmCloseDatabase(db);
+}
+
+// Check that items are found by id whatever order they were set in, that
+// missing items and type mismatches are reported, and that items before
+// damaged part of the record are still read while the rest report corruption.
+static void test_PrefsStoreDecode()
+{
+    DeletePrefsStoreTestDb();
+    Err err = PrefsStoreTestSave(5, "abc");
+    Assert(errNone == err);
+    {
+        PrefsStoreReader reader(PREFS_STORE_TEST_DB_NAME, PREFS_STORE_TEST_DB_CREATOR, PREFS_STORE_TEST_DB_TYPE);
+        for (int id = 0; id < PREFS_STORE_TEST_ITEMS_COUNT; ++id)
+        {
+            if (1 == id || 3 == id)
+                continue;
+            if (0 == id % 2)
+            {
+                Boolean boolVal = false;
+                err = reader.ErrGetBool(id, &boolVal);
+                Assert(errNone == err && boolVal);
+            }
+            else
+            {
+                int intVal = 0;
+                err = reader.ErrGetInt(id, &intVal);
+                Assert(errNone == err && id == intVal);
+            }
+        }
+        int intVal;
+        err = reader.ErrGetInt(PREFS_STORE_TEST_ITEMS_COUNT, &intVal);
+        Assert(psErrItemNotFound == err);
+        err = reader.ErrGetInt(2, &intVal);
+        Assert(psErrItemTypeMismatch == err);
+    }
+    PrefsStoreTestCheck(5, "abc");
+
+    // record is written in order of ids, so it's the last item (int) that is damaged
+    PrefsStoreTestTruncate(1);
+    PrefsStoreReader reader(PREFS_STORE_TEST_DB_NAME, PREFS_STORE_TEST_DB_CREATOR, PREFS_STORE_TEST_DB_TYPE);
+    Boolean boolVal = false;
+    err = reader.ErrGetBool(PREFS_STORE_TEST_ITEMS_COUNT - 2, &boolVal);
+    Assert(errNone == err && boolVal);
+    int intVal;
+    err = reader.ErrGetInt(PREFS_STORE_TEST_ITEMS_COUNT - 1, &intVal);
+    Assert(psErrDatabaseCorrupted == err);
+    err = reader.ErrGetInt(PREFS_STORE_TEST_ITEMS_COUNT, &intVal);
+    Assert(psErrDatabaseCorrupted == err);
+}
+
+// Check that unchanged prefs aren't written, that changed items are appended
+// under the delta header and that the record is compacted when appended items
+// make it over twice the size of all prefs.
+void test_PrefsStore()
+{
+    char header[4];
+    DeletePrefsStoreTestDb();
+
+    Err err = PrefsStoreTestSave(0, "abc");
+    Assert(errNone == err);
+    long fullSize = PrefsStoreTestRecordSize(header);
+    Assert(0 == MemCmp(header, PREFS_STORE_RECORD_ID, 4));
+    PrefsStoreTestCheck(0, "abc");
+
+    err = PrefsStoreTestSave(0, "abc");
+    Assert(errNone == err);
+    Assert(fullSize == PrefsStoreTestRecordSize(header));
+    Assert(0 == MemCmp(header, PREFS_STORE_RECORD_ID, 4));
+
+    // long item takes 2 bytes of id, 2 of type and 4 of value
+    err = PrefsStoreTestSave(7, "abc");
+    Assert(errNone == err);
+    Assert(fullSize + 8 == PrefsStoreTestRecordSize(header));
+    Assert(0 == MemCmp(header, PREFS_STORE_DELTA_RECORD_ID, 4));
+    PrefsStoreTestCheck(7, "abc");
+
+    // longer string makes all prefs 1 byte longer
+    long compactedSize = fullSize + 1;
+    long recSize = fullSize + 8;
+    long value = 7;
+    while (recSize != compactedSize)
+    {
+        err = PrefsStoreTestSave(++value, "abcd");
+        Assert(errNone == err);
+        long newSize = PrefsStoreTestRecordSize(header);
+        Assert(newSize > recSize || newSize == compactedSize);
+        Assert(newSize <= 2 * compactedSize);
+        recSize = newSize;
+    }
+    Assert(0 == MemCmp(header, PREFS_STORE_RECORD_ID, 4));
+    PrefsStoreTestCheck(value, "abcd");
+
+    test_PrefsStoreDecode();
+    DeletePrefsStoreTestDb();
+}
+
+#endif // NDEBUG
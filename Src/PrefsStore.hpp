@@ -70,8 +70,14 @@ private:
     MemHandle   _recHandle;
     const unsigned char *  _recData;
     Boolean     _fDbNotFound;
+    // items decoded from the record on first access, sorted by id
+    PrefItem *  _items;
+    int         _itemsCount;
+    // error that stopped decoding, returned for ids that weren't found
+    Err         _decodeErr;
 
     Err ErrOpenPrefsDatabase();
+    Err ErrDecodeItems();
     Err ErrGetPrefItemWithId(int uniqueId, PrefItem *prefItem);
 public:
     PrefsStoreReader(const char *dbName, UInt32 dbCreator, UInt32 dbType);
@@ -84,16 +90,16 @@ public:
     ~PrefsStoreReader();
 };
 
-#define MAX_PREFS_ITEMS   80
-
 class PrefsStoreWriter NON_COPYABLE
 {
 private:
     const char *      _dbName;
     UInt32      _dbCreator;
     UInt32      _dbType;
-    PrefItem    _items[MAX_PREFS_ITEMS];
+    // items sorted by id, grown as needed
+    PrefItem *  _items;
     int         _itemsCount;
+    int         _itemsCapacity;
 
     Err ErrSetItem(PrefItem *item);
 
@@ -121,4 +127,8 @@ void            serString  (const char *str, char *prefsBlob, long *pCurrBlobSiz
 char *          deserString(const unsigned char **data, long *pCurrBlobSize);
 void            deserStringToBuf(char *buf, int bufSize, const unsigned char **data, long *pCurrBlobSize);
 
+#ifdef DEBUG
+void test_PrefsStore();
+#endif
+
 #endif
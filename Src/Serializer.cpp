@@ -3,11 +3,45 @@
 #include <BufferedReader.hpp>
 #include <Text.hpp>
 #include <UTF8_Processor.hpp>
+#include <Logging.hpp>
+#include <algorithm>
 
 #define SERIALIZER_MAGIC 'serl'
+#define SERIALIZER_DIRECTORY_MAGIC 'sdir'
 
 using namespace std;
 
+// Version 2 stream ends with directory entries followed by this trailer, so that directory is found from the end.
+struct SerializerDirectoryTrailer {
+    uint32_t offset;
+    uint32_t count;
+    uint32_t magic;
+};
+
+enum {maxVarintLength = (8 * sizeof(ulong_t) + 6) / 7};
+
+static char* writeVarint(char* out, ulong_t value)
+{
+    while (value >= 0x80)
+    {
+        *out++ = char(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = char(value);
+    return out;
+}
+
+// Zig-zag mapping makes small negative values small unsigned ones (0, -1, 1, -2 become 0, 1, 2, 3), so that their varints are short.
+static ulong_t zigZagEncode(ulong_t value)
+{
+    return (value << 1) ^ (0 - (value >> (8 * sizeof(ulong_t) - 1)));
+}
+
+static ulong_t zigZagDecode(ulong_t value)
+{
+    return (value >> 1) ^ (0 - (value & 1));
+}
+
 bool Serializable::serializeInFromVersion(Serializer& ser, ulong_t version) {return false;}
 
 ulong_t Serializable::schemaVersion() const {return 1;}
@@ -22,12 +56,19 @@ direction_(directionInput),
 isIndexed_(false),
 skipLastRecord_(false),
 version_(0),
-buffer_(NULL)
+buffer_(NULL),
+writePosition_(0),
+versionWritten_(false),
+finished_(false),
+directoryOffset_(0),
+accumulateErrors_(false),
+error_(errNone)
 {
     reader_->mark();
 }
 
-Serializer::Serializer(Writer& writer): reader_(NULL), writer_(&writer), direction_(directionOutput), isIndexed_(false), skipLastRecord_(false), version_(currentVersion), buffer_(NULL) 
+Serializer::Serializer(Writer& writer): reader_(NULL), writer_(&writer), direction_(directionOutput), isIndexed_(false), skipLastRecord_(false), version_(currentVersion), buffer_(NULL),
+writePosition_(0), versionWritten_(false), finished_(false), directoryOffset_(0), accumulateErrors_(false), error_(errNone)
 {
     writeVersion(); 
 }
@@ -39,7 +80,13 @@ direction_(dir),
 isIndexed_(false),
 skipLastRecord_(false) ,
 version_(currentVersion),
-buffer_(NULL)
+buffer_(NULL),
+writePosition_(0),
+versionWritten_(false),
+finished_(false),
+directoryOffset_(0),
+accumulateErrors_(false),
+error_(errNone)
 {
     reader_->mark();
     if (directionOutput == direction_)
@@ -48,59 +95,121 @@ buffer_(NULL)
 
 Serializer::~Serializer() 
 {
+    assert(directionInput == direction_ || finished_ || failed());
+    // Best effort, so that output isn't lost in release build; error can't be reported from here, so it mustn't be thrown either.
+    if (directionOutput == direction_ && !finished_ && !failed())
+    {
+        accumulateErrors_ = true;
+        finish();
+    }
     delete reader_;
     free(buffer_); 
 }
 
+// Error is remembered also when it's thrown, so that serializer abandoned by the exception counts as failed.
+Serializer& Serializer::fail(status_t error)
+{
+    if (errNone == error_)
+        error_ = error;
+    if (!accumulateErrors_)
+        ErrThrow(error);
+    return *this;
+}
+
+status_t Serializer::flushOutput()
+{
+    if (outputBuffer_.empty())
+        return errNone;
+    status_t error = writer_->writeRaw(outputBuffer_.data(), outputBuffer_.length());
+    outputBuffer_.erase();
+    return error;
+}
+
 void Serializer::serializeChunk(void* buffer, ulong_t length)
 {
-    status_t error;
+    status_t error = errNone;
     if (directionInput == direction_)
     {   
         assert(NULL != reader_);
-        ulong_t read = length;
-        error = reader_->readRaw(buffer, read);
-        if (read != length)
-            ErrThrow(errCorrupted);
+        ulong_t read = 0;
+        if (!failed())
+        {
+            read = length;
+            error = reader_->readRaw(buffer, read);
+            if (errNone == error && read != length)
+                error = errCorrupted;
+        }
+        // Data that couldn't be read is zeroed, so that caller accumulating errors never sees garbage.
+        if (read < length)
+            memset(static_cast<char*>(buffer) + read, 0, length - read);
     }
     else {
         assert(NULL != writer_);
-        error = writer_->writeRaw(buffer, length);
+        assert(!finished_);
+        if (failed())
+            return;
+        writePosition_ += length;
+        if (outputBuffer_.length() + length > outputChunkSize)
+            error = flushOutput();
+        // Chunk that wouldn't fit into buffer anyway is written directly.
+        if (errNone == error && length >= outputChunkSize)
+            error = writer_->writeRaw(buffer, length);
+        else if (errNone == error)
+            outputBuffer_.append(static_cast<const char*>(buffer), length);
     }
     if (errNone != error)
-        ErrThrow(error);
+        fail(error);
 }
 
+// Versions with directory are never scanned.
 bool Serializer::indexNextRecord()
 {
+    assert(!hasDirectory());
     Record record;
     ulong_t length = sizeof(record);
     status_t error = reader_->readRaw(&record, length);
     if (errNone != error)
-        ErrThrow(error);
+    {
+        fail(error);
+        return false;
+    }
     if (0 == length)
         return false;
     if (sizeof(record) != length)
-        ErrThrow(errCorrupted);
+    {
+        fail(errCorrupted);
+        return false;
+    }
 
     if (oldVersion() && unusedIdVer0 == record.id)
         record.id = unusedId;     
 
     if (unusedId != record.id)
-        recordIndex_[record.id] = reader_->position() - length;
+    {
+        DirectoryEntry entry;
+        entry.id = record.id;
+        entry.offset = reader_->position() - length;
+        recordIndex_.push_back(entry);
+    }
 
     if (dtStringVer0 == record.type || dtBlob == record.type || dtText == record.type || dtDouble == record.type)
     { 
         length = record.stringLength;
         void* buffer = malloc(length);
         if (NULL == buffer)
-            ErrThrow(memErrNotEnoughSpace);
+        {
+            fail(memErrNotEnoughSpace);
+            return false;
+        }
 
         error = reader_->readRaw(buffer, length);
         free(buffer);
 
         if (errNone != error)
-            ErrThrow(errCorrupted);
+        {
+            fail(errCorrupted);
+            return false;
+        }
 
     }
     return true;
@@ -129,55 +238,223 @@ void Serializer::writeVersion()
     uint32_t version = currentVersion;
     serializeChunk(&magic, sizeof(magic));
     serializeChunk(&version, sizeof(version));
+    versionWritten_ = true;
+}
+
+// Record written later replaces earlier one with the same id.
+void Serializer::sortIndex(RecordIndex_t& index)
+{
+    stable_sort(index.begin(), index.end(), DirectoryEntryLess());
+    RecordIndex_t::iterator out = index.begin();
+    RecordIndex_t::iterator end = index.end();
+    for (RecordIndex_t::iterator it = index.begin(); it != end; ++it)
+    {
+        RecordIndex_t::iterator next = it + 1;
+        if (next != end && next->id == it->id)
+            continue;
+        *out++ = *it;
+    }
+    index.erase(out, end);
+}
+
+status_t Serializer::finish()
+{
+    if (finished_ || failed())
+        return error_;
+    finished_ = true;
+
+    if (versionWritten_)
+    {
+        sortIndex(directory_);
+        SerializerDirectoryTrailer trailer;
+        trailer.offset = writePosition_;
+        trailer.count = directory_.size();
+        trailer.magic = SERIALIZER_DIRECTORY_MAGIC;
+        if (!directory_.empty())
+            outputBuffer_.append(reinterpret_cast<const char*>(&directory_[0]), directory_.size() * sizeof(DirectoryEntry));
+        outputBuffer_.append(reinterpret_cast<const char*>(&trailer), sizeof(trailer));
+    }
+    status_t error = flushOutput();
+    if (errNone != error)
+        fail(error);
+    return error_;
 }
 
+// Reader is a stream, so the directory is reached by buffering rest of it in one go, which is still much cheaper than parsing records.
+void Serializer::loadDirectory()
+{
+    status_t error = reader_->readToEnd();
+    if (errNone != error)
+    {
+        fail(error);
+        return;
+    }
+
+    SerializerDirectoryTrailer trailer;
+    if (errNone != reader_->seek(-long(sizeof(trailer)), BufferedReader::seekFromEnd))
+    {
+        fail(errCorrupted);
+        return;
+    }
+    ulong_t directoryEnd = reader_->position();
+    serializeChunk(&trailer, sizeof(trailer));
+    if (SERIALIZER_DIRECTORY_MAGIC != trailer.magic || trailer.offset > directoryEnd 
+        || trailer.count != (directoryEnd - trailer.offset) / sizeof(DirectoryEntry)
+        || trailer.offset + trailer.count * sizeof(DirectoryEntry) != directoryEnd)
+    {
+        fail(errCorrupted);
+        return;
+    }
+
+    directoryOffset_ = trailer.offset;
+    recordIndex_.resize(trailer.count);
+    if (0 == trailer.count)
+        return;
+
+    if (errNone != reader_->seek(trailer.offset, BufferedReader::seekFromBeginning))
+    {
+        fail(errCorrupted);
+        return;
+    }
+    serializeChunk(&recordIndex_[0], trailer.count * sizeof(DirectoryEntry));
+    // Binary search relies on the order, so directory that isn't sorted is treated as damaged.
+    for (ulong_t i = 1; i < trailer.count; ++i)
+        if (recordIndex_[i - 1].id >= recordIndex_[i].id)
+        {
+            fail(errCorrupted);
+            return;
+        }
+}
 
 void Serializer::loadIndex() 
 {
     assert(!isIndexed_);
     isIndexed_ = true;
-    bool goOn = true;
     readVersion(); 
-    while (goOn)
-        goOn = indexNextRecord();
+    ulong_t firstRecord = reader_->position();
+    if (hasDirectory())
+        loadDirectory();
+    else
+    {
+        while (indexNextRecord())
+            ;
+        sortIndex(recordIndex_);
+    }
+    // Records without ids are read in sequence starting from the first one.
+    status_t error = reader_->seek(firstRecord, BufferedReader::seekFromBeginning);
+    if (errNone != error)
+        fail(error);
 }
 
 void Serializer::serializeRecordIn(Record& record)
 {
     Record buffer;
     assureIndexed();
-    skipLastRecord_ = false;
+    // After accumulated error all records are skipped, leaving values unchanged.
+    skipLastRecord_ = failed();
+    if (skipLastRecord_)
+        return;
     if (unusedId != record.id)
     {
-        RecordIndex_t::const_iterator it = recordIndex_.find(record.id);
-        if (recordIndex_.end() == it) // Don't try loading missing records with explicit ids. Skip them assuming that they are initialized to some reasonable defaults.
+        RecordIndex_t::const_iterator it = lower_bound(recordIndex_.begin(), recordIndex_.end(), record.id, DirectoryEntryLess());
+        if (recordIndex_.end() == it || it->id != record.id) // Don't try loading missing records with explicit ids. Skip them assuming that they are initialized to some reasonable defaults.
         {
             skipLastRecord_ = true;
             return;  
         }
-        if (reader_->position() != it->second)
+        if (reader_->position() != it->offset)
         {
-            status_t error = reader_->seek(it->second, BufferedReader::seekFromBeginning);
-            assert(errNone == error); // This is correct assumption as we must have already read entire stream once to know record's position.
+            status_t error = reader_->seek(it->offset, BufferedReader::seekFromBeginning);
+            // Offsets of earlier versions come from reading the stream, but directory may be damaged.
+            if (errNone != error)
+                fail(errCorrupted);
         }
     }
-    serializeChunk(&buffer, sizeof(buffer));
+    if (!failed())
+    {
+        if (compactRecords())
+            readCompactRecord(buffer);
+        else
+            serializeChunk(&buffer, sizeof(buffer));
+    }
+    if (!failed() && hasDirectory() && reader_->position() > directoryOffset_)
+        fail(errCorrupted);
     if (oldVersion() && unusedIdVer0 == buffer.id)
         buffer.id = unusedId;
 
-    if (buffer.id != record.id)
-        ErrThrow(errCorrupted);
+    if (!failed() && buffer.id != record.id)
+        fail(errCorrupted);
 
-    if (buffer.type != record.type)
+    if (!failed() && buffer.type != record.type)
         if (!(dtStringVer0 == buffer.type && (dtBlob == record.type || dtText == record.type)))
-            ErrThrow(errCorrupted);
+            fail(errCorrupted);
 
-    record = buffer;
+    skipLastRecord_ = failed();
+    if (!skipLastRecord_)
+        record = buffer;
 }
 
 void Serializer::serializeRecordOut(Record& record)
 {
-    serializeChunk(&record, sizeof(record));
+    if (failed())
+        return;
+    if (unusedId != record.id)
+    {
+        DirectoryEntry entry;
+        entry.id = record.id;
+        entry.offset = writePosition_;
+        directory_.push_back(entry);
+    }
+    // Type, id and value are varints, id incremented by 1 so that unusedId takes single byte.
+    char buffer[3 * maxVarintLength];
+    char* end = writeVarint(buffer, record.type);
+    end = writeVarint(end, record.id + 1);
+    ulong_t value = record.value;
+    if (isSignedType(record.type))
+        value = zigZagEncode(value);
+    end = writeVarint(end, value);
+    serializeChunk(buffer, end - buffer);
+}
+
+bool Serializer::isSignedType(DataType dt)
+{
+    return dtChar == dt || dtShort == dt || dtInt == dt || dtLong == dt;
+}
+
+void Serializer::readVarint(ulong_t& value)
+{
+    value = 0;
+    for (ulong_t shift = 0; ; shift += 7)
+    {
+        if (shift >= 8 * sizeof(ulong_t))
+        {
+            fail(errCorrupted);
+            return;
+        }
+        unsigned char b;
+        serializeChunk(&b, sizeof(b));
+        value |= ulong_t(b & 0x7f) << shift;
+        if (0 == (b & 0x80))
+            break;
+    }
+}
+
+void Serializer::readCompactRecord(Record& record)
+{
+    ulong_t type;
+    readVarint(type);
+    if (type > dtDouble)
+    {
+        fail(errCorrupted);
+        return;
+    }
+    record.fill_ = 0;
+    record.type = DataType(type);
+    readVarint(record.id);
+    --record.id;
+    readVarint(record.value);
+    if (isSignedType(record.type))
+        record.value = zigZagDecode(record.value);
 }
 
 void Serializer::serializeRecord(Record& record)
@@ -239,7 +516,7 @@ Serializer& Serializer::operator()(double& value, ulong_t id)
     serializeSimpleType(dtDouble, length, id);
 
     if (directionInput == direction() && sizeof(double) != length)
-        ErrThrow(errCorrupted);
+        return fail(errCorrupted);
 
     if (directionOutput == direction() || !skipLastRecord_) 
         serializeChunk(&value, sizeof(double)); 
@@ -256,7 +533,7 @@ Serializer& Serializer::narrowBuffer(char* array, ulong_t size, ulong_t id)
     else if (!skipLastRecord_)
     {
         if (size < length)
-            ErrThrow(errBufferTooSmall);
+            return fail(errBufferTooSmall);
         serializeChunk(array, length);
         if (length < size)
             ((char*)array)[length] = '\0';
@@ -306,7 +583,7 @@ Serializer& Serializer::narrowIn(char*& str, ulong_t* len, ulong_t id)
 
     char* p = (char*)malloc(length + 1);
     if (NULL == p)
-        ErrThrow(memErrNotEnoughSpace);
+        return fail(memErrNotEnoughSpace);
 
     buffer_ = p;
     serializeChunk(p, length);
@@ -342,7 +619,7 @@ Serializer& Serializer::textOut(const char_t* str, long len, ulong_t id)
     free(buffer_);
     buffer_ = UTF8_FromNative(str, len, &length);
     if (NULL == buffer_)
-        ErrThrow(memErrNotEnoughSpace);
+        return fail(memErrNotEnoughSpace);
 
     serializeSimpleType(dtText, length, id);
     serializeChunk(buffer_, length);
@@ -367,7 +644,7 @@ Serializer& Serializer::textIn(char_t*& str, ulong_t* len, ulong_t id)
 
     char* p = (char*)malloc(length);
     if (NULL == p)
-        ErrThrow(memErrNotEnoughSpace);
+        return fail(memErrNotEnoughSpace);
 
     buffer_ = p;
     serializeChunk(buffer_, length);
@@ -379,7 +656,7 @@ Serializer& Serializer::textIn(char_t*& str, ulong_t* len, ulong_t id)
     buffer_ = NULL;
 
     if (NULL == s)
-        ErrThrow(memErrNotEnoughSpace);
+        return fail(memErrNotEnoughSpace);
 
     free(str);
     str = s;
@@ -415,7 +692,7 @@ Serializer& Serializer::text(String& value, ulong_t id)
 
     char* p = (char*)malloc(length);
     if (NULL == p)
-        ErrThrow(memErrNotEnoughSpace);
+        return fail(memErrNotEnoughSpace);
 
     buffer_ = p;
     serializeChunk(buffer_, length);
@@ -427,7 +704,7 @@ Serializer& Serializer::text(String& value, ulong_t id)
     buffer_ = NULL;
 
     if (NULL == s)
-        ErrThrow(memErrNotEnoughSpace);
+        return fail(memErrNotEnoughSpace);
 
     buffer_ = s;
     value.assign(s, slen);
@@ -453,7 +730,7 @@ Serializer& Serializer::textBuffer(char_t* array, ulong_t size, ulong_t id)
 
     char* p = (char*)malloc(length);
     if (NULL == p)
-        ErrThrow(memErrNotEnoughSpace);
+        return fail(memErrNotEnoughSpace);
 
     buffer_ = p;
     serializeChunk(buffer_, length);
@@ -465,11 +742,11 @@ Serializer& Serializer::textBuffer(char_t* array, ulong_t size, ulong_t id)
     buffer_ = NULL;
 
     if (NULL == s)
-        ErrThrow(memErrNotEnoughSpace);
+        return fail(memErrNotEnoughSpace);
 
     buffer_ = s;
     if (slen > size)
-        ErrThrow(errBufferTooSmall);
+        return fail(errBufferTooSmall);
 
     memmove(array, s, slen * sizeof(char_t));
     if (slen < size)
@@ -504,4 +781,326 @@ Serializer& Serializer::operator()(Serializable& object, ulong_t id)
     return *this;
 }
 
+#ifndef NDEBUG
+
+class SerializerTestWriter: public Writer {
+public:
+    NarrowString data;
+    ulong_t writesCount;
+
+    SerializerTestWriter(): writesCount(0) {}
+
+    status_t flush() {return errNone;}
+
+    status_t writeRaw(const void* buffer, ulong_t length)
+    {
+        ++writesCount;
+        data.append(static_cast<const char*>(buffer), length);
+        return errNone;
+    }
+};
+
+class SerializerTestFullWriter: public Writer {
+public:
+    status_t flush() {return errNone;}
+
+    status_t writeRaw(const void*, ulong_t) {return memErrNotEnoughSpace;}
+};
+
+// Buffered output is written only by finish(), which must report failure by throwing unless errors are accumulated.
+static void test_SerializerFinish()
+{
+    SerializerTestFullWriter writer;
+    status_t err = errNone;
+    {
+        Serializer serialize(writer);
+        ulong_t value = 1;
+        serialize(value, 1);
+        ErrTry {
+            serialize.finish();
+        }
+        ErrCatch(ex) {
+            err = ex;
+        } ErrEndCatch
+    }
+    assert(memErrNotEnoughSpace == err);
+
+    Serializer serialize(writer);
+    serialize.setAccumulateErrors(true);
+    ulong_t value = 1;
+    serialize(value, 1);
+    err = serialize.finish();
+    assert(memErrNotEnoughSpace == err);
+    assert(memErrNotEnoughSpace == serialize.error());
+}
+
+class SerializerTestReader: public Reader {
+    const NarrowString& data_;
+    ulong_t position_;
+public:
+    SerializerTestReader(const NarrowString& data): data_(data), position_(0) {}
+
+    status_t readRaw(void* buffer, ulong_t& length)
+    {
+        length = std::min<ulong_t>(length, data_.length() - position_);
+        memmove(buffer, data_.data() + position_, length);
+        position_ += length;
+        return errNone;
+    }
+};
+
+static status_t test_SerializerWriteRecords(Serializer& serialize)
+{
+    ErrTry {
+        ulong_t value = 1000;
+        serialize(value, 1);
+        value = 3;
+        serialize(value, 3);
+        value = 4;
+        serialize(value);
+        serialize.narrowOut("seven", -1, 7);
+    }
+    ErrCatch(ex) {
+        return ex;
+    } ErrEndCatch
+    return errNone;
+}
+
+static status_t test_SerializerReadRecords(Serializer& serialize)
+{
+    char* str = NULL;
+    ErrTry {
+        ulong_t value = 0;
+        // Records with ids are read in any order, missing ones are skipped.
+        serialize.narrowIn(str, NULL, 7);
+        assert(0 == strcmp("seven", str));
+        serialize(value, 3);
+        assert(3 == value);
+        value = 1;
+        serialize(value, 100);
+        assert(1 == value);
+        serialize(value);
+        assert(4 == value);
+        serialize(value, 1);
+        assert(1000 == value);
+    }
+    ErrCatch(ex) {
+        free(str);
+        return ex;
+    } ErrEndCatch
+    free(str);
+    return errNone;
+}
+
+class SerializerTestObject: public Serializable {
+public:
+    enum {fieldsCount = 1000};
+    ulong_t fields[fieldsCount];
+
+    void serialize(Serializer& ser)
+    {
+        for (ulong_t i = 0; i < fieldsCount; ++i)
+            ser(fields[i], i);
+    }
+};
+
+static void test_SerializerBenchmark()
+{
+    SerializerTestObject object;
+    for (ulong_t i = 0; i < SerializerTestObject::fieldsCount; ++i)
+        object.fields[i] = i * i;
+
+    enum {rounds = 100};
+    SerializerTestWriter writer;
+    tick_t start = ticks();
+    for (ulong_t i = 0; i < rounds; ++i)
+    {
+        writer.data.erase();
+        writer.writesCount = 0;
+        Serializer serialize(writer);
+        serialize.setAccumulateErrors(true);
+        serialize(object);
+        status_t err = serialize.finish();
+        assert(errNone == err);
+    }
+    LogStrUlong(eLogDebug, _T("test_SerializerBenchmark(): ticks spent writing: "), ticks() - start);
+    // Records are batched instead of being written field by field.
+    assert(writer.writesCount <= writer.data.length() / 1024 + 1);
+
+    start = ticks();
+    for (ulong_t i = 0; i < rounds; ++i)
+    {
+        memset(object.fields, 0, sizeof(object.fields));
+        SerializerTestReader reader(writer.data);
+        Serializer serialize(reader);
+        serialize.setAccumulateErrors(true);
+        serialize(object);
+        assert(errNone == serialize.error());
+    }
+    LogStrUlong(eLogDebug, _T("test_SerializerBenchmark(): ticks spent reading: "), ticks() - start);
+    for (ulong_t i = 0; i < SerializerTestObject::fieldsCount; ++i)
+        assert(i * i == object.fields[i]);
+
+    // Truncated stream reports error once instead of throwing, and leaves values that couldn't be read unchanged.
+    NarrowString data(writer.data, 0, writer.data.length() / 2);
+    SerializerTestReader reader(data);
+    Serializer serialize(reader);
+    serialize.setAccumulateErrors(true);
+    object.fields[0] = 7;
+    serialize(object);
+    assert(Serializer::errCorrupted == serialize.error());
+    assert(7 == object.fields[0]);
+}
+
+class SerializerTestPrefsVer1: public SchemaSerializable<SerializerTestPrefsVer1> {
+public:
+    ulong_t count;
+    NarrowString name;
+
+    static const SerialField<SerializerTestPrefsVer1> serialFields[];
+};
+
+const SerialField<SerializerTestPrefsVer1> SerializerTestPrefsVer1::serialFields[] = {
+    SERIAL_FIELD(SerializerTestPrefsVer1, ulong_t, count, 1, 1),
+    SERIAL_NARROW_FIELD(SerializerTestPrefsVer1, name, Serializable::unusedId, 1),
+    SERIAL_FIELDS_END
+};
+
+// Next version of the same object.
+class SerializerTestPrefs: public SchemaSerializable<SerializerTestPrefs> {
+public:
+    ulong_t count;
+    NarrowString name;
+    long offset;
+    String title;
+
+    SerializerTestPrefs(): count(0), offset(-1) {}
+
+    ulong_t schemaVersion() const {return 2;}
+
+    static const SerialField<SerializerTestPrefs> serialFields[];
+};
+
+const SerialField<SerializerTestPrefs> SerializerTestPrefs::serialFields[] = {
+    SERIAL_FIELD(SerializerTestPrefs, ulong_t, count, 1, 1),
+    SERIAL_NARROW_FIELD(SerializerTestPrefs, name, Serializable::unusedId, 1),
+    SERIAL_FIELD(SerializerTestPrefs, long, offset, Serializable::unusedId, 2),
+    SERIAL_TEXT_FIELD(SerializerTestPrefs, title, 3, 2),
+    SERIAL_FIELDS_END
+};
+
+static void test_SerializerSchema()
+{
+    SerializerTestWriter writer;
+    {
+        SerializerTestPrefsVer1 prefs;
+        prefs.count = 5;
+        prefs.name = "five";
+        Serializer serialize(writer);
+        serialize.setAccumulateErrors(true);
+        serialize(prefs);
+        status_t err = serialize.finish();
+        assert(errNone == err);
+    }
+    SerializerTestPrefs prefs;
+    {
+        SerializerTestReader reader(writer.data);
+        Serializer serialize(reader);
+        serialize.setAccumulateErrors(true);
+        serialize(prefs);
+        assert(errNone == serialize.error());
+    }
+    // Fields added in version 2 keep their defaults.
+    assert(5 == prefs.count && "five" == prefs.name && -1 == prefs.offset && prefs.title.empty());
+
+    prefs.offset = -7;
+    prefs.title = _T("title");
+    writer.data.erase();
+    {
+        Serializer serialize(writer);
+        serialize(prefs);
+        status_t err = serialize.finish();
+        assert(errNone == err);
+    }
+    SerializerTestPrefs copy;
+    SerializerTestReader reader(writer.data);
+    Serializer serialize(reader);
+    serialize.setAccumulateErrors(true);
+    serialize(copy);
+    assert(errNone == serialize.error());
+    assert(5 == copy.count && "five" == copy.name && -7 == copy.offset && _T("title") == copy.title);
+}
+
+static status_t test_SerializerRead(const NarrowString& data)
+{
+    SerializerTestReader reader(data);
+    Serializer serialize(reader);
+    return test_SerializerReadRecords(serialize);
+}
+
+void test_Serializer()
+{
+    SerializerTestWriter writer;
+    {
+        Serializer serialize(writer);
+        status_t err = test_SerializerWriteRecords(serialize);
+        assert(errNone == err);
+        err = serialize.finish();
+        assert(errNone == err);
+    }
+    status_t err = test_SerializerRead(writer.data);
+    assert(errNone == err);
+
+    SerializerDirectoryTrailer trailer;
+    memmove(&trailer, writer.data.data() + writer.data.length() - sizeof(trailer), sizeof(trailer));
+    assert(SERIALIZER_DIRECTORY_MAGIC == trailer.magic && 3 == trailer.count);
+
+    // Same records in version 1 layout of fixed-size structures and no directory.
+    SerializerTestWriter oldWriter;
+    uint32_t header[2] = {SERIALIZER_MAGIC, 1};
+    oldWriter.writeRaw(header, sizeof(header));
+    Serializer::Record records[4] = {
+        Serializer::Record(Serializer::dtULong, 1),
+        Serializer::Record(Serializer::dtULong, 3),
+        Serializer::Record(Serializer::dtULong, Serializer::unusedId),
+        Serializer::Record(Serializer::dtBlob, 7)
+    };
+    records[0].value = 1000;
+    records[1].value = 3;
+    records[2].value = 4;
+    records[3].stringLength = 5;
+    oldWriter.writeRaw(records, sizeof(records));
+    oldWriter.write("seven");
+    // Varints should make records several times shorter.
+    assert(trailer.offset * 2 < oldWriter.data.length());
+    err = test_SerializerRead(oldWriter.data);
+    assert(errNone == err);
+
+    SerializerTestWriter signedWriter;
+    {
+        Serializer serialize(signedWriter);
+        signed char c = -1;
+        long l = -100000;
+        serialize(c)(l, 2);
+        err = serialize.finish();
+        assert(errNone == err);
+    }
+    SerializerTestReader signedReader(signedWriter.data);
+    Serializer serialize(signedReader);
+    signed char c = 0;
+    long l = 0;
+    serialize(c)(l, 2);
+    assert(-1 == c && -100000 == l);
+
+    // Directory pointing past the stream must be detected.
+    NarrowString data = writer.data;
+    data.replace(trailer.offset + sizeof(uint32_t), sizeof(uint32_t), sizeof(uint32_t), char(0xff));
+    err = test_SerializerRead(data);
+    assert(Serializer::errCorrupted == err);
+
+    test_SerializerBenchmark();
+    test_SerializerSchema();
+    test_SerializerFinish();
+}
 
+#endif
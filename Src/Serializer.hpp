@@ -3,7 +3,7 @@
 
 #include <Debug.hpp>
 #include <BaseTypes.hpp>
-#include <map>
+#include <vector>
 
 class Reader;
 class Writer;
@@ -36,11 +36,48 @@ class Serializer {
     bool skipLastRecord_;
 	void* buffer_; 
     
-    typedef std::map<ulong_t, ulong_t> RecordIndex_t;
+    //! Directory entries are stored as they are in memory, sorted by id.
+    struct DirectoryEntry {
+        uint32_t id;
+        uint32_t offset;
+    };
+    
+    struct DirectoryEntryLess {
+        bool operator()(const DirectoryEntry& lhs, const DirectoryEntry& rhs) const {return lhs.id < rhs.id;}
+        bool operator()(const DirectoryEntry& lhs, ulong_t id) const {return lhs.id < id;}
+    };
+    
+    typedef std::vector<DirectoryEntry> RecordIndex_t;
     RecordIndex_t recordIndex_;
     
+    //! Records with ids written so far, which make directory written by finish().
+    RecordIndex_t directory_;
+    ulong_t writePosition_;
+    bool versionWritten_;
+    bool finished_;
+    
+    //! Offset of directory in version 2 stream, which sequential reads mustn't reach.
+    ulong_t directoryOffset_;
+    
+    //! Output is collected into chunks of this size, so that writer isn't called for every field.
+    enum {outputChunkSize = 1024};
+    NarrowString outputBuffer_;
+    
+    bool accumulateErrors_;
+    status_t error_;
+    
+    bool failed() const {return errNone != error_;}
+    
+    Serializer& fail(status_t error);
+    
+    status_t flushOutput();
+    
     bool indexNextRecord();
 
+    static void sortIndex(RecordIndex_t& index);
+
+    void loadDirectory();
+
     void loadIndex();
     
     void assureIndexed() { if (!isIndexed_) loadIndex();}
@@ -50,12 +87,18 @@ class Serializer {
 	void writeVersion();	   
 	   
 	bool oldVersion() const {return 0 == version_;} 
+	
+	bool hasDirectory() const {return version_ >= 2;}
+	
+	bool compactRecords() const {return version_ >= 3;}
 	   
 	enum {unusedIdVer0 = Serializable::unusedIdVer0};
 
 public:
 
-	enum {currentVersion = 1}; // version 0 is what is used in PalmOS InfoMan up to 1.3
+	// version 0 is what is used in PalmOS InfoMan up to 1.3, version 2 adds directory of records with ids at the end of stream,
+	// version 3 stores records as varints instead of fixed-size structures
+	enum {currentVersion = 3};
 
     enum Direction {
         directionInput,
@@ -68,10 +111,29 @@ public:
 
     Serializer(Reader& reader, Writer& writer, Direction dir);
 
+    //! @note finish() must be called after serializing out, as destructor can't report the error. It asserts that, 
+    //! but still finishes output on a best-effort basis.
     ~Serializer();
 
+    /**
+     * Writes directory of records with ids, which allows reading them in any order without scanning entire stream,
+     * and flushes buffered output. Nothing may be serialized out afterwards. Required after serializing out, unless it already failed.
+     * Throws on error unless errors are accumulated.
+     * @return accumulated error if there was one.
+     */
+    status_t finish();
+
     Direction direction() const {return direction_;}
     
+    /**
+     * When errors are accumulated, the first one is remembered instead of being thrown and all following operations do nothing
+     * (values read are left unchanged or zeroed), so that status is checked once with error() after entire object is serialized.
+     * This avoids cost of setting up exception handler around each object.
+     */
+    void setAccumulateErrors(bool accumulate) {accumulateErrors_ = accumulate;}
+    
+    status_t error() const {return error_;}
+    
     void setDirection(Direction dir) {direction_ = dir;} 
 
     enum Error {
@@ -187,6 +249,14 @@ private:
     
     void serializeRecordOut(Record& record);
     
+    static bool isSignedType(DataType dt);
+    
+    void readVarint(ulong_t& value);
+    
+    void readCompactRecord(Record& record);
+    
+    friend void test_Serializer();
+    
     template<class T>
     Serializer& serializeSimpleType(DataType dt, T& value, ulong_t id)
     {
@@ -239,4 +309,81 @@ private:
 */
 };
 
+/**
+ * Entry of static table describing fields of class T (see SchemaSerializable).
+ * Function serializing the field is instantiated for its member pointer, so that choice of Serializer operation
+ * for field's type is made by compiler instead of being written by hand for each field.
+ * @note This only saves writing serialize() by hand: each field costs an indirect call on top of the same Serializer
+ * operation (records are still encoded and decoded by their DataType), so it's no faster than hand-written code.
+ */
+template<class T>
+struct SerialField {
+
+    typedef void (*Serialize_t)(Serializer& ser, T& object, ulong_t id);
+    
+    Serialize_t serialize;
+    
+    ulong_t id;
+    
+    //! Schema version field was added in, objects stored with earlier version are read without it.
+    ulong_t sinceVersion;
+    
+};
+
+template<class T, class Field, Field T::*member>
+void SerialFieldValue(Serializer& ser, T& object, ulong_t id) {ser(object.*member, id);}
+
+template<class T, NarrowString T::*member>
+void SerialFieldNarrow(Serializer& ser, T& object, ulong_t id) {ser.narrow(object.*member, id);}
+
+template<class T, String T::*member>
+void SerialFieldText(Serializer& ser, T& object, ulong_t id) {ser.text(object.*member, id);}
+
+//! Field of numeric type or Serializable.
+#define SERIAL_FIELD(Class, Type, member, id, sinceVersion) {&SerialFieldValue<Class, Type, &Class::member>, (id), (sinceVersion)}
+
+#define SERIAL_NARROW_FIELD(Class, member, id, sinceVersion) {&SerialFieldNarrow<Class, &Class::member>, (id), (sinceVersion)}
+
+//! Field converted to UTF-8 like with Serializer::text().
+#define SERIAL_TEXT_FIELD(Class, member, id, sinceVersion) {&SerialFieldText<Class, &Class::member>, (id), (sinceVersion)}
+
+#define SERIAL_FIELDS_END {NULL, Serializable::unusedId, 0}
+
+/**
+ * Serializable with fields described by table instead of hand-written serialize(), which T (derived class) defines as
+ * @code static const SerialField<T> serialFields[]; @endcode ended with SERIAL_FIELDS_END. The same table serializes object
+ * in both directions, and objects stored with earlier schemaVersion() are read without fields added later, so that
+ * adding a field needs only a table entry with current version. 
+ * Fields without ids are read in sequence, so they can't be removed; fields with ids may be just dropped from the table.
+ */
+template<class T>
+class SchemaSerializable: public Serializable {
+
+    void serializeFields(Serializer& ser, ulong_t version)
+    {
+        T& object = static_cast<T&>(*this);
+        for (const SerialField<T>* field = T::serialFields; NULL != field->serialize; ++field)
+            if (field->sinceVersion <= version)
+                (*field->serialize)(ser, object, field->id);
+    }
+
+public:
+
+    void serialize(Serializer& ser) {serializeFields(ser, schemaVersion());}
+    
+    bool serializeInFromVersion(Serializer& ser, ulong_t version)
+    {
+        // Newer schema can't be read.
+        if (version > schemaVersion())
+            return false;
+        serializeFields(ser, version);
+        return true;
+    }
+
+};
+
+#ifdef DEBUG
+void test_Serializer();
+#endif
+
 #endif
\ No newline at end of file
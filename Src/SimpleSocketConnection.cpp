@@ -4,16 +4,18 @@
 
 SimpleSocketConnection::SimpleSocketConnection(SocketConnectionManager& manager):
 SocketConnection(manager),
-maxResponseSize_(32768),
-sending_(true),
-chunkSize_(576),
 request_(NULL),
 requestLenLeft_(0),
 requestSent_(0),
-response_(NULL),
-responseLen_(0),
+maxResponseSize_(32768),
+chunkSize_(576),
 totalReceived_(0),
-chunk_(NULL)
+sending_(true),
+shutdownAfterSend_(true),
+responseBuffer_(NULL),
+responseCapacity_(0),
+response_(NULL),
+responseLen_(0)
 {}
 
 status_t SimpleSocketConnection::notifyWritable()
@@ -33,9 +35,12 @@ status_t SimpleSocketConnection::notifyWritable()
         if (0 == requestLenLeft_)
         {
             sending_ = false;
-            error = socket().shutdown(netSocketDirOutput);
-            if (error)
-                LogStrUlong(eLogDebug, _T("notifyWritable(): Socket::shutdown() returned error: "), error);
+            if (shutdownAfterSend_)
+            {
+                error = socket().shutdown(netSocketDirOutput);
+                if (error)
+                    LogStrUlong(eLogDebug, _T("notifyWritable(): Socket::shutdown() returned error: "), error);
+            }
         }
         else
             registerEvent(SocketSelector::eventWrite);                
@@ -74,29 +79,20 @@ status_t SimpleSocketConnection::notifyReadable()
         goto Exit;
     }
 
-    if (NULL == chunk_)
-        chunk_ = (char*)malloc(chunkSize_);
-    if (NULL == chunk_)
-    {
-        error = memErrNotEnoughSpace;
+    error = reserveResponse(chunkSize_);
+    if (errNone != error)
         goto Exit;
-    }
 
     dataSize = 0;
-    error = socket().receive(dataSize, chunk_, chunkSize_, transferTimeout());
+    error = socket().receive(dataSize, response_ + responseLen_, chunkSize_, transferTimeout());
     if (errNone != error)
         goto Exit;
 
     totalReceived_ += dataSize;
     assert(dataSize <= chunkSize_);
 
-    response_ = StrAppend(response_, responseLen_, chunk_, dataSize);
-    if (NULL == response_)
-    {
-        error = memErrNotEnoughSpace;
-        goto Exit;
-    }
     responseLen_ += dataSize;
+    response_[responseLen_] = '\0';
 
     if (0 == dataSize)
     {   
@@ -136,11 +132,8 @@ SimpleSocketConnection::~SimpleSocketConnection()
     if (NULL != request_)
         free(request_);
 
-    if (NULL != response_)
-        free(response_);
-
-    if (NULL != chunk_)
-        free(chunk_);
+    if (NULL != responseBuffer_)
+        free(responseBuffer_);
 }
 
 status_t SimpleSocketConnection::open()
@@ -184,3 +177,64 @@ status_t SimpleSocketConnection::setRequest(const char* request, ulong_t request
     return errNone;
 }
 
+void SimpleSocketConnection::restartRequest(ulong_t offset)
+{
+    requestLenLeft_ += requestSent_;
+    assert(offset <= requestLenLeft_);
+    requestLenLeft_ -= offset;
+    requestSent_ = offset;
+    sending_ = true;
+    totalReceived_ = 0;
+    response_ = responseBuffer_;
+    responseLen_ = 0;
+}
+
+/**
+ * Makes room for length bytes (and terminating '\0') after response_. Unread data is moved to the start of buffer
+ * only if it's not longer than what was consumed before it, otherwise buffer grows twice, so every received byte is
+ * copied a constant number of times on average.
+ */
+status_t SimpleSocketConnection::reserveResponse(ulong_t length)
+{
+    ulong_t offset = response_ - responseBuffer_;
+    ulong_t needed = responseLen_ + length + 1;
+    if (offset + needed <= responseCapacity_)
+        return errNone;
+
+    if (needed <= responseCapacity_ && responseLen_ <= offset)
+    {
+        memmove(responseBuffer_, response_, responseLen_);
+        response_ = responseBuffer_;
+        return errNone;
+    }
+
+    ulong_t capacity = 2 * responseCapacity_;
+    if (capacity < needed)
+        capacity = needed;
+    char* buffer = (char*)malloc(capacity);
+    if (NULL == buffer)
+        return memErrNotEnoughSpace;
+
+    if (0 != responseLen_)
+        memcpy(buffer, response_, responseLen_);
+    buffer[responseLen_] = '\0';
+    free(responseBuffer_);
+    responseBuffer_ = buffer;
+    responseCapacity_ = capacity;
+    response_ = buffer;
+    return errNone;
+}
+
+void SimpleSocketConnection::consumeResponse(ulong_t length)
+{
+    assert(length <= responseLen_);
+    responseLen_ -= length;
+    // Rewinding to the start of empty buffer is free and spares moving data later.
+    if (0 == responseLen_ && NULL != responseBuffer_)
+    {
+        response_ = responseBuffer_;
+        response_[0] = '\0';
+    }
+    else
+        response_ += length;
+}
@@ -20,13 +20,23 @@ class SimpleSocketConnection: public SocketConnection
     ulong_t      totalReceived_;
 
     bool         sending_;
-    char*		chunk_;
+    bool         shutdownAfterSend_;
+
+    // Data is received straight into responseBuffer_, consumed data is skipped by advancing response_ instead of erasing.
+    char*       responseBuffer_;
+    ulong_t     responseCapacity_;
+
+    status_t reserveResponse(ulong_t length);
 
 protected:
 
+    //! Received data that wasn't consumed yet, always followed by '\0'.
     char*		response_;
     ulong_t		responseLen_;
 
+    //! Drops length bytes from the start of response_ in constant time.
+    void consumeResponse(ulong_t length);
+
 protected:
 
     status_t open();
@@ -42,6 +52,13 @@ protected:
     // set request to send to a copy of request
     status_t setRequest(const char* request, ulong_t requestSize);
 
+    //! Prepares for sending request again from offset (e.g. on a new socket) and drops response received so far.
+    void restartRequest(ulong_t offset = 0);
+
+    //! Output isn't shut down after request is sent if socket should stay open for the next one.
+    void setShutdownAfterSend(bool value)
+    {shutdownAfterSend_ = value;}
+
     /*
     status_t setRequest(const NarrowString& request)
     {
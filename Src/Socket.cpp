@@ -3,6 +3,15 @@
 #include <SocketAddress.hpp>
 #include <NetLibrary.hpp>
 
+#ifdef _POSIX
+# include <fcntl.h>
+# include <unistd.h>
+#endif
+
+#ifdef SOCKET_SELECTOR_HAS_READY_LIST
+# include <sys/epoll.h>
+#endif
+
 #ifdef __MWERKS__
 #pragma mark -
 #pragma mark SocketBase
@@ -131,6 +140,22 @@ status_t SocketBase::setNonBlocking(bool value)
 }
 #endif
 
+#ifdef _POSIX
+status_t SocketBase::setNonBlocking(bool value)
+{
+    int flags = fcntl(socket_, F_GETFL, 0);
+    if (-1 == flags)
+        return errno;
+    if (value)
+        flags |= O_NONBLOCK;
+    else
+        flags &= ~O_NONBLOCK;
+    if (-1 == fcntl(socket_, F_SETFL, flags))
+        return errno;
+    return errNone;
+}
+#endif
+
 status_t SocketBase::setOption(uint_t level, uint_t option, const void* optionValue, uint_t valueLength, long timeout)
 {
     assert(isOpen());
@@ -206,6 +231,111 @@ status_t SocketBase::getLinger(CommonSocketLinger_t& linger) const
 #pragma mark SocketSelector
 #endif
 
+#ifdef SOCKET_SELECTOR_HAS_READY_LIST
+
+SocketSelector::SocketSelector(NetLibrary& netLib, bool catchStandardEvents):
+    netLib_(netLib),
+    epoll_(epoll_create(maxEventsPerSelect)),
+    eventsCount_(0)
+{
+    if (-1 == epoll_)
+        LogStrUlong(eLogError, _T("SocketSelector(): epoll_create() failed, error: "), errno);
+}
+
+SocketSelector::~SocketSelector()
+{
+    if (-1 != epoll_)
+        ::close(epoll_);
+}
+
+// Sockets are added to epoll set only while they have events registered, as errors and hangups are reported regardless of the mask.
+void SocketSelector::updateSocket(NativeSocket_t socket, unsigned char registered)
+{
+    if (socket < 0)
+        return;
+    if (ulong_t(socket) >= events_.size())
+    {
+        if (0 == registered)
+            return;
+        SocketEvents none = {0, 0};
+        events_.resize(socket + 1, none);
+    }
+    SocketEvents& events = events_[socket];
+    if (events.registered == registered)
+        return;
+
+    epoll_event ev;
+    memzero(&ev, sizeof(ev));
+    ev.data.fd = socket;
+    if (0 != (registered & (1 << eventRead)))
+        ev.events |= EPOLLIN;
+    if (0 != (registered & (1 << eventWrite)))
+        ev.events |= EPOLLOUT;
+    if (0 != (registered & (1 << eventException)))
+        ev.events |= EPOLLPRI;
+
+    int op = EPOLL_CTL_MOD;
+    if (0 == events.registered)
+        op = EPOLL_CTL_ADD;
+    else if (0 == registered)
+        op = EPOLL_CTL_DEL;
+    events.registered = registered;
+
+    int res = epoll_ctl(epoll_, op, socket, &ev);
+    // Closing socket removes it from epoll set, so handle may be reused by a new socket behind our back.
+    if (-1 == res && ENOENT == errno && EPOLL_CTL_DEL != op)
+        res = epoll_ctl(epoll_, EPOLL_CTL_ADD, socket, &ev);
+    else if (-1 == res && EEXIST == errno)
+        res = epoll_ctl(epoll_, EPOLL_CTL_MOD, socket, &ev);
+    if (-1 == res && EPOLL_CTL_DEL != op)
+        LogStrUlong(eLogError, _T("updateSocket(): epoll_ctl() failed, error: "), errno);
+}
+
+status_t SocketSelector::select(long timeout)
+{
+    Sockets_t::const_iterator end = readySockets_.end();
+    for (Sockets_t::const_iterator it = readySockets_.begin(); it != end; ++it)
+        if (ulong_t(*it) < events_.size())
+            events_[*it].reported = 0;
+    readySockets_.clear();
+    eventsCount_ = 0;
+
+    epoll_event ready[maxEventsPerSelect];
+    int count = epoll_wait(epoll_, ready, maxEventsPerSelect, timeout);
+    // Timeout is reported only when it really elapsed, as caller charges all of it to every connection.
+    if (0 == count)
+        return netErrTimeout;
+    // Interrupted wait is reported as an empty ready list, so that caller simply selects again.
+    if (-1 == count)
+        return (EINTR == errno ? errNone : errno);
+
+    // Sockets that didn't fit are left for the next select(), as epoll is level-triggered.
+    for (int i = 0; i < count; ++i)
+    {
+        NativeSocket_t socket = ready[i].data.fd;
+        if (ulong_t(socket) >= events_.size())
+            continue;
+        SocketEvents& events = events_[socket];
+        unsigned char reported = 0;
+        if (0 != (ready[i].events & EPOLLIN))
+            reported |= (1 << eventRead);
+        if (0 != (ready[i].events & EPOLLOUT))
+            reported |= (1 << eventWrite);
+        if (0 != (ready[i].events & EPOLLPRI))
+            reported |= (1 << eventException);
+        // Same as select(), failed socket is ready for any event it waits for.
+        if (0 != (ready[i].events & (EPOLLERR | EPOLLHUP)))
+            reported = events.registered;
+        events.reported = reported & events.registered;
+        if (0 != events.reported)
+            readySockets_.push_back(socket);
+    }
+    eventsCount_ = readySockets_.size();
+    return errNone;
+}
+
+#else
+
 SocketSelector::SocketSelector(NetLibrary& netLib, bool catchStandardEvents):
     netLib_(netLib),
     width_(0),
@@ -292,3 +422,4 @@ void SocketSelector::recalculateWidth()
         }                
 }
 
+#endif // SOCKET_SELECTOR_HAS_READY_LIST
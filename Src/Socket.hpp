@@ -11,6 +11,12 @@
 #include <Utility.hpp>
 #include <NativeSocks.hpp>
 
+#if defined(_POSIX)
+# include <vector>
+//! SocketSelector is backed by epoll and lists sockets that are ready after select() (see SocketSelector::readySocket()).
+# define SOCKET_SELECTOR_HAS_READY_LIST
+#endif
+
 #ifdef _MSC_VER
 //disable performance warning while casting int to bool
 #pragma warning (disable : 4800)
@@ -27,8 +33,6 @@ class SocketAddress;
  */
 class SocketBase: private NonCopyable
 {
-    void close();
-
 protected:
 
     /**
@@ -84,6 +88,26 @@ public:
     
     bool isOpen() const
     {return invalidSocket!=socket_;}
+
+    void close();
+
+    /**
+     * Gives up ownership of underlying socket, which is left open (so that it can be reused, see SocketConnectionManager).
+     * @return handle of the socket, which should be passed to attach() or closed with NetLibrary::socketClose().
+     */
+    NativeSocket_t detach()
+    {
+        NativeSocket_t socket = socket_;
+        socket_ = invalidSocket;
+        return socket;
+    }
+
+    //! Takes ownership of open socket, e.g. one returned by detach().
+    void attach(NativeSocket_t socket)
+    {
+        assert(!isOpen());
+        socket_ = socket;
+    }
     
     //status_t getLinger(CommonSocketLinger_t& linger) const;
             
@@ -128,12 +152,38 @@ class SocketSelector: private NonCopyable
     enum {eventTypesCount_=3};
     
     NetLibrary& netLib_;
+#ifdef SOCKET_SELECTOR_HAS_READY_LIST
+    enum {maxEventsPerSelect = 256};
+
+    int epoll_;
+
+    //! Masks of (1 << EventType) registered for and reported on each socket, indexed by socket handle.
+    struct SocketEvents
+    {
+        unsigned char registered;
+        unsigned char reported;
+    };
+    typedef std::vector<SocketEvents> SocketEvents_t;
+    SocketEvents_t events_;
+
+    typedef std::vector<NativeSocket_t> Sockets_t;
+    Sockets_t readySockets_;
+
+    void updateSocket(NativeSocket_t socket, unsigned char registered);
+
+    unsigned char registeredEvents(NativeSocket_t socket) const
+    {return (socket >= 0 && ulong_t(socket) < events_.size()) ? events_[socket].registered : 0;}
+
+    unsigned char reportedEvents(NativeSocket_t socket) const
+    {return (socket >= 0 && ulong_t(socket) < events_.size()) ? events_[socket].reported : 0;}
+#else
     NativeFDSet_t inputFDs_[eventTypesCount_];
     NativeFDSet_t outputFDs_[eventTypesCount_];
     uint_t width_;
-    uint_t eventsCount_;
     
     void recalculateWidth();
+#endif
+    uint_t eventsCount_;
     
 public:
 
@@ -146,6 +196,34 @@ public:
     
     SocketSelector(NetLibrary& netLib, bool catchStandardEvents=true);
     
+#ifdef SOCKET_SELECTOR_HAS_READY_LIST
+
+    ~SocketSelector();
+
+    void registerSocket(const SocketBase& socket, EventType event)
+    {updateSocket(socket, registeredEvents(socket) | (1 << event));}
+
+    void unregisterSocket(const SocketBase& socket, EventType event)
+    {updateSocket(socket, registeredEvents(socket) & ~(1 << event));}
+
+    //! @return netErrTimeout only if timeout elapsed; errNone with no ready sockets if wait was interrupted.
+    status_t select(long timeout = evtWaitForever);
+
+    bool checkSocketEvent(const SocketBase& socket, EventType event) const
+    {return 0 != (reportedEvents(socket) & (1 << event));}
+
+    bool isRegistered(const SocketBase& socket, EventType event) const
+    {return 0 != (registeredEvents(socket) & (1 << event));}
+
+    //! Sockets with events reported by last select(), so that they can be dispatched without checking every registered one.
+    ulong_t readySocketsCount() const
+    {return readySockets_.size();}
+
+    NativeSocket_t readySocket(ulong_t index) const
+    {return readySockets_[index];}
+
+#else
+
     ~SocketSelector()
     {}
     
@@ -175,6 +253,8 @@ public:
         NativeSocket_t ref = socket;
         return netFDIsSet(ref, &inputFDs_[event]);
     }
+
+#endif // SOCKET_SELECTOR_HAS_READY_LIST
     
 #ifdef _PALM_OS        
     status_t selectWithInputEvents(long timeout = evtWaitForever);
@@ -6,6 +6,13 @@
 void SocketConnectionManager::registerEvent(SocketConnection& connection, SocketSelector::EventType event)
 {
     selector_.registerSocket(connection.socket(), event);
+#ifdef SOCKET_SELECTOR_HAS_READY_LIST
+    NativeSocket_t socket = connection.socket();
+    assert(invalidSocket != socket);
+    if (ulong_t(socket) >= socketConnections_.size())
+        socketConnections_.resize(socket + 1, NULL);
+    socketConnections_[socket] = &connection;
+#endif
 }
 
 void SocketConnectionManager::unregisterEvents(SocketConnection& connection)
@@ -14,6 +21,11 @@ void SocketConnectionManager::unregisterEvents(SocketConnection& connection)
     selector_.unregisterSocket(socket, SocketSelector::eventRead);
     selector_.unregisterSocket(socket, SocketSelector::eventWrite);
     selector_.unregisterSocket(socket, SocketSelector::eventException);
+#ifdef SOCKET_SELECTOR_HAS_READY_LIST
+    NativeSocket_t ref = socket;
+    if (invalidSocket != ref && ulong_t(ref) < socketConnections_.size() && &connection == socketConnections_[ref])
+        socketConnections_[ref] = NULL;
+#endif
 }
 
 SocketConnectionManager::SocketConnectionManager():
@@ -22,12 +34,16 @@ SocketConnectionManager::SocketConnectionManager():
     stop_(false),
     event_(NULL),
 #endif         
-    connectionsCount_(0)
+    connectionsCount_(0),
+    connections_(defaultMaxConnections, NULL),
+    maxIdleSockets_(defaultMaxIdleSockets),
+    idleTimeout_(15 * ticksPerSecond())
 {}
 
 SocketConnectionManager::~SocketConnectionManager()
 {
     abortConnections();
+    closeIdleSockets();
 #ifdef _WIN32
     if (NULL != event_)
         CloseHandle(event_);
@@ -53,10 +69,8 @@ void SocketConnectionManager::compactConnections()
         if (NULL != connections_[i])
         {
             if (i!=curPos)
-            {
                 connections_[curPos] = connections_[i];
-                curPos++;
-            }
+            curPos++;
         }
         else
         {
@@ -65,6 +79,105 @@ void SocketConnectionManager::compactConnections()
     }
     connectionsCount_ = countAfter;
 }
+
+void SocketConnectionManager::removeConnection(SocketConnection& connection)
+{
+    for (int i = 0; i < connectionsCount_; ++i)
+    {
+        if (&connection != connections_[i])
+            continue;
+        connections_[i] = NULL;
+        compactConnections();
+        return;
+    }
+}
+
+void SocketConnectionManager::closeNetLibIfUnused()
+{
+    if (0 == connectionsCount_ && idleSockets_.empty() && !netLib_.closed())
+        netLib_.close();
+}
+
+void SocketConnectionManager::closeIdleSocket(IdleSockets_t::iterator it)
+{
+    status_t error;
+    netLib_.socketClose(it->socket, evtWaitForever, error);
+    if (errNone != error)
+        LogStrUlong(eLogError, _T("closeIdleSocket(): NetLibSocketClose() returned error: "), error);
+    idleSockets_.erase(it);
+}
+
+void SocketConnectionManager::closeExpiredIdleSockets()
+{
+    tick_t now = ticks();
+    // List is ordered by idleSince, so expired sockets are at its end.
+    while (!idleSockets_.empty() && now - idleSockets_.back().idleSince > idleTimeout_)
+        closeIdleSocket(--idleSockets_.end());
+}
+
+void SocketConnectionManager::closeIdleSockets()
+{
+    LockGuard guard(lock_);
+    while (!idleSockets_.empty())
+        closeIdleSocket(idleSockets_.begin());
+    closeNetLibIfUnused();
+}
+
+void SocketConnectionManager::setMaxIdleSockets(ulong_t count)
+{
+    LockGuard guard(lock_);
+    maxIdleSockets_ = count;
+    while (idleSockets_.size() > maxIdleSockets_)
+        closeIdleSocket(--idleSockets_.end());
+    closeNetLibIfUnused();
+}
+
+bool SocketConnectionManager::takeIdleSocket(const char* address, SocketBase& socket)
+{
+    LockGuard guard(lock_);
+    closeExpiredIdleSockets();
+    if (NULL == address)
+        return false;
+    IdleSockets_t::iterator end = idleSockets_.end();
+    for (IdleSockets_t::iterator it = idleSockets_.begin(); it != end; ++it)
+    {
+        if (it->address != address)
+            continue;
+        socket.attach(it->socket);
+        idleSockets_.erase(it);
+        return true;
+    }
+    return false;
+}
+
+void SocketConnectionManager::keepIdleSocket(const char* address, SocketBase& socket)
+{
+    LockGuard guard(lock_);
+    assert(socket.isOpen());
+    if (0 == maxIdleSockets_ || NULL == address)
+    {
+        socket.close();
+        return;
+    }
+    closeExpiredIdleSockets();
+    IdleSocket idle;
+    idle.address = address;
+    idle.idleSince = ticks();
+    idleSockets_.push_front(idle);
+    idleSockets_.front().socket = socket.detach();
+    while (idleSockets_.size() > maxIdleSockets_)
+        closeIdleSocket(--idleSockets_.end());
+}
+
+status_t SocketConnectionManager::setMaxConnections(ulong_t count)
+{
+    LockGuard guard(lock_);
+    assert(0 != count);
+    if (0 != connectionsCount_)
+        return netErrSocketBusy;
+    connections_.assign(count, NULL);
+    return errNone;
+}
     
 bool SocketConnectionManager::manageFinishedConnections()
 { 
@@ -83,8 +196,7 @@ bool SocketConnectionManager::manageFinishedConnections()
     if (fDeletedConnection)
     {
         compactConnections();
-        if (0==connectionsCount_)
-            netLib_.close();
+        closeNetLibIfUnused();
     }
     return fDeletedConnection;
 }
@@ -181,7 +293,10 @@ status_t SocketConnectionManager::manageConnectionEvents(long timeout)
 
     if (errNone != error)
         return error;
-        
+
+#ifdef SOCKET_SELECTOR_HAS_READY_LIST
+    dispatchReadySockets();
+#else
     for (int i=0; i<connectionsCount_; i++)
     {
         status_t connErr=errNone;
@@ -219,9 +334,55 @@ status_t SocketConnectionManager::manageConnectionEvents(long timeout)
             break;
     }
     compactConnections();
+#endif
     return errNone;
 }
 
+#ifdef SOCKET_SELECTOR_HAS_READY_LIST
+
+// Only sockets reported by selector are visited, so that cost of dispatch doesn't grow with number of idle connections.
+void SocketConnectionManager::dispatchReadySockets()
+{
+    ulong_t count = selector_.readySocketsCount();
+    for (ulong_t i = 0; i < count; ++i)
+    {
+        NativeSocket_t socket = selector_.readySocket(i);
+        if (ulong_t(socket) >= socketConnections_.size())
+            continue;
+        SocketConnection* conn = socketConnections_[socket];
+        if (NULL == conn)
+            continue;
+        assert(SocketConnection::stateOpened==conn->state());
+        status_t connErr=errNone;
+        if (selector_.checkSocketEvent(conn->socket(), SocketSelector::eventException))
+        {
+            unregisterEvents(*conn);
+            conn->resetTimeout();
+            connErr=conn->notifyException();
+        }                        
+        else if (selector_.checkSocketEvent(conn->socket_, SocketSelector::eventWrite))
+        {
+            unregisterEvents(*conn);
+            conn->resetTimeout();
+            connErr=conn->notifyWritable();
+        } 
+        else if (selector_.checkSocketEvent(conn->socket_, SocketSelector::eventRead))
+        {
+            unregisterEvents(*conn);
+            conn->resetTimeout();
+            connErr=conn->notifyReadable();
+        }
+        if (connErr)
+        {
+            conn->handleError(connErr);
+            removeConnection(*conn);
+            delete conn;
+        }
+    }
+}
+
+#endif
+
 #ifdef _PALM_OS 
 
 bool SocketConnectionManager::checkEvent(EventType& event)
@@ -389,12 +550,29 @@ void SocketConnectionManager::abortConnections()
     connectionsCount_ = 0;
 }
 
+void SocketConnectionManager::abortConnection(SocketConnection& connection)
+{
+    LockGuard g(lock_);
+    for (int i = 0; i < connectionsCount_; ++i)
+    {
+        if (&connection != connections_[i])
+            continue;
+        connections_[i] = NULL;
+        compactConnections();
+        connection.abortConnection();
+        delete &connection;
+        closeNetLibIfUnused();
+        return;
+    }
+}
+
 SocketConnection::SocketConnection(SocketConnectionManager& manager):
     manager_(manager),
     state_(stateUnresolved),
     transferTimeout_(evtWaitForever),
     socket_(manager.netLib_),
-    currentTimeout_(0)
+    currentTimeout_(0),
+    serverAddress(NULL)
 {
 }
 
@@ -409,9 +587,31 @@ void SocketConnection::abortConnection()
     setState(stateFinished);
 }
 
+bool SocketConnection::reuseIdleSocket()
+{
+    assert(!socket_.isOpen());
+    return manager_.takeIdleSocket(serverAddress, socket_);
+}
+
+void SocketConnection::keepSocketIdle()
+{
+    manager_.unregisterEvents(*this);
+    manager_.keepIdleSocket(serverAddress, socket_);
+    setState(stateFinished);
+}
+
 status_t SocketConnection::open()
 {
     assert(stateUnopened==state());
+    // Idle socket taken over in reuseIdleSocket() is already connected.
+    if (socket_.isOpen())
+    {
+        setState(stateOpened);
+        registerEvent(SocketSelector::eventWrite);
+        registerEvent(SocketSelector::eventRead);
+        return errNone;
+    }
+
     status_t error=socket_.open();
     if (error)
     {
@@ -419,7 +619,7 @@ status_t SocketConnection::open()
         return error;
     }
 
-#ifdef _WIN32
+#if defined(_WIN32) || defined(_POSIX)
     error = socket_.setNonBlocking();
     if (error)
     {
@@ -529,7 +729,7 @@ void SocketConnection::handleError(status_t)
 status_t SocketConnectionManager::enqueueConnection(SocketConnection& conn)
 {
     LockGuard guard(lock_);
-    if (maxConnections == connectionsCount_)
+    if (connections_.size() == ulong_t(connectionsCount_))
         return netErrUnimplemented;
 
     connections_[connectionsCount_++] = &conn;
@@ -664,3 +864,135 @@ void SocketConnectionManager::stop()
 
 #endif
 
+
+#if defined(_POSIX) && !defined(NDEBUG)
+
+#include <LoopbackTestServer.hpp>
+#include <unistd.h>
+#include <sys/resource.h>
+
+enum {
+    echoTestConnectionsCount = 1000,
+    echoTestMessageLength = 64
+};
+
+// Echoes back everything it reads, messages are short enough to always fit into socket buffer.
+static bool echoTestRespond(LoopbackTestServer&, int socket, NarrowString& received, ulong_t& requestsCount)
+{
+    ssize_t res = write(socket, received.data(), received.length());
+    assert(ssize_t(received.length()) == res);
+    received.clear();
+    ++requestsCount;
+    return true;
+}
+
+// Sends a message and finishes when it's echoed back unchanged.
+class EchoTestConnection: public SocketConnection
+{
+    char message_[echoTestMessageLength];
+    uint_t sent_;
+    uint_t received_;
+    ulong_t& completedCount_;
+
+protected:
+
+    status_t notifyWritable()
+    {
+        status_t error = socket().send(sent_, message_ + sent_, sizeof(message_) - sent_, 0);
+        if (errNone != error && netErrWouldBlock != error)
+            return error;
+        registerEvent(sent_ < sizeof(message_) ? SocketSelector::eventWrite : SocketSelector::eventRead);
+        return errNone;
+    }
+
+    status_t notifyReadable()
+    {
+        char buffer[echoTestMessageLength];
+        uint_t received = 0;
+        status_t error = socket().receive(received, buffer, sizeof(message_) - received_, 0);
+        if (netErrWouldBlock == error)
+        {
+            registerEvent(SocketSelector::eventRead);
+            return errNone;
+        }
+        if (errNone != error)
+            return error;
+        if (0 == received)
+            return netErrSocketClosedByRemote;
+        if (0 != memcmp(buffer, message_ + received_, received))
+            return errResponseMalformed;
+        received_ += received;
+        if (received_ < sizeof(message_))
+        {
+            registerEvent(SocketSelector::eventRead);
+            return errNone;
+        }
+        ++completedCount_;
+        setState(stateFinished);
+        return errNone;
+    }
+
+public:
+
+    EchoTestConnection(SocketConnectionManager& manager, ulong_t index, ulong_t& completedCount):
+        SocketConnection(manager),
+        sent_(0),
+        received_(0),
+        completedCount_(completedCount)
+    {
+        for (ulong_t i = 0; i < sizeof(message_); ++i)
+            message_[i] = char(index + i);
+    }
+
+};
+
+// Runs echoTestConnectionsCount connections at once against loopback echo server.
+void test_SocketConnectionManagerBenchmark()
+{
+    // Server runs in the same process, so each connection takes 2 descriptors.
+    rlimit limit;
+    if (0 == getrlimit(RLIMIT_NOFILE, &limit) && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    LoopbackTestServer server;
+    loopbackTestServerStart(server, echoTestRespond);
+
+    char serverAddress[32];
+    StrPrintF(serverAddress, "127.0.0.1:%u", uint_t(server.port));
+    ulong_t completedCount = 0;
+    {
+        SocketConnectionManager manager;
+        status_t error = manager.setMaxConnections(echoTestConnectionsCount);
+        assert(errNone == error);
+        for (ulong_t i = 0; i < echoTestConnectionsCount; ++i)
+        {
+            EchoTestConnection* conn = new EchoTestConnection(manager, i, completedCount);
+            conn->serverAddress = serverAddress;
+            conn->setTransferTimeout(10000);
+            error = conn->enqueue();
+            assert(errNone == error);
+        }
+        EchoTestConnection extra(manager, 0, completedCount);
+        error = extra.enqueue();
+        assert(errNone != error);
+        error = manager.setMaxConnections(1);
+        assert(errNone != error);
+
+        tick_t start = ticks();
+        while (manager.active())
+        {
+            error = manager.manageConnectionEvents(1000);
+            assert(errNone == error);
+        }
+        LogStrUlong(eLogDebug, _T("test_SocketConnectionManagerBenchmark(): ticks spent: "), ticks() - start);
+    }
+    assert(echoTestConnectionsCount == completedCount);
+
+    loopbackTestServerStop(server);
+    assert(echoTestConnectionsCount == server.acceptedCount);
+}
+
+#endif
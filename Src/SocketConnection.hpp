@@ -2,11 +2,14 @@
 #define __ARSLEXIS_SOCKET_CONNECTION_HPP__
 
 #include <ErrBase.h>
+#include <BaseTypes.hpp>
 #include <NetLibrary.hpp>
 #include <Logging.hpp>
 #include <SocketAddress.hpp>
 #include <Socket.hpp>
 #include <Lock.hpp>
+#include <vector>
+#include <list>
 
 class SocketConnection;
 
@@ -16,9 +19,42 @@ class SocketConnectionManager: private NonCopyable
     NetLibrary      netLib_;
     SocketSelector  selector_;
 
+    typedef std::vector<SocketConnection*> Connections_t;
+
     int                 connectionsCount_;
-    enum {maxConnections = 5}; 
-    SocketConnection *  connections_[maxConnections];
+    //! Sized to maximum number of connections, first connectionsCount_ are used.
+    Connections_t       connections_;
+
+#ifdef SOCKET_SELECTOR_HAS_READY_LIST
+    //! Connections waiting for events, indexed by socket handle.
+    Connections_t       socketConnections_;
+
+    void dispatchReadySockets();
+#endif
+
+    //! Open socket of finished persistent connection, kept for reuse by next connection to the same address.
+    struct IdleSocket
+    {
+        NarrowString address;
+        NativeSocket_t socket;
+        tick_t idleSince;
+    };
+
+    //! Most recently used first.
+    typedef std::list<IdleSocket> IdleSockets_t;
+    IdleSockets_t       idleSockets_;
+    ulong_t             maxIdleSockets_;
+    tick_t              idleTimeout_;
+
+    void closeIdleSocket(IdleSockets_t::iterator it);
+
+    void closeExpiredIdleSockets();
+
+    bool takeIdleSocket(const char* address, SocketBase& socket);
+
+    void keepIdleSocket(const char* address, SocketBase& socket);
+
+    void closeNetLibIfUnused();
 
     void registerEvent(SocketConnection& connection, SocketSelector::EventType event);
 
@@ -31,6 +67,8 @@ class SocketConnectionManager: private NonCopyable
 
     void compactConnections();
 
+    void removeConnection(SocketConnection& connection);
+
     bool manageFinishedConnections();
     bool manageUnresolvedConnections();
     bool manageUnopenedConnections();
@@ -43,6 +81,8 @@ public:
     void acquire() {lock_.acquire();}
     void release() {lock_.release();}  
 
+    enum {defaultMaxConnections = 5};
+
     SocketConnectionManager();
 
     ~SocketConnectionManager();
@@ -50,6 +90,29 @@ public:
     bool active() const
     {return 0!=connectionsCount_;}
 
+    ulong_t maxConnections() const
+    {return connections_.size();}
+
+    //! Changes number of connections that may be enqueued at once, may be called only when there are none.
+    status_t setMaxConnections(ulong_t count);
+
+    enum {defaultMaxIdleSockets = 4};
+
+    //! Limits number of idle sockets kept for reuse (for all addresses together), 0 disables reuse.
+    void setMaxIdleSockets(ulong_t count);
+
+    ulong_t maxIdleSockets() const
+    {return maxIdleSockets_;}
+
+    //! Idle sockets aren't reused after timeout (in ticks), as server has probably closed them by then.
+    void setIdleTimeout(tick_t timeout)
+    {idleTimeout_ = timeout;}
+
+    ulong_t idleSocketsCount() const
+    {return idleSockets_.size();}
+
+    void closeIdleSockets();
+
     status_t manageConnectionEvents(long timeout = evtWaitForever);
     
 #ifdef _PALM_OS
@@ -58,6 +121,9 @@ public:
     
     void abortConnections();
     
+    //! Aborts and deletes single connection, if it's still managed.
+    void abortConnection(SocketConnection& conn);
+    
     status_t enqueueConnection(SocketConnection& conn);  
 
     friend class SocketConnection;
@@ -132,6 +198,16 @@ protected:
 
     void resetTimeout() {currentTimeout_ = 0;}
 
+    /**
+     * Takes over idle socket kept by manager for serverAddress, so that open() doesn't need to connect.
+     * Should be called from resolve(), which can then skip resolving.
+     * @return false if there's no such socket.
+     */
+    bool reuseIdleSocket();
+
+    //! Hands open socket over to manager for reuse by next connection to serverAddress and finishes this connection.
+    void keepSocketIdle();
+
 public:
 
     const char* serverAddress;
@@ -159,5 +235,8 @@ public:
     friend class SocketConnectionManager;
 };
 
+#if defined(_POSIX) && defined(DEBUG)
+void test_SocketConnectionManagerBenchmark();
+#endif
 
 #endif
@@ -74,6 +74,15 @@ status_t File::read(void* buffer, Size bytesToRead, Size& bytesRead)
 	return errNone;
 }
 
+// Windows CE doesn't support overlapped file I/O, so callers have to serialize positional reads with other file operations.
+status_t File::read(Position position, void* buffer, Size bytesToRead, Size& bytesRead)
+{
+	status_t error = seek(position, seekFromBeginning);
+	if (errNone != error)
+		return error;
+	return read(buffer, bytesToRead, bytesRead);
+}
+
 status_t File::write(const void* buffer, Size bytesToWrite)
 {
 	assert(isOpen());